@@ -21,6 +21,17 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <linux/limits.h>
 
 #include <gst/gst.h>
@@ -28,39 +39,324 @@
 
 #include <libvci/error.h>
 #include <libvci/filesystem.h>
+#include <libvci/macro.h>
+
+#include "../shared/prefilter.h"
+#include "scan-index.h"
 
 #define URI_FILE_SCHEME "file://"
 #define URI_MAX (PATH_MAX + sizeof(URI_FILE_SCHEME))
 
+#define DIRENT_BUFFER_SIZE (1 << 15)
+#define DISCOVERER_TIMEOUT (5 * GST_SECOND)
+#define DEFAULT_QUEUE_SIZE 256
+#define MAX_WORKERS 64
+
+/* 
+ * Directories are read with getdents64(2) directly, glibc only has a
+ * wrapper for it since 2.30. 
+ */
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* 
+ * A file which needs to be discovered, size and modification time are 
+ * only known if an index is used.
+ */
+struct scan_job {
+    uint64_t file_size;
+    uint64_t mtime;
+    bool sniff;
+    char uri[];
+};
+
+struct prefilter_stats {
+    unsigned int files;
+    unsigned int by_name;
+    atomic_uint sniffed;
+    atomic_uint by_content;
+};
+
+/* 
+ * The directory walker and the discoverer workers are decoupled 
+ * by a bounded queue of scan jobs. The walker blocks as soon as 
+ * the workers fall behind, so memory usage does not depend on the
+ * size of the scanned library.
+ */
+struct work_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    
+    struct scan_job **jobs;
+    unsigned int size;
+    unsigned int head;
+    unsigned int count;
+    bool closed;
+};
 
-static GstDiscoverer *_gst_discoverer;
-static char _uri[URI_MAX];
+/* Playable uris collected for '--sorted' */
+struct result_list {
+    pthread_mutex_t lock;
+    
+    char **uris;
+    size_t count;
+    size_t size;
+};
+
+static struct work_queue _queue;
+static struct result_list _results;
+static struct scan_index _index;
+static struct prefilter_stats _stats;
+static bool _use_index;
+static bool _prefilter = true;
+static bool _sorted;
 static char _rpath[PATH_MAX];
 
+static const char help[] = {
+    "Usage: climp-discoverer [OPTION]... [DIRECTORY]...\n"
+    "Recursively scan DIRECTORY for playable audio files and print "
+    "their uris.\n\n"
+    "  -j, --jobs=NUM        number of parallel discoverers\n"
+    "                        (default: twice the number of cpus)\n"
+    "  -q, --queue-size=NUM  number of files which may be pending\n"
+    "                        between scanning and discovering\n"
+    "  -s, --sorted          print the uris sorted once the scan is done\n"
+    "                        instead of streaming them as they are found\n"
+    "  -i, --index=FILE      only discover files which are new or changed\n"
+    "                        since the scan which wrote FILE, FILE is\n"
+    "                        updated afterwards and keeps the files of\n"
+    "                        directories which were not scanned again\n"
+    "  -n, --no-prefilter    discover every file, don't skip files which\n"
+    "                        can't be audio by their name or first bytes\n"
+    "  -h, --help            print this help and exit\n"
+};
 
-static char *set_uri(const char *__restrict path, 
-                     size_t len, 
-                     const char *__restrict name)
+static int work_queue_init(struct work_queue *__restrict q, unsigned int size)
 {
-    if (sizeof(URI_FILE_SCHEME) + len + 1 + strlen(name) >= URI_MAX)
+    q->jobs = malloc(size * sizeof(*q->jobs));
+    if (!q->jobs)
+        return -errno;
+    
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    
+    q->size   = size;
+    q->head   = 0;
+    q->count  = 0;
+    q->closed = false;
+    
+    return 0;
+}
+
+static void work_queue_destroy(struct work_queue *__restrict q)
+{
+    while (q->count--) {
+        free(q->jobs[q->head]);
+        q->head = (q->head + 1) % q->size;
+    }
+    
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_mutex_destroy(&q->lock);
+    
+    free(q->jobs);
+}
+
+static void work_queue_push(struct work_queue *__restrict q, 
+                            struct scan_job *job)
+{
+    pthread_mutex_lock(&q->lock);
+    
+    while (q->count == q->size)
+        pthread_cond_wait(&q->not_full, &q->lock);
+    
+    q->jobs[(q->head + q->count) % q->size] = job;
+    q->count += 1;
+    
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Returns NULL as soon as the queue is closed and drained */
+static struct scan_job *work_queue_pop(struct work_queue *__restrict q)
+{
+    struct scan_job *job;
+    
+    pthread_mutex_lock(&q->lock);
+    
+    while (q->count == 0 && !q->closed)
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    
+    if (q->count == 0) {
+        pthread_mutex_unlock(&q->lock);
         return NULL;
+    }
+    
+    job = q->jobs[q->head];
+    q->head = (q->head + 1) % q->size;
+    q->count -= 1;
+    
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    
+    return job;
+}
+
+static void work_queue_close(struct work_queue *__restrict q)
+{
+    pthread_mutex_lock(&q->lock);
+    
+    q->closed = true;
+    pthread_cond_broadcast(&q->not_empty);
+    
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void result_list_init(struct result_list *__restrict list)
+{
+    pthread_mutex_init(&list->lock, NULL);
+    
+    list->uris  = NULL;
+    list->count = 0;
+    list->size  = 0;
+}
+
+static void result_list_destroy(struct result_list *__restrict list)
+{
+    for (size_t i = 0; i < list->count; ++i)
+        free(list->uris[i]);
     
-    strcpy(_uri, URI_FILE_SCHEME);
-    strcat(_uri, path);
-    strcat(_uri, "/");
-    strcat(_uri, name);
+    free(list->uris);
+    pthread_mutex_destroy(&list->lock);
+}
+
+static int result_list_add(struct result_list *__restrict list, 
+                           const char *__restrict uri)
+{
+    char **uris, *dup;
+    size_t size;
+    
+    dup = strdup(uri);
+    if (!dup)
+        return -errno;
+    
+    pthread_mutex_lock(&list->lock);
+    
+    if (list->count == list->size) {
+        size = (list->size) ? 2 * list->size : 1024;
+        
+        uris = realloc(list->uris, size * sizeof(*uris));
+        if (!uris) {
+            pthread_mutex_unlock(&list->lock);
+            free(dup);
+            return -ENOMEM;
+        }
+        
+        list->uris = uris;
+        list->size = size;
+    }
+    
+    list->uris[list->count++] = dup;
+    
+    pthread_mutex_unlock(&list->lock);
     
-    return _uri;
+    return 0;
+}
+
+static int compare_uri(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
 }
 
-static bool uri_is_playable(const char *__restrict uri)
+static void result_list_print(struct result_list *__restrict list)
+{
+    qsort(list->uris, list->count, sizeof(*list->uris), &compare_uri);
+    
+    for (size_t i = 0; i < list->count; ++i)
+        fprintf(stdout, "%s\n", list->uris[i]);
+}
+
+static struct scan_job *scan_job_new(const char *__restrict path, 
+                                     size_t len, 
+                                     const char *__restrict name)
+{
+    size_t name_len, scheme_len = sizeof(URI_FILE_SCHEME) - 1;
+    struct scan_job *job;
+    char *uri;
+    
+    name_len = strlen(name);
+    
+    if (scheme_len + len + 1 + name_len >= URI_MAX) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    
+    job = malloc(sizeof(*job) + scheme_len + len + 1 + name_len + 1);
+    if (!job)
+        return NULL;
+    
+    job->file_size = 0;
+    job->mtime     = 0;
+    job->sniff     = false;
+    
+    uri = job->uri;
+    
+    memcpy(uri, URI_FILE_SCHEME, scheme_len);
+    memcpy(uri + scheme_len, path, len);
+    uri[scheme_len + len] = '/';
+    memcpy(uri + scheme_len + len + 1, name, name_len + 1);
+    
+    return job;
+}
+
+static void parse_tags(const GstTagList *list, const gchar *tag, void *data)
+{
+    struct scan_meta *meta = data;
+    const char *s;
+    char **dst;
+    
+    if (strcmp(GST_TAG_TITLE, tag) == 0)
+        dst = &meta->title;
+    else if (strcmp(GST_TAG_ARTIST, tag) == 0)
+        dst = &meta->artist;
+    else if (strcmp(GST_TAG_ALBUM, tag) == 0)
+        dst = &meta->album;
+    else
+        return;
+    
+    if (*dst || gst_tag_list_get_tag_size(list, tag) == 0)
+        return;
+    
+    s = g_value_get_string(gst_tag_list_get_value_index(list, tag, 0));
+    if (s)
+        *dst = strdup(s);
+}
+
+static void scan_meta_destroy(struct scan_meta *__restrict meta)
+{
+    free(meta->title);
+    free(meta->artist);
+    free(meta->album);
+}
+
+static bool uri_is_playable(GstDiscoverer *disc, 
+                            const char *__restrict uri, 
+                            struct scan_meta *__restrict meta)
 {
     GstDiscovererResult result;
     GstDiscovererInfo *info;
     GstDiscovererStreamInfo *s_info, *s_info_next;
-    GError *err;
+    const GstTagList *tags;
+    GError *err = NULL;
     
-    info = gst_discoverer_discover_uri(_gst_discoverer, uri, &err);
+    info = gst_discoverer_discover_uri(disc, uri, &err);
     
     if(err)
         g_error_free(err);
@@ -91,18 +387,261 @@ static bool uri_is_playable(const char *__restrict uri)
         s_info = s_info_next;
     }
     
+    if (meta) {
+        tags = gst_discoverer_info_get_tags(info);
+        
+        if (tags)
+            gst_tag_list_foreach(tags, &parse_tags, meta);
+    }
+    
     gst_discoverer_info_unref(info);
     
     return true;
 }
 
-int recursive_scan(const char *__restrict path)
+static void emit_uri(const char *__restrict uri)
 {
-    DIR *dir;
-    struct dirent buf, *ent;
-    size_t len;
     int err;
     
+    if (!_sorted) {
+        /* a single call per line, stdio locks the stream for us */
+        fprintf(stdout, "%s\n", uri);
+        return;
+    }
+    
+    err = result_list_add(&_results, uri);
+    if (err < 0)
+        fprintf(stderr, "failed to store \"%s\" - %s\n", uri, strerr(-err));
+}
+
+static bool sniff_uri(const char *__restrict uri)
+{
+    const char *path = uri + sizeof(URI_FILE_SCHEME) - 1;
+    
+    atomic_fetch_add(&_stats.sniffed, 1);
+    
+    if (prefilter_check_content(path) == PREFILTER_REJECT) {
+        atomic_fetch_add(&_stats.by_content, 1);
+        return false;
+    }
+    
+    return true;
+}
+
+static void prefilter_report(const struct prefilter_stats *__restrict stats)
+{
+    unsigned int by_content, rejected;
+    
+    by_content = atomic_load(&stats->by_content);
+    rejected   = stats->by_name + by_content;
+    
+    fprintf(stderr, "prefilter: rejected %u of %u files (%.1f%%) - "
+            "%u by name, %u of %u sniffed by content\n", rejected, 
+            stats->files, (stats->files) ? 100.0 * rejected / stats->files : 0.0,
+            stats->by_name, by_content, atomic_load(&stats->sniffed));
+}
+
+static void *discover_worker(void *arg)
+{
+    GstDiscoverer *disc = arg;
+    struct scan_job *job;
+    struct scan_meta meta;
+    bool playable;
+    int err;
+    
+    while ((job = work_queue_pop(&_queue))) {
+        memset(&meta, 0, sizeof(meta));
+        
+        if (job->sniff && !sniff_uri(job->uri))
+            playable = false;
+        else
+            playable = uri_is_playable(disc, job->uri, 
+                                       (_use_index) ? &meta : NULL);
+        
+        if (playable)
+            emit_uri(job->uri);
+        
+        if (_use_index) {
+            err = scan_index_store(&_index, job->uri, job->file_size, 
+                                   job->mtime, playable, &meta);
+            if (err < 0) {
+                fprintf(stderr, "failed to index \"%s\" - %s\n", job->uri,
+                        strerr(-err));
+            }
+            
+            scan_meta_destroy(&meta);
+        }
+        
+        free(job);
+    }
+    
+    return NULL;
+}
+
+/* Checks the index before a file is handed to the discoverers */
+static void scan_file(int dirfd, struct scan_job *job, const char *name)
+{
+    const struct scan_record *rec;
+    struct stat st;
+    
+    if (!_use_index) {
+        work_queue_push(&_queue, job);
+        return;
+    }
+    
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+        fprintf(stderr, "failed to stat \"%s\" - %s\n", job->uri, errstr);
+        free(job);
+        return;
+    }
+    
+    rec = scan_index_lookup(&_index, job->uri, &st);
+    if (rec) {
+        /* unchanged since the last scan, no need to open it */
+        if (rec->playable)
+            emit_uri(job->uri);
+        
+        free(job);
+        return;
+    }
+    
+    job->file_size = st.st_size;
+    job->mtime     = file_index_mtime(&st);
+    
+    work_queue_push(&_queue, job);
+}
+
+static unsigned char entry_type(int dirfd, const struct linux_dirent64 *ent)
+{
+    struct stat st;
+    
+    if (ent->d_type != DT_UNKNOWN)
+        return ent->d_type;
+    
+    /* some (network) file systems don't fill in 'd_type' */
+    if (fstatat(dirfd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        return DT_UNKNOWN;
+    
+    if (S_ISREG(st.st_mode))
+        return DT_REG;
+    
+    if (S_ISDIR(st.st_mode))
+        return DT_DIR;
+    
+    return DT_UNKNOWN;
+}
+
+/* 
+ * Walks the directory 'fd' whose absolute path is stored in the first 
+ * 'len' bytes of '_rpath' and takes ownership of 'fd'.
+ */
+static int scan_dir(int fd, size_t len)
+{
+    struct linux_dirent64 *ent;
+    enum prefilter_verdict verdict;
+    struct scan_job *job;
+    char *buf;
+    size_t name_len;
+    long n;
+    int sub_fd, err;
+    
+    buf = malloc(DIRENT_BUFFER_SIZE);
+    if (!buf) {
+        err = -errno;
+        close(fd);
+        return err;
+    }
+    
+    while (1) {
+        n = syscall(SYS_getdents64, fd, buf, DIRENT_BUFFER_SIZE);
+        if (n < 0) {
+            err = -errno;
+            _rpath[len] = '\0';
+            fprintf(stderr, "reading dir \"%s\" failed - %s\n", 
+                    (len) ? _rpath : "/", strerr(-err));
+            break;
+        }
+        
+        if (n == 0)
+            break;
+        
+        for (long off = 0; off < n; off += ent->d_reclen) {
+            ent = (struct linux_dirent64 *) (buf + off);
+            
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+                continue;
+            
+            switch (entry_type(fd, ent)) {
+            case DT_REG:
+                _stats.files += 1;
+                
+                verdict = (_prefilter) ? prefilter_check_name(ent->d_name) : 
+                                         PREFILTER_PROBE;
+                
+                if (verdict == PREFILTER_REJECT) {
+                    _stats.by_name += 1;
+                    continue;
+                }
+                
+                job = scan_job_new(_rpath, len, ent->d_name);
+                if (!job) {
+                    _rpath[len] = '\0';
+                    fprintf(stderr, "uri for file \"%s\" in subdir \"%s\""
+                            " - %s - skipping file\n", ent->d_name, _rpath, 
+                            errstr);
+                    continue;
+                }
+                
+                job->sniff = (verdict == PREFILTER_UNKNOWN);
+                
+                scan_file(fd, job, ent->d_name);
+                break;
+            case DT_DIR:
+                name_len = strlen(ent->d_name);
+                
+                if (len + 1 + name_len + 1 > PATH_MAX) {
+                    _rpath[len] = '\0';
+                    fprintf(stderr, "**ERROR: path for \"%s\" too long in "
+                            "subfolder %s\n", ent->d_name, _rpath);
+                    continue;
+                }
+                
+                sub_fd = openat(fd, ent->d_name, 
+                                O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                
+                _rpath[len] = '/';
+                memcpy(_rpath + len + 1, ent->d_name, name_len + 1);
+                
+                if (sub_fd < 0) {
+                    fprintf(stderr, "failed to open dir \"%s\" - %s\n", 
+                            _rpath, errstr);
+                    continue;
+                }
+                
+                err = scan_dir(sub_fd, len + 1 + name_len);
+                if (err < 0) {
+                    _rpath[len + 1 + name_len] = '\0';
+                    fprintf(stderr, "failed to scan subdir \"%s\" - %s\n", 
+                            _rpath, strerr(-err));
+                }
+                break;
+            default:
+                break;
+            }
+        }
+    }
+    
+    free(buf);
+    close(fd);
+    
+    return 0;
+}
+
+static int recursive_scan(const char *__restrict path)
+{
+    size_t len;
+    int fd, err;
+    
     len = strlen(path);
     
     if (len >= PATH_MAX) {
@@ -122,102 +661,207 @@ int recursive_scan(const char *__restrict path)
         return recursive_scan(_rpath);
     }
     
-    dir = opendir(path);
-    if (!dir) {
+    fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
         err = -errno;
         fprintf(stderr, "failed to open dir \"%s\" - %s\n", path, errstr);
         return err;
     }
     
     if (_rpath != path)
-        strcpy(_rpath, path);
+        memcpy(_rpath, path, len + 1);
     
-    while (1) {
-        err = readdir_r(dir, &buf, &ent);
-        if (err) {
-            fprintf(stderr, "reading dir \"%s\" failed - %s\n", path, 
-                    strerr(err));
-            break;
-        }
-        
-        if (!ent)
-            break;
+    /* avoid double slashes in the uris, "/" becomes the empty prefix */
+    while (len > 0 && _rpath[len - 1] == '/')
+        --len;
+    
+    if (_use_index) {
+        char uri[URI_MAX];
         
-        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
-            continue;
+        snprintf(uri, sizeof(uri), URI_FILE_SCHEME "%.*s", (int) len, _rpath);
         
-        switch (ent->d_type) {
-        case DT_REG:
-            if (!set_uri(_rpath, len, ent->d_name)) {
-                fprintf(stderr, "uri for file \"%s\" in subdir \"%s\""
-                        " is too long - skipping file\n", ent->d_name, _rpath);
-                continue;
-            }
-            
-            if (!uri_is_playable(_uri))
-                continue;
-            
-            fprintf(stdout, "%s\n", _uri);
-            
-            break;
-        case DT_DIR:
-            if (len + 1 + 1 + strlen(ent->d_name) > PATH_MAX) {
-                fprintf(stderr, "**ERROR: path for \"%s\" too long in subfolder %s\n", 
-                        ent->d_name, _rpath);
-                continue;
-            }
-            
-            strcat(_rpath, "/");
-            strcat(_rpath, ent->d_name);
-            
-            err = recursive_scan(_rpath);
-            
-            _rpath[len] = '\0';
-            
-            if (err < 0) {
-                fprintf(stderr, "failed to scan subdir \"%s\" - %s\n", _rpath, 
-                        strerr(-err));
-                goto cleanup1;
-            }
-            break;
-        default:
-            break;
+        err = scan_index_add_root(&_index, uri);
+        if (err < 0) {
+            fprintf(stderr, "failed to index dir \"%s\" - %s\n", _rpath,
+                    strerr(-err));
+            close(fd);
+            return err;
         }
     }
+    
+    return scan_dir(fd, len);
+}
 
-cleanup1:
-    closedir(dir);
+static int parse_count(const char *__restrict arg, 
+                       unsigned int min, 
+                       unsigned int max,
+                       unsigned int *__restrict val)
+{
+    char *end;
+    long n;
+    
+    errno = 0;
+    n = strtol(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0')
+        return -EINVAL;
+    
+    if (n < (long) min || n > (long) max)
+        return -ERANGE;
+    
+    *val = (unsigned int) n;
     
     return 0;
 }
 
 int main(int argc, char *argv[])
 {
+    static const struct option options[] = {
+        { "jobs",         required_argument, NULL, 'j' },
+        { "queue-size",   required_argument, NULL, 'q' },
+        { "sorted",       no_argument,       NULL, 's' },
+        { "index",        required_argument, NULL, 'i' },
+        { "no-prefilter", no_argument,       NULL, 'n' },
+        { "help",         no_argument,       NULL, 'h' },
+        { NULL,           0,                 NULL,  0  },
+    };
+    GstDiscoverer *discs[MAX_WORKERS];
+    pthread_t threads[MAX_WORKERS];
+    unsigned int jobs, queue_size, started;
+    const char *index_path = NULL;
     GError *error;
-    int err;
+    long cpus;
+    int c, err;
+    
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    
+    /* 
+     * The discoverers spend most of their time waiting for (network) I/O,
+     * so use more of them than there are cpus.
+     */
+    jobs = (cpus > 0) ? (unsigned int) min(2 * cpus, MAX_WORKERS) : 2;
+    queue_size = DEFAULT_QUEUE_SIZE;
+    
+    while ((c = getopt_long(argc, argv, "j:q:si:nh", options, NULL)) != -1) {
+        switch (c) {
+        case 'j':
+            err = parse_count(optarg, 1, MAX_WORKERS, &jobs);
+            if (err < 0) {
+                fprintf(stderr, "invalid number of jobs \"%s\" - %s\n", 
+                        optarg, strerr(-err));
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'q':
+            err = parse_count(optarg, 1, 1 << 20, &queue_size);
+            if (err < 0) {
+                fprintf(stderr, "invalid queue size \"%s\" - %s\n", 
+                        optarg, strerr(-err));
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 's':
+            _sorted = true;
+            break;
+        case 'i':
+            index_path = optarg;
+            break;
+        case 'n':
+            _prefilter = false;
+            break;
+        case 'h':
+            fprintf(stdout, "%s", help);
+            exit(EXIT_SUCCESS);
+        default:
+            fprintf(stderr, "%s", help);
+            exit(EXIT_FAILURE);
+        }
+    }
     
     gst_init(NULL, NULL);
     
-    _gst_discoverer = gst_discoverer_new(5 * GST_SECOND, &error);
-    if (!_gst_discoverer) {
-        fprintf(stderr, "failed to initialize discoverer");
+    /* every worker gets its own discoverer, they are not thread-safe */
+    for (unsigned int i = 0; i < jobs; ++i) {
+        error = NULL;
         
-        if (error) {
-            fprintf(stderr, " - %s", error->message);
-            g_error_free(error);
+        discs[i] = gst_discoverer_new(DISCOVERER_TIMEOUT, &error);
+        if (!discs[i]) {
+            fprintf(stderr, "failed to initialize discoverer");
+            
+            if (error) {
+                fprintf(stderr, " - %s", error->message);
+                g_error_free(error);
+            }
+            
+            fprintf(stderr, "\n");
+            exit(EXIT_FAILURE);
         }
-        
-        fprintf(stderr, "\n");
+    }
+    
+    err = work_queue_init(&_queue, queue_size);
+    if (err < 0) {
+        fprintf(stderr, "failed to initialize work queue - %s\n", 
+                strerr(-err));
         exit(EXIT_FAILURE);
     }
     
-    for (int i = 1; i < argc; ++i) {
+    result_list_init(&_results);
+    
+    if (index_path) {
+        err = scan_index_init(&_index, index_path);
+        if (err < 0) {
+            fprintf(stderr, "failed to load index \"%s\" - %s\n", 
+                    index_path, strerr(-err));
+            exit(EXIT_FAILURE);
+        }
+        
+        _use_index = true;
+    }
+    
+    for (started = 0; started < jobs; ++started) {
+        err = pthread_create(&threads[started], NULL, &discover_worker, 
+                             discs[started]);
+        if (err) {
+            fprintf(stderr, "failed to start discoverer thread - %s\n", 
+                    strerr(err));
+            break;
+        }
+    }
+    
+    if (started == 0)
+        exit(EXIT_FAILURE);
+    
+    for (int i = optind; i < argc; ++i) {
         err = recursive_scan(argv[i]);
         if (err < 0)
             fprintf(stderr, "failed to scan \"%s\" - %s\n", argv[i], strerr(-err));
     }
     
-    gst_object_unref(_gst_discoverer);
+    work_queue_close(&_queue);
+    
+    for (unsigned int i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+    
+    if (_sorted)
+        result_list_print(&_results);
+    
+    if (_prefilter)
+        prefilter_report(&_stats);
+    
+    if (_use_index) {
+        err = scan_index_save(&_index);
+        if (err < 0) {
+            fprintf(stderr, "failed to save index \"%s\" - %s\n", 
+                    index_path, strerr(-err));
+        }
+        
+        scan_index_destroy(&_index);
+    }
+    
+    result_list_destroy(&_results);
+    work_queue_destroy(&_queue);
+    
+    for (unsigned int i = 0; i < jobs; ++i)
+        gst_object_unref(discs[i]);
     
     gst_deinit();
     
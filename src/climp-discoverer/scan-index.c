@@ -0,0 +1,247 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libvci/error.h>
+
+#include "scan-index.h"
+
+#define SCAN_INDEX_MAGIC        0x58444e49u
+#define SCAN_INDEX_VERSION      1
+
+int scan_index_init(struct scan_index *__restrict si, 
+                    const char *__restrict path)
+{
+    int err;
+    
+    memset(si, 0, sizeof(*si));
+    
+    err = file_index_init(&si->index, path, SCAN_INDEX_MAGIC, 
+                          SCAN_INDEX_VERSION, 
+                          offsetof(struct scan_record, data));
+    if (err < 0)
+        return err;
+    
+    err = vector_init(&si->vec_seen, 0);
+    if (err < 0)
+        goto cleanup1;
+    
+    err = vector_init(&si->vec_records, 0);
+    if (err < 0)
+        goto cleanup2;
+    
+    vector_set_data_delete(&si->vec_records, &free);
+    
+    err = vector_init(&si->vec_roots, 0);
+    if (err < 0)
+        goto cleanup3;
+    
+    vector_set_data_delete(&si->vec_roots, &free);
+    
+    err = file_index_load(&si->index);
+    if (err == -EBADMSG) {
+        fprintf(stderr, "index \"%s\" is invalid - rescanning everything\n", 
+                path);
+    } else if (err < 0) {
+        goto cleanup4;
+    }
+    
+    pthread_mutex_init(&si->lock, NULL);
+    
+    return 0;
+    
+cleanup4:
+    vector_destroy(&si->vec_roots);
+cleanup3:
+    vector_destroy(&si->vec_records);
+cleanup2:
+    vector_destroy(&si->vec_seen);
+cleanup1:
+    file_index_destroy(&si->index);
+    
+    return err;
+}
+
+void scan_index_destroy(struct scan_index *__restrict si)
+{
+    pthread_mutex_destroy(&si->lock);
+    vector_destroy(&si->vec_roots);
+    vector_destroy(&si->vec_records);
+    vector_destroy(&si->vec_seen);
+    file_index_destroy(&si->index);
+}
+
+static void write_records(struct file_index_writer *__restrict w, 
+                          const struct vector *vec)
+{
+    unsigned int size = vector_size(vec);
+    
+    for (unsigned int i = 0; i < size; ++i) {
+        const struct scan_record *rec = *vector_at((struct vector *) vec, i);
+    
+        file_index_writer_append(w, &rec->head);
+    }
+}
+
+/* Marks the directory 'uri' as scanned, see scan_index_save() */
+int scan_index_add_root(struct scan_index *__restrict si, 
+                        const char *__restrict uri)
+{
+    char *dup;
+    int err;
+    
+    dup = strdup(uri);
+    if (!dup)
+        return -errno;
+    
+    err = vector_insert_back(&si->vec_roots, dup);
+    if (err < 0)
+        free(dup);
+    
+    return err;
+}
+
+static bool below_root(struct scan_index *__restrict si, 
+                       const char *__restrict uri)
+{
+    unsigned int size = vector_size(&si->vec_roots);
+    
+    for (unsigned int i = 0; i < size; ++i) {
+        const char *root = *vector_at(&si->vec_roots, i);
+        size_t len = strlen(root);
+        
+        if (strncmp(uri, root, len) == 0 && uri[len] == '/')
+            return true;
+    }
+    
+    return false;
+}
+
+/* 
+ * Below the scanned roots only records of files seen during this scan are 
+ * written, so deleted files vanish from the index. Records of files in 
+ * other directories are kept as they were.
+ */
+int scan_index_save(struct scan_index *__restrict si)
+{
+    const struct file_record *rec;
+    struct file_index_writer w;
+    int err;
+    
+    err = file_index_writer_open(&w, &si->index);
+    if (err < 0)
+        return err;
+    
+    for (rec = file_index_next_mapped(&si->index, NULL); rec; 
+         rec = file_index_next_mapped(&si->index, rec)) {
+        if (!file_index_is_current(&si->index, rec))
+            continue;
+        
+        if (!below_root(si, file_record_string(&si->index, rec, 0)))
+            file_index_writer_append(&w, rec);
+    }
+    
+    write_records(&w, &si->vec_seen);
+    write_records(&w, &si->vec_records);
+    
+    return file_index_writer_commit(&w, &si->index);
+}
+
+/* 
+ * Returns the record of 'uri' if the file did not change since the last
+ * scan. A record is handed out only once, later lookups of the same uri
+ * are misses.
+ */
+const struct scan_record *
+scan_index_lookup(struct scan_index *__restrict si, 
+                  const char *__restrict uri,
+                  const struct stat *__restrict st)
+{
+    const struct scan_record *rec;
+    int err;
+    
+    rec = (const void *) file_index_lookup(&si->index, uri);
+    if (!rec)
+        goto miss;
+    
+    if (rec->mtime != file_index_mtime(st) || 
+        rec->file_size != (uint64_t) st->st_size)
+        goto miss;
+    
+    err = vector_insert_back(&si->vec_seen, (void *) rec);
+    if (err < 0)
+        goto miss;
+    
+    file_index_take(&si->index, uri);
+    
+    si->hits += 1;
+    
+    return rec;
+    
+miss:
+    si->misses += 1;
+    return NULL;
+}
+
+int scan_index_store(struct scan_index *__restrict si,
+                     const char *__restrict uri,
+                     uint64_t file_size,
+                     uint64_t mtime,
+                     bool playable,
+                     const struct scan_meta *__restrict meta)
+{
+    const char *strings[FILE_INDEX_STRINGS] = { uri, "", "", "" };
+    struct scan_record *rec;
+    int err;
+    
+    if (meta) {
+        strings[1] = (meta->title)  ? meta->title  : "";
+        strings[2] = (meta->artist) ? meta->artist : "";
+        strings[3] = (meta->album)  ? meta->album  : "";
+    }
+    
+    rec = file_record_new(&si->index, strings);
+    if (!rec)
+        return -errno;
+    
+    rec->playable  = playable;
+    rec->mtime     = mtime;
+    rec->file_size = file_size;
+    
+    pthread_mutex_lock(&si->lock);
+    err = vector_insert_back(&si->vec_records, rec);
+    pthread_mutex_unlock(&si->lock);
+    
+    if (err < 0) {
+        free(rec);
+        return err;
+    }
+    
+    return 0;
+}
+
+const char *scan_record_uri(const struct scan_record *__restrict rec)
+{
+    return rec->data;
+}
\ No newline at end of file
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SCAN_INDEX_H_
+#define _SCAN_INDEX_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <libvci/vector.h>
+
+#include "../shared/file-index.h"
+
+/*
+ * Persistent index of a previous library scan. For every scanned file
+ * the size, modification time, whether it is playable and its basic tags
+ * are recorded. A file whose size and modification time did not change
+ * since the last scan does not need to be discovered again. Only records
+ * below the roots of the current scan are replaced, the others are kept.
+ */
+struct scan_record {
+    struct file_record head;
+    uint32_t playable;
+    uint64_t mtime;
+    uint64_t file_size;
+    char data[];
+};
+
+struct scan_meta {
+    char *title;
+    char *artist;
+    char *album;
+};
+
+struct scan_index {
+    struct file_index index;
+    struct vector vec_seen;
+    struct vector vec_records;
+    struct vector vec_roots;
+    pthread_mutex_t lock;
+    
+    unsigned int hits;
+    unsigned int misses;
+};
+
+int scan_index_init(struct scan_index *__restrict si, 
+                    const char *__restrict path);
+
+void scan_index_destroy(struct scan_index *__restrict si);
+
+int scan_index_add_root(struct scan_index *__restrict si, 
+                        const char *__restrict uri);
+
+int scan_index_save(struct scan_index *__restrict si);
+
+const struct scan_record *
+scan_index_lookup(struct scan_index *__restrict si, 
+                  const char *__restrict uri,
+                  const struct stat *__restrict st);
+
+int scan_index_store(struct scan_index *__restrict si,
+                     const char *__restrict uri,
+                     uint64_t file_size,
+                     uint64_t mtime,
+                     bool playable,
+                     const struct scan_meta *__restrict meta);
+
+const char *scan_record_uri(const struct scan_record *__restrict rec);
+
+#endif /* _SCAN_INDEX_H_ */
\ No newline at end of file
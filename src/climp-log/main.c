@@ -21,25 +21,627 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#define BUFFER_SIZE (1 << 12)
+#include "../shared/log-format.h"
+
+#define BUFFER_SIZE (1 << 16)
+#define MAX_TAGS 16
+#define MAX_FIELDS 8
+/* remaining ranges are scanned instead of bisected */
+#define BISECT_MIN (1 << 12)
+/* interval in milliseconds in which --follow checks for new records */
+#define FOLLOW_INTERVAL 200
+
+struct filter {
+    int64_t since;
+    int64_t until;
+    const char *tags[MAX_TAGS];
+    unsigned int n_tags;
+    int level;
+    const char *grep;
+    bool json;
+    bool follow;
+};
+
+/* A parsed JSON line, the strings still point into the line and are escaped */
+struct record {
+    int64_t ts;
+    int level;
+    const char *tag;
+    size_t tag_len;
+    const char *msg;
+    size_t msg_len;
+    struct {
+        const char *key;
+        size_t key_len;
+        const char *val;
+        size_t val_len;
+    } fields[MAX_FIELDS];
+    unsigned int n_fields;
+};
+
+static const char help[] = {
+    "Usage: climp-log [OPTION]... [FILE]\n"
+    "Print the log of climpd, FILE defaults to $CLIMPD_LOGFILE or\n"
+    "/tmp/climpd-<uid>.log.\n\n"
+    "The filters only work on logs written with 'Log.Format = json', lines\n"
+    "in any other format are only printed if no filter is given.\n\n"
+    "  -s, --since=TIME      only print records written at or after TIME\n"
+    "  -u, --until=TIME      only print records written at or before TIME\n"
+    "  -t, --tag=TAG         only print records of TAG, may be repeated\n"
+    "  -l, --level=LEVEL     only print records of LEVEL and above, one of\n"
+    "                        debug, info, warning and error\n"
+    "  -g, --grep=TEXT       only print records whose message contains TEXT\n"
+    "  -j, --json            print matching records as they are stored\n"
+    "  -f, --follow          keep printing records as they are written\n"
+    "  -h, --help            print this help and exit\n\n"
+    "TIME is either 'YYYY-mm-dd [HH:MM[:SS]]', 'HH:MM[:SS]' of today,\n"
+    "'@SECONDS' since the epoch or '-N[smhd]' ago.\n"
+};
+
+static const char *level_labels[LOG_FORMAT_LEVELS] = {
+    "DEBUG", "INFO", "WARNING", "ERROR",
+};
+
+static struct filter _filter = {
+    .since = INT64_MIN,
+    .until = INT64_MAX,
+    .level = -1,
+};
+
+static char _msg[BUFFER_SIZE];
+
+static int parse_time(const char *__restrict arg, int64_t *__restrict us)
+{
+    static const char *formats[] = {
+        "%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M",
+        "%Y-%m-%d", "%H:%M:%S", "%H:%M",
+    };
+    time_t now = time(NULL);
+    long long n, unit;
+    struct tm tm;
+    char *end;
+    
+    if (arg[0] == '@' || arg[0] == '-') {
+        errno = 0;
+        n = strtoll(arg + 1, &end, 10);
+        if (errno != 0 || end == arg + 1 || n < 0)
+            return -EINVAL;
+    
+        if (arg[0] == '@') {
+            if (*end != '\0')
+                return -EINVAL;
+    
+            *us = n * 1000000;
+            return 0;
+        }
+    
+        switch (*end) {
+        case '\0':
+        case 's': unit = 1;     break;
+        case 'm': unit = 60;    break;
+        case 'h': unit = 3600;  break;
+        case 'd': unit = 86400; break;
+        default:
+            return -EINVAL;
+        }
+    
+        if (*end != '\0' && end[1] != '\0')
+            return -EINVAL;
+    
+        *us = ((int64_t) now - n * unit) * 1000000;
+        return 0;
+    }
+    
+    for (unsigned int i = 0; i < sizeof(formats) / sizeof(*formats); ++i) {
+        /* fields missing in the format default to today, midnight */
+        localtime_r(&now, &tm);
+        tm.tm_hour = 0;
+        tm.tm_min  = 0;
+        tm.tm_sec  = 0;
+    
+        end = strptime(arg, formats[i], &tm);
+        if (!end || *end != '\0')
+            continue;
+    
+        tm.tm_isdst = -1;
+    
+        *us = (int64_t) mktime(&tm) * 1000000;
+        return 0;
+    }
+    
+    return -EINVAL;
+}
+
+static bool filter_active(const struct filter *__restrict f)
+{
+    return f->since != INT64_MIN || f->until != INT64_MAX || f->n_tags > 0 ||
+           f->level >= 0 || f->grep;
+}
+
+/* Returns the start of the first line at or after 'pos' */
+static size_t next_line(const char *__restrict buf, size_t size, size_t pos)
+{
+    const char *p;
+    
+    if (pos == 0 || pos >= size || buf[pos - 1] == '\n')
+        return pos;
+    
+    p = memchr(buf + pos, '\n', size - pos);
+    
+    return (p) ? (size_t) (p - buf) + 1 : size;
+}
+
+/* Reads the time stamp of a line without parsing the rest of it */
+static bool line_ts(const char *__restrict line, size_t len, 
+                    int64_t *__restrict ts)
+{
+    static const size_t prefix_len = sizeof(LOG_FORMAT_TS_PREFIX) - 1;
+    int64_t val = 0;
+    size_t i;
+    
+    if (len <= prefix_len || memcmp(line, LOG_FORMAT_TS_PREFIX, prefix_len))
+        return false;
+    
+    for (i = prefix_len; i < len && line[i] >= '0' && line[i] <= '9'; ++i)
+        val = val * 10 + (line[i] - '0');
+    
+    if (i == prefix_len || i == len || line[i] != ',')
+        return false;
+    
+    *ts = val;
+    
+    return true;
+}
+
+/* Returns the end of the string starting behind the quote at 'p' or NULL */
+static const char *string_end(const char *p, const char *end)
+{
+    for (; p < end; ++p) {
+        if (*p == '\\')
+            ++p;
+        else if (*p == '"')
+            return p;
+    }
+    
+    return NULL;
+}
+
+/* Only understands the flat objects written by climpd */
+static bool record_parse(struct record *__restrict rec, 
+                         const char *__restrict line, 
+                         size_t len)
+{
+    const char *p = line + 1, *end = line + len;
+    
+    if (!line_ts(line, len, &rec->ts))
+        return false;
+    
+    rec->level    = -1;
+    rec->tag      = "";
+    rec->tag_len  = 0;
+    rec->msg      = "";
+    rec->msg_len  = 0;
+    rec->n_fields = 0;
+    
+    while (p < end && *p == '"') {
+        const char *key = p + 1, *key_end, *val, *val_end;
+        size_t key_len;
+    
+        key_end = string_end(key, end);
+        if (!key_end || key_end + 1 >= end || key_end[1] != ':')
+            return false;
+    
+        key_len = (size_t) (key_end - key);
+        val = key_end + 2;
+    
+        if (val < end && *val == '"') {
+            val += 1;
+            val_end = string_end(val, end);
+            if (!val_end)
+                return false;
+    
+            p = val_end + 1;
+        } else {
+            for (val_end = val; val_end < end; ++val_end) {
+                if (*val_end == ',' || *val_end == '}')
+                    break;
+            }
+    
+            p = val_end;
+        }
+    
+        if (key_len == 5 && memcmp(key, "level", 5) == 0) {
+            rec->level = log_format_level_parse(val, (size_t) (val_end - val));
+        } else if (key_len == 3 && memcmp(key, "tag", 3) == 0) {
+            rec->tag     = val;
+            rec->tag_len = (size_t) (val_end - val);
+        } else if (key_len == 3 && memcmp(key, "msg", 3) == 0) {
+            rec->msg     = val;
+            rec->msg_len = (size_t) (val_end - val);
+        } else if (!(key_len == 2 && memcmp(key, "ts", 2) == 0) &&
+                   !(key_len == 3 && memcmp(key, "tid", 3) == 0) &&
+                   rec->n_fields < MAX_FIELDS) {
+            unsigned int i = rec->n_fields++;
+    
+            rec->fields[i].key     = key;
+            rec->fields[i].key_len = key_len;
+            rec->fields[i].val     = val;
+            rec->fields[i].val_len = (size_t) (val_end - val);
+        }
+    
+        if (p < end && *p == ',')
+            ++p;
+    }
+    
+    return p < end && *p == '}';
+}
+
+static size_t unescape(char *__restrict dst, size_t size, 
+                       const char *__restrict src, size_t len)
+{
+    size_t n = 0;
+    
+    for (size_t i = 0; i < len && n + 1 < size; ++i) {
+        char c = src[i];
+    
+        if (c == '\\' && i + 1 < len) {
+            c = src[++i];
+    
+            switch (c) {
+            case 'n': c = '\n'; break;
+            case 't': c = '\t'; break;
+            case 'r': c = '\r'; break;
+            case 'b': c = '\b'; break;
+            case 'u':
+                if (i + 4 < len) {
+                    unsigned int code;
+    
+                    if (sscanf(src + i + 1, "%4x", &code) == 1) {
+                        c = (code < 0x80) ? (char) code : '?';
+                        i += 4;
+                    }
+                }
+                break;
+            default:
+                break;
+            }
+        }
+    
+        dst[n++] = c;
+    }
+    
+    dst[n] = '\0';
+    
+    return n;
+}
+
+static bool tag_matches(const struct filter *__restrict f, 
+                        const struct record *__restrict rec)
+{
+    if (f->n_tags == 0)
+        return true;
+    
+    for (unsigned int i = 0; i < f->n_tags; ++i) {
+        if (strlen(f->tags[i]) == rec->tag_len && 
+            memcmp(f->tags[i], rec->tag, rec->tag_len) == 0)
+            return true;
+    }
+    
+    return false;
+}
+
+static void print_record(const struct record *__restrict rec)
+{
+    /* consecutive records mostly share the second */
+    static char stamp[32];
+    static time_t stamp_sec = -1;
+    struct tm tm;
+    time_t sec;
+    
+    sec = (time_t) (rec->ts / 1000000);
+    if (sec != stamp_sec) {
+        strftime(stamp, sizeof(stamp), "%F %T", localtime_r(&sec, &tm));
+        stamp_sec = sec;
+    }
+    
+    printf("%s.%06ld %-7s %.*s: %s", stamp, (long) (rec->ts % 1000000), 
+           (rec->level >= 0) ? level_labels[rec->level] : "?", 
+           (int) rec->tag_len, rec->tag, _msg);
+    
+    for (unsigned int i = 0; i < rec->n_fields; ++i) {
+        printf("%s%.*s=%.*s", (i == 0) ? " [" : " ", 
+               (int) rec->fields[i].key_len, rec->fields[i].key,
+               (int) rec->fields[i].val_len, rec->fields[i].val);
+    }
+    
+    printf("%s\n", (rec->n_fields) ? "]" : "");
+}
+
+/* 
+ * Prints the line if it passes the filter. Returns false once a record
+ * lies past the end of the time range, so the rest need not be read.
+ */
+static bool handle_line(const char *__restrict line, size_t len)
+{
+    const struct filter *f = &_filter;
+    struct record rec;
+    bool msg_done = false;
+    
+    /* strip the line feed, it is written by the print functions */
+    if (len > 0 && line[len - 1] == '\n')
+        len -= 1;
+    
+    if (!record_parse(&rec, line, len)) {
+        if (!filter_active(f))
+            printf("%.*s\n", (int) len, line);
+    
+        return true;
+    }
+    
+    if (rec.ts > f->until)
+        return rec.ts - f->until <= LOG_FORMAT_MAX_SKEW;
+    
+    if (rec.ts < f->since || rec.level < f->level || !tag_matches(f, &rec))
+        return true;
+    
+    if (f->grep) {
+        unescape(_msg, sizeof(_msg), rec.msg, rec.msg_len);
+        msg_done = true;
+    
+        if (!strstr(_msg, f->grep))
+            return true;
+    }
+    
+    if (f->json) {
+        printf("%.*s\n", (int) len, line);
+        return true;
+    }
+    
+    if (!msg_done)
+        unescape(_msg, sizeof(_msg), rec.msg, rec.msg_len);
+    
+    print_record(&rec);
+    
+    return true;
+}
+
+/* 
+ * Finds the first line which may lie in the time range. The file is 
+ * ordered by time except for the records of different threads, which may
+ * be out of order by up to LOG_FORMAT_MAX_SKEW, so it can be bisected.
+ */
+static size_t seek_since(const char *__restrict buf, size_t size, int64_t since)
+{
+    int64_t target = since - LOG_FORMAT_MAX_SKEW;
+    size_t lo = 0, hi = size;
+    
+    while (lo < hi && hi - lo > BISECT_MIN) {
+        size_t mid = next_line(buf, size, lo + (hi - lo) / 2);
+        size_t pos = mid;
+        int64_t ts = 0;
+        bool found = false;
+    
+        /* skip lines which are not in JSON format */
+        while (pos < hi) {
+            size_t next = next_line(buf, size, pos + 1);
+    
+            found = line_ts(buf + pos, next - pos, &ts);
+            if (found)
+                break;
+    
+            pos = next;
+        }
+    
+        if (!found)
+            hi = lo + (hi - lo) / 2;
+        else if (ts < target)
+            lo = next_line(buf, size, pos + 1);
+        else
+            hi = mid;
+    }
+    
+    return lo;
+}
+
+/* Prints all complete lines in 'buf' and returns the number of bytes used */
+static size_t handle_lines(const char *__restrict buf, size_t size, 
+                           bool *__restrict done)
+{
+    size_t pos = 0;
+    
+    while (pos < size) {
+        const char *p = memchr(buf + pos, '\n', size - pos);
+        size_t len;
+    
+        if (!p)
+            break;
+    
+        len = (size_t) (p - (buf + pos)) + 1;
+    
+        if (!handle_line(buf + pos, len)) {
+            *done = true;
+            return pos;
+        }
+    
+        pos += len;
+    }
+    
+    return pos;
+}
+
+static int follow(int fd, off_t offset)
+{
+    static char buffer[BUFFER_SIZE];
+    size_t len = 0, used;
+    bool done = false;
+    struct stat st;
+    ssize_t n;
+    
+    while (!done) {
+        n = pread(fd, buffer + len, sizeof(buffer) - len, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+    
+            return -errno;
+        }
+    
+        if (n == 0) {
+            fflush(stdout);
+            usleep(FOLLOW_INTERVAL * 1000);
+    
+            if (fstat(fd, &st) < 0)
+                return -errno;
+    
+            /* start over if the log was truncated, i.e. climpd restarted */
+            if (st.st_size < offset) {
+                offset = 0;
+                len = 0;
+            }
+    
+            continue;
+        }
+    
+        offset += n;
+        len += (size_t) n;
+    
+        used = handle_lines(buffer, len, &done);
+    
+        /* a line longer than the buffer is printed in pieces */
+        if (used == 0 && len == sizeof(buffer)) {
+            done = !handle_line(buffer, len);
+            used = len;
+        }
+    
+        len -= used;
+        memmove(buffer, buffer + used, len);
+    }
+    
+    return 0;
+}
+
+static int print_log(int fd)
+{
+    const char *buf = NULL;
+    size_t size, pos = 0, end;
+    bool done = false;
+    struct stat st;
+    int err;
+    
+    if (fstat(fd, &st) < 0)
+        return -errno;
+    
+    size = (size_t) st.st_size;
+    
+    if (size > 0) {
+        buf = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (buf == MAP_FAILED)
+            return -errno;
+    
+        if (_filter.since != INT64_MIN)
+            pos = seek_since(buf, size, _filter.since);
+    
+        end = pos + handle_lines(buf + pos, size - pos, &done);
+    
+        /* without --follow an unterminated last line is printed anyway */
+        if (!done && !_filter.follow && end < size)
+            handle_line(buf + end, size - end);
+    
+        munmap((void *) buf, size);
+    
+        pos = end;
+    }
+    
+    if (done || !_filter.follow)
+        return 0;
+    
+    err = follow(fd, (off_t) pos);
+    
+    fflush(stdout);
+    
+    return err;
+}
 
 int main(int argc, char *argv[])
 {
-    static __thread char buffer[BUFFER_SIZE];
+    static const struct option options[] = {
+        { "since",        required_argument, NULL, 's' },
+        { "until",        required_argument, NULL, 'u' },
+        { "tag",          required_argument, NULL, 't' },
+        { "level",        required_argument, NULL, 'l' },
+        { "grep",         required_argument, NULL, 'g' },
+        { "json",         no_argument,       NULL, 'j' },
+        { "follow",       no_argument,       NULL, 'f' },
+        { "help",         no_argument,       NULL, 'h' },
+        { NULL,           0,                 NULL,  0  },
+    };
+    static char out[BUFFER_SIZE];
     char *path;
     bool env;
-    ssize_t n;
-    int fd, err;
+    int fd, c, err;
+    
+    while ((c = getopt_long(argc, argv, "s:u:t:l:g:jfh", options, NULL)) 
+           != -1) {
+        switch (c) {
+        case 's':
+        case 'u':
+            err = parse_time(optarg, (c == 's') ? &_filter.since : 
+                                                  &_filter.until);
+            if (err < 0) {
+                fprintf(stderr, "invalid time \"%s\"\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 't':
+            if (_filter.n_tags == MAX_TAGS) {
+                fprintf(stderr, "too many tags - at most %d\n", MAX_TAGS);
+                exit(EXIT_FAILURE);
+            }
+    
+            _filter.tags[_filter.n_tags++] = optarg;
+            break;
+        case 'l':
+            _filter.level = log_format_level_parse(optarg, strlen(optarg));
+            if (_filter.level < 0) {
+                fprintf(stderr, "invalid level \"%s\"\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'g':
+            _filter.grep = optarg;
+            break;
+        case 'j':
+            _filter.json = true;
+            break;
+        case 'f':
+            _filter.follow = true;
+            break;
+        case 'h':
+            fprintf(stdout, "%s", help);
+            exit(EXIT_SUCCESS);
+        default:
+            fprintf(stderr, "%s", help);
+            exit(EXIT_FAILURE);
+        }
+    }
     
-    (void) argc;
-    (void) argv;
+    if (optind < argc - 1) {
+        fprintf(stderr, "%s", help);
+        exit(EXIT_FAILURE);
+    }
     
-    path = getenv("CLIMPD_LOGFILE");
+    path = (optind < argc) ? argv[optind] : getenv("CLIMPD_LOGFILE");
     env = !!path;
     if (!path) {
         err = asprintf(&path, "/tmp/climpd-%u.log", getuid());
@@ -57,22 +659,19 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
     
-    while (1) {
-        n = read(fd, buffer, BUFFER_SIZE);
-        if (n < 0) {
-            const char *msg = strerror(errno);
-            fprintf(stderr, "failed to read from file - %s\n", msg);
-            exit(EXIT_FAILURE);
-        }
-        if (n == 0)
-            break;
-        
-        n = write(STDOUT_FILENO, buffer, n);
-        if (n < 0) {
-            const char *msg = strerror(errno);
-            fprintf(stderr, "failed to write to stdout - %s\n", msg);
-            exit(EXIT_FAILURE);
-        }
+    setvbuf(stdout, out, _IOFBF, sizeof(out));
+    
+    err = print_log(fd);
+    if (err < 0) {
+        const char *msg = strerror(-err);
+        fprintf(stderr, "failed to read log file - %s\n", msg);
+        exit(EXIT_FAILURE);
+    }
+    
+    if (fflush(stdout) != 0) {
+        const char *msg = strerror(errno);
+        fprintf(stderr, "failed to write to stdout - %s\n", msg);
+        exit(EXIT_FAILURE);
     }
     
     close(fd);
@@ -25,19 +25,38 @@
 #include <errno.h>
 #include <time.h>
 #include <stdbool.h>
+#include <fcntl.h>
+#include <wordexp.h>
+#include <signal.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/types.h>
 
+#include <libvci/macro.h>
 #include <libvci/error.h>
 
 #include "../shared/ipc.h"
+#include "../shared/status-page.h"
 
 extern char **environ;
 
+/* maximum number of requests in flight in batch mode */
+#define BATCH_WINDOW 64
+/* same as the default of 'ConsoleOutput.Meta_Column_Width' */
+#define META_COLUMN_WIDTH 24
+
 static int _ipc_sock;
 
+static const char *event_names[] = {
+    [IPC_EVENT_TRACK]         = "track",
+    [IPC_EVENT_END_OF_STREAM] = "eos",
+    [IPC_EVENT_BUS_ERROR]     = "error",
+    [IPC_EVENT_VOLUME]        = "volume",
+    [IPC_EVENT_MUTE]          = "mute",
+    [IPC_EVENT_OVERFLOW]      = "overflow",
+};
+
 static void sleep_ns(unsigned long ns)
 {
     struct timespec ts;
@@ -117,11 +136,228 @@ static int spawn_climpd(void)
     exit(EXIT_FAILURE);
 }
 
+static int recv_status(void)
+{
+    int status, err;
+    
+    err = ipc_recv_status(_ipc_sock, &status);
+    if (err < 0) {
+        fprintf(stderr, "failed to receive response - %s\n", strerr(-err));
+        return err;
+    }
+    
+    if (status)
+        fprintf(stderr, "server sent error: %s\n", strerr(status));
+    
+    return 0;
+}
+
+/*
+ * Print the current track in the format of '--current' from the status
+ * page, without connecting to (or starting) the daemon.
+ */
+static int print_status_page(void)
+{
+    const struct status_page *page;
+    struct status_page_data data;
+    unsigned int pos, len;
+    int64_t nsec;
+    pid_t pid;
+    int err;
+    
+    err = status_page_open(&page);
+    if (err < 0) {
+        if (err == -ENOENT)
+            fprintf(stderr, "climp: climpd is not running\n");
+        else
+            fprintf(stderr, "failed to open status page - %s\n", 
+                    strerr(-err));
+        
+        return err;
+    }
+    
+    pid = page->pid;
+    err = status_page_read(page, &data);
+    
+    status_page_close(page);
+    
+    if (err < 0) {
+        fprintf(stderr, "failed to read status page - %s\n", strerr(-err));
+        return err;
+    }
+    
+    if (kill(pid, 0) < 0 && errno == ESRCH) {
+        fprintf(stderr, "climp: climpd is not running\n");
+        return -ESRCH;
+    }
+    
+    if (data.index == STATUS_PAGE_NO_TRACK) {
+        printf("climpd: no current track\n");
+        return 0;
+    }
+    
+    nsec = status_page_position(&data);
+    pos = (nsec > 0) ? (unsigned int) (nsec / 1000000000) : 0;
+    len = META_COLUMN_WIDTH;
+    
+    printf(" ( %3u )  %2u:%02u / %2u:%02u   %-*.*s %-*.*s %-*.*s\n",
+           data.index, pos / 60, pos % 60, 
+           data.duration / 60, data.duration % 60,
+           len, len, data.title, len, len, data.artist, len, len, data.album);
+    
+    return 0;
+}
+
+static int parse_event_mask(char **names, int n, uint32_t *__restrict mask)
+{
+    unsigned int i;
+    
+    if (n == 0) {
+        *mask = IPC_EVENT_ALL;
+        return 0;
+    }
+    
+    *mask = 0;
+    
+    while (n--) {
+        for (i = 0; i < ARRAY_SIZE(event_names); ++i) {
+            if (event_names[i] && strcmp(event_names[i], names[n]) == 0)
+                break;
+        }
+        
+        if (i == ARRAY_SIZE(event_names)) {
+            fprintf(stderr, "climp: unknown event \"%s\"\n", names[n]);
+            return -EINVAL;
+        }
+        
+        *mask |= IPC_EVENT_MASK(i);
+    }
+    
+    return 0;
+}
+
+/*
+ * Print one line per event: its name, its value and, if there is one, its 
+ * text. Runs until the daemon quits or the client is interrupted.
+ */
+static int run_subscription(uint32_t mask)
+{
+    struct ipc_event ev;
+    const char *name;
+    char *text;
+    int status, err;
+    
+    err = ipc_send_subscribe(_ipc_sock, mask);
+    if (err < 0) {
+        fprintf(stderr, "failed to subscribe - %s\n", strerr(-err));
+        return err;
+    }
+    
+    err = ipc_recv_status(_ipc_sock, &status);
+    if (err < 0) {
+        fprintf(stderr, "failed to receive response - %s\n", strerr(-err));
+        return err;
+    }
+    
+    if (status) {
+        fprintf(stderr, "server sent error: %s\n", strerr(status));
+        return -status;
+    }
+    
+    while (1) {
+        err = ipc_recv_event(_ipc_sock, &ev, &text);
+        if (err == -EIO)
+            return 0;
+        
+        if (err < 0) {
+            fprintf(stderr, "failed to receive event - %s\n", strerr(-err));
+            return err;
+        }
+        
+        name = NULL;
+        if (ev.type < ARRAY_SIZE(event_names))
+            name = event_names[ev.type];
+        
+        printf("%s %u%s%s\n", (name) ? name : "unknown", ev.value, 
+               (*text) ? " " : "", text);
+        fflush(stdout);
+        
+        free(text);
+    }
+}
+
+/*
+ * Read one command line per line from stdin and send all of them over the
+ * already established connection. In batch mode up to BATCH_WINDOW requests
+ * are sent before waiting for their replies, in interactive mode every line 
+ * is answered before the next prompt is shown.
+ */
+static int run_batch(bool interactive)
+{
+    char *line = NULL;
+    size_t size = 0;
+    unsigned int pending = 0;
+    wordexp_t we;
+    int err = 0;
+    
+    while (1) {
+        if (interactive) {
+            fputs("climp> ", stdout);
+            fflush(stdout);
+        }
+        
+        if (getline(&line, &size, stdin) < 0)
+            break;
+        
+        line[strcspn(line, "\n")] = '\0';
+        
+        if (line[strspn(line, " \t")] == '\0' || line[0] == '#')
+            continue;
+        
+        err = wordexp(line, &we, WRDE_NOCMD);
+        if (err) {
+            fprintf(stderr, "climp: invalid command line \"%s\"\n", line);
+            err = 0;
+            continue;
+        }
+        
+        err = ipc_send_argv(_ipc_sock, (const char **) we.we_wordv, 
+                            (int) we.we_wordc);
+        wordfree(&we);
+        
+        if (err < 0) {
+            fprintf(stderr, "failed to send commands - %s\n", strerr(-err));
+            break;
+        }
+        
+        if (interactive || ++pending == BATCH_WINDOW) {
+            err = recv_status();
+            if (err < 0)
+                break;
+            
+            if (pending)
+                --pending;
+        }
+    }
+    
+    if (interactive && err == 0)
+        fputc('\n', stdout);
+    
+    while (err == 0 && pending--)
+        err = recv_status();
+    
+    free(line);
+    
+    return err;
+}
+
 int main(int argc, char *argv[])
 {
     char *sock_path = NULL;
-    int fd0, fd1, fd2, attempts, status, err;
+    int fd0, fd1, fd2, attempts, err;
     const char *cwd = getenv("PWD");
+    bool batch, interactive, subscribe;
+    uint32_t mask = 0;
     
     if(getuid() == 0) {
         fprintf(stderr, "climp: cannot run as root\n");
@@ -133,7 +369,22 @@ int main(int argc, char *argv[])
         argc = 2;
     }
     
-    err = asprintf(&sock_path, "/tmp/.climpd-%d.sock", getuid());
+    if (strcmp(argv[1], "--status-shm") == 0) {
+        err = print_status_page();
+        exit((err < 0) ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+    
+    interactive = strcmp(argv[1], "--interactive") == 0;
+    subscribe = strcmp(argv[1], "--subscribe") == 0;
+    batch = interactive || subscribe || strcmp(argv[1], "--batch") == 0;
+    
+    if (subscribe) {
+        err = parse_event_mask(argv + 2, argc - 2, &mask);
+        if (err < 0)
+            exit(EXIT_FAILURE);
+    }
+    
+    err = ipc_socket_path(&sock_path);
     if (err < 0) {
         fprintf(stderr, "failed to create socket path\n");
         exit(EXIT_FAILURE);
@@ -176,29 +427,45 @@ int main(int argc, char *argv[])
         }
     }
     
-    fd0 = STDIN_FILENO;
+    /* in batch mode stdin carries the commands and is not for the server */
+    fd0 = (batch) ? open("/dev/null", O_RDONLY) : STDIN_FILENO;
     fd1 = STDOUT_FILENO;
     fd2 = STDERR_FILENO;
     
-    err = ipc_send_setup(_ipc_sock, fd0, fd1, fd2, cwd);
-    if (err < 0) {
-        fprintf(stderr, "failed to send environment - %s\n", strerr(-err));
+    if (fd0 < 0) {
+        fprintf(stderr, "failed to open /dev/null - %s\n", errstr);
         exit(EXIT_FAILURE);
     }
     
-    err = ipc_send_argv(_ipc_sock, (const char **) argv + 1, argc - 1);
+    err = ipc_send_setup(_ipc_sock, fd0, fd1, fd2, cwd);
     if (err < 0) {
-        fprintf(stderr, "failed to send commands - %s\n", strerr(-err));
+        fprintf(stderr, "failed to send environment - %s\n", strerr(-err));
         exit(EXIT_FAILURE);
     }
+    
+    if (subscribe) {
+        close(fd0);
         
-    /* This step is needed for a flawless synchronisation */
-    err = ipc_recv_status(_ipc_sock, &status);
-    if (err < 0) {
-        fprintf(stderr, "failed to receive response - %s\n", strerr(-err));
-        exit(EXIT_FAILURE);
-    } else if (status) {
-        fprintf(stderr, "server sent error: %s\n", strerr(status));
+        err = run_subscription(mask);
+        if (err < 0)
+            exit(EXIT_FAILURE);
+    } else if (batch) {
+        close(fd0);
+        
+        err = run_batch(interactive);
+        if (err < 0)
+            exit(EXIT_FAILURE);
+    } else {
+        err = ipc_send_argv(_ipc_sock, (const char **) argv + 1, argc - 1);
+        if (err < 0) {
+            fprintf(stderr, "failed to send commands - %s\n", strerr(-err));
+            exit(EXIT_FAILURE);
+        }
+        
+        /* This step is needed for a flawless synchronisation */
+        err = recv_status();
+        if (err < 0)
+            exit(EXIT_FAILURE);
     }
     
     close(_ipc_sock);
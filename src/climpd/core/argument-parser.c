@@ -19,6 +19,7 @@
  */
 
 #include <stdlib.h>
+#include <errno.h>
 
 #include <libvci/hash.h>
 #include <libvci/compare.h>
@@ -70,6 +71,9 @@ int argument_parser_init(struct argument_parser *__restrict ap,
         }
     }
     
+    ap->args  = args;
+    ap->size  = size;
+    ap->stats = NULL;
     ap->default_handler = NULL;
     
     climpd_log_i(tag, "initialized\n");
@@ -83,6 +87,7 @@ cleanup1:
 
 void argument_parser_destroy(struct argument_parser *__restrict ap)
 {
+    free(ap->stats);
     map_destroy(&ap->map);
     climpd_log_i(tag, "destroyed\n");
 }
@@ -95,6 +100,7 @@ int argument_parser_run(struct argument_parser *__restrict ap,
 
     for (int i = 0 ; i < argc; ++i) {
         struct arg *arg = map_retrieve(&ap->map, argv[i]);
+        gint64 start;
         int j;
         
         if (!arg) {
@@ -118,7 +124,13 @@ int argument_parser_run(struct argument_parser *__restrict ap,
         
         climpd_log_append("\b'\n");
         
+        start = stats_begin();
+        
         err = arg->handler(argv[i], argv + i + 1, j - (i + 1));
+        
+        if (ap->stats)
+            stats_record(ap->stats[arg - ap->args], start, err < 0);
+        
         if (err < 0)
             climpd_log_w(tag, "\"%s\" failed - %s\n", argv[i], strerr(-err));
         
@@ -132,4 +144,21 @@ void argument_parser_set_default_handler(struct argument_parser *__restrict ap,
                                          void (*func)(const char *))
 {
     ap->default_handler = func;
+}
+
+/* Records calls and latency of every handler in 's' */
+int argument_parser_set_stats(struct argument_parser *__restrict ap,
+                              struct stats *__restrict s)
+{
+    ap->stats = calloc(ap->size, sizeof(*ap->stats));
+    if (!ap->stats) {
+        int err = -errno;
+        climpd_log_e(tag, "failed to allocate statistics - %s\n", errstr);
+        return err;
+    }
+    
+    for (unsigned int i = 0; i < ap->size; ++i)
+        ap->stats[i] = stats_register(s, "command", ap->args[i].long_arg);
+    
+    return 0;
 }
\ No newline at end of file
@@ -23,6 +23,8 @@
 
 #include <libvci/map.h>
 
+#include <core/stats.h>
+
 struct arg {
     const char *long_arg;
     const char *short_arg;
@@ -32,6 +34,11 @@ struct arg {
 
 struct argument_parser {
     struct map map;
+    struct arg *args;
+    unsigned int size;
+    
+    /* one counter per entry of 'args', NULL without statistics */
+    struct stats_counter **stats;
     
     void (*default_handler)(const char *);
 };
@@ -49,4 +56,7 @@ int argument_parser_run(struct argument_parser *__restrict ap,
 void argument_parser_set_default_handler(struct argument_parser *__restrict ap, 
                                          void (*func)(const char *));
 
+int argument_parser_set_stats(struct argument_parser *__restrict ap,
+                              struct stats *__restrict s);
+
 #endif /* _ARGUMENT_PARSER_H_ */
\ No newline at end of file
@@ -29,6 +29,15 @@
 
 static const char *tag = "audio-player";
 
+static void notify(struct audio_player *__restrict ap,
+                   enum audio_player_event event,
+                   unsigned int value,
+                   const char *text)
+{
+    if (ap->on_event)
+        ap->on_event(event, value, text, ap->on_event_data);
+}
+
 static void handle_bus_error(struct gst_engine *en, 
                              const char *name, 
                              const char *msg, 
@@ -41,6 +50,8 @@ static void handle_bus_error(struct gst_engine *en,
     if (info)
         climpd_log_e(tag, "additional debug info: %s\n", info);
     
+    notify(ap, AUDIO_PLAYER_EVENT_BUS_ERROR, 0, msg);
+    
     if (ap->active_track) {
         const char *uri = media_uri(ap->active_track);
      
@@ -48,9 +59,98 @@ static void handle_bus_error(struct gst_engine *en,
     }
 }
 
+static void drop_next_track(struct audio_player *__restrict ap)
+{
+    if (ap->next_track) {
+        media_unref(ap->next_track);
+        ap->next_track = NULL;
+    }
+}
+
+static void queue_next_track(struct audio_player *__restrict ap)
+{
+    struct media *m = NULL;
+    unsigned int track;
+    int err;
+    
+    if (!ap->gapless) {
+        drop_next_track(ap);
+        return;
+    }
+    
+    track = playlist_peek_next(&ap->playlist);
+    if (track != (unsigned int) -1)
+        m = playlist_at(&ap->playlist, (int) track);
+    
+    err = gst_engine_queue_uri(&ap->engine, (m) ? media_uri(m) : NULL);
+    if (err < 0) {
+        /* 
+         * The pipeline already took the queued track, handle_track_change()
+         * queues its successor once the change is announced.
+         */
+        if (m)
+            media_unref(m);
+        
+        return;
+    }
+    
+    drop_next_track(ap);
+    ap->next_track = m;
+}
+
+/* Re-queues the next track whenever the playlist edits invalidate it */
+static void handle_next_change(struct playlist *pl)
+{
+    struct audio_player *ap = container_of(pl, struct audio_player, playlist);
+    
+    if (!audio_player_is_stopped(ap))
+        queue_next_track(ap);
+}
+
+static void handle_track_change(struct gst_engine *en)
+{
+    struct audio_player *ap = container_of(en, struct audio_player, engine);
+    struct playlist *pl = &ap->playlist;
+    struct media *m;
+    unsigned int track;
+    
+    m = ap->next_track;
+    if (!m)
+        return;
+    
+    ap->next_track = NULL;
+    
+    /* 
+     * The playlist may have been edited after the pipeline took the track.
+     * The track keeps playing anyway, only the index is looked up again.
+     */
+    track = playlist_peek_next(pl);
+    if (track != (unsigned int) -1 && 
+        playlist_at_unsafe(pl, (int) track) == m) {
+        playlist_next(pl);
+    } else {
+        track = playlist_index_of(pl, media_path(m));
+        if (track != (unsigned int) -1)
+            playlist_set_index(pl, (int) track);
+    }
+    
+    if (ap->active_track)
+        media_unref(ap->active_track);
+    
+    ap->active_track = m;
+    
+    climpd_log_i(tag, "now playing '%s' (gapless)\n", media_path(m));
+    
+    notify(ap, AUDIO_PLAYER_EVENT_TRACK, track, media_uri(m));
+    
+    queue_next_track(ap);
+}
+
 static void handle_end_of_stream(struct gst_engine *en)
 {
     struct audio_player *ap = container_of(en, struct audio_player, engine);
+    
+    notify(ap, AUDIO_PLAYER_EVENT_END_OF_STREAM, 0, NULL);
 
     audio_player_play_next(ap);
 }
@@ -69,6 +169,7 @@ int audio_player_init(struct audio_player *__restrict ap)
     
     gst_engine_set_end_of_stream_handler(&ap->engine, &handle_end_of_stream);
     gst_engine_set_bus_error_handler(&ap->engine, &handle_bus_error);
+    gst_engine_set_track_change_handler(&ap->engine, &handle_track_change);
     
     err = playlist_init(&ap->playlist);
     if (err < 0) {
@@ -77,6 +178,10 @@ int audio_player_init(struct audio_player *__restrict ap)
         return err;
     }
     
+    playlist_set_next_change_handler(&ap->playlist, &handle_next_change);
+    
+    ap->gapless = true;
+    
     climpd_log_i(tag, "initialized\n");
     
     return 0;
@@ -84,6 +189,8 @@ int audio_player_init(struct audio_player *__restrict ap)
 
 void audio_player_destroy(struct audio_player *__restrict ap)
 {
+    drop_next_track(ap);
+    
     if (ap->active_track)
         media_unref(ap->active_track);
     
@@ -155,6 +262,10 @@ int audio_player_play_track(struct audio_player *__restrict ap, int track)
     
     climpd_log_i(tag, "now playing '%s'\n", media_path(ap->active_track));
     
+    notify(ap, AUDIO_PLAYER_EVENT_TRACK, track, media_uri(m));
+    
+    queue_next_track(ap);
+    
     return 0;
 
 fail:
@@ -204,6 +315,8 @@ void audio_player_set_volume(struct audio_player *__restrict ap,
                              unsigned int vol)
 {
     gst_engine_set_volume(&ap->engine, vol);
+    
+    notify(ap, AUDIO_PLAYER_EVENT_VOLUME, gst_engine_volume(&ap->engine), NULL);
 }
 
 unsigned int audio_player_volume(const struct audio_player *__restrict ap)
@@ -214,6 +327,8 @@ unsigned int audio_player_volume(const struct audio_player *__restrict ap)
 void audio_player_set_mute(struct audio_player *__restrict ap, bool mute)
 {
     gst_engine_set_mute(&ap->engine, mute);
+    
+    notify(ap, AUDIO_PLAYER_EVENT_MUTE, mute, NULL);
 }
 
 bool audio_player_is_muted(const struct audio_player *__restrict ap)
@@ -225,7 +340,25 @@ void audio_player_toggle_mute(struct audio_player *__restrict ap)
 {
     bool mute = gst_engine_is_muted(&ap->engine);
     
-    gst_engine_set_mute(&ap->engine, !mute);
+    audio_player_set_mute(ap, !mute);
+}
+
+void audio_player_set_gapless(struct audio_player *__restrict ap, 
+                              bool gapless)
+{
+    ap->gapless = gapless;
+    
+    if (!gapless) {
+        drop_next_track(ap);
+        gst_engine_queue_uri(&ap->engine, NULL);
+    } else if (!audio_player_is_stopped(ap)) {
+        queue_next_track(ap);
+    }
+}
+
+bool audio_player_gapless(const struct audio_player *__restrict ap)
+{
+    return ap->gapless;
 }
 
 enum audio_player_state 
@@ -260,6 +393,11 @@ int audio_player_stream_position(const struct audio_player *__restrict ap)
     return gst_engine_stream_position(&ap->engine);
 }
 
+gint64 audio_player_stream_time(const struct audio_player *__restrict ap)
+{
+    return gst_engine_stream_time(&ap->engine);
+}
+
 struct playlist *audio_player_playlist(struct audio_player *__restrict ap)
 {
     return &ap->playlist;
@@ -271,3 +409,10 @@ audio_player_active_track(const struct audio_player *__restrict ap)
     return ap->active_track;
 }
 
+void audio_player_set_event_handler(struct audio_player *__restrict ap,
+                                    audio_player_event_handler handler,
+                                    void *data)
+{
+    ap->on_event      = handler;
+    ap->on_event_data = data;
+}
\ No newline at end of file
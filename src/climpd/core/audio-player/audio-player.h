@@ -30,11 +30,32 @@ enum audio_player_state {
     AUDIO_PLAYER_STOPPED = GST_ENGINE_STOPPED,
 };
 
+enum audio_player_event {
+    /* 'value' is the playlist index, 'text' the uri of the new track */
+    AUDIO_PLAYER_EVENT_TRACK,
+    AUDIO_PLAYER_EVENT_END_OF_STREAM,
+    /* 'text' is the error message */
+    AUDIO_PLAYER_EVENT_BUS_ERROR,
+    AUDIO_PLAYER_EVENT_VOLUME,
+    AUDIO_PLAYER_EVENT_MUTE,
+};
+
+typedef void (*audio_player_event_handler)(enum audio_player_event event,
+                                           unsigned int value,
+                                           const char *text,
+                                           void *data);
+
 struct audio_player {
     struct gst_engine engine;
     struct playlist playlist;
     
     struct media *active_track;
+    struct media *next_track;
+    
+    bool gapless;
+    
+    audio_player_event_handler on_event;
+    void *on_event_data;
 };
 
 int audio_player_init(struct audio_player *__restrict ap);
@@ -70,6 +91,11 @@ bool audio_player_is_muted(const struct audio_player *__restrict ap);
 
 void audio_player_toggle_mute(struct audio_player *__restrict ap);
 
+void audio_player_set_gapless(struct audio_player *__restrict ap, 
+                              bool gapless);
+
+bool audio_player_gapless(const struct audio_player *__restrict ap);
+
 enum audio_player_state 
 audio_player_state(const struct audio_player *__restrict ap);
 
@@ -84,11 +110,17 @@ int audio_player_set_stream_position(struct audio_player *__restrict ap,
 
 int audio_player_stream_position(const struct audio_player *__restrict ap);
 
+gint64 audio_player_stream_time(const struct audio_player *__restrict ap);
+
 struct playlist *audio_player_playlist(struct audio_player *__restrict ap);
 
 const struct media *
 audio_player_active_track(const struct audio_player *__restrict ap);
 
+void audio_player_set_event_handler(struct audio_player *__restrict ap,
+                                    audio_player_event_handler handler,
+                                    void *data);
+
 
 
 #endif /* _AUDIO_PLAYER_H_ */
\ No newline at end of file
@@ -18,14 +18,23 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <math.h>
 
 #include <libvci/macro.h>
+#include <libvci/error.h>
 
 #include <core/climpd-log.h>
 #include <core/audio-player/gst-engine.h>
 
+/* 
+ * 'GstPlayFlags' is not part of the public headers, 
+ * this is the value of GST_PLAY_FLAG_AUDIO 
+ */
+#define GST_PLAY_FLAG_AUDIO (1 << 1)
+
 static const char *tag = "gst-engine";
 
 static void handle_bus_error(struct gst_engine *__restrict en, GstMessage *msg)
@@ -48,6 +57,21 @@ static void handle_bus_error(struct gst_engine *__restrict en, GstMessage *msg)
     }
 }
 
+static void handle_stream_start(struct gst_engine *__restrict en)
+{
+    bool changed;
+    
+    pthread_mutex_lock(&en->mutex);
+    
+    changed = en->track_changed;
+    en->track_changed = false;
+    
+    pthread_mutex_unlock(&en->mutex);
+    
+    if (changed && en->on_track_change)
+        en->on_track_change(en);
+}
+
 static gboolean bus_watcher(GstBus *bus, GstMessage *msg, void *data)
 {
     struct gst_engine *en = data;
@@ -62,6 +86,9 @@ static gboolean bus_watcher(GstBus *bus, GstMessage *msg, void *data)
         if (en->on_end_of_stream)
             en->on_end_of_stream(en);
         break;
+    case GST_MESSAGE_STREAM_START:
+        handle_stream_start(en);
+        break;
     case GST_MESSAGE_STATE_CHANGED:
     case GST_MESSAGE_TAG:
     case GST_MESSAGE_PROGRESS:
@@ -107,62 +134,66 @@ static int gst_engine_set_state(struct gst_engine *__restrict en,
     return 0;
 }
 
-static void on_pad_added(GstElement *src, GstPad *new_pad, void *data) {
+static void on_about_to_finish(GstElement *playbin, void *data)
+{
     struct gst_engine *en = data;
-    GstPad *sink_pad;
-    GstPadLinkReturn ret;
-    GstCaps *new_pad_caps;
-    GstStructure *new_pad_struct;
-    const gchar *new_pad_type;
-    
-    (void) src;
-    
-    sink_pad = gst_element_get_static_pad(en->gst_convert, "sink");
-    
-    /* If our converter is already linked, we have nothing to do here */
-    if(gst_pad_is_linked(sink_pad))
-        goto cleanup1;
-    
-    /* Check the new pad's type */
-    new_pad_caps   = gst_pad_query_caps(new_pad, NULL);
-    new_pad_struct = gst_caps_get_structure(new_pad_caps, 0);
-    new_pad_type   = gst_structure_get_name(new_pad_struct);
     
-    if(!g_str_has_prefix(new_pad_type, "audio/x-raw"))
-        goto cleanup2;
+    (void) playbin;
     
-    ret = gst_pad_link(new_pad, sink_pad);
+    /* 
+     * This is called from a streaming thread. Setting the uri here lets
+     * the pipeline decode the next track before the current one has ended.
+     */
+    pthread_mutex_lock(&en->mutex);
     
-    if(GST_PAD_LINK_FAILED(ret))
-        climpd_log_e(tag, "linking new pad %s failed\n", new_pad_type);
+    if (en->next_uri) {
+        g_object_set(en->gst_pipeline, "uri", en->next_uri, NULL);
+        
+        free(en->next_uri);
+        en->next_uri = NULL;
+        en->track_changed = true;
+    }
     
-cleanup2:
-    gst_caps_unref(new_pad_caps);
-cleanup1:
-    gst_object_unref(sink_pad);
+    pthread_mutex_unlock(&en->mutex);
 }
 
 int gst_engine_init(struct gst_engine *__restrict en)
 {
-    static const char *elements[] = {
-        "uridecodebin",         "source",
+    const char *elements[] = {
         "audioconvert",         "convert",
         "pitch",                "pitch",
         "volume",               "volume",
         "autoaudiosink",        "sink",
     };
+    const char *sink;
     GstElement *ele;
+    GstPad *pad;
     GstBus *bus;
     bool ok;
     
     memset(en, 0, sizeof(*en));
     
-    en->gst_pipeline = gst_pipeline_new(NULL);
+    pthread_mutex_init(&en->mutex, NULL);
+    
+    /* e.g. 'fakesink' to run without an audio device */
+    sink = getenv("CLIMPD_AUDIO_SINK");
+    if (sink)
+        elements[ARRAY_SIZE(elements) - 2] = sink;
+    
+    en->gst_pipeline = gst_element_factory_make("playbin", NULL);
     if (!en->gst_pipeline) {
-        climpd_log_e(tag, "creating gstreamer pipeline failed\n");
+        climpd_log_e(tag, "creating \"playbin\" element failed\n");
         goto fail;
     }
     
+    en->gst_bin = gst_bin_new("audio-sink");
+    if (!en->gst_bin) {
+        climpd_log_e(tag, "creating audio sink bin failed\n");
+        goto fail;
+    }
+    
+    gst_object_ref_sink(en->gst_bin);
+    
     for (unsigned int i = 0; i < ARRAY_SIZE(elements); i += 2) {
         ele = gst_element_factory_make(elements[i], elements[i + 1]);
         if (!ele) {
@@ -170,7 +201,7 @@ int gst_engine_init(struct gst_engine *__restrict en)
             goto fail;
         }
         
-        ok = gst_bin_add(GST_BIN(en->gst_pipeline), ele);
+        ok = gst_bin_add(GST_BIN(en->gst_bin), ele);
         if (!ok) {
             gst_object_unref(ele);
             climpd_log_e(tag, "adding \"%s\" element failed\n", elements[i]);
@@ -178,13 +209,15 @@ int gst_engine_init(struct gst_engine *__restrict en)
         }
     }
     
-    en->gst_source = gst_bin_get_by_name(GST_BIN(en->gst_pipeline), "source");
-    en->gst_convert = gst_bin_get_by_name(GST_BIN(en->gst_pipeline), "convert");
-    en->gst_pitch = gst_bin_get_by_name(GST_BIN(en->gst_pipeline), "pitch");
-    en->gst_volume = gst_bin_get_by_name(GST_BIN(en->gst_pipeline), "volume");
-    en->gst_sink = gst_bin_get_by_name(GST_BIN(en->gst_pipeline), "sink");
+    en->gst_convert = gst_bin_get_by_name(GST_BIN(en->gst_bin), "convert");
+    en->gst_pitch = gst_bin_get_by_name(GST_BIN(en->gst_bin), "pitch");
+    en->gst_volume = gst_bin_get_by_name(GST_BIN(en->gst_bin), "volume");
+    en->gst_sink = gst_bin_get_by_name(GST_BIN(en->gst_bin), "sink");
     
-    g_signal_connect(en->gst_source, "pad-added", G_CALLBACK(&on_pad_added), en);
+    /* a 'fakesink' would otherwise consume the stream as fast as possible */
+    if (sink && g_object_class_find_property(G_OBJECT_GET_CLASS(en->gst_sink), 
+                                             "sync"))
+        g_object_set(en->gst_sink, "sync", true, NULL);
     
     ok = gst_element_link(en->gst_convert, en->gst_pitch);
     if (!ok) {
@@ -204,6 +237,26 @@ int gst_engine_init(struct gst_engine *__restrict en)
         goto fail;
     }
     
+    pad = gst_element_get_static_pad(en->gst_convert, "sink");
+    ok = gst_element_add_pad(en->gst_bin, gst_ghost_pad_new("sink", pad));
+    gst_object_unref(pad);
+    
+    if (!ok) {
+        climpd_log_e(tag, "adding sink pad to audio sink bin failed\n");
+        goto fail;
+    }
+    
+    /* 
+     * playbin does the decoding for us, we only plug in our own audio sink 
+     * and skip video streams (e.g. embedded cover art) altogether
+     */
+    g_object_set(en->gst_pipeline, 
+                 "audio-sink", en->gst_bin, 
+                 "flags", GST_PLAY_FLAG_AUDIO,
+                 NULL);
+    
+    g_signal_connect(en->gst_pipeline, "about-to-finish", 
+                     G_CALLBACK(&on_about_to_finish), en);
     
     bus = gst_element_get_bus(en->gst_pipeline);
     gst_bus_add_watch(bus, &bus_watcher, en);
@@ -230,12 +283,14 @@ fail:
     if (en->gst_convert)
         g_object_unref(en->gst_convert);
     
-    if (en->gst_source)
-        g_object_unref(en->gst_source);
+    if (en->gst_bin)
+        g_object_unref(en->gst_bin);
     
     if (en->gst_pipeline)
         g_object_unref(en->gst_pipeline);
     
+    pthread_mutex_destroy(&en->mutex);
+    
     climpd_log_e(tag, "initialization failed\n");
     
     return -1;
@@ -245,20 +300,63 @@ void gst_engine_destroy(struct gst_engine *__restrict en)
 {
     gst_engine_stop(en);
     
+    free(en->next_uri);
+    
     g_object_unref(en->gst_sink);
     g_object_unref(en->gst_volume);
     g_object_unref(en->gst_pitch);
     g_object_unref(en->gst_convert);
-    g_object_unref(en->gst_source);
+    g_object_unref(en->gst_bin);
     g_object_unref(en->gst_pipeline);
     
+    pthread_mutex_destroy(&en->mutex);
+    
     climpd_log_i(tag, "destroyed\n");
 }
 
 void gst_engine_set_uri(struct gst_engine *__restrict en, 
                         const char *__restrict uri)
 {
-    g_object_set(en->gst_source, "uri", uri, NULL);
+    pthread_mutex_lock(&en->mutex);
+    
+    free(en->next_uri);
+    en->next_uri = NULL;
+    en->track_changed = false;
+    
+    pthread_mutex_unlock(&en->mutex);
+    
+    g_object_set(en->gst_pipeline, "uri", uri, NULL);
+}
+
+/* 
+ * Fails with -EBUSY if the pipeline already switched to the previously 
+ * queued uri, but its track change was not handled yet.
+ */
+int gst_engine_queue_uri(struct gst_engine *__restrict en, 
+                         const char *__restrict uri)
+{
+    char *dup = NULL;
+    int err = 0;
+    
+    if (uri) {
+        dup = strdup(uri);
+        if (!dup)
+            climpd_log_w(tag, "failed to queue '%s' - %s\n", uri, errstr);
+    }
+    
+    pthread_mutex_lock(&en->mutex);
+    
+    if (en->track_changed) {
+        free(dup);
+        err = -EBUSY;
+    } else {
+        free(en->next_uri);
+        en->next_uri = dup;
+    }
+    
+    pthread_mutex_unlock(&en->mutex);
+    
+    return err;
 }
 
 int gst_engine_play(struct gst_engine *__restrict en)
@@ -297,13 +395,22 @@ int gst_engine_stop(struct gst_engine *__restrict en)
     return err;
 }
 
+gint64 gst_engine_stream_time(const struct gst_engine *__restrict en)
+{
+    gint64 nsec;
+    
+    if (!gst_element_query_position(en->gst_pipeline, GST_FORMAT_TIME, &nsec))
+        return -1;
+    
+    return nsec;
+}
+
 int gst_engine_stream_position(const struct gst_engine *__restrict en)
 {
-    bool ok;
     gint64 nsec;
     
-    ok = gst_element_query_position(en->gst_pipeline, GST_FORMAT_TIME, &nsec);
-    if (!ok) {
+    nsec = gst_engine_stream_time(en);
+    if (nsec < 0) {
         climpd_log_e(tag, "failed to query the position of the stream\n");
         return -1;
     }
@@ -422,4 +529,10 @@ void gst_engine_set_bus_error_handler(struct gst_engine *__restrict en,
                                       bus_error_callback func)
 {
     en->on_bus_error = func;
+}
+
+void gst_engine_set_track_change_handler(struct gst_engine *__restrict en,
+                                         track_change_callback func)
+{
+    en->on_track_change = func;
 }
\ No newline at end of file
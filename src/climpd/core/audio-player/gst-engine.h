@@ -22,6 +22,7 @@
 #define _GST_ENGINE_H_
 
 #include <stdbool.h>
+#include <pthread.h>
 
 #include <gst/gst.h>
 
@@ -34,6 +35,7 @@ enum gst_engine_state {
 struct gst_engine;
 
 typedef void (*eos_callback)(struct gst_engine *);
+typedef void (*track_change_callback)(struct gst_engine *);
 typedef void (*bus_error_callback)(struct gst_engine *, 
                                    const char *, 
                                    const char *, 
@@ -41,18 +43,27 @@ typedef void (*bus_error_callback)(struct gst_engine *,
 
 struct gst_engine {
     GstElement *gst_pipeline;
-    GstElement *gst_source;
+    GstElement *gst_bin;
     GstElement *gst_convert;
     GstElement *gst_pitch;
     GstElement *gst_volume;
     GstElement *gst_sink;
     GstState gst_state;
     
+    /* 
+     * Uri of the next track, handed over to the pipeline from 
+     * the streaming thread when the current track is about to finish 
+     */
+    pthread_mutex_t mutex;
+    char *next_uri;
+    bool track_changed;
+    
     unsigned int volume;
     bool mute;
 
     eos_callback on_end_of_stream;
     bus_error_callback on_bus_error;
+    track_change_callback on_track_change;
 };
 
 int gst_engine_init(struct gst_engine *__restrict en);
@@ -62,6 +73,9 @@ void gst_engine_destroy(struct gst_engine *__restrict en);
 void gst_engine_set_uri(struct gst_engine *__restrict en, 
                         const char *__restrict uri);
 
+int gst_engine_queue_uri(struct gst_engine *__restrict en,
+                         const char *__restrict uri);
+
 int gst_engine_play(struct gst_engine *__restrict en);
 
 int gst_engine_pause(struct gst_engine *__restrict en);
@@ -70,6 +84,9 @@ int gst_engine_stop(struct gst_engine *__restrict en);
 
 int gst_engine_stream_position(const struct gst_engine *__restrict en);
 
+/* Position in nanoseconds, -1 if it cannot be determined */
+gint64 gst_engine_stream_time(const struct gst_engine *__restrict en);
+
 int gst_engine_set_stream_position(struct gst_engine *__restrict en, 
                                    unsigned int sec);
 
@@ -97,4 +114,7 @@ void gst_engine_set_end_of_stream_handler(struct gst_engine *__restrict en,
 void gst_engine_set_bus_error_handler(struct gst_engine *__restrict en, 
                                       bus_error_callback func);
 
+void gst_engine_set_track_change_handler(struct gst_engine *__restrict en,
+                                         track_change_callback func);
+
 #endif /* _GST_ENGINE_H_ */
\ No newline at end of file
@@ -18,9 +18,13 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/socket.h>
 
 #include <libvci/macro.h>
 #include <libvci/error.h>
@@ -30,6 +34,9 @@
 #include <util/bool.h>
 #include <util/strconvert.h>
 
+#define EVENT_BUFFER_SIZE_MIN (4 * 1024)
+#define EVENT_BUFFER_SIZE_MAX (16 * 1024 * 1024)
+
 static const char *tag = "climpd-config";
 
 static void log_invalid_value(const char *__restrict key, 
@@ -148,6 +155,255 @@ static void parse_shuffle(const char *key, const char *val, void *arg)
     climpd_log_i(tag, "'%s' -> '%s'\n", key, yes_no(conf->ap_conf.shuffle));
 }
 
+static void parse_gapless(const char *key, const char *val, void *arg)
+{
+    struct climpd_config *conf = arg;
+    bool gapless;
+    int err;
+    
+    err = str_to_bool(val, &gapless);
+    if (err < 0) {
+        log_invalid_value(key, val, -err);
+        return;
+    }
+    
+    conf->ap_conf.gapless = gapless;
+    
+    climpd_log_i(tag, "'%s' -> '%s'\n", key, yes_no(conf->ap_conf.gapless));
+}
+
+static void parse_discoverers(const char *key, const char *val, void *arg)
+{
+    struct climpd_config *conf = arg;
+    int cnt, err;
+    
+    err = str_to_int(val, &cnt);
+    if (err < 0) {
+        log_invalid_value(key, val, -err);
+        return;
+    }
+    
+    cnt = max(cnt, 0);
+    
+    conf->tr_conf.discoverers = (unsigned int) cnt;
+    
+    climpd_log_i(tag, "'%s' -> '%u'\n", key, conf->tr_conf.discoverers);
+}
+
+static void parse_backlog(const char *key, const char *val, void *arg)
+{
+    struct climpd_config *conf = arg;
+    int backlog, err;
+    
+    err = str_to_int(val, &backlog);
+    if (err < 0) {
+        log_invalid_value(key, val, -err);
+        return;
+    }
+    
+    backlog = min(backlog, SOMAXCONN);
+    backlog = max(backlog, 1);
+    
+    conf->ss_conf.backlog = (unsigned int) backlog;
+    
+    climpd_log_i(tag, "'%s' -> '%u'\n", key, conf->ss_conf.backlog);
+}
+
+static void parse_event_buffer_size(const char *key, const char *val, 
+                                    void *arg)
+{
+    struct climpd_config *conf = arg;
+    int size, err;
+    
+    err = str_to_int(val, &size);
+    if (err < 0) {
+        log_invalid_value(key, val, -err);
+        return;
+    }
+    
+    size = min(size, EVENT_BUFFER_SIZE_MAX);
+    size = max(size, EVENT_BUFFER_SIZE_MIN);
+    
+    conf->ss_conf.event_buffer_size = (unsigned int) size;
+    
+    climpd_log_i(tag, "'%s' -> '%u'\n", key, conf->ss_conf.event_buffer_size);
+}
+
+static void parse_library_roots(const char *key, const char *val, void *arg)
+{
+    struct climpd_config *conf = arg;
+    char *roots;
+    
+    roots = strdup(val);
+    if (!roots) {
+        log_invalid_value(key, val, errno);
+        return;
+    }
+    
+    free(conf->lib_conf.roots);
+    conf->lib_conf.roots = roots;
+    
+    climpd_log_i(tag, "'%s' -> '%s'\n", key, conf->lib_conf.roots);
+}
+
+static void parse_library_watch(const char *key, const char *val, void *arg)
+{
+    struct climpd_config *conf = arg;
+    bool watch;
+    int err;
+    
+    err = str_to_bool(val, &watch);
+    if (err < 0) {
+        log_invalid_value(key, val, -err);
+        return;
+    }
+    
+    conf->lib_conf.watch = watch;
+    
+    climpd_log_i(tag, "'%s' -> '%s'\n", key, yes_no(conf->lib_conf.watch));
+}
+
+static void parse_playlist_sync(const char *key, const char *val, void *arg)
+{
+    struct climpd_config *conf = arg;
+    enum file_sync sync;
+    int err;
+    
+    err = file_sync_parse(val, &sync);
+    if (err < 0) {
+        log_invalid_value(key, val, -err);
+        return;
+    }
+    
+    conf->pl_conf.sync = sync;
+    
+    climpd_log_i(tag, "'%s' -> '%s'\n", key, file_sync_name(sync));
+}
+
+static void parse_background_save(const char *key, const char *val, void *arg)
+{
+    struct climpd_config *conf = arg;
+    bool background;
+    int err;
+    
+    err = str_to_bool(val, &background);
+    if (err < 0) {
+        log_invalid_value(key, val, -err);
+        return;
+    }
+    
+    conf->pl_conf.background_save = background;
+    
+    climpd_log_i(tag, "'%s' -> '%s'\n", key, 
+                 yes_no(conf->pl_conf.background_save));
+}
+
+static void parse_persistence_delay(const char *key, const char *val, 
+                                    void *arg)
+{
+    struct climpd_config *conf = arg;
+    int delay, err;
+    
+    err = str_to_int(val, &delay);
+    if (err < 0) {
+        log_invalid_value(key, val, -err);
+        return;
+    }
+    
+    delay = max(delay, 0);
+    
+    conf->ps_conf.delay = (unsigned int) delay;
+    
+    climpd_log_i(tag, "'%s' -> '%u'\n", key, conf->ps_conf.delay);
+}
+
+static void parse_max_changes(const char *key, const char *val, void *arg)
+{
+    struct climpd_config *conf = arg;
+    int cnt, err;
+    
+    err = str_to_int(val, &cnt);
+    if (err < 0) {
+        log_invalid_value(key, val, -err);
+        return;
+    }
+    
+    cnt = max(cnt, 1);
+    
+    conf->ps_conf.max_changes = (unsigned int) cnt;
+    
+    climpd_log_i(tag, "'%s' -> '%u'\n", key, conf->ps_conf.max_changes);
+}
+
+static void parse_log_interval(const char *key, const char *val, void *arg)
+{
+    struct climpd_config *conf = arg;
+    int sec, err;
+    
+    err = str_to_int(val, &sec);
+    if (err < 0) {
+        log_invalid_value(key, val, -err);
+        return;
+    }
+    
+    sec = max(sec, 0);
+    
+    conf->st_conf.log_interval = (unsigned int) sec;
+    
+    climpd_log_i(tag, "'%s' -> '%u'\n", key, conf->st_conf.log_interval);
+}
+
+static void parse_log_level(const char *key, const char *val, void *arg)
+{
+    struct climpd_config *conf = arg;
+    enum climpd_log_level level;
+    int err;
+    
+    err = climpd_log_level_parse(val, &level);
+    if (err < 0) {
+        log_invalid_value(key, val, -err);
+        return;
+    }
+    
+    conf->log_conf.level = level;
+    
+    climpd_log_i(tag, "'%s' -> '%s'\n", key, climpd_log_level_name(level));
+}
+
+static void parse_log_format(const char *key, const char *val, void *arg)
+{
+    struct climpd_config *conf = arg;
+    enum climpd_log_format fmt;
+    int err;
+    
+    err = climpd_log_format_parse(val, &fmt);
+    if (err < 0) {
+        log_invalid_value(key, val, -err);
+        return;
+    }
+    
+    conf->log_conf.format = fmt;
+    
+    climpd_log_i(tag, "'%s' -> '%s'\n", key, climpd_log_format_name(fmt));
+}
+
+static void parse_log_async(const char *key, const char *val, void *arg)
+{
+    struct climpd_config *conf = arg;
+    bool async;
+    int err;
+    
+    err = str_to_bool(val, &async);
+    if (err < 0) {
+        log_invalid_value(key, val, -err);
+        return;
+    }
+    
+    conf->log_conf.async = async;
+    
+    climpd_log_i(tag, "'%s' -> '%s'\n", key, yes_no(conf->log_conf.async));
+}
+
 static void parse_keep_changes(const char *key, const char *val, void *arg)
 {
     struct climpd_config *conf = arg;
@@ -165,16 +421,25 @@ static void parse_keep_changes(const char *key, const char *val, void *arg)
     climpd_log_i(tag, "'%s' -> '%s'\n", key, yes_no(conf->keep_changes));
 }
 
-static void write_config(int fd, void *arg)
+/* Returns the contents of the config file for 'conf' or NULL on failure */
+static char *config_text(const struct climpd_config *__restrict conf, 
+                         size_t *__restrict len)
 {
-    struct climpd_config *conf = arg;
+    const char *roots = conf->lib_conf.roots;
+    char *text;
+    int n;
     
-    dprintf(fd,
+    n = asprintf(&text,
             "# climpd configuration\n#\n"
             "# Valid Ranges for\n"
             "# - Volume : [0, 100]\n"
             "# - Pitch  : [0.1, 10.0]\n"
-            "# - Speed  : [0.1, 40.0]\n#\n\n"
+            "# - Speed  : [0.1, 40.0]\n"
+            "# - Discoverers : [0, 16] (0 = one per cpu)\n"
+            "# - Backlog     : [1, %d]\n"
+            "# - Event_Buffer_Size : [%d, %d]\n"
+            "# - Sync        : none, data, full\n"
+            "# - Level       : debug, info, warning, error\n#\n\n"
             "# Column width for media meta information\n"
             "ConsoleOutput.Meta_Column_Width = %u\n\n"
             "# Player Settings\n"
@@ -182,13 +447,79 @@ static void write_config(int fd, void *arg)
             "AudioPlayer.Pitch = %.2f\n"
             "AudioPlayer.Speed = %.2f\n"
             "AudioPlayer.Repeat = %s\n"
-            "AudioPlayer.Shuffle = %s\n\n"
+            "AudioPlayer.Shuffle = %s\n"
+            "AudioPlayer.Gapless = %s\n\n"
+            "# Number of parallel media discoverers\n"
+            "TagReader.Discoverers = %u\n\n"
+            "# Maximum number of pending client connections\n"
+            "SocketServer.Backlog = %u\n"
+            "# Bytes of events buffered for each subscribed client\n"
+            "SocketServer.Event_Buffer_Size = %u\n\n"
+            "# Directories of the music library, separated by ':'\n"
+            "%sLibrary.Roots = %s\n"
+            "# Follow changes of the library directories via inotify\n"
+            "Library.Watch = %s\n\n"
+            "# How thoroughly saved playlists are flushed to disk\n"
+            "Playlist.Sync = %s\n"
+            "# Write the session playlist on a separate thread\n"
+            "Playlist.Background_Save = %s\n\n"
+            "# Save changes after this many milliseconds without further\n"
+            "# changes or after this many changes, whatever comes first\n"
+            "Persistence.Delay = %u\n"
+            "Persistence.Max_Changes = %u\n\n"
+            "# Write the command and request statistics to the log every\n"
+            "# this many seconds, 0 disables it\n"
+            "Stats.Log_Interval = %u\n\n"
+            "# Log messages below this level are discarded\n"
+            "Log.Level = %s\n"
+            "# 'text' or 'json', one object per line for 'climp-log'\n"
+            "Log.Format = %s\n"
+            "# Write the log on a separate thread\n"
+            "Log.Async = %s\n\n"
             "# Config options\n"
             "Config.Keep_Changes = %s\n\n",
+            SOMAXCONN, EVENT_BUFFER_SIZE_MIN, EVENT_BUFFER_SIZE_MAX,
             conf->cout_conf.meta_column_width, conf->ap_conf.volume, 
             conf->ap_conf.pitch, conf->ap_conf.speed, 
             yes_no(conf->ap_conf.repeat), yes_no(conf->ap_conf.shuffle), 
-            yes_no(conf->keep_changes));
+            yes_no(conf->ap_conf.gapless), conf->tr_conf.discoverers,
+            conf->ss_conf.backlog, conf->ss_conf.event_buffer_size,
+            (roots) ? "" : "# ", 
+            (roots) ? roots : "/path/to/music", yes_no(conf->lib_conf.watch),
+            file_sync_name(conf->pl_conf.sync), 
+            yes_no(conf->pl_conf.background_save), conf->ps_conf.delay,
+            conf->ps_conf.max_changes, conf->st_conf.log_interval,
+            climpd_log_level_name(conf->log_conf.level),
+            climpd_log_format_name(conf->log_conf.format),
+            yes_no(conf->log_conf.async), yes_no(conf->keep_changes));
+    if (n < 0) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    
+    *len = n;
+    
+    return text;
+}
+
+static void write_config(int fd, void *arg)
+{
+    size_t len;
+    char *text;
+    ssize_t n;
+    
+    text = config_text(arg, &len);
+    if (!text) {
+        climpd_log_e(tag, "failed to write config - %s\n", errstr);
+        return;
+    }
+    
+    n = write(fd, text, len);
+    if (n < 0 || (size_t) n != len)
+        climpd_log_e(tag, "failed to write config - %s\n", 
+                     (n < 0) ? errstr : strerr(EIO));
+    
+    free(text);
 }
 
 static struct config_handle handles[] = {
@@ -198,6 +529,20 @@ static struct config_handle handles[] = {
     { &parse_speed,             "AudioPlayer.Speed",               NULL },
     { &parse_repeat,            "AudioPlayer.Repeat",              NULL },
     { &parse_shuffle,           "AudioPlayer.Shuffle",             NULL },
+    { &parse_gapless,           "AudioPlayer.Gapless",             NULL },
+    { &parse_discoverers,       "TagReader.Discoverers",           NULL },
+    { &parse_backlog,           "SocketServer.Backlog",            NULL },
+    { &parse_event_buffer_size, "SocketServer.Event_Buffer_Size",  NULL },
+    { &parse_library_roots,     "Library.Roots",                   NULL },
+    { &parse_library_watch,     "Library.Watch",                   NULL },
+    { &parse_playlist_sync,     "Playlist.Sync",                   NULL },
+    { &parse_background_save,   "Playlist.Background_Save",        NULL },
+    { &parse_persistence_delay, "Persistence.Delay",               NULL },
+    { &parse_max_changes,       "Persistence.Max_Changes",         NULL },
+    { &parse_log_interval,      "Stats.Log_Interval",              NULL },
+    { &parse_log_level,         "Log.Level",                       NULL },
+    { &parse_log_format,        "Log.Format",                      NULL },
+    { &parse_log_async,         "Log.Async",                       NULL },
     { &parse_keep_changes,      "Config.Keep_Changes",             NULL },
 };
 
@@ -213,6 +558,20 @@ int climpd_config_init(struct climpd_config *__restrict conf,
     conf->ap_conf.speed = 1.0f;
     conf->ap_conf.repeat = true;
     conf->ap_conf.shuffle = false;
+    conf->ap_conf.gapless = true;
+    conf->tr_conf.discoverers = 0;
+    conf->ss_conf.backlog = 32;
+    conf->ss_conf.event_buffer_size = 64 * 1024;
+    conf->lib_conf.roots = NULL;
+    conf->lib_conf.watch = false;
+    conf->pl_conf.sync = FILE_SYNC_DATA;
+    conf->pl_conf.background_save = true;
+    conf->ps_conf.delay = 2000;
+    conf->ps_conf.max_changes = 64;
+    conf->st_conf.log_interval = 0;
+    conf->log_conf.level = CLIMPD_LOG_INFO;
+    conf->log_conf.format = CLIMPD_LOG_TEXT;
+    conf->log_conf.async = true;
     conf->keep_changes = false;
     
     err = config_init(&conf->conf, path, &write_config, conf);
@@ -241,6 +600,7 @@ int climpd_config_init(struct climpd_config *__restrict conf,
 
 cleanup1:
     config_destroy(&conf->conf);
+    free(conf->lib_conf.roots);
 out:
     climpd_log_e(tag, "failed to initialize configuration file '%s' - %s\n",
                  path, strerr(-err));
@@ -250,6 +610,7 @@ out:
 void climpd_config_destroy(struct climpd_config *__restrict conf)
 {
     config_destroy(&conf->conf);
+    free(conf->lib_conf.roots);
     
     climpd_log_i(tag, "destroyed\n");
 }
@@ -268,16 +629,32 @@ int climpd_config_load(struct climpd_config *__restrict conf)
 
 int climpd_config_save(struct climpd_config *__restrict conf)
 {
-    int fd = open(config_path(&conf->conf), O_WRONLY | O_TRUNC);
-    if (fd < 0) {
-        int err = -errno;
-        climpd_log_e(tag, "failed to open config for writing - %s\n", errstr);
+    const char *path = config_path(&conf->conf);
+    struct iovec iov;
+    size_t len;
+    char *text;
+    int err;
+    
+    text = config_text(conf, &len);
+    if (!text) {
+        err = -errno;
+        climpd_log_e(tag, "failed to save config - %s\n", strerr(-err));
         return err;
     }
     
-    write_config(fd, conf);
+    iov.iov_base = text;
+    iov.iov_len  = len;
     
-    close(fd);
+    /* the config is saved while running, so never leave a truncated one */
+    err = atomic_file_write(path, &iov, 1, FILE_SYNC_DATA);
+    
+    free(text);
+    
+    if (err < 0) {
+        climpd_log_e(tag, "failed to save config to '%s' - %s\n", path, 
+                     strerr(-err));
+        return err;
+    }
     
     climpd_log_i(tag, "saved current configuration\n");
     
@@ -296,6 +673,48 @@ climpd_config_audio_player_config(struct climpd_config *__restrict conf)
     return &conf->ap_conf;
 }
 
+struct tag_reader_config *
+climpd_config_tag_reader_config(struct climpd_config *__restrict conf)
+{
+    return &conf->tr_conf;
+}
+
+struct socket_server_config *
+climpd_config_socket_server_config(struct climpd_config *__restrict conf)
+{
+    return &conf->ss_conf;
+}
+
+struct library_config *
+climpd_config_library_config(struct climpd_config *__restrict conf)
+{
+    return &conf->lib_conf;
+}
+
+struct playlist_config *
+climpd_config_playlist_config(struct climpd_config *__restrict conf)
+{
+    return &conf->pl_conf;
+}
+
+struct persistence_config *
+climpd_config_persistence_config(struct climpd_config *__restrict conf)
+{
+    return &conf->ps_conf;
+}
+
+struct stats_config *
+climpd_config_stats_config(struct climpd_config *__restrict conf)
+{
+    return &conf->st_conf;
+}
+
+struct log_config *
+climpd_config_log_config(struct climpd_config *__restrict conf)
+{
+    return &conf->log_conf;
+}
+
 bool climpd_config_keep_changes(const struct climpd_config *__restrict conf)
 {
     return conf->keep_changes;
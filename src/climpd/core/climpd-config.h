@@ -25,6 +25,9 @@
 
 #include <libvci/config.h>
 
+#include <core/climpd-log.h>
+#include <util/atomic-file.h>
+
 
 struct console_output_config {
     unsigned meta_column_width;
@@ -36,6 +39,46 @@ struct audio_player_config {
     float speed;
     bool repeat;
     bool shuffle;
+    bool gapless;
+};
+
+struct tag_reader_config {
+    unsigned int discoverers;
+};
+
+struct socket_server_config {
+    unsigned int backlog;
+    /* bytes buffered per event subscriber */
+    unsigned int event_buffer_size;
+};
+
+/* 'roots' is a colon separated list of directories, like $PATH */
+struct library_config {
+    char *roots;
+    bool watch;
+};
+
+struct playlist_config {
+    enum file_sync sync;
+    bool background_save;
+};
+
+/* 'delay' is in milliseconds */
+struct persistence_config {
+    unsigned int delay;
+    unsigned int max_changes;
+};
+
+/* 'log_interval' is in seconds, 0 disables the periodic dump */
+struct stats_config {
+    unsigned int log_interval;
+};
+
+/* 'async' hands log records to a writer thread */
+struct log_config {
+    enum climpd_log_level level;
+    enum climpd_log_format format;
+    bool async;
 };
 
 struct climpd_config {
@@ -43,6 +86,13 @@ struct climpd_config {
     
     struct console_output_config cout_conf;
     struct audio_player_config ap_conf;
+    struct tag_reader_config tr_conf;
+    struct socket_server_config ss_conf;
+    struct library_config lib_conf;
+    struct playlist_config pl_conf;
+    struct persistence_config ps_conf;
+    struct stats_config st_conf;
+    struct log_config log_conf;
 
     bool keep_changes;
 };
@@ -62,6 +112,27 @@ climpd_config_console_output_config(struct climpd_config *__restrict conf);
 struct audio_player_config *
 climpd_config_audio_player_config(struct climpd_config *__restrict conf);
 
+struct tag_reader_config *
+climpd_config_tag_reader_config(struct climpd_config *__restrict conf);
+
+struct socket_server_config *
+climpd_config_socket_server_config(struct climpd_config *__restrict conf);
+
+struct library_config *
+climpd_config_library_config(struct climpd_config *__restrict conf);
+
+struct playlist_config *
+climpd_config_playlist_config(struct climpd_config *__restrict conf);
+
+struct persistence_config *
+climpd_config_persistence_config(struct climpd_config *__restrict conf);
+
+struct stats_config *
+climpd_config_stats_config(struct climpd_config *__restrict conf);
+
+struct log_config *
+climpd_config_log_config(struct climpd_config *__restrict conf);
+
 bool climpd_config_keep_changes(const struct climpd_config *__restrict conf);
 
 
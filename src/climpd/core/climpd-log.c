@@ -21,45 +21,867 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
+#include <strings.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 
 #include <libvci/log.h>
+#include <libvci/macro.h>
 #include <libvci/error.h>
 
 #include <core/climpd-log.h>
 
+#include "../../shared/log-format.h"
+
 #define LOG_PATH_RAW "/tmp/climpd-%d.log"
 
+/*
+ * The asynchronous backend: every thread that logs owns a single producer,
+ * single consumer ring of records, so logging never takes a lock. A record
+ * is a binary header followed by its fields and the already formatted
+ * message, a writer thread turns it into a text or JSON line and writes
+ * whole batches with a single write(). Records of one thread stay in 
+ * order, records of different threads are ordered by the time they were
+ * drained.
+ */
+#define LOG_RING_SIZE           (64 * 1024)
+#define LOG_MAX_THREADS         64
+#define LOG_LINE_MAX            1024
+#define LOG_BATCH_SIZE          (64 * 1024)
+/* longest time a record waits for the writer in milliseconds */
+#define LOG_FLUSH_INTERVAL      100
+/* debug and info records per second and thread, warnings are not limited */
+#define LOG_RATE                1000
+#define LOG_BURST               4000
+/* a formatted line, JSON escaping may blow up the text six times */
+#define LOG_RECORD_MAX          (6 * LOG_LINE_MAX + 512)
+/* room kept for the structured fields and the end of a JSON line */
+#define LOG_JSON_TAIL           (CLIMPD_LOG_FIELDS_MAX * 64 + 8)
+
+/* the record continues a line the writer already consumed */
+#define LOG_RECORD_CONTINUED    0x1u
+
+/* A record is followed by 'n_fields' fields and 'len' bytes of text */
+struct log_record {
+    uint32_t size;
+    uint16_t len;
+    uint8_t level;
+    uint8_t n_fields;
+    int32_t tid;
+    uint32_t flags;
+    int64_t sec;
+    int64_t nsec;
+    const char *tag;
+};
+
+/* the line currently built by climpd_log_*() and climpd_log_append() */
+struct log_line {
+    char text[LOG_LINE_MAX];
+    size_t len;
+    const char *tag;
+    enum climpd_log_level level;
+    struct timespec time;
+    struct climpd_log_field fields[CLIMPD_LOG_FIELDS_MAX];
+    unsigned int n_fields;
+    bool continued;
+};
+
+struct log_ring {
+    _Atomic size_t head;
+    _Atomic size_t tail;
+    _Atomic unsigned long dropped;
+    _Atomic unsigned long limited;
+    _Atomic bool dead;
+    
+    struct log_line line;
+    
+    /* token bucket of the rate limit */
+    int64_t tokens;
+    int64_t refill;
+    
+    char data[LOG_RING_SIZE];
+};
+
+static const char *level_labels[] = {
+    [CLIMPD_LOG_DEBUG]      = "DEBUG",
+    [CLIMPD_LOG_INFO]       = "INFO",
+    [CLIMPD_LOG_WARNING]    = "WARNING",
+    [CLIMPD_LOG_ERROR]      = "ERROR",
+};
+
+static const char *format_names[] = {
+    [CLIMPD_LOG_TEXT]       = "text",
+    [CLIMPD_LOG_JSON]       = "json",
+};
+
+static const int vci_levels[] = {
+    [CLIMPD_LOG_DEBUG]      = LOG_DEBUG,
+    [CLIMPD_LOG_INFO]       = LOG_INFO,
+    [CLIMPD_LOG_WARNING]    = LOG_WARNING,
+    [CLIMPD_LOG_ERROR]      = LOG_ERROR,
+};
+
 static struct log log;
+static _Atomic int min_level = CLIMPD_LOG_DEBUG;
+static _Atomic int format = CLIMPD_LOG_TEXT;
+
+static _Atomic bool async;
+static _Atomic(struct log_ring *) rings[LOG_MAX_THREADS];
+static __thread struct log_ring *self;
+/* set if the thread could not get a ring and logs synchronously */
+static __thread bool no_ring;
+/* set if the last line of the thread was filtered, appends are dropped */
+static __thread bool filtered;
+/* the line of a thread that formats its records itself */
+static __thread struct log_line direct;
+static __thread pid_t tid;
+static pthread_key_t ring_key;
+
+static pthread_t writer;
+static bool writer_running;
+static bool writer_stop;
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+/* set while the writer sleeps, so producers only signal if they have to */
+static _Atomic bool writer_waiting;
+/* set by producers which want the writer to drain before the interval */
+static _Atomic bool wake_pending;
+/* serializes the consumers, i.e. the writer and climpd_log_flush() */
+static pthread_mutex_t drain_lock;
+
+static char batch[LOG_BATCH_SIZE];
+static size_t batch_len;
+static unsigned long written;
+static unsigned long dropped;
+static unsigned long reported;
+
+#define log_enabled(level)                                                     \
+    ((int) (level) >= atomic_load_explicit(&min_level, memory_order_relaxed))
+#define log_format()                                                           \
+    ((enum climpd_log_format) atomic_load_explicit(&format,                    \
+                                                   memory_order_relaxed))
+
+__attribute__((format(printf,4,5)))
+static size_t buf_printf(char *__restrict buf, size_t size, size_t n,
+                         const char *__restrict fmt, ...)
+{
+    va_list vargs;
+    int m;
+    
+    if (n + 1 >= size)
+        return n;
+    
+    va_start(vargs, fmt);
+    m = vsnprintf(buf + n, size - n, fmt, vargs);
+    va_end(vargs);
+    
+    if (m < 0)
+        return n;
+    
+    return min(n + (size_t) m, size - 1);
+}
+
+static size_t format_text(char *__restrict buf, size_t size,
+                          const struct log_record *__restrict rec,
+                          const char *__restrict text)
+{
+    char stamp[32];
+    struct tm tm;
+    time_t sec;
+    size_t n = 0;
+    
+    if (rec->tag && !(rec->flags & LOG_RECORD_CONTINUED)) {
+        sec = (time_t) rec->sec;
+        strftime(stamp, sizeof(stamp), "%F %T", localtime_r(&sec, &tm));
+    
+        n = buf_printf(buf, size, n, "%s.%06ld %-7s %s: ", stamp, 
+                       (long) rec->nsec / 1000, level_labels[rec->level], 
+                       rec->tag);
+    }
+    
+    size = min(size - n, (size_t) rec->len);
+    memcpy(buf + n, text, size);
+    
+    return n + size;
+}
+
+/* The text already ends in a line feed, it is moved behind the fields */
+static size_t format_json(char *__restrict buf, size_t size,
+                          const struct log_record *__restrict rec,
+                          const struct climpd_log_field *__restrict fields,
+                          const char *__restrict text)
+{
+    const char *tag = (rec->tag) ? rec->tag : "";
+    size_t len = rec->len;
+    size_t n;
+    
+    if (len > 0 && text[len - 1] == '\n')
+        len -= 1;
+    
+    n = buf_printf(buf, size, 0, 
+                   LOG_FORMAT_TS_PREFIX "%lld,\"level\":\"%s\",\"tag\":\"", 
+                   (long long) rec->sec * 1000000 + rec->nsec / 1000, 
+                   log_format_level_name(rec->level));
+    n += log_format_escape(buf + n, size - n - LOG_JSON_TAIL, tag, strlen(tag));
+    n = buf_printf(buf, size, n, "\",\"tid\":%d,\"msg\":\"", rec->tid);
+    n += log_format_escape(buf + n, size - n - LOG_JSON_TAIL, text, len);
+    n = buf_printf(buf, size, n, "\"");
+    
+    for (unsigned int i = 0; i < rec->n_fields; ++i)
+        n = buf_printf(buf, size - 2, n, ",\"%s\":%lld", fields[i].key, 
+                       fields[i].value);
+    
+    buf[n++] = '}';
+    buf[n++] = '\n';
+    
+    return n;
+}
+
+static size_t format_record(char *__restrict buf, size_t size,
+                            const struct log_record *__restrict rec,
+                            const struct climpd_log_field *__restrict fields,
+                            const char *__restrict text)
+{
+    if (log_format() == CLIMPD_LOG_JSON)
+        return format_json(buf, size, rec, fields, text);
+    
+    return format_text(buf, size, rec, text);
+}
+
+static struct log_ring *ring_new(void)
+{
+    struct log_ring *ring;
+    
+    ring = calloc(1, sizeof(*ring));
+    if (!ring)
+        return NULL;
+    
+    ring->tokens = LOG_BURST;
+    
+    for (unsigned int i = 0; i < LOG_MAX_THREADS; ++i) {
+        struct log_ring *expected = NULL;
+    
+        if (atomic_compare_exchange_strong(&rings[i], &expected, ring)) {
+            pthread_setspecific(ring_key, ring);
+            return ring;
+        }
+    }
+    
+    /* too many threads, this one keeps logging synchronously */
+    free(ring);
+    return NULL;
+}
+
+static void wake_writer(void)
+{
+    /* the writer drains before it looks at 'wake_pending' again */
+    if (atomic_exchange(&wake_pending, true))
+        return;
+    
+    /* 
+     * Pairs with the writer, which sets 'writer_waiting' before it checks 
+     * 'wake_pending', so one of both sides sees the flag of the other.
+     */
+    if (!atomic_load(&writer_waiting))
+        return;
+    
+    pthread_mutex_lock(&wake_lock);
+    pthread_cond_signal(&wake_cond);
+    pthread_mutex_unlock(&wake_lock);
+}
+
+static void ring_copy_in(struct log_ring *__restrict ring, size_t pos,
+                         const void *__restrict src, size_t len)
+{
+    size_t off = pos & (LOG_RING_SIZE - 1);
+    size_t n = LOG_RING_SIZE - off;
+    
+    if (n > len)
+        n = len;
+    
+    memcpy(ring->data + off, src, n);
+    memcpy(ring->data, (const char *) src + n, len - n);
+}
+
+static void ring_copy_out(const struct log_ring *__restrict ring, size_t pos,
+                          void *__restrict dst, size_t len)
+{
+    size_t off = pos & (LOG_RING_SIZE - 1);
+    size_t n = LOG_RING_SIZE - off;
+    
+    if (n > len)
+        n = len;
+    
+    memcpy(dst, ring->data + off, n);
+    memcpy((char *) dst + n, ring->data, len - n);
+}
+
+static bool rate_limited(struct log_ring *__restrict ring,
+                         enum climpd_log_level level,
+                         const struct timespec *__restrict now)
+{
+    int64_t ms = (int64_t) now->tv_sec * 1000 + now->tv_nsec / 1000000;
+    
+    if (level >= CLIMPD_LOG_WARNING)
+        return false;
+    
+    if (ms > ring->refill) {
+        ring->tokens += (ms - ring->refill) * LOG_RATE / 1000;
+        if (ring->tokens > LOG_BURST)
+            ring->tokens = LOG_BURST;
+    
+        ring->refill = ms;
+    }
+    
+    if (ring->tokens <= 0)
+        return true;
+    
+    ring->tokens -= 1;
+    
+    return false;
+}
+
+static void line_record(const struct log_line *__restrict line,
+                        struct log_record *__restrict rec)
+{
+    if (!tid)
+        tid = (pid_t) syscall(SYS_gettid);
+    
+    rec->len      = (uint16_t) line->len;
+    rec->level    = (uint8_t) line->level;
+    rec->n_fields = (uint8_t) line->n_fields;
+    rec->tid      = tid;
+    rec->flags    = (line->continued) ? LOG_RECORD_CONTINUED : 0;
+    rec->sec      = line->time.tv_sec;
+    rec->nsec     = line->time.tv_nsec;
+    rec->tag      = line->tag;
+    rec->size     = (uint32_t) (sizeof(*rec) + 
+                                rec->n_fields * sizeof(*line->fields) + 
+                                rec->len + 7) & ~7u;
+}
+
+/* Moves the line of 'ring' into the ring buffer */
+static void ring_push(struct log_ring *__restrict ring,
+                      const struct log_record *__restrict rec)
+{
+    size_t head, tail, fields_size;
+    
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    
+    if (LOG_RING_SIZE - (head - tail) < rec->size) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    
+    fields_size = rec->n_fields * sizeof(*ring->line.fields);
+    
+    ring_copy_in(ring, head, rec, sizeof(*rec));
+    ring_copy_in(ring, head + sizeof(*rec), ring->line.fields, fields_size);
+    ring_copy_in(ring, head + sizeof(*rec) + fields_size, ring->line.text, 
+                 rec->len);
+    
+    atomic_store_explicit(&ring->head, head + rec->size, memory_order_release);
+    
+    /* do not let the ring run full or errors wait for the next interval */
+    if (head - tail + rec->size > LOG_RING_SIZE / 2 || 
+        rec->level == CLIMPD_LOG_ERROR)
+        wake_writer();
+}
+
+/* Writes the line right away, a single write() keeps it in one piece */
+static void line_write(const struct log_line *__restrict line,
+                       const struct log_record *__restrict rec)
+{
+    char buf[LOG_RECORD_MAX];
+    size_t n;
+    ssize_t m;
+    
+    n = format_record(buf, sizeof(buf), rec, line->fields, line->text);
+    
+    do {
+        m = write(log_fd(&log), buf, n);
+    } while (m < 0 && errno == EINTR);
+}
+
+static void line_push(struct log_line *__restrict line, 
+                      struct log_ring *__restrict ring)
+{
+    struct log_record rec;
+    
+    if (line->len == 0)
+        return;
+    
+    line_record(line, &rec);
+    
+    if (ring)
+        ring_push(ring, &rec);
+    else
+        line_write(line, &rec);
+    
+    /* text appended from now on continues the line */
+    line->len       = 0;
+    line->n_fields  = 0;
+    line->continued = true;
+}
+
+/* Pushes an unterminated line, e.g. if the next one starts */
+static void line_finish(struct log_line *__restrict line,
+                        struct log_ring *__restrict ring)
+{
+    if (line->len == 0)
+        return;
+    
+    if (line->len < LOG_LINE_MAX - 1)
+        line->text[line->len++] = '\n';
+    else
+        line->text[LOG_LINE_MAX - 2] = '\n';
+    
+    line_push(line, ring);
+}
+
+static void line_vappend(struct log_line *__restrict line,
+                         struct log_ring *__restrict ring,
+                         const char *__restrict fmt, 
+                         va_list vargs)
+{
+    size_t size = LOG_LINE_MAX - line->len;
+    int n;
+    
+    if (line->len == 0 && line->continued)
+        clock_gettime(CLOCK_REALTIME, &line->time);
+    
+    n = vsnprintf(line->text + line->len, size, fmt, vargs);
+    if (n <= 0)
+        return;
+    
+    if ((size_t) n >= size) {
+        /* keep the truncated line a line */
+        line->len = LOG_LINE_MAX - 1;
+        line->text[LOG_LINE_MAX - 2] = '\n';
+    } else {
+        line->len += (size_t) n;
+    }
+    
+    if (line->text[line->len - 1] == '\n')
+        line_push(line, ring);
+}
+
+static void ring_release(void *data)
+{
+    struct log_ring *ring = data;
+    
+    /* an unterminated line of the exiting thread would be lost otherwise */
+    line_finish(&ring->line, ring);
+    
+    /* the writer frees the ring once it is drained */
+    atomic_store_explicit(&ring->dead, true, memory_order_release);
+    self = NULL;
+}
+
+static struct log_ring *log_ring(void)
+{
+    if (!atomic_load_explicit(&async, memory_order_relaxed))
+        return NULL;
+    
+    if (!self && !no_ring) {
+        self = ring_new();
+        no_ring = !self;
+    }
+    
+    return self;
+}
+
+static void climpd_log_vprintf(enum climpd_log_level level, 
+                               const char *__restrict tag,
+                               const struct climpd_log_field *fields,
+                               unsigned int n_fields,
+                               const char *__restrict fmt, 
+                               va_list vargs)
+{
+    struct log_ring *ring;
+    struct log_line *line;
+    
+    filtered = false;
+    
+    ring = log_ring();
+    if (!ring && log_format() == CLIMPD_LOG_TEXT) {
+        log_vprintf(&log, vci_levels[level], tag, fmt, vargs);
+        return;
+    }
+    
+    line = (ring) ? &ring->line : &direct;
+    
+    line_finish(line, ring);
+    
+    clock_gettime(CLOCK_REALTIME, &line->time);
+    
+    /* limited lines are not even formatted */
+    if (ring && rate_limited(ring, level, &line->time)) {
+        atomic_fetch_add_explicit(&ring->limited, 1, memory_order_relaxed);
+        filtered = true;
+        return;
+    }
+    
+    line->tag       = tag;
+    line->level     = level;
+    line->continued = false;
+    line->n_fields  = min(n_fields, CLIMPD_LOG_FIELDS_MAX);
+    
+    if (line->n_fields)
+        memcpy(line->fields, fields, line->n_fields * sizeof(*fields));
+    
+    line_vappend(line, ring, fmt, vargs);
+}
+
+static void batch_flush(void)
+{
+    const char *p = batch;
+    size_t n = batch_len;
+    ssize_t m;
+    
+    while (n > 0) {
+        m = write(log_fd(&log), p, n);
+        if (m < 0) {
+            if (errno == EINTR)
+                continue;
+    
+            break;
+        }
+    
+        p += m;
+        n -= (size_t) m;
+    }
+    
+    batch_len = 0;
+}
+
+static void batch_add(const struct log_record *__restrict rec,
+                      const struct climpd_log_field *__restrict fields,
+                      const char *__restrict text)
+{
+    if (LOG_BATCH_SIZE - batch_len < LOG_RECORD_MAX)
+        batch_flush();
+    
+    batch_len += format_record(batch + batch_len, LOG_BATCH_SIZE - batch_len, 
+                               rec, fields, text);
+    
+    written += 1;
+}
+
+/* Consumes all records of 'ring', returns false if it can be freed */
+static bool ring_drain(struct log_ring *__restrict ring)
+{
+    struct climpd_log_field fields[CLIMPD_LOG_FIELDS_MAX];
+    char text[LOG_LINE_MAX];
+    struct log_record rec;
+    size_t head, tail, fields_size;
+    bool dead;
+    
+    dead = atomic_load_explicit(&ring->dead, memory_order_acquire);
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    
+    while (tail != head) {
+        ring_copy_out(ring, tail, &rec, sizeof(rec));
+    
+        fields_size = rec.n_fields * sizeof(*fields);
+    
+        ring_copy_out(ring, tail + sizeof(rec), fields, fields_size);
+        ring_copy_out(ring, tail + sizeof(rec) + fields_size, text, rec.len);
+    
+        batch_add(&rec, fields, text);
+    
+        tail += rec.size;
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+    
+    dropped += atomic_exchange_explicit(&ring->dropped, 0, 
+                                        memory_order_relaxed);
+    dropped += atomic_exchange_explicit(&ring->limited, 0, 
+                                        memory_order_relaxed);
+    
+    return !dead;
+}
+
+static void drain(void)
+{
+    for (unsigned int i = 0; i < LOG_MAX_THREADS; ++i) {
+        struct log_ring *ring = atomic_load(&rings[i]);
+    
+        if (!ring)
+            continue;
+    
+        if (!ring_drain(ring)) {
+            atomic_store(&rings[i], NULL);
+            free(ring);
+        }
+    }
+    
+    if (dropped != reported) {
+        struct log_record rec = { .level = CLIMPD_LOG_WARNING };
+        struct climpd_log_field field = { "dropped", 0 };
+        struct timespec now;
+        char text[128];
+        int n;
+    
+        clock_gettime(CLOCK_REALTIME, &now);
+    
+        n = snprintf(text, sizeof(text), "dropped %lu records\n", 
+                     dropped - reported);
+    
+        field.value = (long long) (dropped - reported);
+    
+        rec.len      = (uint16_t) n;
+        rec.n_fields = 1;
+        rec.tid      = (int32_t) syscall(SYS_gettid);
+        rec.sec      = now.tv_sec;
+        rec.nsec     = now.tv_nsec;
+        rec.tag      = "climpd-log";
+    
+        batch_add(&rec, &field, text);
+        reported = dropped;
+    }
+    
+    batch_flush();
+}
+
+static void *writer_main(void *arg)
+{
+    struct timespec ts;
+    bool stop = false;
+    
+    (void) arg;
+    
+    while (!stop) {
+        pthread_mutex_lock(&wake_lock);
+    
+        atomic_store(&writer_waiting, true);
+    
+        if (!writer_stop && !atomic_load(&wake_pending)) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+    
+            ts.tv_nsec += LOG_FLUSH_INTERVAL * 1000000L;
+            ts.tv_sec  += ts.tv_nsec / 1000000000L;
+            ts.tv_nsec %= 1000000000L;
+    
+            pthread_cond_timedwait(&wake_cond, &wake_lock, &ts);
+        }
+    
+        atomic_store(&writer_waiting, false);
+        atomic_store(&wake_pending, false);
+    
+        stop = writer_stop;
+    
+        pthread_mutex_unlock(&wake_lock);
+    
+        pthread_mutex_lock(&drain_lock);
+        drain();
+        pthread_mutex_unlock(&drain_lock);
+    }
+    
+    return NULL;
+}
 
 int climpd_log_init(const char *path)
 {
+    pthread_mutexattr_t attr;
     int err;
-
+    
     err = log_init(&log, path, LOG_ALL);
     if (err < 0)
         return err;
     
     log_set_level(&log, LOG_DEBUG);
     
+    err = pthread_key_create(&ring_key, &ring_release);
+    if (err) {
+        log_destroy(&log);
+        return -err;
+    }
+    
+    /* a crash while draining must not dead lock climpd_log_flush() */
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
+    pthread_mutex_init(&drain_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    
     return 0;
 }
 
+/* Other threads must not log anymore, their partial lines are taken over */
 void climpd_log_destroy(void)
 {
+    struct log_ring *ring;
+    
+    climpd_log_set_async(false);
+    
+    for (unsigned int i = 0; i < LOG_MAX_THREADS; ++i) {
+        ring = atomic_load(&rings[i]);
+        if (ring)
+            line_finish(&ring->line, ring);
+    }
+    
+    pthread_mutex_lock(&drain_lock);
+    drain();
+    pthread_mutex_unlock(&drain_lock);
+    
+    for (unsigned int i = 0; i < LOG_MAX_THREADS; ++i)
+        free(atomic_exchange(&rings[i], NULL));
+    
+    /* no destructor may run for a ring that is gone */
+    pthread_key_delete(ring_key);
+    self    = NULL;
+    no_ring = false;
+    
+    pthread_mutex_destroy(&drain_lock);
     log_destroy(&log);
 }
 
+/*
+ * Hands records to a writer thread instead of writing them right away.
+ * Threads do not survive fork(), so this has to be enabled after the
+ * process was daemonized.
+ */
+int climpd_log_set_async(bool enable)
+{
+    int err;
+    
+    if (enable == writer_running)
+        return 0;
+    
+    if (enable) {
+        writer_stop = false;
+    
+        err = pthread_create(&writer, NULL, &writer_main, NULL);
+        if (err)
+            return -err;
+    
+        writer_running = true;
+        atomic_store(&async, true);
+    
+        return 0;
+    }
+    
+    /* finish the line of this thread, other threads are on their own */
+    if (self)
+        line_finish(&self->line, self);
+    
+    atomic_store(&async, false);
+    
+    pthread_mutex_lock(&wake_lock);
+    writer_stop = true;
+    pthread_cond_signal(&wake_cond);
+    pthread_mutex_unlock(&wake_lock);
+    
+    pthread_join(writer, NULL);
+    writer_running = false;
+    
+    return 0;
+}
+
+/* Records below 'level' are discarded before they are formatted */
+void climpd_log_set_level(enum climpd_log_level level)
+{
+    atomic_store_explicit(&min_level, level, memory_order_relaxed);
+}
+
+const char *climpd_log_level_name(enum climpd_log_level level)
+{
+    return log_format_level_name(level);
+}
+
+int climpd_log_level_parse(const char *__restrict name, 
+                           enum climpd_log_level *level)
+{
+    int val = log_format_level_parse(name, strlen(name));
+    
+    if (val < 0)
+        return -EINVAL;
+    
+    *level = (enum climpd_log_level) val;
+    
+    return 0;
+}
+
+/* 
+ * Switches the format of the records written from now on. Text records 
+ * of synchronous logging are still written by libvci.
+ */
+void climpd_log_set_format(enum climpd_log_format fmt)
+{
+    struct log_line *line = (self) ? &self->line : &direct;
+    
+    /* do not let the pending line change its format half way */
+    line_finish(line, self);
+    
+    atomic_store_explicit(&format, fmt, memory_order_relaxed);
+}
+
+const char *climpd_log_format_name(enum climpd_log_format fmt)
+{
+    return format_names[fmt];
+}
+
+int climpd_log_format_parse(const char *__restrict name, 
+                            enum climpd_log_format *fmt)
+{
+    for (unsigned int i = 0; i < ARRAY_SIZE(format_names); ++i) {
+        if (strcasecmp(name, format_names[i]) == 0) {
+            *fmt = (enum climpd_log_format) i;
+            return 0;
+        }
+    }
+    
+    return -EINVAL;
+}
+
+/* Writes all pending records to the log file */
+void climpd_log_flush(void)
+{
+    if (!writer_running)
+        return;
+    
+    if (pthread_mutex_lock(&drain_lock) != 0)
+        return;
+    
+    drain();
+    
+    pthread_mutex_unlock(&drain_lock);
+}
+
+/* Number of records written and dropped by the asynchronous backend */
+void climpd_log_counters(unsigned long *__restrict n_written, 
+                         unsigned long *__restrict n_dropped)
+{
+    pthread_mutex_lock(&drain_lock);
+    
+    *n_written = written;
+    *n_dropped = dropped;
+    
+    pthread_mutex_unlock(&drain_lock);
+}
+
 void climpd_log_d(const char *__restrict tag, const char *fmt, ...)
 {
     va_list vargs;
     
+    if (!log_enabled(CLIMPD_LOG_DEBUG)) {
+        filtered = true;
+        return;
+    }
+    
     va_start(vargs, fmt);
     
-    log_vprintf(&log, LOG_DEBUG, tag, fmt, vargs);
+    climpd_log_vprintf(CLIMPD_LOG_DEBUG, tag, NULL, 0, fmt, vargs);
     
     va_end(vargs);
 }
@@ -68,9 +890,14 @@ void climpd_log_i(const char *__restrict tag, const char *fmt, ...)
 {
     va_list vargs;
     
+    if (!log_enabled(CLIMPD_LOG_INFO)) {
+        filtered = true;
+        return;
+    }
+    
     va_start(vargs, fmt);
     
-    log_vprintf(&log, LOG_INFO, tag, fmt, vargs);
+    climpd_log_vprintf(CLIMPD_LOG_INFO, tag, NULL, 0, fmt, vargs);
     
     va_end(vargs);
 }
@@ -79,9 +906,14 @@ void climpd_log_w(const char *__restrict tag, const char *fmt, ...)
 {
     va_list vargs;
     
+    if (!log_enabled(CLIMPD_LOG_WARNING)) {
+        filtered = true;
+        return;
+    }
+    
     va_start(vargs, fmt);
     
-    log_vprintf(&log, LOG_WARNING, tag, fmt, vargs);
+    climpd_log_vprintf(CLIMPD_LOG_WARNING, tag, NULL, 0, fmt, vargs);
     
     va_end(vargs);
 }
@@ -92,7 +924,7 @@ void climpd_log_e(const char *__restrict tag, const char *fmt, ...)
     
     va_start(vargs, fmt);
     
-    log_vprintf(&log, LOG_ERROR, tag, fmt, vargs);
+    climpd_log_vprintf(CLIMPD_LOG_ERROR, tag, NULL, 0, fmt, vargs);
     
     va_end(vargs);
 }
@@ -100,40 +932,89 @@ void climpd_log_e(const char *__restrict tag, const char *fmt, ...)
 void climpd_log_v_d(const char *__restrict tag, const char *__restrict fmt, 
                     va_list vargs)
 {
-    log_vprintf(&log, LOG_DEBUG, tag, fmt, vargs);
+    if (log_enabled(CLIMPD_LOG_DEBUG))
+        climpd_log_vprintf(CLIMPD_LOG_DEBUG, tag, NULL, 0, fmt, vargs);
+    else
+        filtered = true;
 }
 
 void climpd_log_v_i(const char *__restrict tag, const char *__restrict fmt, 
                     va_list vargs)
 {
-    log_vprintf(&log, LOG_INFO, tag, fmt, vargs);
+    if (log_enabled(CLIMPD_LOG_INFO))
+        climpd_log_vprintf(CLIMPD_LOG_INFO, tag, NULL, 0, fmt, vargs);
+    else
+        filtered = true;
 }
 
 void climpd_log_v_w(const char *__restrict tag, const char *__restrict fmt, 
                     va_list vargs)
 {
-    log_vprintf(&log, LOG_WARNING, tag, fmt, vargs);
+    if (log_enabled(CLIMPD_LOG_WARNING))
+        climpd_log_vprintf(CLIMPD_LOG_WARNING, tag, NULL, 0, fmt, vargs);
+    else
+        filtered = true;
 }
 
 void climpd_log_v_e(const char *__restrict tag, const char *__restrict fmt, 
                     va_list vargs)
 {
-    log_vprintf(&log, LOG_ERROR, tag, fmt, vargs);
+    climpd_log_vprintf(CLIMPD_LOG_ERROR, tag, NULL, 0, fmt, vargs);
+}
+
+/*
+ * Like the other climpd_log_*() functions, but attaches up to 
+ * CLIMPD_LOG_FIELDS_MAX integer fields to the record. Text records ignore
+ * them, so 'fmt' should mention the values as well.
+ */
+void climpd_log_fields(enum climpd_log_level level,
+                       const char *__restrict tag,
+                       const struct climpd_log_field *fields,
+                       unsigned int n_fields,
+                       const char *fmt, ...)
+{
+    va_list vargs;
+    
+    if (!log_enabled(level)) {
+        filtered = true;
+        return;
+    }
+    
+    va_start(vargs, fmt);
+    
+    climpd_log_vprintf(level, tag, fields, n_fields, fmt, vargs);
+    
+    va_end(vargs);
 }
 
+/* 
+ * Appended text belongs to the last line of the calling thread and is 
+ * dropped together with it if that line was filtered.
+ */
 void climpd_log_append(const char *fmt, ...)
 {
+    struct log_ring *ring;
     va_list vargs;
     
+    if (filtered)
+        return;
+    
     va_start(vargs, fmt);
     
-    log_vappend(&log, fmt, vargs);
+    ring = log_ring();
+    if (ring)
+        line_vappend(&ring->line, ring, fmt, vargs);
+    else if (log_format() == CLIMPD_LOG_JSON)
+        line_vappend(&direct, NULL, fmt, vargs);
+    else
+        log_vappend(&log, fmt, vargs);
     
     va_end(vargs);
 }
 
 void climpd_log_print(int fd)
 {
+    climpd_log_flush();
     log_print(&log, fd);
 }
 
@@ -22,11 +22,53 @@
 #define _CLIMPD_LOG_H_
 
 #include <stdarg.h>
+#include <stdbool.h>
+
+enum climpd_log_level {
+    CLIMPD_LOG_DEBUG,
+    CLIMPD_LOG_INFO,
+    CLIMPD_LOG_WARNING,
+    CLIMPD_LOG_ERROR,
+};
+
+enum climpd_log_format {
+    CLIMPD_LOG_TEXT,
+    CLIMPD_LOG_JSON,
+};
+
+#define CLIMPD_LOG_FIELDS_MAX   4
+
+/* 'key' has to be a plain identifier, it is written without escaping */
+struct climpd_log_field {
+    const char *key;
+    long long value;
+};
 
 int climpd_log_init(const char *path);
 
 void climpd_log_destroy(void);
 
+int climpd_log_set_async(bool enable);
+
+void climpd_log_set_level(enum climpd_log_level level);
+
+const char *climpd_log_level_name(enum climpd_log_level level);
+
+int climpd_log_level_parse(const char *__restrict name, 
+                           enum climpd_log_level *level);
+
+void climpd_log_set_format(enum climpd_log_format fmt);
+
+const char *climpd_log_format_name(enum climpd_log_format fmt);
+
+int climpd_log_format_parse(const char *__restrict name, 
+                            enum climpd_log_format *fmt);
+
+void climpd_log_flush(void);
+
+void climpd_log_counters(unsigned long *__restrict n_written, 
+                         unsigned long *__restrict n_dropped);
+
 __attribute__((format(printf,2,3)))
 void climpd_log_d(const char *__restrict tag, const char *fmt, ...);
 
@@ -51,6 +93,13 @@ void climpd_log_v_w(const char *__restrict tag, const char *__restrict fmt,
 void climpd_log_v_e(const char *__restrict tag, const char *__restrict fmt, 
                     va_list vargs);
 
+__attribute__((format(printf,5,6)))
+void climpd_log_fields(enum climpd_log_level level,
+                       const char *__restrict tag,
+                       const struct climpd_log_field *fields,
+                       unsigned int n_fields,
+                       const char *fmt, ...);
+
 __attribute__((format(printf,1,2)))
 void climpd_log_append(const char *fmt, ...);
 
@@ -0,0 +1,603 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <linux/limits.h>
+
+#include <libvci/error.h>
+
+#include <core/climpd-log.h>
+#include <core/library/library-watcher.h>
+
+#include <prefilter.h>
+
+#define URI_FILE_SCHEME "file://"
+
+#define WATCH_MASK (IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM |  \
+                    IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+#define EVENT_BUFFER_SIZE (64 * 1024)
+
+/* number of directory entries handled in a single main loop iteration */
+#define SCAN_BATCH_SIZE 256
+
+struct dir_watch {
+    int wd;
+    unsigned int index;
+    char path[];
+};
+
+struct dir_scan {
+    DIR *dir;
+    char *path;
+};
+
+static const char *tag = "library-watcher";
+
+static int wd_compare(const void *a, const void *b)
+{
+    intptr_t wd1 = (intptr_t) a, wd2 = (intptr_t) b;
+    
+    return (wd1 > wd2) - (wd1 < wd2);
+}
+
+static unsigned int wd_hash(const void *key)
+{
+    return (unsigned int) (uintptr_t) key;
+}
+
+static void *wd_key(int wd)
+{
+    return (void *) (intptr_t) wd;
+}
+
+static bool path_in_dir(const char *__restrict path, 
+                        const char *__restrict dir, 
+                        size_t len)
+{
+    return strncmp(path, dir, len) == 0 && (path[len] == '/' || !path[len]);
+}
+
+static int join_path(char *__restrict dst, 
+                     const char *__restrict dir, 
+                     const char *__restrict name)
+{
+    int n = snprintf(dst, PATH_MAX, "%s/%s", dir, name);
+    
+    return (n < 0 || n >= PATH_MAX) ? -ENAMETOOLONG : 0;
+}
+
+static bool is_audio_file(const char *__restrict name)
+{
+    return prefilter_check_name(name) == PREFILTER_PROBE;
+}
+
+static void add_file(struct library_watcher *__restrict lw, 
+                     const char *__restrict path)
+{
+    char uri[sizeof(URI_FILE_SCHEME) + PATH_MAX];
+    struct media *m;
+    int n, err;
+    
+    /* paths below the roots are canonical already, skip realpath() */
+    n = snprintf(uri, sizeof(uri), URI_FILE_SCHEME "%s", path);
+    if (n < 0 || (size_t) n >= sizeof(uri))
+        return;
+    
+    m = media_new_uri(uri, n);
+    if (!m) {
+        climpd_log_w(tag, "failed to create media '%s' - %s\n", path, errstr);
+        return;
+    }
+    
+    err = library_add(lw->library, m);
+    if (err < 0) {
+        climpd_log_w(tag, "failed to add '%s' to library - %s\n", path,
+                     strerr(-err));
+    }
+    
+    media_unref(m);
+}
+
+static void dir_watch_delete(struct library_watcher *__restrict lw, 
+                             struct dir_watch *__restrict dw)
+{
+    struct dir_watch *last;
+    
+    map_take(&lw->wd_map, wd_key(dw->wd));
+    
+    last = vector_take_back(&lw->vec_dirs);
+    if (last != dw) {
+        last->index = dw->index;
+        *vector_at(&lw->vec_dirs, dw->index) = last;
+    }
+    
+    free(dw);
+}
+
+static int watch_dir(struct library_watcher *__restrict lw, 
+                     const char *__restrict path)
+{
+    struct dir_watch *dw;
+    size_t len;
+    int wd, err;
+    
+    wd = inotify_add_watch(g_io_channel_unix_get_fd(lw->channel), path, 
+                           WATCH_MASK);
+    if (wd < 0)
+        return -errno;
+    
+    /* the same directory may be reached again, e.g. after a rename */
+    dw = map_retrieve(&lw->wd_map, wd_key(wd));
+    if (dw) {
+        if (strcmp(dw->path, path) == 0)
+            return 0;
+        
+        dir_watch_delete(lw, dw);
+    }
+    
+    len = strlen(path);
+    
+    dw = malloc(sizeof(*dw) + len + 1);
+    if (!dw) {
+        err = -errno;
+        goto cleanup1;
+    }
+    
+    dw->wd    = wd;
+    dw->index = vector_size(&lw->vec_dirs);
+    memcpy(dw->path, path, len + 1);
+    
+    err = vector_insert_back(&lw->vec_dirs, dw);
+    if (err < 0)
+        goto cleanup2;
+    
+    err = map_insert(&lw->wd_map, wd_key(wd), dw);
+    if (err < 0)
+        goto cleanup3;
+    
+    return 0;
+
+cleanup3:
+    vector_take_back(&lw->vec_dirs);
+cleanup2:
+    free(dw);
+cleanup1:
+    inotify_rm_watch(g_io_channel_unix_get_fd(lw->channel), wd);
+    return err;
+}
+
+/* Drops the watches of 'path' and all its subdirectories */
+static void unwatch_dir(struct library_watcher *__restrict lw,
+                        const char *__restrict path)
+{
+    unsigned int i;
+    size_t len;
+    int fd;
+    
+    fd  = g_io_channel_unix_get_fd(lw->channel);
+    len = strlen(path);
+    i   = vector_size(&lw->vec_dirs);
+    
+    while (i--) {
+        struct dir_watch *dw = *vector_at(&lw->vec_dirs, i);
+        
+        if (!path_in_dir(dw->path, path, len))
+            continue;
+        
+        inotify_rm_watch(fd, dw->wd);
+        dir_watch_delete(lw, dw);
+    }
+}
+
+static void dir_scan_delete(struct dir_scan *__restrict scan)
+{
+    if (scan->dir)
+        closedir(scan->dir);
+    
+    free(scan->path);
+    free(scan);
+}
+
+static gboolean scan_next(void *data);
+
+static void queue_dir(struct library_watcher *__restrict lw, 
+                      const char *__restrict path)
+{
+    struct dir_scan *scan;
+    
+    scan = calloc(1, sizeof(*scan));
+    if (!scan)
+        goto fail;
+    
+    scan->path = strdup(path);
+    if (!scan->path) {
+        free(scan);
+        goto fail;
+    }
+    
+    g_queue_push_tail(&lw->pending, scan);
+    
+    if (lw->scan_id == 0)
+        lw->scan_id = g_idle_add(&scan_next, lw);
+    
+    return;
+    
+fail:
+    climpd_log_e(tag, "failed to queue '%s' for scanning - %s\n", path, 
+                 errstr);
+}
+
+static unsigned char entry_type(DIR *dir, const struct dirent *ent)
+{
+    struct stat st;
+    
+    if (ent->d_type != DT_UNKNOWN)
+        return ent->d_type;
+    
+    if (fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        return DT_UNKNOWN;
+    
+    if (S_ISREG(st.st_mode))
+        return DT_REG;
+    
+    if (S_ISDIR(st.st_mode))
+        return DT_DIR;
+    
+    return DT_UNKNOWN;
+}
+
+/* Returns 'false' as soon as the directory is done */
+static bool scan_dir(struct library_watcher *__restrict lw, 
+                     struct dir_scan *__restrict scan)
+{
+    char path[PATH_MAX];
+    struct dirent *ent;
+    int err;
+    
+    if (!scan->dir) {
+        /* subscribe first, so no file created meanwhile gets lost */
+        if (lw->watch) {
+            err = watch_dir(lw, scan->path);
+            if (err < 0) {
+                climpd_log_w(tag, "failed to watch '%s' - %s\n", scan->path,
+                             strerr(-err));
+            }
+        }
+        
+        scan->dir = opendir(scan->path);
+        if (!scan->dir) {
+            climpd_log_w(tag, "failed to open '%s' - %s\n", scan->path, 
+                         errstr);
+            return false;
+        }
+    }
+    
+    for (unsigned int i = 0; i < SCAN_BATCH_SIZE; ++i) {
+        errno = 0;
+        ent = readdir(scan->dir);
+        if (!ent) {
+            if (errno) {
+                climpd_log_w(tag, "failed to read '%s' - %s\n", scan->path,
+                             errstr);
+            }
+            
+            return false;
+        }
+        
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+        
+        if (join_path(path, scan->path, ent->d_name) < 0)
+            continue;
+        
+        switch (entry_type(scan->dir, ent)) {
+        case DT_REG:
+            if (is_audio_file(ent->d_name))
+                add_file(lw, path);
+            break;
+        case DT_DIR:
+            queue_dir(lw, path);
+            break;
+        default:
+            break;
+        }
+    }
+    
+    return true;
+}
+
+static gboolean scan_next(void *data)
+{
+    struct library_watcher *lw = data;
+    struct dir_scan *scan;
+    
+    scan = g_queue_peek_head(&lw->pending);
+    if (!scan) {
+        lw->scan_id = 0;
+        
+        climpd_log_i(tag, "library holds %u tracks\n", 
+                     library_size(lw->library));
+        return false;
+    }
+    
+    if (!scan_dir(lw, scan)) {
+        g_queue_pop_head(&lw->pending);
+        dir_scan_delete(scan);
+    }
+    
+    return true;
+}
+
+static void rescan(struct library_watcher *__restrict lw)
+{
+    unsigned int size = vector_size(&lw->vec_roots);
+    
+    for (unsigned int i = 0; i < size; ++i) {
+        const char *root = *vector_at(&lw->vec_roots, i);
+        
+        library_remove_dir(lw->library, root);
+        queue_dir(lw, root);
+    }
+}
+
+/* Tracks which vanished from disk must not stay in the playlist either */
+static void drop_tracks(struct library_watcher *__restrict lw, 
+                        const char *__restrict path)
+{
+    unsigned int n;
+    
+    n = playlist_remove_path(lw->playlist, path);
+    if (n == 0)
+        return;
+    
+    climpd_log_i(tag, "removed %u vanished track(s) at '%s'\n", n, path);
+    
+    if (lw->on_playlist_change)
+        lw->on_playlist_change(lw->playlist);
+}
+
+static void handle_event(struct library_watcher *__restrict lw,
+                         const struct inotify_event *__restrict ev)
+{
+    char path[PATH_MAX];
+    struct dir_watch *dw;
+    
+    if (ev->mask & IN_Q_OVERFLOW) {
+        climpd_log_w(tag, "event queue overflow - rescanning library\n");
+        rescan(lw);
+        return;
+    }
+    
+    dw = map_retrieve(&lw->wd_map, wd_key(ev->wd));
+    if (!dw)
+        return;
+    
+    /* the directory itself is gone, the kernel already dropped the watch */
+    if (ev->mask & IN_IGNORED) {
+        dir_watch_delete(lw, dw);
+        return;
+    }
+    
+    if (ev->len == 0 || join_path(path, dw->path, ev->name) < 0)
+        return;
+    
+    if (ev->mask & IN_ISDIR) {
+        if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+            climpd_log_i(tag, "new directory '%s'\n", path);
+            queue_dir(lw, path);
+        } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            climpd_log_i(tag, "directory '%s' vanished\n", path);
+            unwatch_dir(lw, path);
+            library_remove_dir(lw->library, path);
+            drop_tracks(lw, path);
+        }
+        
+        return;
+    }
+    
+    if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+        if (!is_audio_file(ev->name))
+            return;
+        
+        add_file(lw, path);
+        
+        if (playlist_refresh(lw->playlist, path))
+            climpd_log_i(tag, "refreshing changed track '%s'\n", path);
+    } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        library_remove(lw->library, path);
+        drop_tracks(lw, path);
+    }
+}
+
+static gboolean handle_inotify(GIOChannel *src, GIOCondition cond, void *data)
+{
+    static char buf[EVENT_BUFFER_SIZE] 
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct library_watcher *lw = data;
+    const struct inotify_event *ev;
+    ssize_t n;
+    
+    (void) cond;
+    
+    while (1) {
+        n = read(g_io_channel_unix_get_fd(src), buf, sizeof(buf));
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                climpd_log_e(tag, "failed to read events - %s\n", errstr);
+                lw->watch_id = 0;
+                return false;
+            }
+            
+            return true;
+        }
+        
+        for (char *p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event *) p;
+            handle_event(lw, ev);
+        }
+    }
+}
+
+int library_watcher_init(struct library_watcher *__restrict lw, 
+                         struct library *__restrict lib,
+                         struct playlist *__restrict pl,
+                         playlist_change_callback func,
+                         bool watch)
+{
+    const struct map_config conf = {
+        .size        = MAP_DEFAULT_SIZE,
+        .lower_bound = MAP_DEFAULT_LOWER_BOUND,
+        .upper_bound = MAP_DEFAULT_UPPER_BOUND,
+        .static_size = false,
+        .key_compare = &wd_compare,
+        .key_hash    = &wd_hash,
+        .data_delete = NULL,
+    };
+    int fd, err;
+    
+    memset(lw, 0, sizeof(*lw));
+    
+    lw->library  = lib;
+    lw->playlist = pl;
+    lw->watch    = watch;
+    
+    lw->on_playlist_change = func;
+    
+    g_queue_init(&lw->pending);
+    
+    err = vector_init(&lw->vec_roots, 0);
+    if (err < 0) {
+        climpd_log_e(tag, "failed to initialize vector - %s\n", strerr(-err));
+        return err;
+    }
+    
+    vector_set_data_delete(&lw->vec_roots, &free);
+    
+    err = vector_init(&lw->vec_dirs, 0);
+    if (err < 0) {
+        climpd_log_e(tag, "failed to initialize vector - %s\n", strerr(-err));
+        goto cleanup1;
+    }
+    
+    vector_set_data_delete(&lw->vec_dirs, &free);
+    
+    err = map_init(&lw->wd_map, &conf);
+    if (err < 0) {
+        climpd_log_e(tag, "failed to initialize map - %s\n", strerr(-err));
+        goto cleanup2;
+    }
+    
+    if (watch) {
+        fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd < 0) {
+            err = -errno;
+            climpd_log_e(tag, "failed to initialize inotify - %s\n", errstr);
+            goto cleanup3;
+        }
+        
+        lw->channel = g_io_channel_unix_new(fd);
+        if (!lw->channel) {
+            err = -ENOMEM;
+            close(fd);
+            climpd_log_e(tag, "failed to create io channel\n");
+            goto cleanup3;
+        }
+        
+        g_io_channel_set_close_on_unref(lw->channel, true);
+        
+        lw->watch_id = g_io_add_watch(lw->channel, G_IO_IN, &handle_inotify, 
+                                      lw);
+    }
+    
+    climpd_log_i(tag, "initialized%s\n", (watch) ? " - watching for changes" : "");
+    
+    return 0;
+
+cleanup3:
+    map_destroy(&lw->wd_map);
+cleanup2:
+    vector_destroy(&lw->vec_dirs);
+cleanup1:
+    vector_destroy(&lw->vec_roots);
+    return err;
+}
+
+void library_watcher_destroy(struct library_watcher *__restrict lw)
+{
+    struct dir_scan *scan;
+    
+    if (lw->scan_id)
+        g_source_remove(lw->scan_id);
+    
+    while ((scan = g_queue_pop_head(&lw->pending)))
+        dir_scan_delete(scan);
+    
+    if (lw->channel) {
+        if (lw->watch_id)
+            g_source_remove(lw->watch_id);
+        
+        g_io_channel_unref(lw->channel);
+    }
+    
+    map_destroy(&lw->wd_map);
+    vector_destroy(&lw->vec_dirs);
+    vector_destroy(&lw->vec_roots);
+    
+    climpd_log_i(tag, "destroyed\n");
+}
+
+int library_watcher_add_root(struct library_watcher *__restrict lw,
+                             const char *__restrict path)
+{
+    char *rpath;
+    int err;
+    
+    rpath = realpath(path, NULL);
+    if (!rpath) {
+        err = -errno;
+        climpd_log_e(tag, "invalid library root '%s' - %s\n", path, errstr);
+        return err;
+    }
+    
+    err = vector_insert_back(&lw->vec_roots, rpath);
+    if (err < 0) {
+        climpd_log_e(tag, "failed to add library root '%s' - %s\n", rpath, 
+                     strerr(-err));
+        free(rpath);
+        return err;
+    }
+    
+    queue_dir(lw, rpath);
+    
+    climpd_log_i(tag, "added library root '%s'\n", rpath);
+    
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LIBRARY_WATCHER_H_
+#define _LIBRARY_WATCHER_H_
+
+#include <stdbool.h>
+
+#include <gst/gst.h>
+
+#include <libvci/map.h>
+#include <libvci/vector.h>
+
+#include <core/library/library.h>
+#include <core/playlist/playlist.h>
+
+/*
+ * Fills the library with the audio files below its root directories.
+ * Directories are scanned one at a time from the main loop, so a huge
+ * library does not block the daemon. If 'watch' is set, the directories
+ * stay subscribed via inotify and the library follows every file that
+ * appears, changes, moves or disappears. Tracks of the playlist whose 
+ * files change get their tags read again, tracks whose files disappear are
+ * removed from it.
+ */
+typedef void (*playlist_change_callback)(struct playlist *);
+
+struct library_watcher {
+    struct library *library;
+    struct playlist *playlist;
+    playlist_change_callback on_playlist_change;
+    bool watch;
+    
+    GIOChannel *channel;
+    guint watch_id;
+    
+    GQueue pending;
+    guint scan_id;
+    
+    struct vector vec_roots;
+    struct vector vec_dirs;
+    struct map wd_map;
+};
+
+int library_watcher_init(struct library_watcher *__restrict lw, 
+                         struct library *__restrict lib,
+                         struct playlist *__restrict pl,
+                         playlist_change_callback func,
+                         bool watch);
+
+void library_watcher_destroy(struct library_watcher *__restrict lw);
+
+int library_watcher_add_root(struct library_watcher *__restrict lw,
+                             const char *__restrict path);
+
+#endif /* _LIBRARY_WATCHER_H_ */
\ No newline at end of file
@@ -0,0 +1,272 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libvci/compare.h>
+#include <libvci/hash.h>
+#include <libvci/error.h>
+
+#include <core/climpd-log.h>
+#include <core/library/library.h>
+
+static const char *tag = "library";
+
+/* positions are stored off by one, a NULL entry means 'not found' */
+static void *position_pack(unsigned int i)
+{
+    return (void *) (uintptr_t) (i + 1);
+}
+
+static unsigned int position_unpack(const void *data)
+{
+    return (unsigned int) ((uintptr_t) data - 1);
+}
+
+static bool path_in_dir(const char *__restrict path, 
+                        const char *__restrict dir, 
+                        size_t len)
+{
+    return strncmp(path, dir, len) == 0 && (path[len] == '/' || len == 0);
+}
+
+/* Swaps the last track into position 'i' */
+static void library_remove_at(struct library *__restrict lib, unsigned int i)
+{
+    struct media *m, *last;
+    unsigned int last_i;
+    int err;
+    
+    m = *vector_at(&lib->vec_media, i);
+    map_take(&lib->path_index, media_path(m));
+    search_index_remove(&lib->search_index, media_path(m));
+    
+    last_i = vector_size(&lib->vec_media) - 1;
+    last   = vector_take_back(&lib->vec_media);
+    
+    if (i != last_i) {
+        *vector_at(&lib->vec_media, i) = last;
+        
+        map_take(&lib->path_index, media_path(last));
+        
+        err = map_insert(&lib->path_index, media_path(last), position_pack(i));
+        if (err < 0) {
+            climpd_log_w(tag, "failed to re-index '%s' - %s\n", 
+                         media_path(last), strerr(-err));
+        }
+    }
+    
+    media_unref(m);
+}
+
+int library_init(struct library *__restrict lib, 
+                 struct tag_reader *__restrict tr)
+{
+    const struct map_config conf = {
+        .size        = MAP_DEFAULT_SIZE,
+        .lower_bound = MAP_DEFAULT_LOWER_BOUND,
+        .upper_bound = MAP_DEFAULT_UPPER_BOUND,
+        .static_size = false,
+        .key_compare = &compare_string,
+        .key_hash    = &hash_string,
+        .data_delete = NULL,
+    };
+    int err;
+    
+    lib->tag_reader = tr;
+    
+    err = vector_init(&lib->vec_media, 0);
+    if (err < 0) {
+        climpd_log_e(tag, "failed to initialize vector - %s\n", strerr(-err));
+        return err;
+    }
+    
+    vector_set_data_delete(&lib->vec_media, (void (*)(void *)) &media_unref);
+    
+    err = map_init(&lib->path_index, &conf);
+    if (err < 0) {
+        climpd_log_e(tag, "failed to initialize path index - %s\n", 
+                     strerr(-err));
+        goto cleanup1;
+    }
+    
+    err = search_index_init(&lib->search_index);
+    if (err < 0) {
+        climpd_log_e(tag, "failed to initialize search index - %s\n", 
+                     strerr(-err));
+        goto cleanup2;
+    }
+    
+    climpd_log_i(tag, "initialized\n");
+    
+    return 0;
+    
+cleanup2:
+    map_destroy(&lib->path_index);
+cleanup1:
+    vector_destroy(&lib->vec_media);
+    return err;
+}
+
+void library_destroy(struct library *__restrict lib)
+{
+    search_index_destroy(&lib->search_index);
+    map_destroy(&lib->path_index);
+    vector_destroy(&lib->vec_media);
+    
+    climpd_log_i(tag, "destroyed\n");
+}
+
+/* Adds 'm' to the library, a track with the same path gets replaced */
+int library_add(struct library *__restrict lib, struct media *m)
+{
+    unsigned int i;
+    void *data;
+    int err;
+    
+    /* tags found in the cache are there before the track gets indexed */
+    if (lib->tag_reader && !media_is_parsed(m))
+        tag_reader_read_background(lib->tag_reader, m);
+    
+    data = map_retrieve(&lib->path_index, media_path(m));
+    if (data) {
+        i = position_unpack(data);
+        
+        /* the key is owned by the old media, drop it before the media */
+        map_take(&lib->path_index, media_path(m));
+        
+        media_unref(*vector_at(&lib->vec_media, i));
+        *vector_at(&lib->vec_media, i) = media_ref(m);
+        
+        err = map_insert(&lib->path_index, media_path(m), position_pack(i));
+        if (err < 0) {
+            /* a track which can't be found must not stay in the library */
+            library_remove_at(lib, i);
+            return err;
+        }
+        
+        goto out;
+    }
+    
+    i = vector_size(&lib->vec_media);
+    
+    err = vector_insert_back(&lib->vec_media, media_ref(m));
+    if (err < 0) {
+        media_unref(m);
+        return err;
+    }
+    
+    err = map_insert(&lib->path_index, media_path(m), position_pack(i));
+    if (err < 0) {
+        media_unref(vector_take_back(&lib->vec_media));
+        return err;
+    }
+    
+out:
+    err = search_index_add(&lib->search_index, m);
+    if (err < 0) {
+        climpd_log_w(tag, "failed to index '%s' for searching - %s\n", 
+                     media_path(m), strerr(-err));
+    }
+    
+    return 0;
+}
+
+void library_remove(struct library *__restrict lib, const char *__restrict path)
+{
+    void *data;
+    
+    data = map_retrieve(&lib->path_index, path);
+    if (data)
+        library_remove_at(lib, position_unpack(data));
+}
+
+/* Removes all tracks below 'dir' and returns how many there were */
+unsigned int library_remove_dir(struct library *__restrict lib, 
+                                const char *__restrict dir)
+{
+    unsigned int i, cnt = 0;
+    size_t len;
+    
+    len = strlen(dir);
+    
+    while (len > 0 && dir[len - 1] == '/')
+        --len;
+    
+    i = vector_size(&lib->vec_media);
+    
+    /* walk backwards, so the swapped in tracks are already checked */
+    while (i--) {
+        struct media *m = *vector_at(&lib->vec_media, i);
+        
+        if (path_in_dir(media_path(m), dir, len)) {
+            library_remove_at(lib, i);
+            cnt += 1;
+        }
+    }
+    
+    return cnt;
+}
+
+/* Indexes the tags of 'm' once they are known, if it is part of the library */
+void library_update(struct library *__restrict lib, struct media *m)
+{
+    int err;
+    
+    if (library_find(lib, media_path(m)) != m)
+        return;
+    
+    err = search_index_add(&lib->search_index, m);
+    if (err < 0) {
+        climpd_log_w(tag, "failed to index '%s' for searching - %s\n", 
+                     media_path(m), strerr(-err));
+    }
+}
+
+int library_search(struct library *__restrict lib, 
+                   const char *__restrict query,
+                   unsigned int limit,
+                   struct vector *__restrict results)
+{
+    return search_index_search(&lib->search_index, query, limit, results);
+}
+
+struct media *library_find(struct library *__restrict lib, 
+                           const char *__restrict path)
+{
+    void *data;
+    
+    data = map_retrieve(&lib->path_index, path);
+    
+    return (data) ? *vector_at(&lib->vec_media, position_unpack(data)) : NULL;
+}
+
+struct media *library_at(struct library *__restrict lib, unsigned int i)
+{
+    return *vector_at(&lib->vec_media, i);
+}
+
+unsigned int library_size(const struct library *__restrict lib)
+{
+    return vector_size(&lib->vec_media);
+}
\ No newline at end of file
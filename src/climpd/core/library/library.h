@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LIBRARY_H_
+#define _LIBRARY_H_
+
+#include <libvci/map.h>
+#include <libvci/vector.h>
+
+#include <core/library/search-index.h>
+#include <core/playlist/tag-reader.h>
+#include <media/media.h>
+
+/*
+ * In-memory index of all media files below the configured library roots.
+ * Tracks are kept in no particular order, removing one moves the last
+ * track into its place. Tags come from the tag cache or are discovered in
+ * the background, the search index is updated as soon as they arrive.
+ */
+struct library {
+    struct vector vec_media;
+    struct map path_index;
+    struct search_index search_index;
+    struct tag_reader *tag_reader;
+};
+
+int library_init(struct library *__restrict lib, 
+                 struct tag_reader *__restrict tr);
+
+void library_destroy(struct library *__restrict lib);
+
+int library_add(struct library *__restrict lib, struct media *m);
+
+void library_remove(struct library *__restrict lib, const char *__restrict path);
+
+unsigned int library_remove_dir(struct library *__restrict lib, 
+                                const char *__restrict dir);
+
+void library_update(struct library *__restrict lib, struct media *m);
+
+int library_search(struct library *__restrict lib, 
+                   const char *__restrict query,
+                   unsigned int limit,
+                   struct vector *__restrict results);
+
+struct media *library_find(struct library *__restrict lib, 
+                           const char *__restrict path);
+
+struct media *library_at(struct library *__restrict lib, unsigned int i);
+
+unsigned int library_size(const struct library *__restrict lib);
+
+#endif /* _LIBRARY_H_ */
\ No newline at end of file
@@ -0,0 +1,518 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include <libvci/compare.h>
+#include <libvci/hash.h>
+#include <libvci/error.h>
+
+#include <core/climpd-log.h>
+#include <core/library/search-index.h>
+
+/* dead documents which may pile up before the index gets compacted */
+#define COMPACT_THRESHOLD 4096
+
+#define SEARCH_MAX_TERMS 16
+
+struct search_doc {
+    struct media *media;
+    unsigned int id;
+    bool alive;
+    char text[];
+};
+
+struct posting_list {
+    unsigned int *ids;
+    unsigned int size;
+    unsigned int capacity;
+};
+
+static const char *tag = "search-index";
+
+static void *trigram_key(const char *__restrict s)
+{
+    uint32_t t;
+    
+    t = (uint32_t) (unsigned char) s[0] << 16 | 
+        (uint32_t) (unsigned char) s[1] << 8  | 
+        (uint32_t) (unsigned char) s[2];
+    
+    /* a NULL key is not allowed */
+    return (void *) (uintptr_t) (t + 1);
+}
+
+static int trigram_compare(const void *a, const void *b)
+{
+    uintptr_t t1 = (uintptr_t) a, t2 = (uintptr_t) b;
+    
+    return (t1 > t2) - (t1 < t2);
+}
+
+static unsigned int trigram_hash(const void *key)
+{
+    uintptr_t t = (uintptr_t) key;
+    
+    return (unsigned int) (t * 2654435761u);
+}
+
+static int compare_key(const void *a, const void *b)
+{
+    return trigram_compare(*(void * const *) a, *(void * const *) b);
+}
+
+static void posting_list_delete(void *data)
+{
+    struct posting_list *list = data;
+    
+    free(list->ids);
+    free(list);
+}
+
+static char *append_lower(char *__restrict dst, const char *__restrict src)
+{
+    while (*src)
+        *dst++ = tolower((unsigned char) *src++);
+    
+    return dst;
+}
+
+static struct search_doc *search_doc_new(struct media *m)
+{
+    const struct media_info *info;
+    struct search_doc *doc;
+    const char *strings[4];
+    size_t size = 0;
+    char *p;
+    
+    info = media_info(m);
+    
+    strings[0] = media_path(m);
+    strings[1] = info->title;
+    strings[2] = info->artist;
+    strings[3] = info->album;
+    
+    for (unsigned int i = 0; i < 4; ++i)
+        size += strlen(strings[i]) + 1;
+    
+    doc = malloc(sizeof(*doc) + size);
+    if (!doc)
+        return NULL;
+    
+    doc->media = media_ref(m);
+    doc->alive = true;
+    
+    /* lines can't be part of a search term, so they separate the fields */
+    p = doc->text;
+    
+    for (unsigned int i = 0; i < 4; ++i) {
+        p = append_lower(p, strings[i]);
+        *p++ = '\n';
+    }
+    
+    p[-1] = '\0';
+    
+    return doc;
+}
+
+static void search_doc_delete(void *data)
+{
+    struct search_doc *doc = data;
+    
+    if (doc->media)
+        media_unref(doc->media);
+    
+    free(doc);
+}
+
+static void search_doc_kill(struct search_index *__restrict si, 
+                            struct search_doc *__restrict doc)
+{
+    doc->alive = false;
+    
+    media_unref(doc->media);
+    doc->media = NULL;
+    
+    si->dead += 1;
+}
+
+static int posting_list_append(struct search_index *__restrict si, 
+                               void *key,
+                               unsigned int id)
+{
+    struct posting_list *list;
+    unsigned int *ids, capacity;
+    int err;
+    
+    list = map_retrieve(&si->postings, key);
+    if (!list) {
+        list = calloc(1, sizeof(*list));
+        if (!list)
+            return -errno;
+        
+        err = map_insert(&si->postings, key, list);
+        if (err < 0) {
+            free(list);
+            return err;
+        }
+    }
+    
+    if (list->size == list->capacity) {
+        capacity = (list->capacity) ? 2 * list->capacity : 4;
+        
+        ids = realloc(list->ids, capacity * sizeof(*ids));
+        if (!ids)
+            return -errno;
+        
+        list->ids      = ids;
+        list->capacity = capacity;
+    }
+    
+    list->ids[list->size++] = id;
+    
+    return 0;
+}
+
+static int index_doc(struct search_index *__restrict si, 
+                     const struct search_doc *__restrict doc)
+{
+    size_t len, n;
+    void **keys;
+    int err = 0;
+    
+    len = strlen(doc->text);
+    if (len < 3)
+        return 0;
+    
+    n = len - 2;
+    
+    keys = malloc(n * sizeof(*keys));
+    if (!keys)
+        return -errno;
+    
+    for (size_t i = 0; i < n; ++i)
+        keys[i] = trigram_key(doc->text + i);
+    
+    /* every id may only show up once in a posting list */
+    qsort(keys, n, sizeof(*keys), &compare_key);
+    
+    for (size_t i = 0; i < n; ++i) {
+        if (i > 0 && keys[i] == keys[i - 1])
+            continue;
+        
+        err = posting_list_append(si, keys[i], doc->id);
+        if (err < 0)
+            break;
+    }
+    
+    free(keys);
+    
+    return err;
+}
+
+static void search_index_compact(struct search_index *__restrict si)
+{
+    unsigned int size, alive = 0;
+    int err;
+    
+    size = vector_size(&si->vec_docs);
+    
+    for (unsigned int i = 0; i < size; ++i) {
+        struct search_doc *doc = *vector_at(&si->vec_docs, i);
+        
+        if (!doc->alive) {
+            search_doc_delete(doc);
+            continue;
+        }
+        
+        doc->id = alive;
+        *vector_at(&si->vec_docs, alive++) = doc;
+    }
+    
+    while (vector_size(&si->vec_docs) > alive)
+        vector_take_back(&si->vec_docs);
+    
+    map_clear(&si->postings);
+    si->dead = 0;
+    
+    for (unsigned int i = 0; i < alive; ++i) {
+        err = index_doc(si, *vector_at(&si->vec_docs, i));
+        if (err < 0) {
+            climpd_log_w(tag, "failed to rebuild index - %s\n", strerr(-err));
+            break;
+        }
+    }
+    
+    climpd_log_i(tag, "compacted index to %u documents, %u trigrams\n", 
+                 alive, map_size(&si->postings));
+}
+
+int search_index_init(struct search_index *__restrict si)
+{
+    const struct map_config path_conf = {
+        .size        = MAP_DEFAULT_SIZE,
+        .lower_bound = MAP_DEFAULT_LOWER_BOUND,
+        .upper_bound = MAP_DEFAULT_UPPER_BOUND,
+        .static_size = false,
+        .key_compare = &compare_string,
+        .key_hash    = &hash_string,
+        .data_delete = NULL,
+    };
+    const struct map_config postings_conf = {
+        .size        = MAP_DEFAULT_SIZE,
+        .lower_bound = MAP_DEFAULT_LOWER_BOUND,
+        .upper_bound = MAP_DEFAULT_UPPER_BOUND,
+        .static_size = false,
+        .key_compare = &trigram_compare,
+        .key_hash    = &trigram_hash,
+        .data_delete = &posting_list_delete,
+    };
+    int err;
+    
+    si->dead = 0;
+    
+    err = vector_init(&si->vec_docs, 0);
+    if (err < 0)
+        return err;
+    
+    vector_set_data_delete(&si->vec_docs, &search_doc_delete);
+    
+    err = map_init(&si->path_map, &path_conf);
+    if (err < 0)
+        goto cleanup1;
+    
+    err = map_init(&si->postings, &postings_conf);
+    if (err < 0)
+        goto cleanup2;
+    
+    return 0;
+
+cleanup2:
+    map_destroy(&si->path_map);
+cleanup1:
+    vector_destroy(&si->vec_docs);
+    return err;
+}
+
+void search_index_destroy(struct search_index *__restrict si)
+{
+    map_destroy(&si->postings);
+    map_destroy(&si->path_map);
+    vector_destroy(&si->vec_docs);
+}
+
+/* Indexes 'm', an older document with the same path is replaced */
+int search_index_add(struct search_index *__restrict si, struct media *m)
+{
+    struct search_doc *doc, *old;
+    int err;
+    
+    doc = search_doc_new(m);
+    if (!doc)
+        return -errno;
+    
+    /* the key is owned by the media of the old document */
+    old = map_take(&si->path_map, media_path(m));
+    if (old)
+        search_doc_kill(si, old);
+    
+    doc->id = vector_size(&si->vec_docs);
+    
+    err = vector_insert_back(&si->vec_docs, doc);
+    if (err < 0) {
+        search_doc_delete(doc);
+        return err;
+    }
+    
+    err = map_insert(&si->path_map, media_path(m), doc);
+    if (err < 0) {
+        search_doc_kill(si, doc);
+        return err;
+    }
+    
+    err = index_doc(si, doc);
+    if (err < 0)
+        climpd_log_w(tag, "'%s' is only partially indexed\n", media_path(m));
+    
+    if (si->dead > COMPACT_THRESHOLD && si->dead > vector_size(&si->vec_docs) / 2)
+        search_index_compact(si);
+    
+    return 0;
+}
+
+void search_index_remove(struct search_index *__restrict si, 
+                         const char *__restrict path)
+{
+    struct search_doc *doc;
+    
+    doc = map_take(&si->path_map, path);
+    if (doc)
+        search_doc_kill(si, doc);
+}
+
+static int compare_list_size(const void *a, const void *b)
+{
+    const struct posting_list *l1 = *(const struct posting_list * const *) a;
+    const struct posting_list *l2 = *(const struct posting_list * const *) b;
+    
+    return (l1->size > l2->size) - (l1->size < l2->size);
+}
+
+/* Keeps only those of the 'n' candidates which are also part of 'list' */
+static unsigned int intersect(unsigned int *__restrict ids, 
+                              unsigned int n,
+                              const struct posting_list *__restrict list)
+{
+    unsigned int i = 0, j = 0, cnt = 0;
+    
+    while (i < n && j < list->size) {
+        if (ids[i] < list->ids[j]) {
+            ++i;
+        } else if (ids[i] > list->ids[j]) {
+            ++j;
+        } else {
+            ids[cnt++] = ids[i];
+            ++i;
+            ++j;
+        }
+    }
+    
+    return cnt;
+}
+
+static bool doc_matches(const struct search_doc *__restrict doc, 
+                        char **terms, 
+                        unsigned int n)
+{
+    if (!doc->alive)
+        return false;
+    
+    for (unsigned int i = 0; i < n; ++i) {
+        if (!strstr(doc->text, terms[i]))
+            return false;
+    }
+    
+    return true;
+}
+
+/*
+ * Appends up to 'limit' media to 'results' whose path or tags contain all
+ * whitespace separated terms of 'query' (case-insensitive). The media are
+ * not referenced and only valid until the index is changed.
+ */
+int search_index_search(struct search_index *__restrict si, 
+                        const char *__restrict query,
+                        unsigned int limit,
+                        struct vector *__restrict results)
+{
+    char *terms[SEARCH_MAX_TERMS], *lower, *save, *p;
+    const struct posting_list **lists;
+    unsigned int n_terms = 0, n_lists = 0, n_ids, cnt = 0;
+    unsigned int *ids = NULL;
+    size_t len;
+    int err = 0;
+    
+    lower = malloc(strlen(query) + 1);
+    if (!lower)
+        return -errno;
+    
+    *append_lower(lower, query) = '\0';
+    
+    for (p = strtok_r(lower, " \t\n", &save); p && n_terms < SEARCH_MAX_TERMS; 
+         p = strtok_r(NULL, " \t\n", &save))
+        terms[n_terms++] = p;
+    
+    lists = malloc((strlen(query) + 1) * sizeof(*lists));
+    if (!lists) {
+        err = -errno;
+        goto cleanup1;
+    }
+    
+    /* terms shorter than a trigram can only be verified, not looked up */
+    for (unsigned int i = 0; i < n_terms; ++i) {
+        len = strlen(terms[i]);
+        
+        for (size_t j = 0; j + 3 <= len; ++j) {
+            lists[n_lists] = map_retrieve(&si->postings, 
+                                          trigram_key(terms[i] + j));
+            if (!lists[n_lists])
+                goto out;
+            
+            ++n_lists;
+        }
+    }
+    
+    if (n_lists > 0) {
+        /* start with the rarest trigram to keep the candidate set small */
+        qsort(lists, n_lists, sizeof(*lists), &compare_list_size);
+        
+        n_ids = lists[0]->size;
+        
+        ids = malloc((n_ids + 1) * sizeof(*ids));
+        if (!ids) {
+            err = -errno;
+            goto cleanup2;
+        }
+        
+        memcpy(ids, lists[0]->ids, n_ids * sizeof(*ids));
+        
+        for (unsigned int i = 1; i < n_lists && n_ids > 0; ++i)
+            n_ids = intersect(ids, n_ids, lists[i]);
+    } else {
+        n_ids = vector_size(&si->vec_docs);
+    }
+    
+    for (unsigned int i = 0; i < n_ids && cnt < limit; ++i) {
+        struct search_doc *doc;
+        
+        doc = *vector_at(&si->vec_docs, (ids) ? ids[i] : i);
+        
+        if (!doc_matches(doc, terms, n_terms))
+            continue;
+        
+        err = vector_insert_back(results, doc->media);
+        if (err < 0)
+            goto cleanup3;
+        
+        ++cnt;
+    }
+    
+out:
+    err = (int) cnt;
+    
+cleanup3:
+    free(ids);
+cleanup2:
+    free(lists);
+cleanup1:
+    free(lower);
+    
+    return err;
+}
+
+unsigned int search_index_size(const struct search_index *__restrict si)
+{
+    return vector_size(&si->vec_docs) - si->dead;
+}
\ No newline at end of file
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SEARCH_INDEX_H_
+#define _SEARCH_INDEX_H_
+
+#include <libvci/map.h>
+#include <libvci/vector.h>
+
+#include <media/media.h>
+
+/*
+ * Trigram index over the path, title, artist and album of media. Every
+ * media is a document whose id is its position in 'vec_docs'. For each 
+ * trigram of the (lower case) text of a document its id is appended to
+ * the posting list of the trigram, so posting lists are always sorted.
+ * Removed documents are only marked dead and dropped in bulk once they
+ * make up the majority of the index.
+ */
+struct search_index {
+    struct vector vec_docs;
+    struct map path_map;
+    struct map postings;
+    unsigned int dead;
+};
+
+int search_index_init(struct search_index *__restrict si);
+
+void search_index_destroy(struct search_index *__restrict si);
+
+int search_index_add(struct search_index *__restrict si, struct media *m);
+
+void search_index_remove(struct search_index *__restrict si, 
+                         const char *__restrict path);
+
+int search_index_search(struct search_index *__restrict si, 
+                        const char *__restrict query,
+                        unsigned int limit,
+                        struct vector *__restrict results);
+
+unsigned int search_index_size(const struct search_index *__restrict si);
+
+#endif /* _SEARCH_INDEX_H_ */
\ No newline at end of file
@@ -37,7 +37,11 @@ static bool is_playlist_file(const char *__restrict path)
 {
     const char *p = strrchr(path, '.');
     
-    return (p) ? strcmp(p, ".m3u") == 0 || strcmp(p, ".txt") == 0 : false; 
+    if (!p)
+        return false;
+    
+    return strcmp(p, ".m3u") == 0 || strcmp(p, ".txt") == 0 
+           || strcmp(p, PLAYLIST_BINARY_SUFFIX) == 0;
 }
 
 static int pathcat(char *__restrict dst,
@@ -0,0 +1,204 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libvci/error.h>
+
+#include <core/climpd-log.h>
+#include <core/persistence.h>
+
+static const char *tag = "persistence";
+
+static gboolean flush_timeout(void *data)
+{
+    struct persistence *p = data;
+    
+    p->timeout_id = 0;
+    persistence_flush(p);
+    
+    return false;
+}
+
+/* The flush took the playlist for saved already, it has to be written again */
+static void handle_save_error(struct playlist *pl, int err, void *data)
+{
+    struct persistence *p = data;
+    
+    (void) pl;
+    (void) err;
+    
+    persistence_mark(p, PERSISTENCE_PLAYLIST);
+}
+
+int persistence_init(struct persistence *__restrict p,
+                     struct playlist *__restrict pl,
+                     const char *__restrict playlist_path,
+                     struct climpd_config *__restrict conf)
+{
+    memset(p, 0, sizeof(*p));
+    
+    p->playlist_path = strdup(playlist_path);
+    if (!p->playlist_path) {
+        int err = -errno;
+        climpd_log_e(tag, "failed to initialize - %s\n", errstr);
+        return err;
+    }
+    
+    p->playlist = pl;
+    p->config   = conf;
+    
+    playlist_set_save_error_handler(pl, &handle_save_error, p);
+    
+    climpd_log_i(tag, "initialized\n");
+    
+    return 0;
+}
+
+/* Pending changes are not written, the final state is saved by the caller */
+void persistence_destroy(struct persistence *__restrict p)
+{
+    if (p->timeout_id)
+        g_source_remove(p->timeout_id);
+    
+    playlist_set_save_error_handler(p->playlist, NULL, NULL);
+    
+    climpd_log_i(tag, "%u flushes\n", p->flushes);
+    
+    free(p->playlist_path);
+    
+    climpd_log_i(tag, "destroyed\n");
+}
+
+static void schedule_flush(struct persistence *__restrict p)
+{
+    const struct persistence_config *conf;
+    
+    conf = climpd_config_persistence_config(p->config);
+    
+    if (p->timeout_id)
+        g_source_remove(p->timeout_id);
+    
+    p->timeout_id = g_timeout_add(conf->delay, &flush_timeout, p);
+}
+
+/* Records a change of the state in 'what' and schedules a flush */
+void persistence_mark(struct persistence *__restrict p, unsigned int what)
+{
+    const struct persistence_config *conf;
+    
+    conf = climpd_config_persistence_config(p->config);
+    
+    p->dirty |= what;
+    p->changes += 1;
+    
+    if (p->changes >= conf->max_changes) {
+        persistence_flush(p);
+        return;
+    }
+    
+    /* every further change postpones the flush */
+    schedule_flush(p);
+}
+
+/* Writes all dirty state now, failed parts stay dirty and are retried */
+int persistence_flush(struct persistence *__restrict p)
+{
+    const struct playlist_config *pl_conf;
+    gint64 start;
+    int err, ret = 0;
+    
+    if (p->timeout_id) {
+        g_source_remove(p->timeout_id);
+        p->timeout_id = 0;
+    }
+    
+    p->changes = 0;
+    
+    if (!p->dirty)
+        return 0;
+    
+    start = g_get_monotonic_time();
+    
+    if (p->dirty & PERSISTENCE_PLAYLIST) {
+        pl_conf = climpd_config_playlist_config(p->config);
+        
+        if (pl_conf->background_save)
+            err = playlist_save_async(p->playlist, p->playlist_path);
+        else
+            err = playlist_save(p->playlist, p->playlist_path);
+        
+        if (err < 0) {
+            climpd_log_w(tag, "failed to save playlist - %s\n", strerr(-err));
+            ret = err;
+        } else {
+            p->dirty &= ~PERSISTENCE_PLAYLIST;
+        }
+    }
+    
+    if (p->dirty & PERSISTENCE_CONFIG) {
+        err = 0;
+        
+        /* changes are only meant to outlive the session if requested */
+        if (climpd_config_keep_changes(p->config))
+            err = climpd_config_save(p->config);
+        
+        if (err < 0) {
+            climpd_log_w(tag, "failed to save config - %s\n", strerr(-err));
+            ret = err;
+        } else {
+            p->dirty &= ~PERSISTENCE_CONFIG;
+        }
+    }
+    
+    p->last_flush = g_get_real_time();
+    p->last_cost  = g_get_monotonic_time() - start;
+    p->flushes   += 1;
+    
+    /* without another change nobody would try to save the state again */
+    if (p->dirty)
+        schedule_flush(p);
+    
+    return ret;
+}
+
+bool persistence_dirty(const struct persistence *__restrict p)
+{
+    return p->dirty != 0;
+}
+
+/* Wall clock time of the last flush in microseconds, 0 if there was none */
+gint64 persistence_last_flush(const struct persistence *__restrict p)
+{
+    return p->last_flush;
+}
+
+/* Time the last flush blocked the main loop in microseconds */
+gint64 persistence_last_cost(const struct persistence *__restrict p)
+{
+    return p->last_cost;
+}
+
+unsigned int persistence_flushes(const struct persistence *__restrict p)
+{
+    return p->flushes;
+}
\ No newline at end of file
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PERSISTENCE_H_
+#define _PERSISTENCE_H_
+
+#include <stdbool.h>
+
+#include <gst/gst.h>
+
+#include <core/climpd-config.h>
+#include <core/playlist/playlist.h>
+
+#define PERSISTENCE_PLAYLIST    0x1u
+#define PERSISTENCE_CONFIG      0x2u
+
+/*
+ * Saves the session playlist and the configuration while the daemon runs.
+ * Mutations only mark the affected state as dirty. It is written once no 
+ * further change happened for the configured delay, or right away after
+ * the configured number of changes, so bursts of commands cause a single
+ * save. The playlist is handed to its background writer if configured.
+ */
+struct persistence {
+    struct playlist *playlist;
+    struct climpd_config *config;
+    char *playlist_path;
+    
+    unsigned int dirty;
+    unsigned int changes;
+    guint timeout_id;
+    
+    gint64 last_flush;
+    gint64 last_cost;
+    unsigned int flushes;
+};
+
+int persistence_init(struct persistence *__restrict p,
+                     struct playlist *__restrict pl,
+                     const char *__restrict playlist_path,
+                     struct climpd_config *__restrict conf);
+
+void persistence_destroy(struct persistence *__restrict p);
+
+void persistence_mark(struct persistence *__restrict p, unsigned int what);
+
+int persistence_flush(struct persistence *__restrict p);
+
+bool persistence_dirty(const struct persistence *__restrict p);
+
+gint64 persistence_last_flush(const struct persistence *__restrict p);
+
+gint64 persistence_last_cost(const struct persistence *__restrict p);
+
+unsigned int persistence_flushes(const struct persistence *__restrict p);
+
+#endif /* _PERSISTENCE_H_ */
\ No newline at end of file
@@ -19,12 +19,14 @@
  */
 
 #include <stdlib.h>
+#include <limits.h>
 #include <errno.h>
 #include <assert.h>
 
 #include <core/playlist/kfy.h>
 
 #define KFY_MIN_CAPACITY 8
+#define KFY_NIL ((unsigned int) -1)
 
 static unsigned int next_pow_2(unsigned int val)
 {
@@ -36,134 +38,432 @@ static unsigned int next_pow_2(unsigned int val)
     return ret;
 }
 
-int kfy_init(struct kfy *__restrict k, unsigned int size)
+static unsigned int node_size(const struct kfy *__restrict k, unsigned int n)
+{
+    return (n == KFY_NIL) ? 0 : k->nodes[n].size;
+}
+
+static unsigned int node_unplayed(const struct kfy *__restrict k, 
+                                  unsigned int n)
+{
+    return (n == KFY_NIL) ? 0 : k->nodes[n].unplayed;
+}
+
+static void node_update(struct kfy *__restrict k, unsigned int n)
+{
+    struct kfy_node *node = k->nodes + n;
+    
+    node->size     = 1 + node_size(k, node->left) + node_size(k, node->right);
+    node->unplayed = !node->played + node_unplayed(k, node->left) 
+                                   + node_unplayed(k, node->right);
+}
+
+static unsigned int node_new(struct kfy *__restrict k)
 {
+    struct kfy_node *node;
+    unsigned int n;
+    
+    if (k->free_list != KFY_NIL) {
+        n = k->free_list;
+        k->free_list = k->nodes[n].left;
+    } else {
+        if (k->used == k->capacity) {
+            unsigned int cap = next_pow_2(k->capacity);
+            
+            node = realloc(k->nodes, cap * sizeof(*node));
+            if (!node)
+                return KFY_NIL;
+            
+            k->nodes    = node;
+            k->capacity = cap;
+        }
+        
+        n = k->used++;
+    }
+    
+    node = k->nodes + n;
+    
+    node->left     = KFY_NIL;
+    node->right    = KFY_NIL;
+    node->prio     = random_uint_range(&k->rand, 0, INT_MAX);
+    node->size     = 1;
+    node->unplayed = 1;
+    node->played   = false;
+    
+    return n;
+}
+
+/* Makes sure that the next 'cnt' calls to node_new() will not fail */
+static int kfy_reserve(struct kfy *__restrict k, unsigned int cnt)
+{
+    struct kfy_node *nodes;
     unsigned int cap;
+    
+    if (k->capacity - k->used >= cnt)
+        return 0;
+    
+    cap = next_pow_2(k->used + cnt);
+    
+    nodes = realloc(k->nodes, cap * sizeof(*nodes));
+    if (!nodes)
+        return -errno;
+    
+    k->nodes    = nodes;
+    k->capacity = cap;
+    
+    return 0;
+}
+
+static void update_all(struct kfy *__restrict k, unsigned int t)
+{
+    if (t == KFY_NIL)
+        return;
+    
+    update_all(k, k->nodes[t].left);
+    update_all(k, k->nodes[t].right);
+    
+    node_update(k, t);
+}
+
+static void node_delete(struct kfy *__restrict k, unsigned int n)
+{
+    k->nodes[n].left = k->free_list;
+    k->free_list = n;
+}
+
+/* Splits 't' into the first 'cnt' nodes ('l') and the rest ('r') */
+static void split(struct kfy *__restrict k, unsigned int t, unsigned int cnt,
+                  unsigned int *l, unsigned int *r)
+{
+    struct kfy_node *node;
+    unsigned int left_size;
+    
+    if (t == KFY_NIL) {
+        *l = KFY_NIL;
+        *r = KFY_NIL;
+        return;
+    }
+    
+    node = k->nodes + t;
+    left_size = node_size(k, node->left);
+    
+    if (cnt <= left_size) {
+        split(k, node->left, cnt, l, &node->left);
+        *r = t;
+    } else {
+        split(k, node->right, cnt - left_size - 1, &node->right, r);
+        *l = t;
+    }
+    
+    node_update(k, t);
+}
+
+static unsigned int merge(struct kfy *__restrict k, unsigned int l, 
+                          unsigned int r)
+{
+    if (l == KFY_NIL)
+        return r;
+    
+    if (r == KFY_NIL)
+        return l;
+    
+    if (k->nodes[l].prio > k->nodes[r].prio) {
+        k->nodes[l].right = merge(k, k->nodes[l].right, r);
+        node_update(k, l);
+        return l;
+    }
+    
+    k->nodes[r].left = merge(k, l, k->nodes[r].left);
+    node_update(k, r);
+    return r;
+}
+
+/* Returns the index of the 'nth' unplayed node in 't' */
+static unsigned int find_unplayed(const struct kfy *__restrict k, 
+                                  unsigned int t, 
+                                  unsigned int nth)
+{
+    unsigned int index = 0;
+    
+    while (t != KFY_NIL) {
+        const struct kfy_node *node = k->nodes + t;
+        unsigned int left_unplayed = node_unplayed(k, node->left);
+    
+        if (nth < left_unplayed) {
+            t = node->left;
+            continue;
+        }
+    
+        if (!node->played && nth == left_unplayed)
+            return index + node_size(k, node->left);
+    
+        nth   -= left_unplayed + !node->played;
+        index += node_size(k, node->left) + 1;
+        t      = node->right;
+    }
+    
+    assert(false && "UNPLAYED NODE NOT FOUND");
+    
+    return KFY_NIL;
+}
+
+static void mark_unplayed(struct kfy *__restrict k, unsigned int t)
+{
+    if (t == KFY_NIL)
+        return;
+    
+    mark_unplayed(k, k->nodes[t].left);
+    mark_unplayed(k, k->nodes[t].right);
+    
+    k->nodes[t].played   = false;
+    k->nodes[t].unplayed = k->nodes[t].size;
+}
+
+static unsigned int get_played(const struct kfy *__restrict k, unsigned int t,
+                               bool *__restrict played, unsigned int i)
+{
+    if (t == KFY_NIL)
+        return i;
+    
+    i = get_played(k, k->nodes[t].left, played, i);
+    played[i++] = k->nodes[t].played;
+    
+    return get_played(k, k->nodes[t].right, played, i);
+}
+
+static unsigned int restore_played(struct kfy *__restrict k, unsigned int t,
+                                   const bool *__restrict played, 
+                                   unsigned int i)
+{
+    if (t == KFY_NIL)
+        return i;
+    
+    i = restore_played(k, k->nodes[t].left, played, i);
+    k->nodes[t].played = played[i++];
+    
+    return restore_played(k, k->nodes[t].right, played, i);
+}
+
+int kfy_init(struct kfy *__restrict k, unsigned int size)
+{
     int err;
     
     err = random_init(&k->rand);
     if (err < 0)
         return err;
     
-    cap = next_pow_2(size);
+    k->capacity = next_pow_2(size);
     
-    k->a = malloc(cap * sizeof(*k->a));
-    if (!k->a) {
+    k->nodes = malloc(k->capacity * sizeof(*k->nodes));
+    if (!k->nodes) {
         err = -errno;
         random_destroy(&k->rand);
-        return -err;
+        return err;
     }
     
-    for (unsigned int i = 0; i < size; ++i)
-        k->a[i] = i;
+    k->root      = KFY_NIL;
+    k->free_list = KFY_NIL;
+    k->used      = 0;
     
-    k->end      = size;
-    k->size     = size;
-    k->capacity = cap;
+    err = kfy_add(k, size);
+    if (err < 0) {
+        kfy_destroy(k);
+        return err;
+    }
     
     return 0;
 }
 
 void kfy_destroy(struct kfy *__restrict k)
 {
-    free(k->a);
+    free(k->nodes);
     random_destroy(&k->rand);
 }
 
 void kfy_reset(struct kfy *__restrict k)
 {
-    if (k->size < k->capacity >> 2 && k->size >= KFY_MIN_CAPACITY) {
-        unsigned int new_cap, *a;
-        
-        new_cap = next_pow_2(k->size);
-        
-        assert(new_cap < k->capacity && "INVALID CAPACITY");
-        
-        a = realloc(k->a, new_cap * sizeof(*k->a));
-        if (a) {
-            k->a        = a;
-            k->capacity = new_cap;
+    mark_unplayed(k, k->root);
+}
+
+void kfy_clear(struct kfy *__restrict k)
+{
+    struct kfy_node *nodes;
+    
+    k->root      = KFY_NIL;
+    k->free_list = KFY_NIL;
+    k->used      = 0;
+    
+    if (k->capacity > KFY_MIN_CAPACITY) {
+        nodes = realloc(k->nodes, KFY_MIN_CAPACITY * sizeof(*nodes));
+        if (nodes) {
+            k->nodes    = nodes;
+            k->capacity = KFY_MIN_CAPACITY;
         }
     }
+}
+
+/* 
+ * Picks the next index like kfy_shuffle(), but does not mark it as played.
+ * If the cycle is done, the index is picked from the next cycle.
+ */
+unsigned int kfy_peek(struct kfy *__restrict k)
+{
+    unsigned int unplayed, nth;
+    
+    assert(k->root != KFY_NIL && "SHUFFLE ON EMPTY SET");
+    
+    unplayed = node_unplayed(k, k->root);
     
-    for (unsigned int i = 0; i < k->size; ++i)
-        k->a[i] = i;
+    if (unplayed == 0)
+        return random_uint_range(&k->rand, 0, kfy_size(k) - 1);
     
-    k->end = k->size;
+    nth = random_uint_range(&k->rand, 0, unplayed - 1);
+    
+    return find_unplayed(k, k->root, nth);
 }
 
-unsigned int kfy_shuffle(struct kfy *__restrict k)
+/* Marks 'index' as played, a done cycle is reset first */
+void kfy_commit(struct kfy *__restrict k, unsigned int index)
 {
-    unsigned int val, index;
-    
-    if (k->end == 0)
+    if (kfy_cycle_done(k))
         kfy_reset(k);
     
-    k->end -= 1;
-    
-    index = random_uint_range(&k->rand, 0, k->end);
+    kfy_set_played(k, index);
+}
+
+unsigned int kfy_shuffle(struct kfy *__restrict k)
+{
+    unsigned int index = kfy_peek(k);
     
-    val = k->a[index];
-    k->a[index] = k->a[k->end];
+    kfy_commit(k, index);
     
-    return val;
+    return index;
 }
 
 int kfy_add(struct kfy *__restrict k, unsigned int cnt)
 {
-    unsigned int new_size, new_cap, new_end, *a;
+    unsigned int *stack, top, n, last;
+    int err;
     
-    new_end  = k->end  + cnt;
-    new_size = k->size + cnt;
+    if (cnt == 0)
+        return 0;
+    
+    if (cnt == 1)
+        return kfy_insert(k, kfy_size(k));
+    
+    err = kfy_reserve(k, cnt);
+    if (err < 0)
+        return err;
     
-    if (new_size < k->capacity) {
-        for (unsigned int i = k->end; i < new_end; ++i)
-            k->a[i] = k->size + i - k->end;
+    stack = malloc(cnt * sizeof(*stack));
+    if (!stack)
+        return -errno;
+    
+    /* 
+     * The new nodes are already in order, so their treap can be built in 
+     * linear time by keeping the right spine on a stack.
+     */
+    top = 0;
+    
+    for (unsigned int i = 0; i < cnt; ++i) {
+        n = node_new(k);
         
-        k->size = new_size;
-        k->end  = new_end;
+        assert(n != KFY_NIL && "CAPACITY NOT RESERVED");
         
-        return 0;
+        last = KFY_NIL;
+        
+        while (top > 0 && k->nodes[stack[top - 1]].prio < k->nodes[n].prio)
+            last = stack[--top];
+        
+        k->nodes[n].left = last;
+        
+        if (top > 0)
+            k->nodes[stack[top - 1]].right = n;
+        
+        stack[top++] = n;
     }
     
-    new_cap = next_pow_2(new_size);
+    n = stack[0];
+    free(stack);
     
-    assert(new_cap > k->capacity && "INVALID CAPACITY");
+    update_all(k, n);
     
-    a = realloc(k->a, new_cap * sizeof(*k->a));
-    if (!a)
-        return -errno;
+    k->root = merge(k, k->root, n);
     
-    for (unsigned int i = k->end; i < new_end; ++i)
-        a[i] = k->size + i - k->end;
+    return 0;
+}
+
+int kfy_insert(struct kfy *__restrict k, unsigned int index)
+{
+    unsigned int n, l, r;
+    
+    assert(index <= kfy_size(k) && "INVALID INDEX");
+    
+    n = node_new(k);
+    if (n == KFY_NIL)
+        return -ENOMEM;
     
-    k->a        = a;
-    k->end      = new_end;
-    k->size     = new_size;
-    k->capacity = new_cap;
+    split(k, k->root, index, &l, &r);
+    
+    k->root = merge(k, merge(k, l, n), r);
     
     return 0;
 }
 
-void kfy_remove(struct kfy *__restrict k, unsigned int cnt)
+void kfy_remove(struct kfy *__restrict k, unsigned int index)
 {
-    assert(cnt <= k->size && "ARGUMENT 'CNT' TOO BIG");
+    unsigned int l, m, r;
     
-    if (cnt > 0) {
-        k->end = (k->end >= cnt) ? k->end - cnt : 0;
-        k->size -= cnt;
-        
-        for (unsigned int i = 0; i < k->end; ++i)
-            k->a[i] = i;
-    }
+    assert(index < kfy_size(k) && "INVALID INDEX");
+    
+    split(k, k->root, index, &l, &r);
+    split(k, r, 1, &m, &r);
+    
+    node_delete(k, m);
+    
+    k->root = merge(k, l, r);
+}
+
+void kfy_set_played(struct kfy *__restrict k, unsigned int index)
+{
+    unsigned int l, m, r;
+    
+    assert(index < kfy_size(k) && "INVALID INDEX");
+    
+    split(k, k->root, index, &l, &r);
+    split(k, r, 1, &m, &r);
+    
+    k->nodes[m].played = true;
+    node_update(k, m);
+    
+    k->root = merge(k, l, merge(k, m, r));
+}
+
+/* Stores for every index whether it was played in the current cycle */
+void kfy_get_played(const struct kfy *__restrict k, bool *__restrict played)
+{
+    get_played(k, k->root, played, 0);
+}
+
+/* Counterpart of kfy_get_played(), sets the state of all indices at once */
+void kfy_restore_played(struct kfy *__restrict k, 
+                        const bool *__restrict played)
+{
+    restore_played(k, k->root, played, 0);
+    update_all(k, k->root);
 }
 
 unsigned int kfy_size(const struct kfy *__restrict k)
 {
-    return k->size;
+    return node_size(k, k->root);
 }
 
-bool kfy_cycle_done(const struct kfy *__restrict k)
+unsigned int kfy_unplayed(const struct kfy *__restrict k)
 {
-    return k->end == 0;
+    return node_unplayed(k, k->root);
 }
+
+bool kfy_cycle_done(const struct kfy *__restrict k)
+{
+    return node_unplayed(k, k->root) == 0;
+}
\ No newline at end of file
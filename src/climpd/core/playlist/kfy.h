@@ -25,11 +25,28 @@
 
 #include <libvci/random.h>
 
+/*
+ * Shuffles the indices [0, size) like a Knuth-Fisher-Yates shuffle, but
+ * keeps them in an implicit treap ordered by index. Every node knows 
+ * whether it was already played in the current cycle and how many unplayed
+ * nodes its subtree holds. That way tracks can be inserted and removed
+ * in O(log n) without forgetting which ones were already played.
+ */
+struct kfy_node {
+    unsigned int left;
+    unsigned int right;
+    unsigned int prio;
+    unsigned int size;
+    unsigned int unplayed;
+    bool played;
+};
+
 struct kfy {
     struct random rand;
-    unsigned int *a;
-    unsigned int end;
-    unsigned int size;
+    struct kfy_node *nodes;
+    unsigned int root;
+    unsigned int free_list;
+    unsigned int used;
     unsigned int capacity;
 };
 
@@ -39,14 +56,31 @@ void kfy_destroy(struct kfy *__restrict k);
 
 void kfy_reset(struct kfy *__restrict k);
 
+void kfy_clear(struct kfy *__restrict k);
+
 unsigned int kfy_shuffle(struct kfy *__restrict k);
 
+unsigned int kfy_peek(struct kfy *__restrict k);
+
+void kfy_commit(struct kfy *__restrict k, unsigned int index);
+
 int kfy_add(struct kfy *__restrict k, unsigned int cnt);
 
-void kfy_remove(struct kfy *__restrict k, unsigned int cnt);
+int kfy_insert(struct kfy *__restrict k, unsigned int index);
+
+void kfy_remove(struct kfy *__restrict k, unsigned int index);
+
+void kfy_set_played(struct kfy *__restrict k, unsigned int index);
+
+void kfy_get_played(const struct kfy *__restrict k, bool *__restrict played);
+
+void kfy_restore_played(struct kfy *__restrict k, 
+                        const bool *__restrict played);
 
 unsigned int kfy_size(const struct kfy *__restrict k);
 
+unsigned int kfy_unplayed(const struct kfy *__restrict k);
+
 bool kfy_cycle_done(const struct kfy *__restrict k);
 
 #endif /* _KFY_H_ */
\ No newline at end of file
@@ -26,10 +26,16 @@
 #include <ctype.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdint.h>
 #include <errno.h>
 #include <assert.h>
+#include <linux/limits.h>
 
 #include <libvci/filesystem.h>
+#include <libvci/compare.h>
+#include <libvci/hash.h>
+#include <libvci/macro.h>
 #include <libvci/error.h>
 
 #include <core/climpd-log.h>
@@ -38,16 +44,73 @@
 #include <media/uri.h>
 
 
+#define PLAYLIST_FILE_MAGIC     0x4c504c43u
+#define PLAYLIST_FILE_VERSION   1
+#define PLAYLIST_FILE_NONE      ((uint32_t) -1)
+
+#define PLAYLIST_FILE_PARSED    0x1u
+#define PLAYLIST_FILE_SEEKABLE  0x2u
+#define PLAYLIST_FILE_PLAYED    0x4u
+
+/*
+ * A binary playlist consists of the header, one record per track and a
+ * string table. Each string of the table is prefixed by its length, null 
+ * terminated and padded to 4 bytes. Records refer to strings by their 
+ * offset within the table, tags are only stored for parsed tracks.
+ */
+struct playlist_file_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t index;
+    uint64_t strings_size;
+};
+
+struct playlist_file_record {
+    uint32_t uri;
+    uint32_t title;
+    uint32_t artist;
+    uint32_t album;
+    uint32_t track;
+    uint32_t duration;
+    uint32_t flags;
+};
+
+struct string_table {
+    char *data;
+    size_t size;
+    size_t capacity;
+};
+
+/* 
+ * The serialized form of a playlist. It does not refer to the playlist, so
+ * the background writer can save it while the playlist keeps changing.
+ */
+struct playlist_image {
+    char *path;
+    enum file_sync sync;
+    struct playlist_file_header header;
+    struct iovec iov[3];
+    int iovcnt;
+    void *data[2];
+};
+
+/* Remembers the last string read from the table, tracks of an album share */
+struct string_memo {
+    uint32_t offset;
+    const char *string;
+};
+
 static const char *tag = "playlist";
 
-static int descending_integer_comparator(const void *a, const void *b)
+static int ascending_index_comparator(const void *a, const void *b)
 {
-    const int *x, *y;
+    const unsigned int *x, *y;
     
     x = a;
     y = b;
     
-    return (*y > *x) - (*y < *x);
+    return (*x > *y) - (*x < *y);
 }
 
 static unsigned int ensure_positiv_index(const struct playlist *__restrict pl, 
@@ -56,6 +119,261 @@ static unsigned int ensure_positiv_index(const struct playlist *__restrict pl,
     return (i < 0) ? vector_size(&pl->vec_media) + i : (unsigned int) i;
 }
 
+/*
+ * The path index maps the path of each track to its position in 'vec_media'.
+ * Positions are stored off by one, so a missing entry (NULL) is 
+ * distinguishable from position 0. For duplicates only the first 
+ * occurrence is indexed.
+ *
+ * Only the positions below 'path_indexed' are exact. Removing a track just 
+ * lowers that bound instead of moving every following entry, the tail is 
+ * indexed again by the next lookup.
+ */
+static void *position_pack(unsigned int i)
+{
+    return (void *) (uintptr_t) (i + 1);
+}
+
+static unsigned int position_unpack(const void *data)
+{
+    return (unsigned int) ((uintptr_t) data - 1);
+}
+
+static const char *path_at(struct playlist *__restrict pl, unsigned int i)
+{
+    return media_path(*vector_at(&pl->vec_media, i));
+}
+
+static int path_index_insert(struct playlist *__restrict pl, unsigned int i)
+{
+    const char *path = path_at(pl, i);
+    
+    if (map_contains(&pl->path_index, path))
+        return 0;
+    
+    return map_insert(&pl->path_index, path, position_pack(i));
+}
+
+/* Indexes the track at the back, unless the tail is outdated anyway */
+static int path_index_append(struct playlist *__restrict pl)
+{
+    unsigned int i = vector_size(&pl->vec_media) - 1;
+    int err;
+    
+    if (pl->path_indexed != i)
+        return 0;
+    
+    err = path_index_insert(pl, i);
+    if (err < 0)
+        return err;
+    
+    pl->path_indexed += 1;
+    
+    return 0;
+}
+
+static void path_index_reset(struct playlist *__restrict pl)
+{
+    map_clear(&pl->path_index);
+    pl->path_indexed = 0;
+}
+
+/* Brings the positions of all tracks behind 'path_indexed' up to date */
+static int path_index_update(struct playlist *__restrict pl)
+{
+    unsigned int size = vector_size(&pl->vec_media);
+    unsigned int begin = pl->path_indexed;
+    int err;
+    
+    if (begin == size)
+        return 0;
+    
+    /* drop the outdated entries first, they may belong to a later duplicate */
+    for (unsigned int i = begin; i < size; ++i) {
+        const char *path = path_at(pl, i);
+        void *data = map_retrieve(&pl->path_index, path);
+        
+        if (data && position_unpack(data) >= begin)
+            map_take(&pl->path_index, path);
+    }
+    
+    for (unsigned int i = begin; i < size; ++i) {
+        err = path_index_insert(pl, i);
+        if (err < 0) {
+            climpd_log_e(tag, "failed to update path index - %s\n", 
+                         strerr(-err));
+            return err;
+        }
+    }
+    
+    pl->path_indexed = size;
+    
+    return 0;
+}
+
+/* Must be called before the track at 'i' is taken out of 'vec_media' */
+static void path_index_remove(struct playlist *__restrict pl, unsigned int i)
+{
+    const char *path = path_at(pl, i);
+    void *data;
+    
+    /* 
+     * Every entry which may be keyed by the removed track has to go, only
+     * an exact entry of an earlier duplicate is kept.
+     */
+    data = map_retrieve(&pl->path_index, path);
+    if (data) {
+        unsigned int pos = position_unpack(data);
+        
+        if (pos == i || pos >= pl->path_indexed)
+            map_take(&pl->path_index, path);
+    }
+    
+    pl->path_indexed = min(pl->path_indexed, i);
+}
+
+/* 
+ * Must only be called once the playlist reached its new state, since the 
+ * handler may peek at the next track right away.
+ */
+static void invalidate_next(struct playlist *__restrict pl)
+{
+    if (!pl->next_valid)
+        return;
+    
+    pl->next_valid = false;
+    
+    if (pl->on_next_change)
+        pl->on_next_change(pl);
+}
+
+static unsigned int advance(struct playlist *__restrict pl)
+{
+    unsigned int i;
+    
+    if (vector_empty(&pl->vec_media))
+        return (unsigned int) -1;
+    
+    /* 
+     * Only peeks at the shuffler, the track is marked as played once 
+     * playlist_next() actually moves to it.
+     */
+    if (pl->shuffle) {
+        if (kfy_cycle_done(&pl->kfy) && !pl->repeat)
+            return (unsigned int) -1;
+        
+        i = kfy_peek(&pl->kfy);
+        
+        assert(i < playlist_size(pl) && "invalid playlist index");
+        
+        return i;
+    }
+    
+    i = pl->index + 1;
+    
+    if (i >= vector_size(&pl->vec_media))
+        i = (pl->repeat) ? 0 : (unsigned int) -1;
+    
+    return i;
+}
+
+static int media_vector_init(struct vector *__restrict vec, unsigned int size)
+{
+    void (*del)(void *);
+    int (*cmp)(const void *, const void *);
+    int err;
+    
+    err = vector_init(vec, size);
+    if (err < 0)
+        return err;
+    
+    del = (void (*)(void *)) &media_unref;
+    cmp = (int (*)(const void *, const void *)) &media_compare;
+    
+    vector_set_data_delete(vec, del);
+    vector_set_data_compare(vec, cmp);
+    
+    return 0;
+}
+
+/* Allocates room for 'size' tracks at once, only possible while empty */
+static void playlist_reserve(struct playlist *__restrict pl, unsigned int size)
+{
+    struct vector vec;
+    
+    assert(vector_empty(&pl->vec_media) && "PLAYLIST NOT EMPTY");
+    
+    if (media_vector_init(&vec, size) < 0)
+        return;
+    
+    vector_destroy(&pl->vec_media);
+    pl->vec_media = vec;
+}
+
+/* 
+ * Appends 'm' to the tracks and the path index, 
+ * the shuffler has to be adjusted by the caller 
+ */
+static int playlist_append(struct playlist *__restrict pl, struct media *m)
+{
+    int err;
+    
+    media_ref(m);
+    
+    err = vector_insert_back(&pl->vec_media, m);
+    if (err < 0) {
+        climpd_log_e(tag, "failed to add '%s' - %s\n", media_uri(m), 
+                     strerr(-err));
+        media_unref(m);
+        return err;
+    }
+    
+    err = path_index_append(pl);
+    if (err < 0) {
+        climpd_log_e(tag, "failed to index '%s' - %s\n", media_uri(m), 
+                     strerr(-err));
+        vector_take_back(&pl->vec_media);
+        media_unref(m);
+        return err;
+    }
+    
+    if (!media_is_parsed(m))
+        tag_reader_read_async(&pl->tag_reader, m);
+    
+    return 0;
+}
+
+/* Drops the tracks behind 'size' which are not known to the shuffler */
+static void playlist_truncate(struct playlist *__restrict pl, unsigned int size)
+{
+    while (vector_size(&pl->vec_media) > size) {
+        path_index_remove(pl, vector_size(&pl->vec_media) - 1);
+        media_unref(vector_take_back(&pl->vec_media));
+    }
+}
+
+/* Adds all tracks behind 'old_size' to the shuffler in a single step */
+static int playlist_extend_shuffler(struct playlist *__restrict pl, 
+                                    unsigned int old_size)
+{
+    unsigned int added = playlist_size(pl) - old_size;
+    int err;
+    
+    err = kfy_add(&pl->kfy, added);
+    if (err < 0) {
+        climpd_log_e(tag, "failed to adjust track shuffler - %s\n", 
+                     strerr(-err));
+        return err;
+    }
+    
+    assert(kfy_size(&pl->kfy) == vector_size(&pl->vec_media) && "INVALID SIZE");
+    
+    if (added > 0 && pl->next_valid && pl->next == (unsigned int) -1)
+        invalidate_next(pl);
+    
+    return 0;
+}
+
 static int playlist_load_file(struct playlist *__restrict pl, 
                               FILE *__restrict file)
 {
@@ -107,236 +425,1073 @@ static int playlist_load_file(struct playlist *__restrict pl,
             goto cleanup1;
     }
     
-    free(line);
+    free(line);
+    
+    return 0;
+
+cleanup1:
+    while (playlist_size(pl) != old_size)
+        playlist_remove(pl, -1);
+    
+    free(line);
+    
+    return err;
+}
+
+static bool is_uri(const char *__restrict s, size_t len)
+{
+    static const char *schemes[] = { "file:///", "http://", "https://" };
+    
+    for (unsigned int i = 0; i < ARRAY_SIZE(schemes); ++i) {
+        size_t n = strlen(schemes[i]);
+        
+        if (len > n && strncmp(s, schemes[i], n) == 0)
+            return true;
+    }
+    
+    return false;
+}
+
+static int playlist_load_buffer(struct playlist *__restrict pl, 
+                                const char *__restrict data, 
+                                size_t size)
+{
+    char path[PATH_MAX];
+    const char *p, *eol, *begin, *last, *end = data + size;
+    unsigned int old_size, lines;
+    struct media *m;
+    size_t len;
+    int err;
+    
+    old_size = playlist_size(pl);
+    
+    /* reserve space for all tracks at once */
+    lines = 1;
+    
+    for (p = data; (p = memchr(p, '\n', end - p)); ++p)
+        ++lines;
+    
+    if (old_size == 0)
+        playlist_reserve(pl, lines);
+    
+    for (p = data; p < end; p = (eol < end) ? eol + 1 : end) {
+        eol = memchr(p, '\n', end - p);
+        if (!eol)
+            eol = end;
+        
+        /* trim leading and trailing whitespaces without copying the line */
+        begin = p;
+        
+        while (begin < eol && isspace(*begin))
+            ++begin;
+        
+        last = eol;
+        
+        while (last > begin && isspace(last[-1]))
+            --last;
+        
+        if (begin == last || *begin == '#' || *begin == ';')
+            continue;
+        
+        len = last - begin;
+        
+        if (is_uri(begin, len)) {
+            /* uris are used as they are, no need for realpath() */
+            m = media_new_uri(begin, len);
+        } else {
+            if (len >= sizeof(path)) {
+                err = -ENAMETOOLONG;
+                climpd_log_e(tag, "\"%.*s\" - %s\n", (int) len, begin,
+                             strerr(-err));
+                goto cleanup1;
+            }
+            
+            memcpy(path, begin, len);
+            path[len] = '\0';
+            
+            if (!path_is_absolute(path) && !uri_ok(path)) {
+                err = -ENOTSUP;
+                climpd_log_e(tag, "\"%s\" - no absolute path or uri\n", path);
+                goto cleanup1;
+            }
+            
+            m = media_new(path);
+        }
+        
+        if (!m) {
+            err = -errno;
+            climpd_log_e(tag, "failed to create media '%.*s' - %s\n", 
+                         (int) len, begin, errstr);
+            goto cleanup1;
+        }
+        
+        err = playlist_append(pl, m);
+        media_unref(m);
+        
+        if (err < 0)
+            goto cleanup1;
+    }
+    
+    err = playlist_extend_shuffler(pl, old_size);
+    if (err < 0)
+        goto cleanup1;
+    
+    return 0;
+
+cleanup1:
+    playlist_truncate(pl, old_size);
+    return err;
+}
+
+/* Returns the string at 'offset' of the table or NULL if it is malformed */
+static const char *string_table_at(const char *__restrict data, size_t size,
+                                   uint32_t offset, size_t *__restrict len)
+{
+    uint32_t n;
+    
+    if (offset % sizeof(n) != 0 || size < sizeof(n) 
+        || offset > size - sizeof(n))
+        return NULL;
+    
+    memcpy(&n, data + offset, sizeof(n));
+    
+    data += offset + sizeof(n);
+    size -= offset + sizeof(n);
+    
+    if (n >= size || data[n] != '\0')
+        return NULL;
+    
+    if (len)
+        *len = n;
+    
+    return data;
+}
+
+/* The memos of a restore hold a reference to their pooled string */
+static void release_memos(struct string_memo *__restrict memos, 
+                          unsigned int size)
+{
+    for (unsigned int i = 0; i < size; ++i) {
+        if (memos[i].string)
+            pooled_string_unref(memos[i].string);
+    }
+}
+
+static int restore_string(struct playlist *__restrict pl,
+                          const char *__restrict data, size_t size,
+                          uint32_t offset,
+                          struct string_memo *__restrict memo,
+                          struct media *__restrict m,
+                          enum media_string field)
+{
+    const char *s;
+    
+    if (offset == PLAYLIST_FILE_NONE)
+        return 0;
+    
+    if (offset != memo->offset) {
+        s = string_table_at(data, size, offset, NULL);
+        if (!s)
+            return -EINVAL;
+        
+        release_memos(memo, 1);
+        
+        memo->offset = offset;
+        memo->string = string_pool_intern(pl->strings, s);
+    }
+    
+    if (memo->string)
+        media_set_string(m, field, pooled_string_ref(memo->string));
+    
+    return 0;
+}
+
+static int restore_info(struct playlist *__restrict pl,
+                        const struct playlist_file_record *__restrict rec,
+                        const char *__restrict strings, size_t size,
+                        struct string_memo *__restrict memos,
+                        struct media *__restrict m)
+{
+    struct media_info *info = media_info(m);
+    int err;
+    
+    err = restore_string(pl, strings, size, rec->title, memos, m, 
+                         MEDIA_TITLE);
+    if (err < 0)
+        return err;
+    
+    err = restore_string(pl, strings, size, rec->artist, memos + 1, m,
+                         MEDIA_ARTIST);
+    if (err < 0)
+        return err;
+    
+    err = restore_string(pl, strings, size, rec->album, memos + 2, m,
+                         MEDIA_ALBUM);
+    if (err < 0)
+        return err;
+    
+    info->track    = rec->track;
+    info->duration = rec->duration;
+    info->seekable = rec->flags & PLAYLIST_FILE_SEEKABLE;
+    
+    media_set_parsed(m, true);
+    
+    return 0;
+}
+
+/* 
+ * Restores the played tracks of the current shuffle cycle and the current
+ * track, which is only meaningful if the file was the whole playlist
+ */
+static int restore_state(struct playlist *__restrict pl, 
+                         const struct playlist_file_header *__restrict header,
+                         const struct playlist_file_record *__restrict recs)
+{
+    bool *played;
+    
+    played = malloc(header->size * sizeof(*played) + 1);
+    if (!played)
+        return -errno;
+    
+    for (uint32_t i = 0; i < header->size; ++i)
+        played[i] = recs[i].flags & PLAYLIST_FILE_PLAYED;
+    
+    kfy_restore_played(&pl->kfy, played);
+    
+    free(played);
+    
+    if (header->index < header->size)
+        pl->index = header->index;
+    
+    invalidate_next(pl);
+    
+    return 0;
+}
+
+static int playlist_load_binary(struct playlist *__restrict pl, 
+                                const void *__restrict data, 
+                                size_t size)
+{
+    struct string_memo memos[3];
+    const struct playlist_file_header *header = data;
+    const struct playlist_file_record *recs;
+    const char *strings, *uri;
+    unsigned int old_size;
+    struct media *m;
+    size_t len;
+    int err;
+    
+    recs = (const void *) (header + 1);
+    
+    if (size < sizeof(*header) || header->version != PLAYLIST_FILE_VERSION)
+        goto invalid;
+    
+    if ((size - sizeof(*header)) / sizeof(*recs) < header->size)
+        goto invalid;
+    
+    strings = (const char *) (recs + header->size);
+    
+    if (header->strings_size != size - (strings - (const char *) data))
+        goto invalid;
+    
+    size = header->strings_size;
+    
+    for (unsigned int i = 0; i < ARRAY_SIZE(memos); ++i) {
+        memos[i].offset = PLAYLIST_FILE_NONE;
+        memos[i].string = NULL;
+    }
+    
+    old_size = playlist_size(pl);
+    
+    if (old_size == 0)
+        playlist_reserve(pl, header->size);
+    
+    for (uint32_t i = 0; i < header->size; ++i) {
+        uri = string_table_at(strings, size, recs[i].uri, &len);
+        if (!uri) {
+            err = -EINVAL;
+            goto cleanup1;
+        }
+        
+        /* the uris were written by climpd, so they are known to be valid */
+        m = media_new_uri(uri, len);
+        if (!m) {
+            err = -errno;
+            climpd_log_e(tag, "failed to create media '%s' - %s\n", uri,
+                         errstr);
+            goto cleanup1;
+        }
+        
+        if (recs[i].flags & PLAYLIST_FILE_PARSED) {
+            err = restore_info(pl, recs + i, strings, size, memos, m);
+            if (err < 0) {
+                media_unref(m);
+                goto cleanup1;
+            }
+        }
+        
+        err = playlist_append(pl, m);
+        media_unref(m);
+        
+        if (err < 0)
+            goto cleanup1;
+    }
+    
+    release_memos(memos, ARRAY_SIZE(memos));
+    
+    err = playlist_extend_shuffler(pl, old_size);
+    if (err < 0)
+        goto cleanup2;
+    
+    if (old_size == 0) {
+        err = restore_state(pl, header, recs);
+        if (err < 0)
+            climpd_log_w(tag, "failed to restore playlist state - %s\n", 
+                         strerr(-err));
+    }
+    
+    return 0;
+
+cleanup1:
+    release_memos(memos, ARRAY_SIZE(memos));
+cleanup2:
+    playlist_truncate(pl, old_size);
+    
+    if (err != -EINVAL)
+        return err;
+    
+invalid:
+    climpd_log_e(tag, "malformed binary playlist\n");
+    return -EINVAL;
+}
+
+/* A truncated header is still detected, so it is rejected instead of parsed */
+static bool is_binary_playlist(const void *__restrict data, size_t size)
+{
+    uint32_t magic;
+    
+    if (size < sizeof(magic))
+        return false;
+    
+    memcpy(&magic, data, sizeof(magic));
+    
+    return magic == PLAYLIST_FILE_MAGIC;
+}
+
+static int playlist_load_regular(struct playlist *__restrict pl, int fd, 
+                                 size_t size)
+{
+    void *data;
+    int err;
+    
+    if (size == 0)
+        return 0;
+    
+    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        err = -errno;
+        climpd_log_e(tag, "failed to map playlist - %s\n", errstr);
+        return err;
+    }
+    
+    madvise(data, size, MADV_SEQUENTIAL);
+    
+    if (is_binary_playlist(data, size))
+        err = playlist_load_binary(pl, data, size);
+    else
+        err = playlist_load_buffer(pl, data, size);
+    
+    munmap(data, size);
+    
+    return err;
+}
+
+static int playlist_load_stream(struct playlist *__restrict pl, int fd)
+{
+    FILE *file;
+    int fd_dup, err;
+    
+    /* avoid that 'fclose' closes the passed file descriptor */
+    
+    fd_dup = dup(fd);
+    if (fd_dup < 0) {
+        err = -errno;
+        climpd_log_e(tag, "failed to duplicate file descriptor - %s\n", errstr);
+        return err;
+    }
+    
+    file = fdopen(fd_dup, "r");
+    if (!file) {
+        err = -errno;
+        climpd_log_e(tag, "failed to open file descriptor '%d' - %s\n",
+                     fd, errstr);
+        close(fd_dup);
+        return err;
+    }
+    
+    err = playlist_load_file(pl, file);
+    
+    fclose(file);
+    
+    return err;
+}
+
+static int playlist_load_any(struct playlist *__restrict pl, int fd)
+{
+    struct stat st;
+    int err;
+    
+    err = fstat(fd, &st);
+    if (err < 0) {
+        err = -errno;
+        climpd_log_e(tag, "failed to stat file descriptor '%d' - %s\n", 
+                     fd, errstr);
+        return err;
+    }
+    
+    /* pipes and terminals can't be mapped */
+    if (S_ISREG(st.st_mode))
+        return playlist_load_regular(pl, fd, st.st_size);
+    
+    return playlist_load_stream(pl, fd);
+}
+
+/* Waits until the background writer has finished all pending saves */
+static void playlist_flush_writer(struct playlist *__restrict pl)
+{
+    if (!pl->writer)
+        return;
+    
+    g_thread_pool_free(pl->writer, false, true);
+    pl->writer = NULL;
+}
+
+int playlist_init(struct playlist *__restrict pl)
+{
+    const struct map_config conf = {
+        .size        = MAP_DEFAULT_SIZE,
+        .lower_bound = MAP_DEFAULT_LOWER_BOUND,
+        .upper_bound = MAP_DEFAULT_UPPER_BOUND,
+        .static_size = false,
+        .key_compare = &compare_string,
+        .key_hash    = &hash_string,
+        .data_delete = NULL,
+    };
+    int err;
+    
+    memset(pl, 0, sizeof(*pl));
+    
+    err = media_vector_init(&pl->vec_media, 64);
+    if (err < 0) {
+        climpd_log_e(tag, "failed to initialize vector - %s\n", strerr(-err));
+        return err;
+    }
+    
+    err = map_init(&pl->path_index, &conf);
+    if (err < 0) {
+        climpd_log_e(tag, "failed to initialize path index - %s\n", 
+                     strerr(-err));
+        goto cleanup1;
+    }
+    
+    /* media parsed by the tag reader keep their strings and the pool alive */
+    pl->strings = string_pool_new();
+    if (!pl->strings) {
+        err = -errno;
+        climpd_log_e(tag, "failed to initialize string pool - %s\n", 
+                     strerr(-err));
+        goto cleanup2;
+    }
+    
+    err = tag_reader_init(&pl->tag_reader, pl->strings);
+    if (err < 0) {
+        err = -ENOTSUP;
+        climpd_log_e(tag, "failed to initialize tag-reader\n");
+        goto cleanup3;
+    }
+    
+    err = kfy_init(&pl->kfy, 0);
+    if (err < 0) {
+        climpd_log_e(tag, "failed to initialize track shuffler - %s\n", 
+                     strerr(-err));
+        goto cleanup4;
+    }
+    
+    pl->index = (unsigned int) -1;
+    pl->sync  = FILE_SYNC_DATA;
+    
+    climpd_log_i(tag, "initialized\n");
+    
+    return 0;
+    
+cleanup4:
+    tag_reader_destroy(&pl->tag_reader);
+cleanup3:
+    string_pool_unref(pl->strings);
+cleanup2:
+    map_destroy(&pl->path_index);
+cleanup1:
+    vector_destroy(&pl->vec_media);
+    
+    return err;
+}
+
+void playlist_destroy(struct playlist *__restrict pl)
+{
+    playlist_flush_writer(pl);
+    
+    if (g_atomic_int_get(&pl->save_error))
+        g_idle_remove_by_data(pl);
+    
+    kfy_destroy(&pl->kfy);
+    tag_reader_destroy(&pl->tag_reader);
+    map_destroy(&pl->path_index);
+    vector_destroy(&pl->vec_media);
+    string_pool_unref(pl->strings);
+    
+    climpd_log_i(tag, "destroyed\n");
+}
+
+int playlist_enable_tag_cache(struct playlist *__restrict pl, 
+                              const char *__restrict path)
+{
+    return tag_reader_enable_cache(&pl->tag_reader, path);
+}
+
+struct tag_reader *playlist_tag_reader(struct playlist *__restrict pl)
+{
+    return &pl->tag_reader;
+}
+
+void playlist_set_max_discoverers(struct playlist *__restrict pl, 
+                                  unsigned int max)
+{
+    tag_reader_set_max_workers(&pl->tag_reader, max);
+}
+
+void playlist_clear(struct playlist *__restrict pl)
+{
+    assert(kfy_size(&pl->kfy) == vector_size(&pl->vec_media) && "INVALID SIZE");
+    
+    kfy_clear(&pl->kfy);
+    path_index_reset(pl);
+    vector_clear(&pl->vec_media);
+    
+    pl->index = (unsigned int) -1;
+    invalidate_next(pl);
+}
+
+int playlist_add_media(struct playlist *__restrict pl, struct media *m)
+{
+    int err;
+    
+    err = playlist_append(pl, m);
+    if (err < 0)
+        return err;
+    
+    err = kfy_add(&pl->kfy, 1);
+    if (err < 0) {
+        climpd_log_e(tag, "failed to adjust track shuffler - %s\n", 
+                     strerr(-err));
+        
+        playlist_truncate(pl, vector_size(&pl->vec_media) - 1);
+        return err;
+    }
+    
+    assert(kfy_size(&pl->kfy) == vector_size(&pl->vec_media) && "INVALID SIZE");
+    
+    /* a new track does not move any other one, only 'the end' changes */
+    if (pl->next_valid && pl->next == (unsigned int) -1)
+        invalidate_next(pl);
+    
+    return 0;
+}
+
+int playlist_add(struct playlist *__restrict pl, const char *__restrict path)
+{
+    struct media *m;
+    int err;
+    
+    m = media_new(path);
+    if (!m) {
+        err = -errno;
+        climpd_log_e(tag, "failed to create media '%s' - %s\n", path, errstr);
+        return err;
+    }
+    
+    err = playlist_add_media(pl, m);
+    media_unref(m);
+    
+    return err;
+}
+
+int playlist_load(struct playlist *__restrict pl, const char *__restrict path)
+{
+    int fd, err;
+    
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        err = -errno;
+        climpd_log_e(tag, "failed to open/load '%s' - %s\n", path, errstr);
+        return err;
+    }
+    
+    err = playlist_load_any(pl, fd);
+    
+    close(fd);
+    
+    if (err < 0)
+        return err;
+    
+    climpd_log_i(tag, "loaded '%s'\n", path);
+
+    return 0;
+}
+
+int playlist_load_fd(struct playlist *__restrict pl, int fd)
+{
+    int err;
+    
+    err = playlist_load_any(pl, fd);
+    if (err < 0)
+        return err;
+    
+    climpd_log_i(tag, "loaded playlist from file descriptor '%d'\n", fd);
+    
+    return 0;
+}
+
+static int string_table_init(struct string_table *__restrict st, size_t size)
+{
+    st->data = malloc(size);
+    if (!st->data)
+        return -errno;
+    
+    st->size     = 0;
+    st->capacity = size;
+    
+    return 0;
+}
+
+static void string_table_destroy(struct string_table *__restrict st)
+{
+    free(st->data);
+}
+
+/* Appends 's' and returns its offset or PLAYLIST_FILE_NONE on failure */
+static uint32_t string_table_add(struct string_table *__restrict st,
+                                 const char *__restrict s)
+{
+    uint32_t len = strlen(s), offset = st->size;
+    size_t size;
+    char *data;
+    
+    size = (sizeof(len) + len + 1 + sizeof(len) - 1) & ~(sizeof(len) - 1);
+    
+    if (st->size + size >= PLAYLIST_FILE_NONE) {
+        errno = EFBIG;
+        return PLAYLIST_FILE_NONE;
+    }
+    
+    if (st->size + size > st->capacity) {
+        size_t cap = max(2 * st->capacity, st->size + size);
+        
+        data = realloc(st->data, cap);
+        if (!data)
+            return PLAYLIST_FILE_NONE;
+        
+        st->data     = data;
+        st->capacity = cap;
+    }
+    
+    data = st->data + st->size;
+    
+    memcpy(data, &len, sizeof(len));
+    memcpy(data + sizeof(len), s, len);
+    memset(data + sizeof(len) + len, 0, size - sizeof(len) - len);
+    
+    st->size += size;
+    
+    return offset;
+}
+
+/* 
+ * Consecutive tracks mostly share their artist and album. As tags are 
+ * interned, the same string of the previous track is reused by pointer.
+ */
+static uint32_t string_table_add_memo(struct string_table *__restrict st,
+                                      const char *__restrict s,
+                                      struct string_memo *__restrict memo)
+{
+    if (s != memo->string) {
+        memo->offset = string_table_add(st, s);
+        memo->string = (memo->offset != PLAYLIST_FILE_NONE) ? s : NULL;
+    }
+    
+    return memo->offset;
+}
+
+static int fill_record(struct playlist_file_record *__restrict rec,
+                       struct media *__restrict m,
+                       struct string_table *__restrict st,
+                       struct string_memo *__restrict memos)
+{
+    const struct media_info *info = media_info(m);
+    
+    memset(rec, 0, sizeof(*rec));
+    
+    rec->uri    = string_table_add(st, media_uri(m));
+    rec->title  = PLAYLIST_FILE_NONE;
+    rec->artist = PLAYLIST_FILE_NONE;
+    rec->album  = PLAYLIST_FILE_NONE;
+    
+    if (rec->uri == PLAYLIST_FILE_NONE)
+        return -errno;
+    
+    if (!media_is_parsed(m))
+        return 0;
+    
+    rec->title  = string_table_add_memo(st, info->title, memos);
+    rec->artist = string_table_add_memo(st, info->artist, memos + 1);
+    rec->album  = string_table_add_memo(st, info->album, memos + 2);
+    
+    if (rec->title == PLAYLIST_FILE_NONE || rec->artist == PLAYLIST_FILE_NONE
+        || rec->album == PLAYLIST_FILE_NONE)
+        return -errno;
+    
+    rec->track    = info->track;
+    rec->duration = info->duration;
+    rec->flags    = PLAYLIST_FILE_PARSED;
+    
+    if (info->seekable)
+        rec->flags |= PLAYLIST_FILE_SEEKABLE;
     
     return 0;
+}
 
-cleanup1:
-    while (playlist_size(pl) != old_size)
-        playlist_remove(pl, -1);
+static struct playlist_image *playlist_image_new(const char *__restrict path,
+                                                enum file_sync sync)
+{
+    struct playlist_image *img;
     
-    free(line);
-    fclose(file);
+    img = calloc(1, sizeof(*img));
+    if (!img)
+        return NULL;
     
-    return err;
+    img->path = strdup(path);
+    if (!img->path) {
+        free(img);
+        return NULL;
+    }
+    
+    img->sync = sync;
+    
+    return img;
 }
 
-int playlist_init(struct playlist *__restrict pl)
+static void playlist_image_delete(struct playlist_image *__restrict img)
+{
+    for (unsigned int i = 0; i < ARRAY_SIZE(img->data); ++i)
+        free(img->data[i]);
+    
+    free(img->path);
+    free(img);
+}
+
+static int playlist_image_write(struct playlist_image *__restrict img)
 {
-    void (*del)(void *);
-    int (*cmp)(const void *, const void *);
     int err;
     
-    memset(pl, 0, sizeof(*pl));
+    err = atomic_file_write(img->path, img->iov, img->iovcnt, img->sync);
+    if (err < 0)
+        climpd_log_e(tag, "failed to save as '%s' - %s\n", img->path, 
+                     strerr(-err));
     
-    err = vector_init(&pl->vec_media, 64);
-    if (err < 0) {
-        climpd_log_e(tag, "failed to initialize vector - %s\n", strerr(-err));
-        return err;
-    }
+    return err;
+}
+
+static int serialize_binary(struct playlist *__restrict pl, 
+                            struct playlist_image *__restrict img)
+{
+    struct playlist_file_header *header = &img->header;
+    struct playlist_file_record *recs;
+    struct string_memo memos[3];
+    struct string_table st;
+    unsigned int size;
+    bool *played;
+    int err;
     
-    del = (void (*)(void *)) &media_unref;
-    cmp = (int (*)(const void *, const void *)) &media_compare;
+    size = vector_size(&pl->vec_media);
     
-    vector_set_data_delete(&pl->vec_media, del);
-    vector_set_data_compare(&pl->vec_media, cmp);
+    recs = malloc(size * sizeof(*recs) + 1);
+    if (!recs)
+        return -errno;
     
-    err = tag_reader_init(&pl->tag_reader);
-    if (err < 0) {
-        err = -ENOTSUP;
-        climpd_log_e(tag, "failed to initialize tag-reader\n");
+    played = malloc(size * sizeof(*played) + 1);
+    if (!played) {
+        err = -errno;
         goto cleanup1;
     }
     
-    err = kfy_init(&pl->kfy, 0);
-    if (err < 0) {
-        climpd_log_e(tag, "failed to initialize track shuffler - %s\n", 
-                     strerr(-err));
+    /* a rough guess to avoid most reallocations */
+    err = string_table_init(&st, size * 64 + 64);
+    if (err < 0)
         goto cleanup2;
+    
+    memset(memos, 0, sizeof(memos));
+    
+    kfy_get_played(&pl->kfy, played);
+    
+    for (unsigned int i = 0; i < size; ++i) {
+        err = fill_record(recs + i, *vector_at(&pl->vec_media, i), &st, memos);
+        if (err < 0)
+            goto cleanup3;
+        
+        if (played[i])
+            recs[i].flags |= PLAYLIST_FILE_PLAYED;
     }
     
-    pl->index = (unsigned int) -1;
+    free(played);
     
-    climpd_log_i(tag, "initialized\n");
+    header->magic        = PLAYLIST_FILE_MAGIC;
+    header->version      = PLAYLIST_FILE_VERSION;
+    header->size         = size;
+    header->index        = pl->index;
+    header->strings_size = st.size;
     
-    return 0;
+    img->iov[0].iov_base = header;
+    img->iov[0].iov_len  = sizeof(*header);
+    img->iov[1].iov_base = recs;
+    img->iov[1].iov_len  = size * sizeof(*recs);
+    img->iov[2].iov_base = st.data;
+    img->iov[2].iov_len  = st.size;
+    img->iovcnt          = 3;
+    
+    img->data[0] = recs;
+    img->data[1] = st.data;
     
+    return 0;
+
+cleanup3:
+    string_table_destroy(&st);
 cleanup2:
-    tag_reader_destroy(&pl->tag_reader);
+    free(played);
 cleanup1:
-    vector_destroy(&pl->vec_media);
+    free(recs);
     
     return err;
 }
 
-void playlist_destroy(struct playlist *__restrict pl)
-{
-    kfy_destroy(&pl->kfy);
-    tag_reader_destroy(&pl->tag_reader);
-    vector_destroy(&pl->vec_media);
-    
-    climpd_log_i(tag, "destroyed\n");
-}
-
-void playlist_clear(struct playlist *__restrict pl)
+static int serialize_text(struct playlist *__restrict pl, 
+                          struct playlist_image *__restrict img)
 {
-    unsigned int size = kfy_size(&pl->kfy);
+    unsigned int n = vector_size(&pl->vec_media);
+    size_t size = 0, len;
+    char *text, *p;
     
-    assert(size == vector_size(&pl->vec_media) && "INVALID SIZE");
-    
-    kfy_remove(&pl->kfy, size);
-    vector_clear(&pl->vec_media);
-    
-    pl->index = (unsigned int) -1;
-}
-
-int playlist_add_media(struct playlist *__restrict pl, struct media *m)
-{
-    int err;
+    /* one uri per line, built in a single buffer instead of a write each */
+    for (unsigned int i = 0; i < n; ++i)
+        size += strlen(media_uri(*vector_at(&pl->vec_media, i))) + 1;
     
-    if (!media_is_parsed(m))
-        tag_reader_read_async(&pl->tag_reader, m);
+    text = malloc(size + 1);
+    if (!text)
+        return -errno;
     
-    media_ref(m);
+    p = text;
     
-    err = vector_insert_back(&pl->vec_media, m);
-    if (err < 0) {
-        const char *uri = media_uri(m);
-        
-        climpd_log_e(tag, "failed to add '%s' - %s\n", uri, strerr(-err));
-        
-        media_unref(m);
+    for (unsigned int i = 0; i < n; ++i) {
+        const char *uri = media_uri(*vector_at(&pl->vec_media, i));
         
-        return err;
+        len = strlen(uri);
+        memcpy(p, uri, len);
+        p[len] = '\n';
+        p += len + 1;
     }
     
-    err = kfy_add(&pl->kfy, 1);
-    if (err < 0) {
-        climpd_log_e(tag, "failed to adjust track shuffler - %s\n", 
-                     strerr(-err));
-        
-        vector_take_back(&pl->vec_media);
-        media_unref(m);
-        return err;
-    }
+    img->iov[0].iov_base = text;
+    img->iov[0].iov_len  = size;
+    img->iovcnt          = 1;
     
-    assert(kfy_size(&pl->kfy) == vector_size(&pl->vec_media) && "INVALID SIZE");
+    img->data[0] = text;
     
     return 0;
 }
 
-int playlist_add(struct playlist *__restrict pl, const char *__restrict path)
+/* Serializes 'pl' in the format that the suffix of 'path' asks for */
+static int playlist_serialize(struct playlist *__restrict pl, 
+                              const char *__restrict path,
+                              struct playlist_image **img)
 {
-    struct media *m;
+    const char *p = strrchr(path, '.');
     int err;
     
-    m = media_new(path);
-    if (!m) {
+    *img = playlist_image_new(path, pl->sync);
+    if (!*img) {
         err = -errno;
-        climpd_log_e(tag, "failed to create media '%s' - %s\n", path, errstr);
-        return err;
+        goto fail;
     }
     
-    err = playlist_add_media(pl, m);
-    media_unref(m);
+    if (p && strcmp(p, PLAYLIST_BINARY_SUFFIX) == 0)
+        err = serialize_binary(pl, *img);
+    else
+        err = serialize_text(pl, *img);
     
+    if (err < 0) {
+        playlist_image_delete(*img);
+        goto fail;
+    }
+    
+    return 0;
+
+fail:
+    climpd_log_e(tag, "failed to save as '%s' - %s\n", path, strerr(-err));
     return err;
 }
 
-int playlist_load(struct playlist *__restrict pl, const char *__restrict path)
+static gboolean report_save_error(void *data)
 {
-    FILE *file;
+    struct playlist *pl = data;
     int err;
     
-    file = fopen(path, "r");
-    if (!file) {
-        err = -errno;
-        climpd_log_e(tag, "failed to open/load '%s' - %s\n", path, errstr);
-        return err;
-    }
+    err = g_atomic_int_get(&pl->save_error);
+    g_atomic_int_set(&pl->save_error, 0);
     
-    err = playlist_load_file(pl, file);
+    if (pl->on_save_error)
+        pl->on_save_error(pl, err, pl->on_save_error_data);
     
-    fclose(file);
+    return false;
+}
+
+static void write_image(void *data, void *arg)
+{
+    struct playlist *pl = arg;
+    int err;
     
-    if (err < 0)
-        return err;
+    err = playlist_image_write(data);
+    playlist_image_delete(data);
     
-    climpd_log_i(tag, "loaded '%s'\n", path);
-
-    return 0;
+    /* 
+     * The caller of playlist_save_async() has long moved on, so failures 
+     * are handed to the main loop. A report still pending covers this one.
+     */
+    if (err < 0 && g_atomic_int_compare_and_exchange(&pl->save_error, 0, err))
+        g_idle_add(&report_save_error, pl);
 }
 
-int playlist_load_fd(struct playlist *__restrict pl, int fd)
+int playlist_save(struct playlist *__restrict pl, const char *__restrict path)
 {
-    FILE *file;
-    int fd_dup, err;
+    struct playlist_image *img;
+    int err;
     
-    /* 'avoid that 'fclose' closes the passed file descriptor */
+    /* a pending background save must not replace this one afterwards */
+    playlist_flush_writer(pl);
     
-    fd_dup = dup(fd);
-    if (fd_dup < 0) {
-        err = -errno;
-        climpd_log_e(tag, "failed to duplicate file descriptor - %s\n", errstr);
+    err = playlist_serialize(pl, path, &img);
+    if (err < 0)
         return err;
-    }
     
-    file = fdopen(fd_dup, "r");
-    if (!file) {
-        err = -errno;
-        climpd_log_e(tag, "failed to open file descriptor '%d' - %s\n",
-                     fd, errstr);
-        close(fd_dup);
-        return err;
-    }
+    err = playlist_image_write(img);
+    playlist_image_delete(img);
     
-    err = playlist_load_file(pl, file);
+    return err;
+}
+
+/*
+ * Like playlist_save(), but only the serialization happens on the calling
+ * thread. Writing and syncing the file is left to the background writer, 
+ * which handles all saves in order.
+ */
+int playlist_save_async(struct playlist *__restrict pl, 
+                        const char *__restrict path)
+{
+    struct playlist_image *img;
+    GError *error = NULL;
+    int err;
     
-    fclose(file);
+    if (!pl->writer) {
+        pl->writer = g_thread_pool_new(&write_image, pl, 1, false, &error);
+        if (!pl->writer) {
+            climpd_log_w(tag, "failed to start background writer - %s\n", 
+                         error->message);
+            g_error_free(error);
+            return playlist_save(pl, path);
+        }
+    }
     
+    err = playlist_serialize(pl, path, &img);
     if (err < 0)
         return err;
     
-    climpd_log_i(tag, "loaded playlist from file descriptor '%d'\n", fd);
+    if (!g_thread_pool_push(pl->writer, img, &error)) {
+        climpd_log_w(tag, "failed to hand '%s' to background writer - %s\n",
+                     path, error->message);
+        g_error_free(error);
+        
+        playlist_flush_writer(pl);
+        
+        err = playlist_image_write(img);
+        playlist_image_delete(img);
+        return err;
+    }
     
     return 0;
 }
 
-int playlist_save(struct playlist *__restrict pl, const char *__restrict path)
+void playlist_set_sync(struct playlist *__restrict pl, enum file_sync sync)
 {
-    unsigned int size;
-    int fd;
-    
-    fd = open(path, O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC, 0644);
-    if (fd < 0) {
-        fd = -errno;
-        climpd_log_e(tag, "failed to save as '%s' - %s\n", path, errstr);
-        return fd;
+    pl->sync = sync;
+}
+
+unsigned int playlist_index_of(struct playlist *__restrict pl, 
+                               const char *__restrict path)
+{
+    char rpath[PATH_MAX];
+    void *data;
+    
+    /* 
+     * Look up the same canonical form 'media_path()' returns, absolute
+     * paths may contain symlinks and '..' as well, see uri_new(). A file
+     * which is gone can't be resolved anymore, but its full path still works.
+     */
+    if (uri_ok(path)) {
+        path = uri_hierarchical(path);
+    } else if (realpath(path, rpath)) {
+        path = rpath;
+    } else if (!path_is_absolute(path)) {
+        return (unsigned int) -1;
     }
     
-    size = vector_size(&pl->vec_media);
-    
-    for (unsigned int i = 0; i < size; ++i)
-            dprintf(fd, "%s\n", media_uri(*vector_at(&pl->vec_media, i)));
+    if (!path || path_index_update(pl) < 0)
+        return (unsigned int) -1;
     
-    close(fd);
+    data = map_retrieve(&pl->path_index, path);
     
-    return 0;
+    return (data) ? position_unpack(data) : (unsigned int) -1;
 }
 
-unsigned int playlist_index_of(struct playlist *__restrict pl, 
-                               const char *__restrict path)
+bool playlist_contains(struct playlist *__restrict pl, 
+                       const char *__restrict path)
 {
-    unsigned int size = vector_size(&pl->vec_media);
+    return playlist_index_of(pl, path) != (unsigned int) -1;
+}
+
+/* Reads the tags of the track at 'path' again, e.g. after it was modified */
+bool playlist_refresh(struct playlist *__restrict pl, 
+                      const char *__restrict path)
+{
+    unsigned int i;
+    struct media *m;
     
-    for (unsigned int i = 0; i < size; ++i) {
-        struct media *m = *vector_at(&pl->vec_media, i);
-        
-        if (media_path_compare(m, path))
-            return i;
-    }
+    i = playlist_index_of(pl, path);
+    if (i == (unsigned int) -1)
+        return false;
     
-    return (unsigned int) -1;
+    m = *vector_at(&pl->vec_media, i);
+    
+    media_set_parsed(m, false);
+    tag_reader_read_async(&pl->tag_reader, m);
+    
+    return true;
 }
 
 void playlist_remove(struct playlist *__restrict pl, int index)
@@ -344,10 +1499,24 @@ void playlist_remove(struct playlist *__restrict pl, int index)
     unsigned int i = ensure_positiv_index(pl, index);
     
     if (i < playlist_size(pl)) {
-        struct media *m = vector_take_at(&pl->vec_media, i);
+        struct media *m;
+        
+        path_index_remove(pl, i);
+        
+        m = vector_take_at(&pl->vec_media, i);
         media_unref(m);
         
-        kfy_remove(&pl->kfy, 1);
+        kfy_remove(&pl->kfy, i);
+        
+        /* 
+         * Keep the index on the current track. If the current track itself
+         * is removed, the index moves to its predecessor, so the next
+         * track is still the one that followed the removed one.
+         */
+        if (pl->index != (unsigned int) -1 && i <= pl->index)
+            pl->index -= 1;
+        
+        invalidate_next(pl);
     }
     
     assert(kfy_size(&pl->kfy) == vector_size(&pl->vec_media) && "INVALID SIZE");
@@ -357,20 +1526,106 @@ void playlist_remove_array(struct playlist *__restrict pl,
                            int *__restrict indices,
                            unsigned int size)
 {
+    unsigned int *pos = (unsigned int *) indices;
+    unsigned int n, r, w, k, removed, before;
+    bool removed_current;
+    
     if (size == 0 || vector_empty(&pl->vec_media))
         return;
     
     for (unsigned int i = 0; i < size; ++i)
-        indices[i] = ensure_positiv_index(pl, indices[i]);
+        pos[i] = ensure_positiv_index(pl, indices[i]);
+    
+    if (size == 1) {
+        playlist_remove(pl, (int) pos[0]);
+        return;
+    }
+    
+    qsort(pos, size, sizeof(*pos), &ascending_index_comparator);
+    
+    n = vector_size(&pl->vec_media);
+    k = 0;
+    removed = 0;
+    before = 0;
+    removed_current = false;
     
-    qsort(indices, size, sizeof(*indices), &descending_integer_comparator);
+    /* 
+     * Move every remaining track to its final position in a single pass,
+     * instead of shifting the tail of the vector once per removed track.
+     */
+    for (r = pos[0], w = pos[0]; r < n; ++r) {
+        struct media *m = *vector_at(&pl->vec_media, r);
+        
+        if (k < size && pos[k] == r) {
+            /* skip duplicate indices */
+            while (k < size && pos[k] == r)
+                ++k;
+            
+            if (r < pl->index)
+                before += 1;
+            else if (r == pl->index)
+                removed_current = true;
+            
+            media_unref(m);
+            removed += 1;
+            continue;
+        }
+        
+        *vector_at(&pl->vec_media, w++) = m;
+    }
+    
+    /* the tail only holds stale copies of already moved tracks */
+    for (unsigned int i = 0; i < removed; ++i)
+        vector_take_back(&pl->vec_media);
+    
+    /* walk backwards, so the remaining indices stay valid */
+    for (unsigned int i = size; i-- > 0;) {
+        if (pos[i] < n && (i == 0 || pos[i - 1] != pos[i]))
+            kfy_remove(&pl->kfy, pos[i]);
+    }
+    
+    path_index_reset(pl);
+    
+    /* see playlist_remove() */
+    if (pl->index != (unsigned int) -1)
+        pl->index -= before + removed_current;
+    
+    invalidate_next(pl);
     
-    playlist_remove(pl, indices[0]);
+    assert(kfy_size(&pl->kfy) == vector_size(&pl->vec_media) && "INVALID SIZE");
+}
+
+/* 
+ * Removes the tracks of the file at 'path' or of any file below it, e.g. 
+ * after they vanished from disk. 'path' has to be canonical already, 
+ * since realpath() does not work on files which are gone.
+ */
+unsigned int playlist_remove_path(struct playlist *__restrict pl, 
+                                  const char *__restrict path)
+{
+    unsigned int size = vector_size(&pl->vec_media);
+    size_t len = strlen(path);
+    unsigned int n = 0;
+    int *indices;
+    
+    indices = malloc(size * sizeof(*indices) + 1);
+    if (!indices) {
+        climpd_log_e(tag, "failed to remove '%s' - %s\n", path, errstr);
+        return 0;
+    }
     
-    for (unsigned int i = 1; i < size; ++i) {
-        if (indices[i - 1] != indices[i])
-            playlist_remove(pl, indices[i]);
+    for (unsigned int i = 0; i < size; ++i) {
+        const char *p = path_at(pl, i);
+        
+        if (strncmp(p, path, len) == 0 && (p[len] == '/' || !p[len]))
+            indices[n++] = (int) i;
     }
+    
+    playlist_remove_array(pl, indices, n);
+    
+    free(indices);
+    
+    return n;
 }
 
 unsigned int playlist_index(const struct playlist *__restrict pl)
@@ -381,6 +1636,16 @@ unsigned int playlist_index(const struct playlist *__restrict pl)
 void playlist_set_index(struct playlist *__restrict pl, int index)
 {
     pl->index = ensure_positiv_index(pl, index);
+    
+    /* 
+     * A track picked by hand counts as played in the current shuffle cycle.
+     * The audio player also sets the index playlist_next() just committed,
+     * so a done cycle must not be reset here, playlist_next() does that.
+     */
+    if (pl->shuffle && pl->index < kfy_size(&pl->kfy))
+        kfy_set_played(&pl->kfy, pl->index);
+    
+    invalidate_next(pl);
 }
 
 struct media *playlist_at(struct playlist *__restrict pl, int index)
@@ -402,7 +1667,12 @@ struct media *playlist_at_unsafe(struct playlist *__restrict pl, int index)
 
 void playlist_set_shuffle(struct playlist *__restrict pl, bool shuffle)
 {
+    bool changed = pl->shuffle != shuffle;
+    
     pl->shuffle = shuffle;
+    
+    if (changed)
+        invalidate_next(pl);
 }
 
 bool playlist_shuffle(const struct playlist *__restrict pl)
@@ -412,7 +1682,12 @@ bool playlist_shuffle(const struct playlist *__restrict pl)
 
 void playlist_set_repeat(struct playlist *__restrict pl, bool repeat)
 {
+    bool changed = pl->repeat != repeat;
+    
     pl->repeat = repeat;
+    
+    if (changed)
+        invalidate_next(pl);
 }
 
 bool playlist_repeat(const struct playlist *__restrict pl)
@@ -422,34 +1697,43 @@ bool playlist_repeat(const struct playlist *__restrict pl)
 
 unsigned int playlist_next(struct playlist *__restrict pl)
 {
+    unsigned int next;
+    
     if (vector_empty(&pl->vec_media))
         return (unsigned int) -1;
     
+    next = playlist_peek_next(pl);
+    
+    /* the caller acts on 'next' itself, so there is nobody to notify */
+    pl->next_valid = false;
+    
     if (pl->shuffle) {
-        if (kfy_cycle_done(&pl->kfy) && !pl->repeat) {
+        /* a finished cycle keeps the last played track as current one */
+        if (next == (unsigned int) -1) {
             kfy_reset(&pl->kfy);
-            return (unsigned int) -1;
+            return next;
         }
         
-        pl->index = kfy_shuffle(&pl->kfy);
-        
-        assert(pl->index < playlist_size(pl) && "invalid playlist index");
-        
-        return pl->index;
+        kfy_commit(&pl->kfy, next);
     }
     
-    ++pl->index;
+    pl->index = next;
     
-    if (pl->index >= vector_size(&pl->vec_media)) {
-        if (!pl->repeat) {
-            pl->index = (unsigned int) -1;
-            return pl->index;
-        }
-        
-        pl->index = 0;
+    return next;
+}
+
+unsigned int playlist_peek_next(struct playlist *__restrict pl)
+{
+    /* 
+     * Remember the result, otherwise a shuffled playlist would 
+     * return a different track on the subsequent call to playlist_next()
+     */
+    if (!pl->next_valid) {
+        pl->next = advance(pl);
+        pl->next_valid = true;
     }
     
-    return pl->index;
+    return pl->next;
 }
 
 unsigned int playlist_size(const struct playlist *__restrict pl)
@@ -466,6 +1750,22 @@ void playlist_sort(struct playlist *__restrict pl)
 {
     vector_sort(&pl->vec_media);
     kfy_reset(&pl->kfy);
+    path_index_reset(pl);
     
     pl->index = (unsigned int) -1;
+    invalidate_next(pl);
+}
+
+void playlist_set_next_change_handler(struct playlist *__restrict pl,
+                                      next_change_callback func)
+{
+    pl->on_next_change = func;
+}
+
+void playlist_set_save_error_handler(struct playlist *__restrict pl,
+                                     save_error_callback func,
+                                     void *data)
+{
+    pl->on_save_error      = func;
+    pl->on_save_error_data = data;
 }
\ No newline at end of file
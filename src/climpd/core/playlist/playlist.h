@@ -22,25 +22,59 @@
 #define _PLAYLIST_H_
 
 #include <libvci/vector.h>
+#include <libvci/map.h>
 
 #include <core/playlist/kfy.h>
 #include <core/playlist/tag-reader.h>
 #include <media/media.h>
+#include <util/atomic-file.h>
+
+/* playlists saved with this suffix use the compact binary format */
+#define PLAYLIST_BINARY_SUFFIX ".clpl"
+
+struct playlist;
+
+typedef void (*next_change_callback)(struct playlist *);
+typedef void (*save_error_callback)(struct playlist *, int, void *);
 
 struct playlist {
     struct vector vec_media;
+    struct map path_index;
+    unsigned int path_indexed;
     struct tag_reader tag_reader;
+    struct string_pool *strings;
     struct kfy kfy;
     
+    GThreadPool *writer;
+    enum file_sync sync;
+    gint save_error;
+    
     unsigned int index;
+    unsigned int next;
+    bool next_valid;
     bool repeat;
     bool shuffle;
+    
+    /* called whenever a previously peeked next track is no longer valid */
+    next_change_callback on_next_change;
+    
+    /* called from the main loop when a background save failed */
+    save_error_callback on_save_error;
+    void *on_save_error_data;
 };
 
 int playlist_init(struct playlist *__restrict pl);
 
 void playlist_destroy(struct playlist *__restrict pl);
 
+int playlist_enable_tag_cache(struct playlist *__restrict pl, 
+                              const char *__restrict path);
+
+struct tag_reader *playlist_tag_reader(struct playlist *__restrict pl);
+
+void playlist_set_max_discoverers(struct playlist *__restrict pl, 
+                                  unsigned int max);
+
 void playlist_clear(struct playlist *__restrict pl);
 
 int playlist_add_media(struct playlist *__restrict pl, struct media *m);
@@ -53,15 +87,29 @@ int playlist_load_fd(struct playlist *__restrict pl, int fd);
 
 int playlist_save(struct playlist *__restrict pl, const char *__restrict path);
 
+int playlist_save_async(struct playlist *__restrict pl, 
+                        const char *__restrict path);
+
+void playlist_set_sync(struct playlist *__restrict pl, enum file_sync sync);
+
 unsigned int playlist_index_of(struct playlist *__restrict pl, 
                                const char *__restrict path);
 
+bool playlist_contains(struct playlist *__restrict pl, 
+                       const char *__restrict path);
+
+bool playlist_refresh(struct playlist *__restrict pl, 
+                      const char *__restrict path);
+
 void playlist_remove(struct playlist *__restrict pl, int index);
 
 void playlist_remove_array(struct playlist *__restrict pl, 
                            int *__restrict indices,
                            unsigned int size);
 
+unsigned int playlist_remove_path(struct playlist *__restrict pl, 
+                                  const char *__restrict path);
+
 unsigned int playlist_index(const struct playlist *__restrict pl);
 
 void playlist_set_index(struct playlist *__restrict pl, int index);
@@ -80,10 +128,19 @@ bool playlist_repeat(const struct playlist *__restrict pl);
 
 unsigned int playlist_next(struct playlist *__restrict pl);
 
+unsigned int playlist_peek_next(struct playlist *__restrict pl);
+
 unsigned int playlist_size(const struct playlist *__restrict pl);
 
 bool playlist_empty(const struct playlist *__restrict pl);
 
 void playlist_sort(struct playlist *__restrict pl);
 
+void playlist_set_next_change_handler(struct playlist *__restrict pl,
+                                      next_change_callback func);
+
+void playlist_set_save_error_handler(struct playlist *__restrict pl,
+                                     save_error_callback func,
+                                     void *data);
+
 #endif /* _PLAYLIST_H_ */
\ No newline at end of file
@@ -0,0 +1,295 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <libvci/error.h>
+
+#include <core/climpd-log.h>
+#include <core/playlist/tag-cache.h>
+
+#include <media/uri.h>
+
+#define TAG_CACHE_MAGIC         0x434d4c43u
+#define TAG_CACHE_VERSION       1
+
+/* 'head.size' to 'seekable' are laid out exactly like before the file index */
+struct tag_cache_record {
+    struct file_record head;
+    uint32_t duration;
+    uint64_t mtime;
+    uint64_t file_size;
+    uint32_t track;
+    uint32_t seekable;
+    char data[];
+};
+
+static const char *tag = "tag-cache";
+
+static struct tag_cache_record *record_new(struct tag_cache *__restrict tc,
+                                           const char *__restrict uri,
+                                           const struct media_info *info,
+                                           const struct stat *__restrict st)
+{
+    const char *strings[] = { uri, info->title, info->artist, info->album };
+    struct tag_cache_record *rec;
+    
+    rec = file_record_new(&tc->index, strings);
+    if (!rec)
+        return NULL;
+    
+    rec->duration  = info->duration;
+    rec->mtime     = file_index_mtime(st);
+    rec->file_size = st->st_size;
+    rec->track     = info->track;
+    rec->seekable  = info->seekable;
+    
+    return rec;
+}
+
+static void copy_meta_element(struct string_pool *__restrict strings,
+                              struct media *__restrict m,
+                              enum media_string field,
+                              const char *__restrict src)
+{
+    src = string_pool_intern(strings, src);
+    if (src)
+        media_set_string(m, field, src);
+}
+
+static int make_parent_dirs(const char *__restrict path)
+{
+    char *dup, *p;
+    int err = 0;
+    
+    dup = strdup(path);
+    if (!dup)
+        return -errno;
+    
+    for (p = strchr(dup + 1, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        
+        err = mkdir(dup, 0755);
+        if (err < 0 && errno != EEXIST) {
+            err = -errno;
+            break;
+        }
+        
+        err = 0;
+        *p = '/';
+    }
+    
+    free(dup);
+    
+    return err;
+}
+
+int tag_cache_init(struct tag_cache *__restrict tc, const char *__restrict path)
+{
+    int err;
+    
+    memset(tc, 0, sizeof(*tc));
+    
+    err = file_index_init(&tc->index, path, TAG_CACHE_MAGIC, TAG_CACHE_VERSION,
+                          offsetof(struct tag_cache_record, data));
+    if (err < 0) {
+        climpd_log_e(tag, "failed to initialize index - %s\n", strerr(-err));
+        return err;
+    }
+    
+    err = vector_init(&tc->vec_records, 0);
+    if (err < 0) {
+        climpd_log_e(tag, "failed to initialize vector - %s\n", strerr(-err));
+        goto cleanup1;
+    }
+    
+    vector_set_data_delete(&tc->vec_records, &free);
+    
+    err = file_index_load(&tc->index);
+    if (err == -EBADMSG) {
+        climpd_log_w(tag, "'%s' is invalid - discarding cached tags\n", path);
+    } else if (err < 0) {
+        climpd_log_e(tag, "failed to load '%s' - %s\n", path, strerr(-err));
+        goto cleanup2;
+    }
+    
+    climpd_log_i(tag, "initialized with '%s'\n", path);
+    
+    return 0;
+
+cleanup2:
+    vector_destroy(&tc->vec_records);
+cleanup1:
+    file_index_destroy(&tc->index);
+    
+    return err;
+}
+
+void tag_cache_destroy(struct tag_cache *__restrict tc)
+{
+    int err;
+    
+    err = tag_cache_save(tc);
+    if (err < 0)
+        climpd_log_w(tag, "failed to save '%s' - %s\n", tc->index.path, 
+                     strerr(-err));
+    
+    climpd_log_i(tag, "%u hits, %u misses\n", tc->hits, tc->misses);
+    
+    /* the index still points into the records */
+    file_index_destroy(&tc->index);
+    vector_destroy(&tc->vec_records);
+    
+    climpd_log_i(tag, "destroyed\n");
+}
+
+int tag_cache_save(struct tag_cache *__restrict tc)
+{
+    const struct file_record *rec;
+    struct file_index_writer w;
+    unsigned int size;
+    int err;
+    
+    if (!tc->dirty)
+        return 0;
+    
+    err = make_parent_dirs(tc->index.path);
+    if (err < 0)
+        return err;
+    
+    err = file_index_writer_open(&w, &tc->index);
+    if (err < 0)
+        return err;
+    
+    /* records of the old file which are still up to date */
+    for (rec = file_index_next_mapped(&tc->index, NULL); rec; 
+         rec = file_index_next_mapped(&tc->index, rec)) {
+        if (file_index_is_current(&tc->index, rec))
+            file_index_writer_append(&w, rec);
+    }
+    
+    size = vector_size(&tc->vec_records);
+    
+    for (unsigned int i = 0; i < size; ++i) {
+        const struct tag_cache_record *r = *vector_at(&tc->vec_records, i);
+        
+        if (file_index_is_current(&tc->index, &r->head))
+            file_index_writer_append(&w, &r->head);
+    }
+    
+    err = file_index_writer_commit(&w, &tc->index);
+    if (err < 0)
+        return err;
+    
+    tc->dirty = false;
+    
+    climpd_log_i(tag, "saved %u entries to '%s'\n", (unsigned int) w.size, 
+                 tc->index.path);
+    
+    return 0;
+}
+
+bool tag_cache_lookup(struct tag_cache *__restrict tc, struct media *m,
+                      struct string_pool *__restrict strings)
+{
+    const struct tag_cache_record *rec;
+    struct media_info *info;
+    struct stat st;
+    const char *s;
+    int err;
+    
+    if (!uri_is_file(media_uri(m)))
+        return false;
+    
+    rec = (const void *) file_index_lookup(&tc->index, media_uri(m));
+    if (!rec)
+        goto miss;
+    
+    err = stat(media_path(m), &st);
+    if (err < 0)
+        goto miss;
+    
+    if (rec->mtime != file_index_mtime(&st) || 
+        rec->file_size != (uint64_t) st.st_size)
+        goto miss;
+    
+    info = media_info(m);
+    
+    s = file_record_string(&tc->index, &rec->head, 1);
+    copy_meta_element(strings, m, MEDIA_TITLE, s);
+    
+    s = file_record_string(&tc->index, &rec->head, 2);
+    copy_meta_element(strings, m, MEDIA_ARTIST, s);
+    
+    s = file_record_string(&tc->index, &rec->head, 3);
+    copy_meta_element(strings, m, MEDIA_ALBUM, s);
+    
+    info->track    = rec->track;
+    info->duration = rec->duration;
+    info->seekable = rec->seekable;
+    
+    media_set_parsed(m, true);
+    
+    tc->hits += 1;
+    
+    return true;
+    
+miss:
+    tc->misses += 1;
+    return false;
+}
+
+int tag_cache_store(struct tag_cache *__restrict tc, struct media *m)
+{
+    struct tag_cache_record *rec;
+    struct stat st;
+    int err;
+    
+    if (!uri_is_file(media_uri(m)))
+        return 0;
+    
+    err = stat(media_path(m), &st);
+    if (err < 0)
+        return -errno;
+    
+    rec = record_new(tc, media_uri(m), media_info(m), &st);
+    if (!rec)
+        return -errno;
+    
+    err = vector_insert_back(&tc->vec_records, rec);
+    if (err < 0) {
+        free(rec);
+        return err;
+    }
+    
+    err = file_index_put(&tc->index, &rec->head);
+    if (err < 0)
+        return err;
+    
+    tc->dirty = true;
+    
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TAG_CACHE_H_
+#define _TAG_CACHE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <libvci/vector.h>
+
+#include <file-index.h>
+#include <media/media.h>
+#include <util/string-pool.h>
+
+/*
+ * Persistent cache for the meta data of local media files. The cache file
+ * gets memory mapped on startup and its records are looked up by uri.
+ * A record is only used if the size and modification time of the file
+ * still match, otherwise the file needs to be discovered again.
+ */
+struct tag_cache {
+    struct file_index index;
+    struct vector vec_records;
+    
+    unsigned int hits;
+    unsigned int misses;
+    bool dirty;
+};
+
+int tag_cache_init(struct tag_cache *__restrict tc, const char *__restrict path);
+
+void tag_cache_destroy(struct tag_cache *__restrict tc);
+
+int tag_cache_save(struct tag_cache *__restrict tc);
+
+bool tag_cache_lookup(struct tag_cache *__restrict tc, struct media *m,
+                      struct string_pool *__restrict strings);
+
+int tag_cache_store(struct tag_cache *__restrict tc, struct media *m);
+
+#endif /* _TAG_CACHE_H_ */
\ No newline at end of file
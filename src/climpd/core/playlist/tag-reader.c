@@ -19,10 +19,10 @@
  */
 
 #include <string.h>
+#include <unistd.h>
 #include <errno.h>
 
-#include <libvci/compare.h>
-#include <libvci/hash.h>
+#include <libvci/macro.h>
 #include <libvci/error.h>
 
 #include <core/climpd-log.h>
@@ -54,11 +54,30 @@ void handle_missing_plugins(GstDiscovererInfo *info)
     climpd_log_append("\n");
 }
 
+struct parse_context {
+    struct string_pool *strings;
+    struct media *media;
+};
+
+static void parse_string(struct parse_context *__restrict ctx, 
+                         enum media_string field,
+                         const GValue *val)
+{
+    const char *s = g_value_get_string(val);
+    
+    if (!s)
+        return;
+    
+    s = string_pool_intern(ctx->strings, s);
+    if (s)
+        media_set_string(ctx->media, field, s);
+}
+
 static void parse_tags(const GstTagList *list, const gchar *tag, void *data)
 {
-    struct media_info *m_info = data;
+    struct parse_context *ctx = data;
+    struct media_info *m_info = media_info(ctx->media);
     const GValue *val;
-    const char *s;
     int i, num;
     
     num = gst_tag_list_get_tag_size(list, tag);
@@ -67,20 +86,11 @@ static void parse_tags(const GstTagList *list, const gchar *tag, void *data)
         val = gst_tag_list_get_value_index(list, tag, i);
         
         if(strcmp(GST_TAG_TITLE, tag) == 0) {
-            s = g_value_get_string(val);
-            strncpy(m_info->title, s, MEDIA_META_ELEMENT_SIZE);
-            
-            m_info->title[MEDIA_META_ELEMENT_SIZE - 1] = '\0';
+            parse_string(ctx, MEDIA_TITLE, val);
         } else if(strcmp(GST_TAG_ALBUM, tag) == 0) {
-            s = g_value_get_string(val);
-            strncpy(m_info->album, s, MEDIA_META_ELEMENT_SIZE);
-            
-            m_info->album[MEDIA_META_ELEMENT_SIZE - 1] = '\0';
+            parse_string(ctx, MEDIA_ALBUM, val);
         } else if(strcmp(GST_TAG_ARTIST, tag) == 0) {
-            s = g_value_get_string(val);
-            strncpy(m_info->artist, s, MEDIA_META_ELEMENT_SIZE);
-            
-            m_info->artist[MEDIA_META_ELEMENT_SIZE - 1] = '\0';
+            parse_string(ctx, MEDIA_ARTIST, val);
         } else if(strcmp(GST_TAG_TRACK_NUMBER, tag) == 0) {
             m_info->track = g_value_get_uint(val);
             
@@ -88,8 +98,11 @@ static void parse_tags(const GstTagList *list, const gchar *tag, void *data)
     }
 }
 
-static void parse_info(GstDiscovererInfo *info, struct media *__restrict m)
+static void parse_info(struct tag_reader *__restrict tr, 
+                       GstDiscovererInfo *info, 
+                       struct media *__restrict m)
 {
+    struct parse_context ctx;
     const GstTagList *tags;
     struct media_info *m_info;
     
@@ -97,20 +110,57 @@ static void parse_info(GstDiscovererInfo *info, struct media *__restrict m)
     m_info->seekable = gst_discoverer_info_get_seekable(info);
     m_info->duration = gst_discoverer_info_get_duration(info) / 1e9;
     
+    ctx.strings = tr->strings;
+    ctx.media   = m;
+    
     tags = gst_discoverer_info_get_tags(info);
     
     if (tags)
-        gst_tag_list_foreach(tags, &parse_tags, m_info);
+        gst_tag_list_foreach(tags, &parse_tags, &ctx);
     
     media_set_parsed(m, true);
 }
 
+static void tag_reader_dispatch(struct tag_reader *__restrict tr);
+
+static gboolean dispatch_idle(void *data)
+{
+    struct tag_reader *tr = data;
+    
+    tr->dispatch_id = 0;
+    tag_reader_dispatch(tr);
+    
+    return false;
+}
+
+static void schedule_dispatch(struct tag_reader *__restrict tr)
+{
+    /* 
+     * Feeding a discoverer from within its own 'discovered' signal is not
+     * safe, so the next media is handed out from the main loop
+     */
+    if (tr->dispatch_id == 0)
+        tr->dispatch_id = g_idle_add(&dispatch_idle, tr);
+}
+
+static bool tag_reader_idle(struct tag_reader *__restrict tr)
+{
+    return g_queue_is_empty(&tr->queue) && g_queue_is_empty(&tr->background);
+}
+
+static void notify_parsed(struct tag_reader *__restrict tr, struct media *m)
+{
+    if (tr->on_parsed)
+        tr->on_parsed(m, tr->on_parsed_data);
+}
+
 static void on_discovered(GstDiscoverer *disc, 
                           GstDiscovererInfo *info,
                           GError *error,
                           void *data)
 {
-    struct tag_reader *reader = data;
+    struct tag_reader_worker *worker = data;
+    struct tag_reader *reader = worker->reader;
     GstDiscovererResult result;
     struct media *m;
     const char *uri;
@@ -120,10 +170,15 @@ static void on_discovered(GstDiscoverer *disc,
     result = gst_discoverer_info_get_result(info);
     uri = gst_discoverer_info_get_uri(info);
     
-    m = map_take(&reader->media_map, uri);
+    /* every discoverer only works on a single media at once */
+    m = worker->media;
     if (!m)
         return;
     
+    worker->media = NULL;
+    
+    stats_record(reader->stats, worker->start, result != GST_DISCOVERER_OK);
+    
     if (m->parsed)
         goto out;
     
@@ -141,50 +196,33 @@ static void on_discovered(GstDiscoverer *disc,
         goto out;
     }
     
-    parse_info(info, m);
+    parse_info(reader, info, m);
+    
+    if (reader->use_cache) {
+        int err = tag_cache_store(&reader->cache, m);
+        if (err < 0) {
+            climpd_log_w(tag, "failed to cache tags of '%s' - %s\n", uri,
+                         strerr(-err));
+        }
+    }
+    
+    notify_parsed(reader, m);
     
 out:
     media_unref(m);
-}
-
-static void on_start(GstDiscoverer *disc, void *data)
-{
-    struct tag_reader *tr = data;
     
-    (void) disc;
-    (void) tr;
-}
-
-static void on_finished(GstDiscoverer *disc, void *data)
-{
-    struct tag_reader *tr = data;
-    
-    (void) disc;
-    (void) tr;
+    if (!tag_reader_idle(reader))
+        schedule_dispatch(reader);
 }
 
-int tag_reader_init(struct tag_reader *__restrict tr)
+static int worker_init(struct tag_reader_worker *__restrict worker,
+                       struct tag_reader *__restrict tr)
 {
-    const struct map_config conf = {
-        .size        = MAP_DEFAULT_SIZE,
-        .lower_bound = MAP_DEFAULT_LOWER_BOUND,
-        .upper_bound = MAP_DEFAULT_UPPER_BOUND,
-        .static_size = false,
-        .key_compare = &compare_string,
-        .key_hash    = &hash_string,
-        .data_delete = (void (*)(void *)) &media_unref,
-    };
-    GError *error;
+    GError *error = NULL;
     int err;
     
-    err = map_init(&tr->media_map, &conf);
-    if (err < 0) {
-        climpd_log_e(tag, "failed to initialize map - %s\n", strerr(-err));
-        return -err;
-    }
-    
-    tr->disc = gst_discoverer_new(5 * GST_SECOND, &error);
-    if (!tr->disc) {
+    worker->disc = gst_discoverer_new(5 * GST_SECOND, &error);
+    if (!worker->disc) {
         if (error) {
             err = -error->code;
             climpd_log_e(tag, "failed to initialize async discoverer - %s\n",
@@ -195,57 +233,221 @@ int tag_reader_init(struct tag_reader *__restrict tr)
             climpd_log_e(tag, "failed to initialize async discoverer\n");
         }
 
-        map_destroy(&tr->media_map);
         return err;
     }
     
-    g_signal_connect(tr->disc, "discovered", G_CALLBACK(on_discovered), tr);
-    g_signal_connect(tr->disc, "starting", G_CALLBACK(on_start), tr);
-    g_signal_connect(tr->disc, "finished", G_CALLBACK(on_finished), tr);
+    worker->reader = tr;
+    worker->media  = NULL;
+    
+    g_signal_connect(worker->disc, "discovered", G_CALLBACK(on_discovered), 
+                     worker);
+    
+    gst_discoverer_start(worker->disc);
+    
+    return 0;
+}
+
+static void worker_destroy(struct tag_reader_worker *__restrict worker)
+{
+    if (!worker->disc)
+        return;
+    
+    gst_discoverer_stop(worker->disc);
+    g_object_unref(worker->disc);
+    
+    if (worker->media)
+        media_unref(worker->media);
+}
+
+static struct tag_reader_worker *idle_worker(struct tag_reader *__restrict tr)
+{
+    for (unsigned int i = 0; i < tr->max_workers; ++i) {
+        struct tag_reader_worker *worker = tr->workers + i;
+        
+        if (worker->media)
+            continue;
+        
+        /* discoverers are only created once they are needed */
+        if (!worker->disc && worker_init(worker, tr) < 0)
+            return NULL;
+        
+        return worker;
+    }
+    
+    return NULL;
+}
+
+static void tag_reader_dispatch(struct tag_reader *__restrict tr)
+{
+    while (!tag_reader_idle(tr)) {
+        struct tag_reader_worker *worker;
+        struct media *m;
+        const char *uri;
+        bool ok;
+        
+        worker = idle_worker(tr);
+        if (!worker)
+            return;
+        
+        m = g_queue_pop_head(&tr->queue);
+        if (!m)
+            m = g_queue_pop_head(&tr->background);
+        uri = media_uri(m);
+        
+        if (media_is_parsed(m)) {
+            media_unref(m);
+            continue;
+        }
+        
+        worker->media = m;
+        worker->start = stats_begin();
+        
+        ok = gst_discoverer_discover_uri_async(worker->disc, uri);
+        if (!ok) {
+            climpd_log_w(tag, "failed to async read tags for '%s'\n", uri);
+            worker->media = NULL;
+            media_unref(m);
+        }
+    }
+}
+
+static unsigned int default_max_workers(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    
+    if (cpus < 1)
+        return 1;
     
-    gst_discoverer_start(tr->disc);
+    return min((unsigned int) cpus, TAG_READER_MAX_WORKERS);
+}
 
-    climpd_log_i(tag, "initialized\n");
+int tag_reader_init(struct tag_reader *__restrict tr, 
+                    struct string_pool *__restrict strings)
+{
+    int err;
+    
+    memset(tr, 0, sizeof(*tr));
+    
+    g_queue_init(&tr->queue);
+    g_queue_init(&tr->background);
+    
+    tr->max_workers = default_max_workers();
+    tr->strings     = strings;
+    
+    /* make sure discovering media is possible at all */
+    err = worker_init(tr->workers, tr);
+    if (err < 0)
+        return err;
+    
+    climpd_log_i(tag, "initialized with up to %u discoverers\n", 
+                 tr->max_workers);
     
     return 0;
 }
 
 void tag_reader_destroy(struct tag_reader *__restrict tr)
 {
-    gst_discoverer_stop(tr->disc);
+    struct media *m;
+    
+    if (tr->dispatch_id)
+        g_source_remove(tr->dispatch_id);
+    
+    for (unsigned int i = 0; i < TAG_READER_MAX_WORKERS; ++i)
+        worker_destroy(tr->workers + i);
+    
+    while ((m = g_queue_pop_head(&tr->queue)))
+        media_unref(m);
+    
+    while ((m = g_queue_pop_head(&tr->background)))
+        media_unref(m);
     
-    g_object_unref(tr->disc);
-    map_destroy(&tr->media_map);
+    if (tr->use_cache)
+        tag_cache_destroy(&tr->cache);
+    
+    climpd_log_i(tag, "%u distinct meta data strings in %zu bytes\n",
+                 string_pool_size(tr->strings), 
+                 string_pool_bytes(tr->strings));
     
     climpd_log_i(tag, "destroyed\n");
 }
 
-void tag_reader_read_async(struct tag_reader *__restrict tr, struct media *m)
+int tag_reader_enable_cache(struct tag_reader *__restrict tr, 
+                            const char *__restrict path)
 {
-    const char *uri = media_uri(m);
-    bool ok;
     int err;
     
-    if (media_is_parsed(m))
-        return;
-    
-    media_ref(m);
+    if (tr->use_cache)
+        return -EALREADY;
     
-    err = map_insert(&tr->media_map, uri, m);
+    err = tag_cache_init(&tr->cache, path);
     if (err < 0) {
-        climpd_log_w(tag, "failed to async read tags for '%s' - %s\n", uri, 
+        climpd_log_e(tag, "failed to initialize tag cache - %s\n", 
                      strerr(-err));
-        media_unref(m);
-        
-        return;
+        return err;
     }
     
-    ok = gst_discoverer_discover_uri_async(tr->disc, uri);
-    if (!ok) {
-        climpd_log_w(tag, "failed to async read tags for '%s'\n", uri);
-        map_take(&tr->media_map, uri);
-        media_unref(m);
-        
+    tr->use_cache = true;
+    
+    return 0;
+}
+
+void tag_reader_set_max_workers(struct tag_reader *__restrict tr, 
+                                unsigned int max)
+{
+    if (max == 0)
+        max = default_max_workers();
+    
+    tr->max_workers = min(max, TAG_READER_MAX_WORKERS);
+    
+    climpd_log_i(tag, "using up to %u discoverers\n", tr->max_workers);
+    
+    tag_reader_dispatch(tr);
+}
+
+unsigned int tag_reader_max_workers(const struct tag_reader *__restrict tr)
+{
+    return tr->max_workers;
+}
+
+void tag_reader_set_handler(struct tag_reader *__restrict tr, 
+                            tag_reader_handler handler,
+                            void *data)
+{
+    tr->on_parsed      = handler;
+    tr->on_parsed_data = data;
+}
+
+/* Records the duration of every discovery in 'c' */
+void tag_reader_set_stats(struct tag_reader *__restrict tr, 
+                          struct stats_counter *c)
+{
+    tr->stats = c;
+}
+
+static void tag_reader_enqueue(struct tag_reader *__restrict tr, 
+                               GQueue *queue,
+                               struct media *m)
+{
+    if (media_is_parsed(m))
+        return;
+    
+    if (tr->use_cache && tag_cache_lookup(&tr->cache, m, tr->strings)) {
+        notify_parsed(tr, m);
         return;
     }
+    
+    g_queue_push_tail(queue, media_ref(m));
+    
+    tag_reader_dispatch(tr);
+}
+
+void tag_reader_read_async(struct tag_reader *__restrict tr, struct media *m)
+{
+    tag_reader_enqueue(tr, &tr->queue, m);
+}
+
+void tag_reader_read_background(struct tag_reader *__restrict tr, 
+                                struct media *m)
+{
+    tag_reader_enqueue(tr, &tr->background, m);
 }
\ No newline at end of file
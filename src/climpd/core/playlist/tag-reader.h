@@ -24,19 +24,74 @@
 #include <gst/gst.h>
 #include <gst/pbutils/pbutils.h>
 
-#include <libvci/map.h>
-
+#include <core/playlist/tag-cache.h>
+#include <core/stats.h>
 #include <media/media.h>
+#include <util/string-pool.h>
 
-struct tag_reader {
-    struct map media_map;
+#define TAG_READER_MAX_WORKERS 16
+
+struct tag_reader;
+
+typedef void (*tag_reader_handler)(struct media *m, void *data);
+
+struct tag_reader_worker {
+    struct tag_reader *reader;
     GstDiscoverer *disc;
+    struct media *media;
+    gint64 start;
+};
+
+/*
+ * Media waiting for discovery are kept in a queue which is drained 
+ * by up to 'max_workers' discoverers. Each discoverer only works on one 
+ * media at a time, so a slow or dead source only blocks its own worker.
+ * Media in the 'background' queue are only discovered while no other
+ * media are waiting.
+ */
+struct tag_reader {
+    struct tag_reader_worker workers[TAG_READER_MAX_WORKERS];
+    unsigned int max_workers;
+    
+    GQueue queue;
+    GQueue background;
+    guint dispatch_id;
+    
+    tag_reader_handler on_parsed;
+    void *on_parsed_data;
+    
+    struct stats_counter *stats;
+    
+    struct tag_cache cache;
+    bool use_cache;
+    
+    /* backs the meta data strings of all parsed media, owned by the caller */
+    struct string_pool *strings;
 };
 
-int tag_reader_init(struct tag_reader* tr);
+int tag_reader_init(struct tag_reader *__restrict tr, 
+                    struct string_pool *__restrict strings);
 
 void tag_reader_destroy(struct tag_reader *__restrict tr);
 
+int tag_reader_enable_cache(struct tag_reader *__restrict tr, 
+                            const char *__restrict path);
+
+void tag_reader_set_max_workers(struct tag_reader *__restrict tr, 
+                                unsigned int max);
+
+unsigned int tag_reader_max_workers(const struct tag_reader *__restrict tr);
+
+void tag_reader_set_handler(struct tag_reader *__restrict tr, 
+                            tag_reader_handler handler,
+                            void *data);
+
+void tag_reader_set_stats(struct tag_reader *__restrict tr, 
+                          struct stats_counter *c);
+
 void tag_reader_read_async(struct tag_reader *__restrict tr, struct media *m);
 
+void tag_reader_read_background(struct tag_reader *__restrict tr, 
+                                struct media *m);
+
 #endif /* _TAG_READER_H_ */
\ No newline at end of file
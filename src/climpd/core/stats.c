@@ -0,0 +1,219 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <libvci/error.h>
+
+#include <core/climpd-log.h>
+#include <core/stats.h>
+
+static const char *tag = "stats";
+
+static gboolean log_timeout(void *data)
+{
+    stats_log(data);
+    
+    return true;
+}
+
+int stats_init(struct stats *__restrict s)
+{
+    int err;
+    
+    err = vector_init(&s->counters, 64);
+    if (err < 0) {
+        climpd_log_e(tag, "failed to initialize - %s\n", strerr(-err));
+        return err;
+    }
+    
+    vector_set_data_delete(&s->counters, &free);
+    
+    s->since        = g_get_real_time();
+    s->log_interval = 0;
+    s->timeout_id   = 0;
+    
+    climpd_log_i(tag, "initialized\n");
+    
+    return 0;
+}
+
+void stats_destroy(struct stats *__restrict s)
+{
+    if (s->timeout_id)
+        g_source_remove(s->timeout_id);
+    
+    vector_destroy(&s->counters);
+    
+    climpd_log_i(tag, "destroyed\n");
+}
+
+/* The returned counter is owned by 's', NULL is returned on failure */
+struct stats_counter *stats_register(struct stats *__restrict s,
+                                     const char *group,
+                                     const char *name)
+{
+    struct stats_counter *c;
+    int err;
+    
+    c = calloc(1, sizeof(*c));
+    if (!c) {
+        climpd_log_w(tag, "failed to register '%s/%s' - %s\n", group, name,
+                     errstr);
+        return NULL;
+    }
+    
+    c->group = group;
+    c->name  = name;
+    
+    err = vector_insert_back(&s->counters, c);
+    if (err < 0) {
+        climpd_log_w(tag, "failed to register '%s/%s' - %s\n", group, name,
+                     strerr(-err));
+        free(c);
+        return NULL;
+    }
+    
+    return c;
+}
+
+void stats_reset(struct stats *__restrict s)
+{
+    unsigned int size = vector_size(&s->counters);
+    
+    for (unsigned int i = 0; i < size; ++i) {
+        struct stats_counter *c = *vector_at(&s->counters, i);
+    
+        c->calls  = 0;
+        c->errors = 0;
+        c->total  = 0;
+        c->max    = 0;
+        memset(c->buckets, 0, sizeof(c->buckets));
+    }
+    
+    s->since = g_get_real_time();
+}
+
+/* 
+ * Upper bound of the bucket holding the 'p' quantile in milliseconds. 
+ * The histogram is logarithmic, so this overestimates by less than 2x.
+ */
+static double quantile(const struct stats_counter *__restrict c, double p)
+{
+    uint64_t rank = (uint64_t) (p * (double) c->calls);
+    uint64_t sum = 0, bound;
+    
+    for (unsigned int i = 0; i < STATS_BUCKETS; ++i) {
+        sum += c->buckets[i];
+    
+        if (sum > rank) {
+            bound = (uint64_t) 1 << i;
+            return ((bound < c->max) ? bound : c->max) / 1000.0;
+        }
+    }
+    
+    return c->max / 1000.0;
+}
+
+static int format_counter(char *__restrict buf, size_t size,
+                          const struct stats_counter *__restrict c)
+{
+    return snprintf(buf, size, " %-9s %-15s %8lu %6lu %9.3f %9.3f %9.3f "
+                    "%9.3f\n", c->group, c->name, (unsigned long) c->calls,
+                    (unsigned long) c->errors, 
+                    (double) c->total / (double) c->calls / 1000.0,
+                    quantile(c, 0.5), quantile(c, 0.99), c->max / 1000.0);
+}
+
+static const char header[] = {
+    " group     name               calls errors   avg(ms)   p50(ms)   "
+    "p99(ms)   max(ms)\n"
+};
+
+/* Prints all counters that were used since the last reset to 'fd' */
+void stats_print(struct stats *__restrict s, int fd)
+{
+    unsigned int size = vector_size(&s->counters);
+    char buf[256], date[64];
+    struct tm tm;
+    time_t sec;
+    
+    sec = (time_t) (s->since / 1000000);
+    strftime(date, sizeof(date), "%F %T", localtime_r(&sec, &tm));
+    
+    dprintf(fd, " statistics since %s\n%s", date, header);
+    
+    for (unsigned int i = 0; i < size; ++i) {
+        const struct stats_counter *c = *vector_at(&s->counters, i);
+    
+        if (c->calls == 0)
+            continue;
+    
+        format_counter(buf, sizeof(buf), c);
+        dprintf(fd, "%s", buf);
+    }
+    
+    dprintf(fd, "\n");
+}
+
+void stats_log(struct stats *__restrict s)
+{
+    unsigned int size = vector_size(&s->counters);
+    char buf[256];
+    
+    climpd_log_i(tag, "%s", header);
+    
+    for (unsigned int i = 0; i < size; ++i) {
+        const struct stats_counter *c = *vector_at(&s->counters, i);
+    
+        if (c->calls == 0)
+            continue;
+    
+        format_counter(buf, sizeof(buf), c);
+        climpd_log_i(tag, "%s", buf);
+    }
+}
+
+/* Dumps the counters to the log every 'sec' seconds, 0 disables it */
+void stats_set_log_interval(struct stats *__restrict s, unsigned int sec)
+{
+    if (sec == s->log_interval)
+        return;
+    
+    if (s->timeout_id) {
+        g_source_remove(s->timeout_id);
+        s->timeout_id = 0;
+    }
+    
+    s->log_interval = sec;
+    
+    if (!sec) {
+        climpd_log_i(tag, "periodic logging disabled\n");
+        return;
+    }
+    
+    s->timeout_id = g_timeout_add_seconds(sec, &log_timeout, s);
+    
+    climpd_log_i(tag, "logging statistics every %u seconds\n", sec);
+}
\ No newline at end of file
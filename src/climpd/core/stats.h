@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <gst/gst.h>
+
+#include <libvci/vector.h>
+
+/* bucket 'i' counts calls that took less than 2^i microseconds */
+#define STATS_BUCKETS 24
+
+/*
+ * Call count, error count and a logarithmic latency histogram of a single
+ * operation. Counters are only updated from the main loop, so they are
+ * plain integers. 'group' and 'name' are not copied and must stay valid
+ * as long as the counter is registered.
+ */
+struct stats_counter {
+    const char *group;
+    const char *name;
+    
+    uint64_t calls;
+    uint64_t errors;
+    /* in microseconds */
+    uint64_t total;
+    uint64_t max;
+    uint32_t buckets[STATS_BUCKETS];
+};
+
+struct stats {
+    struct vector counters;
+    
+    gint64 since;
+    unsigned int log_interval;
+    guint timeout_id;
+};
+
+int stats_init(struct stats *__restrict s);
+
+void stats_destroy(struct stats *__restrict s);
+
+struct stats_counter *stats_register(struct stats *__restrict s,
+                                     const char *group,
+                                     const char *name);
+
+void stats_reset(struct stats *__restrict s);
+
+void stats_print(struct stats *__restrict s, int fd);
+
+void stats_log(struct stats *__restrict s);
+
+void stats_set_log_interval(struct stats *__restrict s, unsigned int sec);
+
+/* Start time for a later stats_record() */
+static inline gint64 stats_begin(void)
+{
+    return g_get_monotonic_time();
+}
+
+/* Records a call that started at 'start', 'c' may be NULL */
+static inline void stats_record(struct stats_counter *c, gint64 start, 
+                                bool error)
+{
+    uint64_t usec;
+    unsigned int i;
+    
+    if (!c)
+        return;
+    
+    usec = (uint64_t) (g_get_monotonic_time() - start);
+    
+    i = (usec) ? 64 - (unsigned int) __builtin_clzll(usec) : 0;
+    if (i >= STATS_BUCKETS)
+        i = STATS_BUCKETS - 1;
+    
+    c->calls  += 1;
+    c->errors += error;
+    c->total  += usec;
+    c->buckets[i] += 1;
+    
+    if (usec > c->max)
+        c->max = usec;
+}
+
+#endif /* _STATS_H_ */
\ No newline at end of file
@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include <libvci/error.h>
+
+#include <core/climpd-log.h>
+#include <core/status-publisher.h>
+
+#define REFRESH_INTERVAL 1
+
+static const char *tag = "status-publisher";
+
+static void copy_text(char *__restrict dst, const char *__restrict src)
+{
+    if (!src)
+        src = "";
+    
+    strncpy(dst, src, STATUS_PAGE_TEXT_MAX - 1);
+    dst[STATUS_PAGE_TEXT_MAX - 1] = '\0';
+}
+
+static enum status_page_state page_state(enum audio_player_state state)
+{
+    switch (state) {
+    case AUDIO_PLAYER_PLAYING:
+        return STATUS_PAGE_PLAYING;
+    case AUDIO_PLAYER_PAUSED:
+        return STATUS_PAGE_PAUSED;
+    case AUDIO_PLAYER_STOPPED:
+    default:
+        return STATUS_PAGE_STOPPED;
+    }
+}
+
+/* Everything is gathered up front to keep readers retrying for a short time */
+static void collect(struct status_publisher *__restrict sp, 
+                    struct status_page_data *__restrict data)
+{
+    struct audio_player *ap = sp->player;
+    struct playlist *pl = audio_player_playlist(ap);
+    const struct media *m = audio_player_active_track(ap);
+    const struct media_info *info;
+    
+    memset(data, 0, sizeof(*data));
+    
+    data->state    = page_state(audio_player_state(ap));
+    data->index    = playlist_index(pl);
+    data->tracks   = playlist_size(pl);
+    data->volume   = audio_player_volume(ap);
+    data->speed    = audio_player_speed(ap);
+    data->position = -1;
+    
+    if (audio_player_is_muted(ap))
+        data->flags |= STATUS_PAGE_MUTED;
+    
+    if (playlist_repeat(pl))
+        data->flags |= STATUS_PAGE_REPEAT;
+    
+    if (playlist_shuffle(pl))
+        data->flags |= STATUS_PAGE_SHUFFLE;
+    
+    if (data->state != STATUS_PAGE_STOPPED)
+        data->position = audio_player_stream_time(ap);
+    
+    data->stamp = g_get_monotonic_time();
+    
+    if (!m)
+        return;
+    
+    info = &m->info;
+    
+    data->duration = info->duration;
+    copy_text(data->title, info->title);
+    copy_text(data->artist, info->artist);
+    copy_text(data->album, info->album);
+}
+
+static void publish(struct status_publisher *__restrict sp)
+{
+    struct status_page_data data;
+    
+    collect(sp, &data);
+    
+    status_page_write_begin(sp->page);
+    memcpy(&sp->page->data, &data, sizeof(data));
+    status_page_write_end(sp->page);
+}
+
+static gboolean refresh_timeout(void *data)
+{
+    struct status_publisher *sp = data;
+    
+    publish(sp);
+    
+    if (audio_player_is_playing(sp->player))
+        return true;
+    
+    sp->timeout_id = 0;
+    
+    return false;
+}
+
+int status_publisher_init(struct status_publisher *__restrict sp,
+                          struct audio_player *__restrict ap)
+{
+    struct status_page *page;
+    int fd, err;
+    
+    memset(sp, 0, sizeof(*sp));
+    
+    err = status_page_name(sp->name, sizeof(sp->name));
+    if (err < 0) {
+        climpd_log_e(tag, "failed to create name of the status page\n");
+        return err;
+    }
+    
+    /* a page left behind by a crashed daemon is replaced */
+    shm_unlink(sp->name);
+    
+    fd = shm_open(sp->name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        err = -errno;
+        climpd_log_e(tag, "shm_open(\"%s\") failed - %s\n", sp->name, errstr);
+        return err;
+    }
+    
+    err = ftruncate(fd, sizeof(*page));
+    if (err < 0) {
+        err = -errno;
+        climpd_log_e(tag, "failed to size the status page - %s\n", errstr);
+        goto cleanup1;
+    }
+    
+    page = mmap(NULL, sizeof(*page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (page == MAP_FAILED) {
+        err = -errno;
+        climpd_log_e(tag, "failed to map the status page - %s\n", errstr);
+        goto cleanup1;
+    }
+    
+    close(fd);
+    
+    page->magic   = STATUS_PAGE_MAGIC;
+    page->version = STATUS_PAGE_VERSION;
+    page->pid     = (int32_t) getpid();
+    
+    sp->player = ap;
+    sp->page   = page;
+    
+    status_publisher_update(sp);
+    
+    climpd_log_i(tag, "publishing status in \"%s\"\n", sp->name);
+    
+    return 0;
+    
+cleanup1:
+    close(fd);
+    shm_unlink(sp->name);
+    return err;
+}
+
+void status_publisher_destroy(struct status_publisher *__restrict sp)
+{
+    if (!sp->page)
+        return;
+    
+    if (sp->timeout_id)
+        g_source_remove(sp->timeout_id);
+    
+    shm_unlink(sp->name);
+    munmap(sp->page, sizeof(*sp->page));
+    
+    climpd_log_i(tag, "destroyed\n");
+}
+
+void status_publisher_update(struct status_publisher *__restrict sp)
+{
+    if (!sp->page)
+        return;
+    
+    publish(sp);
+    
+    if (!audio_player_is_playing(sp->player)) {
+        if (sp->timeout_id) {
+            g_source_remove(sp->timeout_id);
+            sp->timeout_id = 0;
+        }
+    } else if (!sp->timeout_id) {
+        sp->timeout_id = g_timeout_add_seconds(REFRESH_INTERVAL, 
+                                               &refresh_timeout, sp);
+    }
+}
\ No newline at end of file
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _STATUS_PUBLISHER_H_
+#define _STATUS_PUBLISHER_H_
+
+#include <gst/gst.h>
+
+#include <status-page.h>
+
+#include <core/audio-player/audio-player.h>
+
+/*
+ * Mirrors the state of the audio player into the shared status page.
+ * The page is rewritten after every command and once per second while
+ * playing, which catches track changes the player makes on its own.
+ */
+struct status_publisher {
+    struct audio_player *player;
+    struct status_page *page;
+    char name[STATUS_PAGE_NAME_MAX];
+    
+    guint timeout_id;
+};
+
+int status_publisher_init(struct status_publisher *__restrict sp,
+                          struct audio_player *__restrict ap);
+
+void status_publisher_destroy(struct status_publisher *__restrict sp);
+
+void status_publisher_update(struct status_publisher *__restrict sp);
+
+#endif /* _STATUS_PUBLISHER_H_ */
\ No newline at end of file
@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libvci/macro.h>
+#include <libvci/error.h>
+
+#include <core/climpd-log.h>
+#include <ipc/event-stream.h>
+
+/* 
+ * Enough for an overflow notice and the largest event, so a client that
+ * fell behind always learns about it once its buffer is empty again.
+ */
+#define EVENT_MESSAGE_MAX                                                      \
+    (sizeof(struct ipc_header) + sizeof(struct ipc_event) + IPC_EVENT_TEXT_MAX)
+#define EVENT_BUFFER_MIN (2 * EVENT_MESSAGE_MAX)
+
+struct subscriber {
+    struct socket_connection *conn;
+    uint32_t mask;
+    unsigned int dropped;
+};
+
+static const char *tag = "event-stream";
+
+static int subscriber_send(struct subscriber *__restrict sub,
+                           enum ipc_event_type type,
+                           uint32_t value,
+                           const char *__restrict text)
+{
+    char buf[EVENT_MESSAGE_MAX];
+    struct ipc_event ev;
+    ssize_t len;
+    
+    ev.type  = type;
+    ev.value = value;
+    
+    len = ipc_build_event(buf, sizeof(buf), &ev, text);
+    if (len < 0)
+        return len;
+    
+    return socket_connection_send(sub->conn, buf, len);
+}
+
+static void subscriber_notify(struct subscriber *__restrict sub,
+                              enum ipc_event_type type,
+                              uint32_t value,
+                              const char *__restrict text)
+{
+    int err;
+    
+    if (sub->dropped) {
+        err = subscriber_send(sub, IPC_EVENT_OVERFLOW, sub->dropped, NULL);
+        if (err < 0) {
+            sub->dropped++;
+            return;
+        }
+    
+        sub->dropped = 0;
+    }
+    
+    err = subscriber_send(sub, type, value, text);
+    if (err == -ENOBUFS) {
+        climpd_log_w(tag, "subscriber on socket %d is too slow - dropping "
+                     "events\n", sub->conn->fd);
+        sub->dropped = 1;
+    } else if (err < 0) {
+        /* the connection is closed and will be removed on disconnect */
+        climpd_log_i(tag, "failed to notify socket %d - %s\n", sub->conn->fd,
+                     strerr(-err));
+    }
+}
+
+int event_stream_init(struct event_stream *__restrict es, size_t buffer_size)
+{
+    int err;
+    
+    err = vector_init(&es->subscribers, 0);
+    if (err < 0) {
+        climpd_log_e(tag, "failed to initialize subscribers - %s\n", 
+                     strerr(-err));
+        return err;
+    }
+    
+    vector_set_data_delete(&es->subscribers, &free);
+    
+    es->buffer_size = max(buffer_size, EVENT_BUFFER_MIN);
+    
+    climpd_log_i(tag, "initialized with %zu byte buffers\n", es->buffer_size);
+    
+    return 0;
+}
+
+void event_stream_destroy(struct event_stream *__restrict es)
+{
+    vector_destroy(&es->subscribers);
+    
+    climpd_log_i(tag, "destroyed\n");
+}
+
+int event_stream_subscribe(struct event_stream *__restrict es,
+                           struct socket_connection *__restrict conn,
+                           uint32_t mask)
+{
+    struct subscriber *sub;
+    int err;
+    
+    sub = malloc(sizeof(*sub));
+    if (!sub)
+        return -errno;
+    
+    sub->conn    = conn;
+    sub->mask    = mask;
+    sub->dropped = 0;
+    
+    err = vector_insert_back(&es->subscribers, sub);
+    if (err < 0) {
+        free(sub);
+        return err;
+    }
+    
+    socket_connection_set_send_limit(conn, es->buffer_size);
+    
+    climpd_log_i(tag, "socket %d subscribed to events 0x%x\n", conn->fd, mask);
+    
+    return 0;
+}
+
+void event_stream_unsubscribe(struct event_stream *__restrict es,
+                              struct socket_connection *__restrict conn)
+{
+    unsigned int size = vector_size(&es->subscribers);
+    
+    for (unsigned int i = 0; i < size; ++i) {
+        struct subscriber *sub = *vector_at(&es->subscribers, i);
+    
+        if (sub->conn == conn) {
+            vector_take_at(&es->subscribers, i);
+            free(sub);
+            return;
+        }
+    }
+}
+
+void event_stream_set_buffer_size(struct event_stream *__restrict es,
+                                  size_t size)
+{
+    es->buffer_size = max(size, EVENT_BUFFER_MIN);
+}
+
+void event_stream_publish(struct event_stream *__restrict es,
+                          enum ipc_event_type type,
+                          uint32_t value,
+                          const char *__restrict text)
+{
+    unsigned int size = vector_size(&es->subscribers);
+    
+    for (unsigned int i = 0; i < size; ++i) {
+        struct subscriber *sub = *vector_at(&es->subscribers, i);
+    
+        if (sub->mask & IPC_EVENT_MASK(type))
+            subscriber_notify(sub, type, value, text);
+    }
+}
\ No newline at end of file
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _EVENT_STREAM_H_
+#define _EVENT_STREAM_H_
+
+#include <stdint.h>
+
+#include <libvci/vector.h>
+
+#include <ipc/socket-server.h>
+
+/*
+ * Pushes player events to all subscribed connections. Every subscriber 
+ * has its own bounded send buffer: events that do not fit because the
+ * client does not read fast enough are dropped and the client is told 
+ * how many it missed with the next event that fits again, so the main
+ * loop never waits for a subscriber.
+ */
+struct event_stream {
+    struct vector subscribers;
+    size_t buffer_size;
+};
+
+int event_stream_init(struct event_stream *__restrict es, size_t buffer_size);
+
+void event_stream_destroy(struct event_stream *__restrict es);
+
+int event_stream_subscribe(struct event_stream *__restrict es,
+                           struct socket_connection *__restrict conn,
+                           uint32_t mask);
+
+void event_stream_unsubscribe(struct event_stream *__restrict es,
+                              struct socket_connection *__restrict conn);
+
+/* Applies to connections that subscribe afterwards */
+void event_stream_set_buffer_size(struct event_stream *__restrict es,
+                                  size_t size);
+
+void event_stream_publish(struct event_stream *__restrict es,
+                          enum ipc_event_type type,
+                          uint32_t value,
+                          const char *__restrict text);
+
+#endif /* _EVENT_STREAM_H_ */
\ No newline at end of file
@@ -24,17 +24,224 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 
+#include <libvci/macro.h>
 #include <libvci/error.h>
 
 #include <core/climpd-log.h>
 #include <ipc/socket-server.h>
 
+#define SOCKET_READ_SIZE 4096
+#define SOCKET_SEND_LIMIT (64 * 1024)
 
 static const char *tag = "socket-server";
 
+static gboolean handle_connection(GIOChannel *src, GIOCondition cond, 
+                                  void *data);
+
+static void socket_connection_watch(struct socket_connection *conn)
+{
+    conn->watch_id = g_io_add_watch(conn->channel, 
+                                    G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                    &handle_connection, conn);
+}
+
+static void socket_connection_delete(struct socket_connection *conn)
+{
+    struct socket_server *ss = conn->server;
+    
+    if (ss->on_disconnect)
+        ss->on_disconnect(conn);
+    
+    climpd_log_i(tag, "closing connection on socket %d\n", conn->fd);
+    
+    if (conn->watch_id)
+        g_source_remove(conn->watch_id);
+    
+    if (conn->out_watch_id)
+        g_source_remove(conn->out_watch_id);
+    
+    for (unsigned int i = 0; i < conn->fd_count; ++i)
+        close(conn->fds[i]);
+    
+    free(conn->out_buf);
+    free(conn->buf);
+    g_io_channel_unref(conn->channel);
+    free(conn);
+}
+
+static void socket_server_drop(struct socket_server *__restrict ss,
+                               struct socket_connection *conn)
+{
+    unsigned int i, size = vector_size(&ss->vec_conn);
+    
+    for (i = 0; i < size; ++i) {
+        if (*vector_at(&ss->vec_conn, i) == conn) {
+            vector_take_at(&ss->vec_conn, i);
+            break;
+        }
+    }
+    
+    socket_connection_delete(conn);
+}
+
+static void socket_connection_store_fds(struct socket_connection *conn,
+                                        struct msghdr *__restrict msghdr)
+{
+    struct cmsghdr *cmsg;
+    unsigned int i, n;
+    int *fds;
+    
+    for (cmsg = CMSG_FIRSTHDR(msghdr); cmsg; cmsg = CMSG_NXTHDR(msghdr, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        
+        fds = (int *) CMSG_DATA(cmsg);
+        n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        
+        for (i = 0; i < n; ++i) {
+            if (conn->fd_count < ARRAY_SIZE(conn->fds))
+                conn->fds[conn->fd_count++] = fds[i];
+            else
+                close(fds[i]);
+        }
+    }
+}
+
+/*
+ * Read whatever is available on the connection without blocking, so a
+ * client that sends a message in several pieces can not stall the server.
+ */
+static int socket_connection_read(struct socket_connection *conn)
+{
+    char data[CMSG_SPACE(IPC_FD_COUNT * sizeof(int))];
+    struct msghdr msghdr;
+    struct iovec iov;
+    size_t size;
+    ssize_t n;
+    void *buf;
+    
+    if (conn->buf_size - conn->buf_len < SOCKET_READ_SIZE) {
+        size = max(2 * conn->buf_size, conn->buf_len + SOCKET_READ_SIZE);
+        
+        buf = realloc(conn->buf, size);
+        if (!buf)
+            return -errno;
+        
+        conn->buf      = buf;
+        conn->buf_size = size;
+    }
+    
+    iov.iov_base = conn->buf + conn->buf_len;
+    iov.iov_len  = conn->buf_size - conn->buf_len;
+    
+    memset(&msghdr, 0, sizeof(msghdr));
+    
+    msghdr.msg_control    = data;
+    msghdr.msg_controllen = sizeof(data);
+    msghdr.msg_iov        = &iov;
+    msghdr.msg_iovlen     = 1;
+
+again:
+    n = recvmsg(conn->fd, &msghdr, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (n < 0) {
+        if (errno == EINTR)
+            goto again;
+        
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        
+        return -errno;
+    }
+    
+    socket_connection_store_fds(conn, &msghdr);
+    
+    if (n == 0)
+        return -EIO;
+    
+    conn->buf_len += n;
+    
+    return 0;
+}
+
+/* Hand all completely received messages to the request handler */
+static int socket_connection_dispatch(struct socket_connection *conn)
+{
+    struct socket_server *ss = conn->server;
+    struct climpd_log_field fields[] = { { "fd", 0 }, { "ms", 0 } };
+    struct ipc_header hdr;
+    unsigned long ms;
+    ssize_t size;
+    int err;
+    
+    while (!conn->suspended) {
+        size = ipc_message_size(conn->buf, conn->buf_len);
+        if (size < 0)
+            return size;
+        
+        if (size == 0 || (size_t) size > conn->buf_len)
+            return 0;
+        
+        clock_reset(&ss->timer);
+        
+        memcpy(&hdr, conn->buf, sizeof(hdr));
+        
+        err = ss->on_request(conn, &hdr, conn->buf + sizeof(hdr));
+        if (err < 0)
+            return err;
+        
+        conn->buf_len -= size;
+        memmove(conn->buf, conn->buf + size, conn->buf_len);
+        
+        ms = clock_elapsed_ms(&ss->timer);
+    
+        fields[0].value = conn->fd;
+        fields[1].value = (long long) ms;
+    
+        climpd_log_fields(CLIMPD_LOG_INFO, tag, fields, ARRAY_SIZE(fields),
+                          "served request on socket %d in %lu ms\n", 
+                          conn->fd, ms);
+    }
+    
+    return 0;
+}
+
+static gboolean handle_connection(GIOChannel *src, GIOCondition cond, 
+                                  void *data)
+{
+    struct socket_connection *conn = data;
+    int err;
+    
+    (void) src;
+    
+    err = (cond & G_IO_IN) ? socket_connection_read(conn) : -EIO;
+    if (err < 0)
+        goto drop;
+    
+    err = socket_connection_dispatch(conn);
+    if (err < 0)
+        goto drop;
+    
+    if (conn->suspended) {
+        conn->watch_id = 0;
+        return false;
+    }
+    
+    return true;
+
+drop:
+    if (err != -EIO)
+        climpd_log_e(tag, "handling request on socket %d failed - %s\n",
+                     conn->fd, strerr(-err));
+    
+    conn->watch_id = 0;
+    socket_server_drop(conn->server, conn);
+    return false;
+}
+
 static gboolean handle_socket(GIOChannel *src, GIOCondition cond, void *data)
 {
     struct socket_server *ss = data;
+    struct socket_connection *conn;
     struct ucred creds;
     socklen_t cred_len;
     int fd, err;
@@ -42,55 +249,74 @@ static gboolean handle_socket(GIOChannel *src, GIOCondition cond, void *data)
     (void) src;
     (void) cond;
     
-    clock_reset(&ss->timer);
-    
-    fd = accept(g_io_channel_unix_get_fd(ss->channel), NULL, NULL);
+    fd = accept4(g_io_channel_unix_get_fd(ss->channel), NULL, NULL, 
+                 SOCK_CLOEXEC);
     if(fd < 0) {
-        err = -errno;
-        goto out;
+        climpd_log_e(tag, "accept(): %s\n", strerr(errno));
+        return true;
     }
     
     cred_len = sizeof(creds);
     
     err = getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &creds, &cred_len);
     if(err < 0) {
-        err = -errno;
         climpd_log_e(tag, "getsockopt(): %s\n", strerr(errno));
-        goto out;
+        goto cleanup1;
     }
     
     if(creds.uid != getuid()) {
         climpd_log_w(tag, "non-authorized user %d connected -> closing "
         "connection\n", creds.uid);
-        err = -EPERM;
-        goto out;
+        goto cleanup1;
     }
     
-    climpd_log_i(tag, "user %d connected on socket %d\n", creds.uid, fd);
+    conn = calloc(1, sizeof(*conn));
+    if (!conn) {
+        climpd_log_e(tag, "failed to allocate connection - %s\n", errstr);
+        goto cleanup1;
+    }
     
-    if (ss->connection_handler) {
-        err = ss->connection_handler(fd);
-        if (err < 0) {
-            climpd_log_e(tag, "handling connection on socket %d failed - %s\n",
-                         fd, strerr(-err));
-            goto out;
-        }  
-    } else {
-        climpd_log_w(tag, "connection handler not set\n");
+    conn->server    = ss;
+    conn->fd        = fd;
+    conn->out_limit = SOCKET_SEND_LIMIT;
+    
+    conn->channel = g_io_channel_unix_new(fd);
+    if (!conn->channel) {
+        climpd_log_e(tag, "failed to create channel for socket %d\n", fd);
+        goto cleanup2;
     }
     
-out:
-    close(fd);
+    g_io_channel_set_close_on_unref(conn->channel, true);
     
-    climpd_log_i(tag, "served connection on socket %d in %lu ms\n", fd, 
-                 clock_elapsed_ms(&ss->timer));
+    err = vector_insert_back(&ss->vec_conn, conn);
+    if (err < 0) {
+        climpd_log_e(tag, "failed to register connection - %s\n", 
+                     strerr(-err));
+        goto cleanup3;
+    }
+    
+    socket_connection_watch(conn);
     
+    climpd_log_i(tag, "user %d connected on socket %d\n", creds.uid, fd);
+    
+    return true;
+
+cleanup3:
+    /* closes 'fd' */
+    g_io_channel_unref(conn->channel);
+    free(conn);
+    return true;
+cleanup2:
+    free(conn);
+cleanup1:
+    close(fd);
     return true;
 }
 
 int socket_server_init(struct socket_server *__restrict ss,
                        const char *__restrict path,
-                       int (*handler)(int fd))
+                       int backlog,
+                       request_handler handler)
 {
     struct sockaddr_un addr;
     int fd, err;
@@ -103,23 +329,30 @@ int socket_server_init(struct socket_server *__restrict ss,
     
     clock_start(&ss->timer);
     
+    err = vector_init(&ss->vec_conn, 0);
+    if (err < 0) {
+        climpd_log_e(tag, "failed to initialize connections - %s\n", 
+                     strerr(-err));
+        goto cleanup1;
+    }
+    
     ss->path = strdup(path);
     if (!ss->path) {
         climpd_log_e(tag, "failed to allocate memory - %s\n", errstr);
-        goto cleanup1;
+        goto cleanup2;
     }
     
     err = unlink(ss->path);
     if (err < 0 && errno != ENOENT) {
         climpd_log_e(tag, "failed to remove old socket '%s' - %s\n",
                      path, strerr(errno));
-        goto cleanup2;
+        goto cleanup3;
     }
     
     fd = socket(AF_UNIX, SOCK_STREAM, 0);
     if (fd < 0) {
         climpd_log_e(tag, "failed to create socket '%s' - %s\n", path, errstr);
-        goto cleanup2;
+        goto cleanup3;
     }
     
     addr.sun_family = AF_UNIX;
@@ -129,35 +362,38 @@ int socket_server_init(struct socket_server *__restrict ss,
     if (err < 0) {
         climpd_log_e(tag, "failed to bind socket '%s' - %s\n", ss->path, 
                      errstr);
-        goto cleanup3;
+        goto cleanup4;
     }
     
-    err = listen(fd, 5);
+    err = listen(fd, backlog);
     if (err < 0) {
         climpd_log_e(tag, "failed to listen on socket '%s' - %s\n", ss->path,
                      errstr);
-        goto cleanup3;
+        goto cleanup4;
     }
     
     ss->channel = g_io_channel_unix_new(fd);
     if (!ss->channel) {
         climpd_log_e(tag, "failed to create channel for '%s'\n", ss->path);
-        goto cleanup3;
+        goto cleanup4;
     }
     
     g_io_add_watch(ss->channel, G_IO_IN, &handle_socket, ss);
     g_io_channel_set_close_on_unref(ss->channel, true);
     
-    ss->connection_handler = handler;
+    ss->on_request    = handler;
+    ss->on_disconnect = NULL;
     
-    climpd_log_i(tag, "initialized\n");
+    climpd_log_i(tag, "initialized with a backlog of %d\n", backlog);
     
     return 0;
 
-cleanup3:
+cleanup4:
     close(fd);
-cleanup2:
+cleanup3:
     free(ss->path);
+cleanup2:
+    vector_destroy(&ss->vec_conn);
 cleanup1:
     clock_destroy(&ss->timer);
     return err;
@@ -165,6 +401,14 @@ cleanup1:
 
 void socket_server_destroy(struct socket_server *__restrict ss)
 {
+    struct socket_connection *conn;
+    
+    while (!vector_empty(&ss->vec_conn)) {
+        conn = vector_take_back(&ss->vec_conn);
+        socket_connection_delete(conn);
+    }
+    
+    vector_destroy(&ss->vec_conn);
     g_io_channel_unref(ss->channel);
     
     unlink(ss->path);
@@ -173,4 +417,155 @@ void socket_server_destroy(struct socket_server *__restrict ss)
     clock_destroy(&ss->timer);
     
     climpd_log_i(tag, "destroyed\n");
+}
+
+void socket_server_set_disconnect_handler(struct socket_server *__restrict ss,
+                                          disconnect_handler handler)
+{
+    ss->on_disconnect = handler;
+}
+
+int socket_connection_take_fds(struct socket_connection *__restrict conn, 
+                               int *fds, unsigned int n)
+{
+    if (conn->fd_count != n)
+        return -EPROTO;
+    
+    memcpy(fds, conn->fds, n * sizeof(*fds));
+    conn->fd_count = 0;
+    
+    return 0;
+}
+
+void socket_connection_suspend(struct socket_connection *__restrict conn)
+{
+    conn->suspended = true;
+}
+
+void socket_connection_resume(struct socket_connection *__restrict conn)
+{
+    int err;
+    
+    conn->suspended = false;
+    
+    /* messages might have been buffered while the connection was suspended */
+    err = socket_connection_dispatch(conn);
+    if (err < 0) {
+        climpd_log_e(tag, "handling request on socket %d failed - %s\n",
+                     conn->fd, strerr(-err));
+        socket_server_drop(conn->server, conn);
+        return;
+    }
+    
+    if (!conn->suspended)
+        socket_connection_watch(conn);
+}
+
+static ssize_t socket_connection_write(struct socket_connection *conn,
+                                       const void *__restrict buf, 
+                                       size_t len)
+{
+    ssize_t n;
+    
+again:
+    n = send(conn->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0) {
+        if (errno == EINTR)
+            goto again;
+        
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        
+        return -errno;
+    }
+    
+    return n;
+}
+
+static gboolean handle_writable(GIOChannel *src, GIOCondition cond, 
+                                void *data)
+{
+    struct socket_connection *conn = data;
+    ssize_t n;
+    
+    (void) src;
+    (void) cond;
+    
+    n = socket_connection_write(conn, conn->out_buf, conn->out_len);
+    if (n < 0) {
+        /* the connection is dropped once the hang up is read */
+        conn->out_len = 0;
+        conn->out_watch_id = 0;
+        return false;
+    }
+    
+    conn->out_len -= n;
+    memmove(conn->out_buf, conn->out_buf + n, conn->out_len);
+    
+    if (conn->out_len > 0)
+        return true;
+    
+    conn->out_watch_id = 0;
+    
+    return false;
+}
+
+static int socket_connection_reserve(struct socket_connection *conn,
+                                     size_t size)
+{
+    void *buf;
+    
+    if (size <= conn->out_size)
+        return 0;
+    
+    size = min(max(size, 2 * conn->out_size), conn->out_limit);
+    
+    buf = realloc(conn->out_buf, size);
+    if (!buf)
+        return -errno;
+    
+    conn->out_buf  = buf;
+    conn->out_size = size;
+    
+    return 0;
+}
+
+int socket_connection_send(struct socket_connection *__restrict conn,
+                           const void *__restrict buf, size_t len)
+{
+    ssize_t n = 0;
+    int err;
+    
+    if (conn->out_len + len > conn->out_limit)
+        return -ENOBUFS;
+    
+    /* a partial write can not be undone, so make room beforehand */
+    err = socket_connection_reserve(conn, conn->out_len + len);
+    if (err < 0)
+        return err;
+    
+    /* anything sent now would overtake the buffered data */
+    if (conn->out_len == 0) {
+        n = socket_connection_write(conn, buf, len);
+        if (n < 0)
+            return n;
+        
+        if ((size_t) n == len)
+            return 0;
+    }
+    
+    memcpy(conn->out_buf + conn->out_len, (const char *) buf + n, len - n);
+    conn->out_len += len - n;
+    
+    if (!conn->out_watch_id)
+        conn->out_watch_id = g_io_add_watch(conn->channel, G_IO_OUT,
+                                            &handle_writable, conn);
+    
+    return 0;
+}
+
+void socket_connection_set_send_limit(struct socket_connection *__restrict conn,
+                                      size_t limit)
+{
+    conn->out_limit = max(limit, conn->out_len);
 }
\ No newline at end of file
@@ -21,22 +21,98 @@
 #ifndef _SOCKET_SERVER_H_
 #define _SOCKET_SERVER_H_
 
+#include <stdbool.h>
+
 #include <gst/gst.h>
 #include <libvci/clock.h>
+#include <libvci/vector.h>
+
+#include "../../shared/ipc.h"
+
+struct socket_server;
+
+struct socket_connection {
+    struct socket_server *server;
+    GIOChannel *channel;
+    guint watch_id;
+    int fd;
+    
+    char *buf;
+    size_t buf_len;
+    size_t buf_size;
+    
+    int fds[IPC_FD_COUNT];
+    unsigned int fd_count;
+    
+    bool suspended;
+    
+    /* data that could not be sent without blocking yet */
+    char *out_buf;
+    size_t out_len;
+    size_t out_size;
+    size_t out_limit;
+    guint out_watch_id;
+    
+    void *data;
+};
+
+/*
+ * The request handler is called for every complete message received on a
+ * client connection. Returning a negative error code closes the connection,
+ * so it is meant for framing and IO errors only. A request which merely 
+ * failed is answered with an error status instead.
+ */
+typedef int (*request_handler)(struct socket_connection *, 
+                               const struct ipc_header *,
+                               const void *);
+typedef void (*disconnect_handler)(struct socket_connection *);
 
 struct socket_server {
     struct clock timer;
     char *path;
     GIOChannel *channel;
+    struct vector vec_conn;
     
-    int (*connection_handler)(int fd);
+    request_handler on_request;
+    disconnect_handler on_disconnect;
 };
 
 int socket_server_init(struct socket_server *__restrict ss, 
                        const char *__restrict path,
-                       int (*handler)(int fd));
+                       int backlog,
+                       request_handler handler);
 
 void socket_server_destroy(struct socket_server *__restrict ss);
 
+void socket_server_set_disconnect_handler(struct socket_server *__restrict ss,
+                                          disconnect_handler handler);
+
+/*
+ * Moves the file descriptors received on 'conn' to 'fds'. Fails with
+ * -EPROTO if not exactly 'n' file descriptors were received.
+ */
+int socket_connection_take_fds(struct socket_connection *__restrict conn, 
+                               int *fds, unsigned int n);
+
+/*
+ * Stop handling messages on 'conn' until socket_connection_resume() 
+ * is called. May only be called from within the request handler.
+ * Messages that arrive in the meantime are buffered and handled in order.
+ */
+void socket_connection_suspend(struct socket_connection *__restrict conn);
+
+void socket_connection_resume(struct socket_connection *__restrict conn);
+
+/*
+ * Sends 'len' bytes without blocking. Whatever the client does not take
+ * right away is buffered and written as soon as it reads again. Fails with
+ * -ENOBUFS, without sending anything, if the buffered data would exceed
+ * the limit of the connection.
+ */
+int socket_connection_send(struct socket_connection *__restrict conn,
+                           const void *__restrict buf, size_t len);
+
+void socket_connection_set_send_limit(struct socket_connection *__restrict conn,
+                                      size_t limit);
 
 #endif /* _SOCKET_SERVER_H_ */
\ No newline at end of file
@@ -26,8 +26,11 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdarg.h>
+#include <time.h>
+#include <limits.h>
 #include <assert.h>
 #include <execinfo.h>
+#include <sys/mman.h>
 
 #include <libvci/map.h>
 #include <libvci/hash.h>
@@ -46,14 +49,22 @@
 #include <core/media-loader.h>
 #include <core/climpd-config.h>
 #include <core/argument-parser.h>
+#include <core/library/library.h>
+#include <core/library/library-watcher.h>
+#include <core/persistence.h>
+#include <core/status-publisher.h>
+#include <core/stats.h>
 
 #include <ipc/socket-server.h>
+#include <ipc/event-stream.h>
 
 #include <util/strconvert.h>
 #include <util/bool.h>
 
 static const char *tag = "main";
 
+#define SEARCH_MAX_RESULTS 1000U
+
 /* client side standard fds */
 static int fd_in;
 static int fd_out;
@@ -61,31 +72,74 @@ static int fd_err;
 
 static char *conf_path;
 static char *playlist_path;
+static char *legacy_playlist_path;
 static char *loader_path;
+static char *tag_cache_path;
 static char *socket_path;
 
 static struct audio_player audio_player;
 static struct media_loader media_loader;
+static struct library library;
+static struct library_watcher library_watcher;
+static struct persistence persistence;
+static struct status_publisher status_publisher;
 static struct climpd_config config;
 static struct socket_server socket_server;
+static struct event_stream event_stream;
 static struct argument_parser arg_parser;
+static struct stats stats;
 static GMainLoop *main_loop;
 
+enum ipc_phase {
+    IPC_PHASE_RECV_SETUP,
+    IPC_PHASE_RECV_ARGV,
+    IPC_PHASE_DISPATCH,
+    IPC_PHASE_SEND_STATUS,
+    IPC_PHASE_COUNT,
+};
+
+static const char *ipc_phase_names[] = {
+    [IPC_PHASE_RECV_SETUP]  = "recv_setup",
+    [IPC_PHASE_RECV_ARGV]   = "recv_argv",
+    [IPC_PHASE_DISPATCH]    = "dispatch",
+    [IPC_PHASE_SEND_STATUS] = "send_status",
+};
+
+static struct stats_counter *ipc_stats[IPC_PHASE_COUNT];
+
 static const char help[] = {
     "Usage:\n"
-    "climp --cmd1 [[arg1] ...] --cmd2 [[arg1] ...]\n\n"
-    "  -a, --add [args]       Add a .m3u/.txt and / or media file\n"
+    "climp --cmd1 [[arg1] ...] --cmd2 [[arg1] ...]\n"
+    "climp --batch | --interactive\n\n"
+    "      --batch            Read one command line per line from stdin and\n"
+    "                         send all of them over a single connection.\n"
+    "      --interactive      Like --batch, but prompt for each line and\n"
+    "                         wait for its result.\n"
+    "      --status-shm       Like --current, but read the status climpd\n"
+    "                         publishes in shared memory instead of\n"
+    "                         connecting to it.\n"
+    "      --subscribe [args] Print player events as they happen. Arguments\n"
+    "                         select events: track, eos, error, volume,\n"
+    "                         mute. All events are printed by default.\n"
+    "  -a, --add [args]       Add a .m3u/.txt/.clpl and / or media file\n"
     "                         to the playlist\n"
     "      --clear            Clear the current playlist.\n"
     "      --config           Print the climpd configuration.\n"
     "      --remove [args]    Remove media files from the playlist.\n"
-    "                         .m3u / .txt - or media files are accepted\n"
-    "                         arguments.\n"
+    "                         .m3u / .txt / .clpl - or media files are\n"
+    "                         accepted arguments.\n"
     "      --pause            Pause / unpause the player. This has no effect \n"
     "                         if the player is stopped.\n" 
+    "      --persistence      Print when the session was last saved.\n"
     "      --playlist [args]  Print or set the current playlist. Pass\n"
-    "                         media files and / or .m3u / .txt - files.\n"
+    "                         media files and / or .m3u / .txt / .clpl -\n"
+    "                         files.\n"
     "      --repeat           Toggle repeat playlist.\n"
+    "  -s, --search [args]    Print the tracks of the library whose path,\n"
+    "                         title, artist or album contain all arguments.\n"
+    "      --search-add [args]\n"
+    "                         Like --search, but add all matching tracks\n"
+    "                         to the playlist.\n"
     "      --shuffle          Toggle shuffle.\n"
     "  -v, --volume [arg]     Set or get the volume of the climpd-player.\n"
     "  -q, --quit             Quit the climpd application.\n"
@@ -95,7 +149,7 @@ static const char help[] = {
     "  -p, --play [args]      Start playback, or set a playlist and start\n"
     "                         playback immediatley, or jump to a track in the\n"
     "                         playlist. Possible arguments are media files,\n"
-    "                         .m3u / .txt files or numbers.\n"
+    "                         .m3u / .txt / .clpl files or numbers.\n"
     "      --files            Print all files in the current playlist\n"
     "      --mute             Mute or unmute the player\n"
     "      --seek [arg]       Get current position or jump to a position \n"
@@ -104,6 +158,9 @@ static const char help[] = {
     "      --sort             Sort the playlist. /some/file01 will be before\n"
     "                         /some/file02 and so on. Useful if you forgot to\n"
     "                         sort the file in bash (use: sort -V).\n"
+    "      --stats [reset]    Print call counts and latencies of all\n"
+    "                         commands, request phases and tag reads, or\n"
+    "                         reset them.\n"
     "  -i, --stdin            Read playlist from stdin.\n"
     "      --stop             Stop the playback\n"
     "      --uris             Print for each file in the playlist the\n"
@@ -221,6 +278,8 @@ static int handle_add(const char *cmd, const char **argv, int argc)
             report_load_error(cmd, argv[i], err);
     }
     
+    persistence_mark(&persistence, PERSISTENCE_PLAYLIST);
+    
     return 0;
 }
 
@@ -234,6 +293,8 @@ static int handle_clear(const char *cmd, const char **argv, int argc)
     playlist = audio_player_playlist(&audio_player);
     playlist_clear(playlist);
     
+    persistence_mark(&persistence, PERSISTENCE_PLAYLIST);
+    
     return 0;
 }
 
@@ -242,6 +303,12 @@ static int handle_config(const char *cmd, const char **argv, int argc)
     struct playlist *playlist;
     struct audio_player_config *ap_conf;
     struct console_output_config *cout_conf;
+    struct tag_reader_config *tr_conf;
+    struct socket_server_config *ss_conf;
+    struct library_config *lib_conf;
+    struct playlist_config *pl_conf;
+    struct stats_config *st_conf;
+    struct log_config *log_conf;
     int err;
     bool keep;
     
@@ -256,14 +323,33 @@ static int handle_config(const char *cmd, const char **argv, int argc)
     playlist = audio_player_playlist(&audio_player);
     cout_conf = climpd_config_console_output_config(&config);
     ap_conf = climpd_config_audio_player_config(&config);
+    tr_conf = climpd_config_tag_reader_config(&config);
+    ss_conf = climpd_config_socket_server_config(&config);
+    lib_conf = climpd_config_library_config(&config);
+    pl_conf = climpd_config_playlist_config(&config);
+    st_conf = climpd_config_stats_config(&config);
+    log_conf = climpd_config_log_config(&config);
     keep = climpd_config_keep_changes(&config);
     
     audio_player_set_volume(&audio_player, ap_conf->volume);
     audio_player_set_pitch(&audio_player, ap_conf->pitch);
     audio_player_set_speed(&audio_player, ap_conf->speed);
+    audio_player_set_gapless(&audio_player, ap_conf->gapless);
     
     playlist_set_repeat(playlist, ap_conf->repeat);
     playlist_set_shuffle(playlist, ap_conf->shuffle);
+    playlist_set_max_discoverers(playlist, tr_conf->discoverers);
+    playlist_set_sync(playlist, pl_conf->sync);
+    
+    event_stream_set_buffer_size(&event_stream, ss_conf->event_buffer_size);
+    stats_set_log_interval(&stats, st_conf->log_interval);
+    
+    climpd_log_set_level(log_conf->level);
+    climpd_log_set_format(log_conf->format);
+    
+    err = climpd_log_set_async(log_conf->async);
+    if (err < 0)
+        climpd_log_w(tag, "failed to start log writer - %s\n", strerr(-err));
     
     print(" climpd-config      \n"
           " -------------------\n"
@@ -273,9 +359,27 @@ static int handle_config(const char *cmd, const char **argv, int argc)
           " Speed        : %.2f\n"
           " Repeat       : %s  \n"
           " Shuffle      : %s  \n"
+          " Gapless      : %s  \n"
+          " Discoverers  : %u  \n"
+          " Backlog      : %u  \n"
+          " Event Buffer : %u  \n"
+          " Library      : %s  \n"
+          " Watch Library: %s  \n"
+          " Playlist Sync: %s  \n"
+          " Backgr. Save : %s  \n"
+          " Stats Log    : %u s\n"
+          " Log Level    : %s  \n"
+          " Log Format   : %s  \n"
+          " Async Log    : %s  \n"
           " Save Changes : %s  \n\n",
           cout_conf->meta_column_width, ap_conf->volume, ap_conf->pitch,
           ap_conf->speed, yes_no(ap_conf->repeat), yes_no(ap_conf->shuffle), 
+          yes_no(ap_conf->gapless), tr_conf->discoverers, ss_conf->backlog,
+          ss_conf->event_buffer_size,
+          (lib_conf->roots) ? lib_conf->roots : "-", yes_no(lib_conf->watch),
+          file_sync_name(pl_conf->sync), yes_no(pl_conf->background_save),
+          st_conf->log_interval, climpd_log_level_name(log_conf->level),
+          climpd_log_format_name(log_conf->format), yes_no(log_conf->async), 
           yes_no(keep));
     
     return 0;
@@ -399,6 +503,8 @@ static int handle_next(const char *cmd, const char **argv, int argc)
     if (audio_player_is_stopped(&audio_player))
         print("climpd: finished playlist\n");
     
+    persistence_mark(&persistence, PERSISTENCE_PLAYLIST);
+    
     return 0;
 }
 
@@ -432,6 +538,57 @@ static int handle_pause(const char *cmd, const char **argv, int argc)
     return err;
 }
 
+static int handle_persistence(const char *cmd, const char **argv, int argc)
+{
+    char date[64] = "never";
+    struct tm tm;
+    time_t sec;
+    
+    (void) cmd;
+    
+    report_redundant_if_applicable(argv, argc);
+    
+    if (persistence_flushes(&persistence) > 0) {
+        sec = (time_t) (persistence_last_flush(&persistence) / 1000000);
+        strftime(date, sizeof(date), "%F %T", localtime_r(&sec, &tm));
+    }
+    
+    print(" persistence        \n"
+          " -------------------\n"
+          " Unsaved      : %s  \n"
+          " Saves        : %u  \n"
+          " Last Save    : %s  \n"
+          " Last Cost    : %.3f ms\n\n",
+          yes_no(persistence_dirty(&persistence)), 
+          persistence_flushes(&persistence), date,
+          persistence_last_cost(&persistence) / 1000.0);
+    
+    return 0;
+}
+
+static int handle_stats(const char *cmd, const char **argv, int argc)
+{
+    unsigned long written, dropped;
+    
+    if (argc == 0) {
+        stats_print(&stats, fd_out);
+        
+        climpd_log_counters(&written, &dropped);
+        print(" log records written: %lu, dropped: %lu\n\n", written, dropped);
+        
+        return 0;
+    }
+    
+    if (argc > 1 || strcmp(argv[0], "reset") != 0) {
+        eprint("climpd: %s: invalid argument '%s'\n", cmd, argv[argc - 1]);
+        return -EINVAL;
+    }
+    
+    stats_reset(&stats);
+    
+    return 0;
+}
+
 static int handle_play(const char *cmd, const char **argv, int argc)
 {
     struct playlist *playlist;
@@ -474,26 +631,23 @@ static int handle_play(const char *cmd, const char **argv, int argc)
 
     if (cnt != 0) {
         err = audio_player_play_track(&audio_player, index);
-        if (err < 0) {
+        if (err < 0)
             report_error(cmd, "failed to play track", err);
-            return err;
-        }
     } else {
         err = audio_player_play_next(&audio_player);
-        if (err < 0) {
+        if (err < 0)
             report_error(cmd, "failed to start playback", err);
-            return err;
-        }
     }
     
-    err = playlist_save(playlist, playlist_path);
-    if (err < 0)
-        climpd_log_w(tag, "failed to save new playlist\n");
+    /* the new tracks stay in the playlist even if playing them failed */
+    persistence_mark(&persistence, PERSISTENCE_PLAYLIST);
     
-    return 0;
+    return err;
 
 fail:
     playlist_clear(playlist);
+    persistence_mark(&persistence, PERSISTENCE_PLAYLIST);
+    
     return err;
 }
 
@@ -543,6 +697,8 @@ static int handle_playlist(const char *cmd, const char **argv, int argc)
             report_load_error(cmd, argv[i], err);
     }
     
+    persistence_mark(&persistence, PERSISTENCE_PLAYLIST);
+    
     return 0;
 }
 
@@ -574,6 +730,8 @@ static int handle_pitch(const char *cmd, const char **argv, int argc)
     ap_conf = climpd_config_audio_player_config(&config);
     ap_conf->pitch = new_pitch;
     
+    persistence_mark(&persistence, PERSISTENCE_CONFIG);
+    
     return 0;
 }
 
@@ -603,7 +761,20 @@ static int handle_remove(const char *cmd, const char **argv, int argc)
     struct playlist *playlist;
     int int_argv[argc], err;
     
+    playlist = audio_player_playlist(&audio_player);
+    
     for (int i = 0; i < argc; ++i) {
+        if (!str_is_int(argv[i])) {
+            /* tracks can also be removed by their path */
+            int_argv[i] = (int) playlist_index_of(playlist, argv[i]);
+            if (int_argv[i] == -1) {
+                report_arg_error(cmd, argv[i], -ENOENT);
+                return -ENOENT;
+            }
+            
+            continue;
+        }
+        
         err = str_to_int(argv[i], int_argv + i);
         if (err < 0) {
             report_arg_error(cmd, argv[i], err);
@@ -611,9 +782,10 @@ static int handle_remove(const char *cmd, const char **argv, int argc)
         }
     }
     
-    playlist = audio_player_playlist(&audio_player);
     playlist_remove_array(playlist, int_argv, (unsigned int) argc);
     
+    persistence_mark(&persistence, PERSISTENCE_PLAYLIST);
+    
     return 0;
 }
 
@@ -638,9 +810,142 @@ static int handle_repeat(const char *cmd, const char **argv, int argc)
     playlist_set_repeat(playlist, value);
     ap_conf->repeat = value;
     
+    persistence_mark(&persistence, PERSISTENCE_CONFIG);
+    
     return 0;
 }
 
+static char *join_args(const char **argv, int argc)
+{
+    size_t len = 0;
+    char *s, *p;
+    
+    for (int i = 0; i < argc; ++i)
+        len += strlen(argv[i]) + 1;
+    
+    s = malloc(len + 1);
+    if (!s)
+        return NULL;
+    
+    p = s;
+    *p = '\0';
+    
+    for (int i = 0; i < argc; ++i)
+        p += sprintf(p, (i > 0) ? " %s" : "%s", argv[i]);
+    
+    return s;
+}
+
+static int search_library(const char *cmd, const char **argv, int argc, 
+                          unsigned int limit, struct vector *__restrict vec)
+{
+    char *query;
+    int n, err;
+    
+    if (argc == 0) {
+        report_missing_arg(cmd);
+        return -EINVAL;
+    }
+    
+    query = join_args(argv, argc);
+    if (!query) {
+        err = -errno;
+        report_error(cmd, "failed to allocate memory", err);
+        return err;
+    }
+    
+    err = vector_init(vec, 0);
+    if (err < 0) {
+        report_error(cmd, "failed to allocate memory", err);
+        goto out;
+    }
+    
+    n = library_search(&library, query, limit, vec);
+    if (n < 0) {
+        err = n;
+        report_error(cmd, "search failed", err);
+        vector_destroy(vec);
+        goto out;
+    }
+    
+    if (n == 0)
+        eprint("climpd: %s: no tracks match \"%s\"\n", cmd, query);
+    
+out:
+    free(query);
+    return err;
+}
+
+static int handle_search(const char *cmd, const char **argv, int argc)
+{
+    struct console_output_config *cout_conf;
+    struct vector results;
+    unsigned int size, meta_len;
+    int err;
+    
+    /* one more than is shown, to tell whether matches were left out */
+    err = search_library(cmd, argv, argc, SEARCH_MAX_RESULTS + 1, &results);
+    if (err < 0)
+        return err;
+    
+    cout_conf = climpd_config_console_output_config(&config);
+    meta_len = cout_conf->meta_column_width;
+    
+    size = min(vector_size(&results), SEARCH_MAX_RESULTS);
+    
+    for (unsigned int i = 0; i < size; ++i) {
+        struct media *m = *vector_at(&results, i);
+        struct media_info *info = media_info(m);
+        
+        print(" %-*.*s %-*.*s %-*.*s %s\n", 
+              meta_len, meta_len, info->title,
+              meta_len, meta_len, info->artist,
+              meta_len, meta_len, info->album,
+              media_path(m));
+    }
+    
+    if (vector_size(&results) > SEARCH_MAX_RESULTS) {
+        eprint("climpd: %s: only the first %u matches are shown\n", cmd, 
+               SEARCH_MAX_RESULTS);
+    }
+    
+    vector_destroy(&results);
+    
+    return 0;
+}
+
+static int handle_search_add(const char *cmd, const char **argv, int argc)
+{
+    struct playlist *playlist;
+    struct vector results;
+    unsigned int size;
+    int err;
+    
+    err = search_library(cmd, argv, argc, UINT_MAX, &results);
+    if (err < 0)
+        return err;
+    
+    playlist = audio_player_playlist(&audio_player);
+    size = vector_size(&results);
+    
+    /* the playlist shares the media objects of the library */
+    for (unsigned int i = 0; i < size; ++i) {
+        struct media *m = *vector_at(&results, i);
+        
+        err = playlist_add_media(playlist, m);
+        if (err < 0) {
+            report_load_error(cmd, media_path(m), err);
+            break;
+        }
+    }
+    
+    vector_destroy(&results);
+    
+    persistence_mark(&persistence, PERSISTENCE_PLAYLIST);
+    
+    return err;
+}
+
 static int handle_seek(const char *cmd, const char **argv, int argc)
 {
     int sec, err;
@@ -686,6 +991,8 @@ static int handle_shuffle(const char *cmd, const char **argv, int argc)
     playlist_set_shuffle(playlist, value);
     ap_conf->shuffle = value;
     
+    persistence_mark(&persistence, PERSISTENCE_CONFIG);
+    
     return 0;
 }
 
@@ -700,6 +1007,8 @@ static int handle_sort(const char *cmd, const char **argv, int argc)
     playlist = audio_player_playlist(&audio_player);
     playlist_sort(playlist);
     
+    persistence_mark(&persistence, PERSISTENCE_PLAYLIST);
+    
     return 0;
 }
 
@@ -731,6 +1040,8 @@ static int handle_speed(const char *cmd, const char **argv, int argc)
     ap_conf = climpd_config_audio_player_config(&config);
     ap_conf->speed = new_speed;
     
+    persistence_mark(&persistence, PERSISTENCE_CONFIG);
+    
     return 0;
 }
 
@@ -754,6 +1065,8 @@ static int handle_stdin(const char *cmd, const char **argv, int argc)
         report_error(cmd, "error loading playlist: view log for details", err);
         return err;
     }
+    
+    persistence_mark(&persistence, PERSISTENCE_PLAYLIST);
 
     return 0;
 }
@@ -816,6 +1129,8 @@ static int handle_volume(const char *cmd, const char **argv, int argc)
     
     ap_conf = climpd_config_audio_player_config(&config);
     ap_conf->volume = value;
+    
+    persistence_mark(&persistence, PERSISTENCE_CONFIG);
         
     return 0;
 }
@@ -830,6 +1145,7 @@ static struct arg args[] = {
     { "--mute",         "-m",   &handle_mute            },
     { "--next",         "-n",   &handle_next            },
     { "--pause",        "",     &handle_pause           },
+    { "--persistence",  "",     &handle_persistence     },
     { "--play",         "-p",   &handle_play            },
     { "--playlist",     "",     &handle_playlist        },
     { "--pitch",        "",     &handle_pitch           },
@@ -837,62 +1153,413 @@ static struct arg args[] = {
     { "--quit",         "-q",   &handle_quit            },
     { "--remove",       "",     &handle_remove          },
     { "--repeat",       "",     &handle_repeat          },
+    { "--search",       "-s",   &handle_search          },
+    { "--search-add",   "",     &handle_search_add      },
     { "--seek",         "",     &handle_seek            },
     { "--shuffle",      "",     &handle_shuffle         },
     { "--sort",         "",     &handle_sort            },
     { "--speed",        "",     &handle_speed           },
+    { "--stats",        "",     &handle_stats           },
     { "--stdin",        "",     &handle_stdin           },
     { "--stop",         "",     &handle_stop            },
     { "--uris",         "",     &handle_uris            },
     { "--volume",       "-v",   &handle_volume          },
 };
 
-static int handle_connection(int fd)
+#define QUERY_THREADS 4
+
+struct client {
+    int fd_in;
+    int fd_out;
+    int fd_err;
+    char *cwd;
+    bool subscribed;
+};
+
+struct query {
+    struct socket_connection *conn;
+    int fd_out;
+    int memfd;
+    int status;
+    int err;
+    gint64 start;
+};
+
+/* 
+ * Requests which consist only of these commands do not change any state.
+ * Their output is rendered on the main loop and handed to a worker thread, 
+ * which writes it to the client, so a slow reader on the client side
+ * does not hold up other clients.
+ */
+static const char *query_cmds[] = {
+    "--current", "--files", "--persistence", "--playlist", "--search", "-s", 
+    "--stats", "--volume", "-v",
+};
+
+static GThreadPool *query_pool;
+
+static struct client *client_new(struct socket_connection *conn,
+                                 const struct ipc_header *hdr,
+                                 const void *payload)
 {
-    char **argv, *cwd;
-    int argc, err;
+    struct client *client;
+    int fds[IPC_FD_COUNT];
+    int err;
     
-    err = ipc_recv_setup(fd, &fd_in, &fd_out, &fd_err, &cwd);
+    err = socket_connection_take_fds(conn, fds, IPC_FD_COUNT);
     if (err < 0) {
         climpd_log_e(tag, "receiving client's fds failed - %s\n", strerr(-err));
-        return err;
+        return NULL;
+    }
+    
+    client = malloc(sizeof(*client));
+    if (!client) {
+        climpd_log_e(tag, "failed to allocate client - %s\n", errstr);
+        goto cleanup1;
     }
     
-    err = ipc_recv_argv(fd, &argv, &argc);
+    err = ipc_parse_setup(hdr, payload, &client->cwd);
     if (err < 0) {
-        climpd_log_e(tag, "receiving arguments failed - %s\n", strerr(-err));
+        climpd_log_e(tag, "receiving client's setup failed - %s\n", 
+                     strerr(-err));
+        goto cleanup2;
+    }
+    
+    client->fd_in  = fds[0];
+    client->fd_out = fds[1];
+    client->fd_err = fds[2];
+    
+    client->subscribed = false;
+    
+    return client;
+
+cleanup2:
+    free(client);
+cleanup1:
+    for (unsigned int i = 0; i < ARRAY_SIZE(fds); ++i)
+        close(fds[i]);
+    
+    return NULL;
+}
+
+static void client_delete(struct client *__restrict client)
+{
+    free(client->cwd);
+    close(client->fd_err);
+    close(client->fd_out);
+    close(client->fd_in);
+    free(client);
+}
+
+static bool is_query(const char **argv, int argc)
+{
+    if (argc == 0)
+        return false;
+    
+    for (int i = 0; i < argc; ++i) {
+        bool found = false;
+        
+        for (unsigned int j = 0; j < ARRAY_SIZE(query_cmds) && !found; ++j)
+            found = strcmp(argv[i], query_cmds[j]) == 0;
+        
+        if (!found)
+            return false;
+    }
+    
+    return true;
+}
+
+static gboolean finish_query(void *data)
+{
+    struct query *q = data;
+    
+    stats_record(ipc_stats[IPC_PHASE_SEND_STATUS], q->start, q->err < 0);
+    
+    if (q->err < 0)
+        climpd_log_e(tag, "sending query response failed - %s\n", 
+                     strerr(-q->err));
+    
+    /* a broken connection is noticed and closed on the next read */
+    socket_connection_resume(q->conn);
+    free(q);
+    
+    return false;
+}
+
+static void run_query(void *data, void *user_data)
+{
+    struct query *q = data;
+    char buf[4096];
+    off_t off = 0;
+    ssize_t n, m;
+    
+    (void) user_data;
+    
+    q->err = 0;
+    
+    while (q->err == 0) {
+        n = pread(q->memfd, buf, sizeof(buf), off);
+        if (n <= 0) {
+            if (n < 0)
+                q->err = -errno;
+            break;
+        }
+        
+        off += n;
+        
+        for (char *p = buf; n > 0; p += m, n -= m) {
+            m = write(q->fd_out, p, n);
+            if (m < 0) {
+                if (errno == EINTR) {
+                    m = 0;
+                    continue;
+                }
+                
+                q->err = -errno;
+                break;
+            }
+        }
+    }
+    
+    close(q->memfd);
+    
+    if (q->err == 0)
+        q->err = ipc_send_status(q->conn->fd, q->status);
+    
+    g_idle_add(&finish_query, q);
+}
+
+static int handle_query(struct socket_connection *conn, struct client *client,
+                        const char **argv, int argc)
+{
+    struct query *q;
+    GError *error = NULL;
+    gint64 start;
+    int memfd, err;
+    
+    memfd = memfd_create("climpd-query", MFD_CLOEXEC);
+    if (memfd < 0)
+        return -errno;
+    
+    q = malloc(sizeof(*q));
+    if (!q) {
+        err = -errno;
         goto cleanup1;
     }
     
+    /* render the reply from the current state */
+    fd_in  = client->fd_in;
+    fd_out = memfd;
+    fd_err = client->fd_err;
+    
+    start = stats_begin();
+    
+    err = argument_parser_run(&arg_parser, argv, argc);
+    
+    stats_record(ipc_stats[IPC_PHASE_DISPATCH], start, err < 0);
+    
+    fd_out = client->fd_out;
+    
+    if (err < 0)
+        goto cleanup2;
+    
+    q->conn   = conn;
+    q->fd_out = client->fd_out;
+    q->memfd  = memfd;
+    q->status = err;
+    q->start  = stats_begin();
+    
+    /* no further requests of this client until the reply is written */
+    socket_connection_suspend(conn);
+    
+    if (!g_thread_pool_push(query_pool, q, &error)) {
+        climpd_log_e(tag, "failed to queue query - %s\n", error->message);
+        g_error_free(error);
+        
+        run_query(q, NULL);
+    }
+    
+    return 0;
+
+cleanup2:
+    free(q);
+cleanup1:
+    close(memfd);
+    return err;
+}
+
+static int handle_argv(struct socket_connection *conn, struct client *client,
+                       const struct ipc_header *hdr, const void *payload)
+{
+    char **argv;
+    gint64 start;
+    int argc, err;
+    
+    /* events and command replies must not interleave */
+    if (client->subscribed)
+        return -EPROTO;
+    
+    start = stats_begin();
+    
+    err = ipc_parse_argv(hdr, payload, &argv, &argc);
+    
+    stats_record(ipc_stats[IPC_PHASE_RECV_ARGV], start, err < 0);
+    
+    if (err < 0) {
+        climpd_log_e(tag, "receiving arguments failed - %s\n", strerr(-err));
+        return err;
+    }
+    
+    if (query_pool && is_query((const char **) argv, argc)) {
+        err = handle_query(conn, client, (const char **) argv, argc);
+        free(argv);
+        
+        /* the query pool sends the status of a query once it is written */
+        if (err == 0)
+            return 0;
+        
+        goto send_status;
+    }
+    
+    fd_in  = client->fd_in;
+    fd_out = client->fd_out;
+    fd_err = client->fd_err;
+    
+    start = stats_begin();
+    
     /* necessary to handle relative paths */
-    err = chdir(cwd);
+    err = chdir(client->cwd);
     if (err < 0)
-        climpd_log_w(tag, "chdir() to \"%s\" failed - %s\n", cwd, errstr);
+        climpd_log_w(tag, "chdir() to \"%s\" failed - %s\n", client->cwd, 
+                     errstr);
     
     err = argument_parser_run(&arg_parser, (const char **) argv, argc);
     
     chdir("/");
     
+    status_publisher_update(&status_publisher);
+    
+    stats_record(ipc_stats[IPC_PHASE_DISPATCH], start, err < 0);
+    
+    free(argv);
+    
+send_status:
+    /* a failed batch is reported to the client, the connection stays open */
     if (err < 0) {
         climpd_log_e(tag, "handling arguments failed - %s\n", strerr(-err));
-        goto cleanup2;
+        err = -err;
     }
     
-    err = ipc_send_status(fd, err);
+    start = stats_begin();
+    
+    err = ipc_send_status(conn->fd, err);
+    
+    stats_record(ipc_stats[IPC_PHASE_SEND_STATUS], start, err < 0);
+    
     if (err < 0)
         climpd_log_e(tag, "sending response failed - %s\n", strerr(-err));
     
-cleanup2:
-    free(argv);
-cleanup1:
-    free(cwd);
-    close(fd_err);
-    close(fd_out);
-    close(fd_in);
+    return err;
+}
+
+static int handle_subscribe(struct socket_connection *conn, 
+                            struct client *client,
+                            const struct ipc_header *hdr, 
+                            const void *payload)
+{
+    uint32_t mask;
+    int err;
+    
+    if (client->subscribed)
+        return -EPROTO;
+    
+    err = ipc_parse_subscribe(hdr, payload, &mask);
+    if (err < 0) {
+        climpd_log_e(tag, "receiving subscription failed - %s\n", 
+                     strerr(-err));
+        return err;
+    }
+    
+    err = event_stream_subscribe(&event_stream, conn, mask);
+    if (err < 0)
+        climpd_log_e(tag, "subscribing to events failed - %s\n", 
+                     strerr(-err));
+    else
+        client->subscribed = true;
+    
+    err = ipc_send_status(conn->fd, -err);
+    if (err < 0)
+        climpd_log_e(tag, "sending response failed - %s\n", strerr(-err));
     
     return err;
 }
 
+static int handle_request(struct socket_connection *conn, 
+                          const struct ipc_header *hdr,
+                          const void *payload)
+{
+    struct client *client = conn->data;
+    gint64 start;
+    
+    switch (hdr->type) {
+    case IPC_MESSAGE_SETUP:
+        if (client)
+            return -EPROTO;
+        
+        start = stats_begin();
+        
+        conn->data = client_new(conn, hdr, payload);
+        
+        stats_record(ipc_stats[IPC_PHASE_RECV_SETUP], start, !conn->data);
+        
+        return (conn->data) ? 0 : -EPROTO;
+    case IPC_MESSAGE_ARGV:
+        if (!client)
+            return -EPROTO;
+        
+        return handle_argv(conn, client, hdr, payload);
+    case IPC_MESSAGE_SUBSCRIBE:
+        if (!client)
+            return -EPROTO;
+        
+        return handle_subscribe(conn, client, hdr, payload);
+    default:
+        return -EPROTO;
+    }
+}
+
+static void handle_disconnect(struct socket_connection *conn)
+{
+    struct client *client = conn->data;
+    
+    if (!client)
+        return;
+    
+    if (client->subscribed)
+        event_stream_unsubscribe(&event_stream, conn);
+    
+    client_delete(client);
+}
+
+static void handle_player_event(enum audio_player_event event, 
+                                unsigned int value,
+                                const char *text,
+                                void *data)
+{
+    static const enum ipc_event_type types[] = {
+        [AUDIO_PLAYER_EVENT_TRACK]         = IPC_EVENT_TRACK,
+        [AUDIO_PLAYER_EVENT_END_OF_STREAM] = IPC_EVENT_END_OF_STREAM,
+        [AUDIO_PLAYER_EVENT_BUS_ERROR]     = IPC_EVENT_BUS_ERROR,
+        [AUDIO_PLAYER_EVENT_VOLUME]        = IPC_EVENT_VOLUME,
+        [AUDIO_PLAYER_EVENT_MUTE]          = IPC_EVENT_MUTE,
+    };
+    
+    event_stream_publish(data, types[event], value, text);
+    
+    /* track changes and errors happen outside of client requests as well */
+    status_publisher_update(&status_publisher);
+}
+
 // void on_sighub(int signo, siginfo_t *info, void *context)
 // {
 //     (void) signo;
@@ -919,6 +1586,7 @@ void on_sigerr(int signo, siginfo_t *info, void *context)
     (void) context;
     
     climpd_log_e(tag, "received signal \"%s\"\nbacktrace:\n", strsignal(signo));
+    climpd_log_flush();
     
     size = backtrace(buffer, ARRAY_SIZE(buffer));
     if(size > 0)
@@ -985,9 +1653,46 @@ __attribute__((noreturn)) void die_error(void)
     exit(EXIT_FAILURE);;
 }
 
+static void handle_tags_parsed(struct media *m, void *data)
+{
+    library_update(data, m);
+}
+
+/* The library watcher edits the playlist outside of client requests */
+static void handle_playlist_change(struct playlist *pl)
+{
+    (void) pl;
+    
+    persistence_mark(&persistence, PERSISTENCE_PLAYLIST);
+    status_publisher_update(&status_publisher);
+}
+
+static void add_library_roots(const char *__restrict roots)
+{
+    char *dup, *root, *save;
+    
+    dup = strdup(roots);
+    if (!dup) {
+        climpd_log_w(tag, "failed to add library roots - %s\n", errstr);
+        return;
+    }
+    
+    for (root = strtok_r(dup, ":", &save); root; 
+         root = strtok_r(NULL, ":", &save))
+        library_watcher_add_root(&library_watcher, root);
+    
+    free(dup);
+}
+
 int main(int argc, char *argv[])
 {
     struct audio_player_config *player_config;
+    struct tag_reader_config *tr_config;
+    struct socket_server_config *ss_config;
+    struct library_config *lib_config;
+    struct log_config *log_config;
+    struct playlist_config *pl_config;
+    GError *error = NULL;
     struct playlist *playlist;
     const char *home;
     bool no_daemon = false;
@@ -1030,6 +1735,30 @@ int main(int argc, char *argv[])
         die_error();
     }
 
+    log_config = climpd_config_log_config(&config);
+    
+    climpd_log_set_level(log_config->level);
+    climpd_log_set_format(log_config->format);
+    
+    /* the writer thread must be started after daemonizing */
+    err = climpd_log_set_async(log_config->async);
+    if (err < 0)
+        climpd_log_w(tag, "failed to start log writer - %s - logging "
+                     "synchronously\n", strerr(-err));
+    
+    err = stats_init(&stats);
+    if (err < 0) {
+        climpd_log_e(tag, "failed to initialize statistics - %s\n",
+                     strerr(-err));
+        die_error();
+    }
+    
+    stats_set_log_interval(&stats, 
+                           climpd_config_stats_config(&config)->log_interval);
+    
+    for (unsigned int i = 0; i < IPC_PHASE_COUNT; ++i)
+        ipc_stats[i] = stats_register(&stats, "ipc", ipc_phase_names[i]);
+    
     player_config = climpd_config_audio_player_config(&config);
     
     err = audio_player_init(&audio_player);
@@ -1039,24 +1768,53 @@ int main(int argc, char *argv[])
         die_error();
     }
     
-    err = asprintf(&playlist_path, "%s/.config/climp/playlists/__playlist.m3u", 
-                   home);
+    err = asprintf(&playlist_path, "%s/.config/climp/playlists/__playlist%s", 
+                   home, PLAYLIST_BINARY_SUFFIX);
     if (err < 0) {
         climpd_log_e(tag, "failed to locate path to last playlist\n");
         die_error();
     }
     
+    err = asprintf(&legacy_playlist_path, 
+                   "%s/.config/climp/playlists/__playlist.m3u", home);
+    if (err < 0) {
+        climpd_log_e(tag, "failed to locate path to last playlist\n");
+        die_error();
+    }
+    
+    err = asprintf(&tag_cache_path, "%s/.cache/climp/tags.cache", home);
+    if (err < 0) {
+        climpd_log_e(tag, "failed to locate the tag cache\n");
+        die_error();
+    }
+    
     audio_player_set_volume(&audio_player, player_config->volume);
     audio_player_set_pitch(&audio_player, player_config->pitch);
     audio_player_set_speed(&audio_player, player_config->speed);
+    audio_player_set_gapless(&audio_player, player_config->gapless);
     
     playlist = audio_player_playlist(&audio_player);
     
-    if (path_exists(playlist_path)) {
+    err = playlist_enable_tag_cache(playlist, tag_cache_path);
+    if (err < 0)
+        climpd_log_w(tag, "failed to enable tag cache - continuing\n");
+    
+    tr_config = climpd_config_tag_reader_config(&config);
+    playlist_set_max_discoverers(playlist, tr_config->discoverers);
+    
+    pl_config = climpd_config_playlist_config(&config);
+    playlist_set_sync(playlist, pl_config->sync);
+    
+    /* sessions of older versions were saved as plain text */
+    if (path_exists(playlist_path))
         err = playlist_load(playlist, playlist_path);
-        if (err < 0)
-            climpd_log_w(tag, "failed to load last playlist - continuing\n");
-    }
+    else if (path_exists(legacy_playlist_path))
+        err = playlist_load(playlist, legacy_playlist_path);
+    else
+        err = 0;
+    
+    if (err < 0)
+        climpd_log_w(tag, "failed to load last playlist - continuing\n");
     
     playlist_set_repeat(playlist, player_config->repeat);
     playlist_set_shuffle(playlist, player_config->shuffle);
@@ -1080,7 +1838,39 @@ int main(int argc, char *argv[])
         die_error();
     }
     
-    err = asprintf(&socket_path, "/tmp/.climpd-%d.sock", getuid());
+    lib_config = climpd_config_library_config(&config);
+    
+    err = library_init(&library, playlist_tag_reader(playlist));
+    if (err < 0) {
+        climpd_log_e(tag, "failed to initialize library - %s\n", 
+                     strerr(-err));
+        die_error();
+    }
+    
+    tag_reader_set_handler(playlist_tag_reader(playlist), &handle_tags_parsed,
+                           &library);
+    tag_reader_set_stats(playlist_tag_reader(playlist), 
+                         stats_register(&stats, "tags", "discover"));
+    
+    err = library_watcher_init(&library_watcher, &library, playlist, 
+                               &handle_playlist_change, lib_config->watch);
+    if (err < 0) {
+        climpd_log_e(tag, "failed to initialize library watcher - %s\n", 
+                     strerr(-err));
+        die_error();
+    }
+    
+    if (lib_config->roots)
+        add_library_roots(lib_config->roots);
+    
+    err = persistence_init(&persistence, playlist, playlist_path, &config);
+    if (err < 0) {
+        climpd_log_e(tag, "failed to initialize persistence - %s\n", 
+                     strerr(-err));
+        die_error();
+    }
+    
+    err = ipc_socket_path(&socket_path);
     if (err < 0) {
         climpd_log_e(tag, "failed to create path to server socket\n");
         die_error();
@@ -1095,13 +1885,45 @@ int main(int argc, char *argv[])
     
     argument_parser_set_default_handler(&arg_parser, &report_invalid_arg);
     
-    err = socket_server_init(&socket_server, socket_path, &handle_connection);
+    err = argument_parser_set_stats(&arg_parser, &stats);
+    if (err < 0)
+        climpd_log_w(tag, "failed to record command statistics - "
+                     "continuing\n");
+    
+    ss_config = climpd_config_socket_server_config(&config);
+    
+    err = event_stream_init(&event_stream, ss_config->event_buffer_size);
+    if (err < 0) {
+        climpd_log_e(tag, "failed to initialize event stream - %s\n", 
+                     strerr(-err));
+        die_error();
+    }
+    
+    audio_player_set_event_handler(&audio_player, &handle_player_event, 
+                                   &event_stream);
+    
+    err = socket_server_init(&socket_server, socket_path, ss_config->backlog,
+                             &handle_request);
     if (err < 0) {
         climpd_log_e(tag, "failed to initialize server socket - %s\n", 
                      strerr(-err));
         die_error();
     }
     
+    socket_server_set_disconnect_handler(&socket_server, &handle_disconnect);
+    
+    query_pool = g_thread_pool_new(&run_query, NULL, QUERY_THREADS, false, 
+                                   &error);
+    if (!query_pool) {
+        climpd_log_w(tag, "failed to create query threads - %s - answering "
+                     "queries on the main loop\n", error->message);
+        g_error_free(error);
+    }
+    
+    err = status_publisher_init(&status_publisher, &audio_player);
+    if (err < 0)
+        climpd_log_w(tag, "failed to publish status page - continuing\n");
+    
     main_loop = g_main_loop_new(NULL, false);
     if (!main_loop) {
         climpd_log_e(tag, "failed to initialize main loop\n");
@@ -1112,6 +1934,9 @@ int main(int argc, char *argv[])
     
     g_main_loop_run(main_loop);
     
+    persistence_destroy(&persistence);
+    status_publisher_destroy(&status_publisher);
+    
     err = playlist_save(playlist, playlist_path);
     if (err < 0)
         climpd_log_w(tag, "failed to save playlist - continuing shutdown\n");
@@ -1122,15 +1947,26 @@ int main(int argc, char *argv[])
             climpd_log_w(tag, "failed to save config - continuing shutdown\n");
     }
     
+    free(tag_cache_path);
     free(loader_path);
+    free(legacy_playlist_path);
     free(playlist_path);
     free(conf_path);
     
     g_main_loop_unref(main_loop);
+    
+    /* wait for pending queries before their connections are closed */
+    if (query_pool)
+        g_thread_pool_free(query_pool, false, true);
+    
     socket_server_destroy(&socket_server);
+    event_stream_destroy(&event_stream);
     argument_parser_destroy(&arg_parser);
+    library_watcher_destroy(&library_watcher);
+    library_destroy(&library);
     media_loader_destroy(&media_loader);
     audio_player_destroy(&audio_player);
+    stats_destroy(&stats);
     climpd_config_destroy(&config);
     
     return EXIT_SUCCESS;
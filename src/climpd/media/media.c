@@ -30,24 +30,43 @@
 
 #include <media/media.h>
 #include <media/uri.h>
-
-#define MEDIA_META_ELEMENT_SIZE  64
+#include <util/string-pool.h>
 
 struct media *media_new(const char *__restrict arg)
+{
+    struct media *media;
+    char *uri;
+    
+    if (uri_ok(arg))
+        return media_new_uri(arg, strlen(arg));
+    
+    uri = uri_new(arg);
+    if (!uri)
+        return NULL;
+    
+    media = media_new_uri(uri, strlen(uri));
+    
+    uri_delete(uri);
+    
+    return media;
+}
+
+struct media *media_new_uri(const char *__restrict uri, size_t len)
 {
     struct media *media;
     
-    media = malloc(sizeof(*media));
-    if(!media)
+    /* keep the uri in the same allocation as the media itself */
+    media = malloc(sizeof(*media) + len + 1);
+    if (!media)
         return NULL;
     
-    media->uri = uri_new(arg);
-    if(!media->uri)
-        goto cleanup1;
+    memcpy(media->uri, uri, len);
+    media->uri[len] = '\0';
     
-    strncpy(media->info.title,  basename(media->uri), MEDIA_META_ELEMENT_SIZE);
-    strncpy(media->info.artist, "", MEDIA_META_ELEMENT_SIZE);
-    strncpy(media->info.album,  "", MEDIA_META_ELEMENT_SIZE);
+    /* the title defaults to the file name which is part of the uri */
+    media->info.title  = basename(media->uri);
+    media->info.artist = "";
+    media->info.album  = "";
     
     media->info.track = 0;
     media->info.duration = 0;
@@ -60,15 +79,11 @@ struct media *media_new(const char *__restrict arg)
      * setting this flag to true if applicable
      */
     media->parsed = uri_is_http(media->uri);
+    media->pooled = 0;
     
     atomic_init(&media->ref_count, 1);
     
     return media;
-    
-    cleanup1:
-    free(media);
-    
-    return NULL;
 }
 
 struct media *media_ref(struct media *__restrict media)
@@ -77,12 +92,31 @@ struct media *media_ref(struct media *__restrict media)
     return media;
 }
 
+static const char **media_string(struct media *__restrict media, 
+                                 enum media_string field)
+{
+    switch (field) {
+    case MEDIA_TITLE:
+        return &media->info.title;
+    case MEDIA_ARTIST:
+        return &media->info.artist;
+    case MEDIA_ALBUM:
+    default:
+        return &media->info.album;
+    }
+}
+
 void media_unref(struct media *__restrict media)
 {
-    if (atomic_fetch_sub(&media->ref_count, 1) == 1) {
-        uri_delete(media->uri);
-        free(media);
+    if (atomic_fetch_sub(&media->ref_count, 1) != 1)
+        return;
+    
+    for (int i = MEDIA_TITLE; i <= MEDIA_ALBUM; ++i) {
+        if (media->pooled & (1 << i))
+            pooled_string_unref(*media_string(media, i));
     }
+    
+    free(media);
 }
 
 struct media_info *media_info(struct media *__restrict media)
@@ -90,6 +124,19 @@ struct media_info *media_info(struct media *__restrict media)
     return &media->info;
 }
 
+void media_set_string(struct media *__restrict media, 
+                      enum media_string field,
+                      const char *__restrict s)
+{
+    const char **dst = media_string(media, field);
+    
+    if (media->pooled & (1 << field))
+        pooled_string_unref(*dst);
+    
+    *dst = s;
+    media->pooled |= 1 << field;
+}
+
 const char *media_uri(const struct media *__restrict media)
 {
     return media->uri;
@@ -21,40 +21,63 @@
 #ifndef _MEDIA_H_
 #define _MEDIA_H_
 
+#include <stddef.h>
 #include <stdbool.h>
 #include <stdatomic.h>
 
 #include <libvci/link.h>
 
-#define MEDIA_META_ELEMENT_SIZE  64
-
+/* 
+ * The strings either point into the uri or are references to pooled strings
+ * set with media_set_string(), which are released together with the media.
+ */
 struct media_info {
-    char title[MEDIA_META_ELEMENT_SIZE];
-    char artist[MEDIA_META_ELEMENT_SIZE];
-    char album[MEDIA_META_ELEMENT_SIZE];
+    const char *title;
+    const char *artist;
+    const char *album;
     unsigned int track; 
     unsigned int duration;
     bool seekable;
 };
 
+enum media_string {
+    MEDIA_TITLE,
+    MEDIA_ARTIST,
+    MEDIA_ALBUM,
+};
+
 struct media {
     struct media_info info;
-    char *uri;
     const char *path;
     
     bool parsed;
+    /* one bit per 'enum media_string' holding a pooled string */
+    unsigned char pooled;
     
     atomic_int ref_count;
+    
+    char uri[];
 };
 
 struct media *media_new(const char *__restrict arg);
 
+/* 
+ * Creates a media from the first 'len' bytes of 'uri', which must already 
+ * be a valid uri. No path resolution is done.
+ */
+struct media *media_new_uri(const char *__restrict uri, size_t len);
+
 struct media *media_ref(struct media *__restrict media);
 
 void media_unref(struct media *__restrict media);
 
 struct media_info *media_info(struct media *__restrict media);
 
+/* Takes over the reference to the pooled string 's' */
+void media_set_string(struct media *__restrict media, 
+                      enum media_string field,
+                      const char *__restrict s);
+
 const char *media_uri(const struct media *__restrict media);
 
 const char *media_path(const struct media *__restrict media);
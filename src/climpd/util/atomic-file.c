@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <libvci/macro.h>
+
+#include <util/atomic-file.h>
+
+static const char *sync_names[] = {
+    [FILE_SYNC_NONE] = "none",
+    [FILE_SYNC_DATA] = "data",
+    [FILE_SYNC_FULL] = "full",
+};
+
+static int write_all(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t n;
+    
+    while (iovcnt > 0) {
+        n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            
+            return -errno;
+        }
+        
+        /* skip everything that was already written */
+        while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    
+    return 0;
+}
+
+static int sync_parent_dir(const char *__restrict path)
+{
+    const char *p = strrchr(path, '/');
+    char *dir;
+    int fd, err;
+    
+    if (!p)
+        dir = strdup(".");
+    else if (p == path)
+        dir = strdup("/");
+    else
+        dir = strndup(path, p - path);
+    
+    if (!dir)
+        return -errno;
+    
+    fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(dir);
+    
+    if (fd < 0)
+        return -errno;
+    
+    err = fsync(fd);
+    if (err < 0)
+        err = -errno;
+    
+    close(fd);
+    
+    return err;
+}
+
+/* 
+ * Writes all of 'iov' to a temporary file next to 'path' and renames it
+ * to 'path' afterwards, so 'path' is either the old or the new file but
+ * never a partially written one. 'iov' is modified.
+ */
+int atomic_file_write(const char *__restrict path, 
+                      struct iovec *iov, 
+                      int iovcnt,
+                      enum file_sync sync)
+{
+    char *tmp;
+    int fd, err;
+    
+    err = asprintf(&tmp, "%s.tmp", path);
+    if (err < 0)
+        return -ENOMEM;
+    
+    fd = open(tmp, O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        err = -errno;
+        goto cleanup1;
+    }
+    
+    err = write_all(fd, iov, iovcnt);
+    if (err < 0)
+        goto cleanup2;
+    
+    if (sync != FILE_SYNC_NONE) {
+        err = fdatasync(fd);
+        if (err < 0) {
+            err = -errno;
+            goto cleanup2;
+        }
+    }
+    
+    err = close(fd);
+    fd = -1;
+    if (err < 0) {
+        err = -errno;
+        goto cleanup2;
+    }
+    
+    err = rename(tmp, path);
+    if (err < 0) {
+        err = -errno;
+        goto cleanup2;
+    }
+    
+    free(tmp);
+    
+    /* the new file is in place already, so this is not undone on failure */
+    if (sync == FILE_SYNC_FULL)
+        return sync_parent_dir(path);
+    
+    return 0;
+    
+cleanup2:
+    if (fd >= 0)
+        close(fd);
+    
+    unlink(tmp);
+cleanup1:
+    free(tmp);
+    
+    return err;
+}
+
+const char *file_sync_name(enum file_sync sync)
+{
+    return sync_names[sync];
+}
+
+int file_sync_parse(const char *__restrict name, enum file_sync *sync)
+{
+    for (unsigned int i = 0; i < ARRAY_SIZE(sync_names); ++i) {
+        if (strcasecmp(name, sync_names[i]) == 0) {
+            *sync = (enum file_sync) i;
+            return 0;
+        }
+    }
+    
+    return -EINVAL;
+}
\ No newline at end of file
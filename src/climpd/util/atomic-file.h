@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ATOMIC_FILE_H_
+#define _ATOMIC_FILE_H_
+
+#include <sys/uio.h>
+
+/*
+ * How much durability a save buys before it returns. 'none' only protects
+ * against a crash of the process, 'data' syncs the new file before it 
+ * replaces the old one and 'full' also syncs the directory entry.
+ */
+enum file_sync {
+    FILE_SYNC_NONE,
+    FILE_SYNC_DATA,
+    FILE_SYNC_FULL,
+};
+
+int atomic_file_write(const char *__restrict path, 
+                      struct iovec *iov, 
+                      int iovcnt,
+                      enum file_sync sync);
+
+const char *file_sync_name(enum file_sync sync);
+
+int file_sync_parse(const char *__restrict name, enum file_sync *sync);
+
+#endif /* _ATOMIC_FILE_H_ */
\ No newline at end of file
@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include <libvci/compare.h>
+#include <libvci/hash.h>
+#include <libvci/macro.h>
+
+#include <util/string-pool.h>
+
+struct pooled_string {
+    struct string_pool *pool;
+    unsigned int ref_count;
+    char str[];
+};
+
+static struct pooled_string *pooled_string(const char *__restrict s)
+{
+    return container_of(s, struct pooled_string, str);
+}
+
+static void string_pool_delete(struct string_pool *__restrict sp)
+{
+    map_destroy(&sp->map);
+    pthread_mutex_destroy(&sp->mutex);
+    free(sp);
+}
+
+/* Drops one reference with the mutex held, returns true for the last one */
+static bool string_pool_put(struct string_pool *__restrict sp)
+{
+    return --sp->ref_count == 0;
+}
+
+struct string_pool *string_pool_new(void)
+{
+    const struct map_config conf = {
+        .size        = MAP_DEFAULT_SIZE,
+        .lower_bound = MAP_DEFAULT_LOWER_BOUND,
+        .upper_bound = MAP_DEFAULT_UPPER_BOUND,
+        .static_size = false,
+        .key_compare = &compare_string,
+        .key_hash    = &hash_string,
+        .data_delete = NULL,
+    };
+    struct string_pool *sp;
+    int err;
+    
+    sp = malloc(sizeof(*sp));
+    if (!sp)
+        return NULL;
+    
+    err = map_init(&sp->map, &conf);
+    if (err < 0) {
+        free(sp);
+        errno = -err;
+        return NULL;
+    }
+    
+    pthread_mutex_init(&sp->mutex, NULL);
+    
+    sp->bytes     = 0;
+    sp->ref_count = 1;
+    
+    return sp;
+}
+
+struct string_pool *string_pool_ref(struct string_pool *__restrict sp)
+{
+    pthread_mutex_lock(&sp->mutex);
+    sp->ref_count += 1;
+    pthread_mutex_unlock(&sp->mutex);
+    
+    return sp;
+}
+
+void string_pool_unref(struct string_pool *__restrict sp)
+{
+    bool last;
+    
+    pthread_mutex_lock(&sp->mutex);
+    last = string_pool_put(sp);
+    pthread_mutex_unlock(&sp->mutex);
+    
+    if (last)
+        string_pool_delete(sp);
+}
+
+const char *string_pool_intern(struct string_pool *__restrict sp, 
+                               const char *__restrict s)
+{
+    struct pooled_string *ps;
+    size_t len;
+    int err;
+    
+    pthread_mutex_lock(&sp->mutex);
+    
+    ps = map_retrieve(&sp->map, s);
+    if (ps) {
+        ps->ref_count += 1;
+        goto out;
+    }
+    
+    len = strlen(s) + 1;
+    
+    ps = malloc(sizeof(*ps) + len);
+    if (!ps)
+        goto out;
+    
+    ps->pool      = sp;
+    ps->ref_count = 1;
+    memcpy(ps->str, s, len);
+    
+    err = map_insert(&sp->map, ps->str, ps);
+    if (err < 0) {
+        free(ps);
+        ps = NULL;
+        errno = -err;
+        goto out;
+    }
+    
+    /* every string keeps its pool alive */
+    sp->ref_count += 1;
+    sp->bytes += len;
+    
+out:
+    pthread_mutex_unlock(&sp->mutex);
+    
+    return (ps) ? ps->str : NULL;
+}
+
+const char *pooled_string_ref(const char *__restrict s)
+{
+    struct pooled_string *ps = pooled_string(s);
+    
+    pthread_mutex_lock(&ps->pool->mutex);
+    ps->ref_count += 1;
+    pthread_mutex_unlock(&ps->pool->mutex);
+    
+    return s;
+}
+
+void pooled_string_unref(const char *__restrict s)
+{
+    struct pooled_string *ps = pooled_string(s);
+    struct string_pool *sp = ps->pool;
+    bool last = false;
+    
+    pthread_mutex_lock(&sp->mutex);
+    
+    if (--ps->ref_count == 0) {
+        map_take(&sp->map, ps->str);
+        sp->bytes -= strlen(ps->str) + 1;
+        free(ps);
+    
+        last = string_pool_put(sp);
+    }
+    
+    pthread_mutex_unlock(&sp->mutex);
+    
+    if (last)
+        string_pool_delete(sp);
+}
+
+unsigned int string_pool_size(struct string_pool *__restrict sp)
+{
+    unsigned int size;
+    
+    pthread_mutex_lock(&sp->mutex);
+    size = map_size(&sp->map);
+    pthread_mutex_unlock(&sp->mutex);
+    
+    return size;
+}
+
+size_t string_pool_bytes(struct string_pool *__restrict sp)
+{
+    size_t bytes;
+    
+    pthread_mutex_lock(&sp->mutex);
+    bytes = sp->bytes;
+    pthread_mutex_unlock(&sp->mutex);
+    
+    return bytes;
+}
\ No newline at end of file
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _STRING_POOL_H_
+#define _STRING_POOL_H_
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include <libvci/map.h>
+
+/*
+ * Stores each distinct string only once. Every interned string is reference
+ * counted and freed together with its last reference. Each string also keeps
+ * its pool alive, so it stays valid after the owner dropped the pool.
+ */
+struct string_pool {
+    pthread_mutex_t mutex;
+    struct map map;
+    size_t bytes;
+    unsigned int ref_count;
+};
+
+struct string_pool *string_pool_new(void);
+
+struct string_pool *string_pool_ref(struct string_pool *__restrict sp);
+
+void string_pool_unref(struct string_pool *__restrict sp);
+
+/* Returns a new reference to the pooled copy of 's' */
+const char *string_pool_intern(struct string_pool *__restrict sp, 
+                               const char *__restrict s);
+
+/* 's' must have been returned by string_pool_intern() */
+const char *pooled_string_ref(const char *__restrict s);
+
+void pooled_string_unref(const char *__restrict s);
+
+unsigned int string_pool_size(struct string_pool *__restrict sp);
+
+size_t string_pool_bytes(struct string_pool *__restrict sp);
+
+#endif /* _STRING_POOL_H_ */
\ No newline at end of file
@@ -0,0 +1,395 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <libvci/compare.h>
+#include <libvci/hash.h>
+
+#include "file-index.h"
+
+struct file_index_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;
+};
+
+static const char *record_strings(const struct file_index *__restrict fi,
+                                  const struct file_record *__restrict rec)
+{
+    return (const char *) rec + fi->head_size;
+}
+
+static bool record_ok(const struct file_index *__restrict fi,
+                      const struct file_record *__restrict rec, 
+                      size_t max_size)
+{
+    const char *p, *end;
+    
+    if (max_size < fi->head_size || rec->size < fi->head_size)
+        return false;
+    
+    if (rec->size > max_size || rec->size % FILE_INDEX_ALIGNMENT != 0)
+        return false;
+    
+    p   = record_strings(fi, rec);
+    end = (const char *) rec + rec->size;
+    
+    for (unsigned int i = 0; i < FILE_INDEX_STRINGS; ++i) {
+        p = memchr(p, '\0', end - p);
+        if (!p)
+            return false;
+    
+        ++p;
+    }
+    
+    return true;
+}
+
+static void file_index_unmap(struct file_index *__restrict fi)
+{
+    if (fi->data) {
+        munmap(fi->data, fi->data_size);
+        fi->data = NULL;
+        fi->data_size = 0;
+    }
+}
+
+static int file_index_map_file(struct file_index *__restrict fi)
+{
+    struct stat st;
+    void *data;
+    int fd, err;
+    
+    fd = open(fi->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return (errno == ENOENT) ? 0 : -errno;
+    
+    err = fstat(fd, &st);
+    if (err < 0) {
+        err = -errno;
+        goto out;
+    }
+    
+    if ((size_t) st.st_size < sizeof(struct file_index_header))
+        goto out;
+    
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        err = -errno;
+        goto out;
+    }
+    
+    madvise(data, st.st_size, MADV_WILLNEED);
+    
+    fi->data      = data;
+    fi->data_size = st.st_size;
+    
+out:
+    close(fd);
+    return err;
+}
+
+int file_index_init(struct file_index *__restrict fi, 
+                    const char *__restrict path,
+                    uint32_t magic,
+                    uint32_t version,
+                    size_t head_size)
+{
+    const struct map_config conf = {
+        .size        = MAP_DEFAULT_SIZE,
+        .lower_bound = MAP_DEFAULT_LOWER_BOUND,
+        .upper_bound = MAP_DEFAULT_UPPER_BOUND,
+        .static_size = false,
+        .key_compare = &compare_string,
+        .key_hash    = &hash_string,
+        .data_delete = NULL,
+    };
+    int err;
+    
+    memset(fi, 0, sizeof(*fi));
+    
+    fi->path = strdup(path);
+    if (!fi->path)
+        return -errno;
+    
+    err = map_init(&fi->map, &conf);
+    if (err < 0) {
+        free(fi->path);
+        return err;
+    }
+    
+    fi->magic     = magic;
+    fi->version   = version;
+    fi->head_size = head_size;
+    
+    return 0;
+}
+
+void file_index_destroy(struct file_index *__restrict fi)
+{
+    map_destroy(&fi->map);
+    file_index_unmap(fi);
+    free(fi->path);
+}
+
+int file_index_load(struct file_index *__restrict fi)
+{
+    const struct file_index_header *header;
+    const struct file_record *rec;
+    const char *p, *end;
+    int err;
+    
+    err = file_index_map_file(fi);
+    if (err < 0 || !fi->data)
+        return err;
+    
+    header = fi->data;
+    end    = (const char *) fi->data + fi->data_size;
+    
+    if (header->magic != fi->magic || header->version != fi->version)
+        goto invalid;
+    
+    /* validate everything first, so a broken file is discarded as a whole */
+    p = (const char *) (header + 1);
+    
+    for (uint64_t i = 0; i < header->size; ++i) {
+        rec = (const void *) p;
+    
+        if (!record_ok(fi, rec, end - p))
+            goto invalid;
+    
+        p += rec->size;
+    }
+    
+    /* nothing but the records may follow the header */
+    if (p != end)
+        goto invalid;
+    
+    /* the first record of a uri wins */
+    for (rec = file_index_next_mapped(fi, NULL); rec; 
+         rec = file_index_next_mapped(fi, rec)) {
+        const char *uri = record_strings(fi, rec);
+    
+        if (map_contains(&fi->map, uri))
+            continue;
+    
+        err = map_insert(&fi->map, uri, (void *) rec);
+        if (err < 0) {
+            map_clear(&fi->map);
+            file_index_unmap(fi);
+            return err;
+        }
+    }
+    
+    return 0;
+    
+invalid:
+    file_index_unmap(fi);
+    return -EBADMSG;
+}
+
+const struct file_record *
+file_index_lookup(const struct file_index *__restrict fi, 
+                  const char *__restrict uri)
+{
+    return map_retrieve(&fi->map, uri);
+}
+
+const struct file_record *file_index_take(struct file_index *__restrict fi, 
+                                          const char *__restrict uri)
+{
+    return map_take(&fi->map, uri);
+}
+
+int file_index_put(struct file_index *__restrict fi, 
+                   const struct file_record *__restrict rec)
+{
+    const char *uri = record_strings(fi, rec);
+    
+    /* replace a possibly outdated record */
+    map_take(&fi->map, uri);
+    
+    return map_insert(&fi->map, uri, (void *) rec);
+}
+
+bool file_index_is_current(const struct file_index *__restrict fi,
+                           const struct file_record *__restrict rec)
+{
+    return map_retrieve(&fi->map, record_strings(fi, rec)) == rec;
+}
+
+const struct file_record *
+file_index_next_mapped(const struct file_index *__restrict fi, 
+                       const struct file_record *__restrict rec)
+{
+    const struct file_index_header *header = fi->data;
+    const char *p;
+    
+    if (!header || header->size == 0)
+        return NULL;
+    
+    if (!rec)
+        return (const void *) (header + 1);
+    
+    /* file_index_load() made sure the records fill the file exactly */
+    p = (const char *) rec + rec->size;
+    
+    if (p >= (const char *) fi->data + fi->data_size)
+        return NULL;
+    
+    return (const void *) p;
+}
+
+void *file_record_new(const struct file_index *__restrict fi,
+                      const char *const strings[FILE_INDEX_STRINGS])
+{
+    size_t len[FILE_INDEX_STRINGS], size;
+    struct file_record *rec;
+    char *p;
+    
+    size = fi->head_size;
+    
+    for (unsigned int i = 0; i < FILE_INDEX_STRINGS; ++i) {
+        len[i] = strlen(strings[i]) + 1;
+        size += len[i];
+    }
+    
+    size = (size + FILE_INDEX_ALIGNMENT - 1) & ~(FILE_INDEX_ALIGNMENT - 1);
+    
+    rec = calloc(1, size);
+    if (!rec)
+        return NULL;
+    
+    rec->size = size;
+    
+    p = (char *) rec + fi->head_size;
+    
+    for (unsigned int i = 0; i < FILE_INDEX_STRINGS; ++i) {
+        memcpy(p, strings[i], len[i]);
+        p += len[i];
+    }
+    
+    return rec;
+}
+
+const char *file_record_string(const struct file_index *__restrict fi,
+                               const struct file_record *__restrict rec,
+                               unsigned int i)
+{
+    const char *s = record_strings(fi, rec);
+    
+    while (i--)
+        s = strchr(s, '\0') + 1;
+    
+    return s;
+}
+
+uint64_t file_index_mtime(const struct stat *__restrict st)
+{
+    return (uint64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+int file_index_writer_open(struct file_index_writer *__restrict w,
+                           const struct file_index *__restrict fi)
+{
+    struct file_index_header header;
+    int err;
+    
+    err = asprintf(&w->tmp, "%s.tmp", fi->path);
+    if (err < 0)
+        return -ENOMEM;
+    
+    w->file = fopen(w->tmp, "we");
+    if (!w->file) {
+        err = -errno;
+        free(w->tmp);
+        return err;
+    }
+    
+    w->size = 0;
+    
+    /* the number of records is filled in by file_index_writer_commit() */
+    memset(&header, 0, sizeof(header));
+    fwrite(&header, sizeof(header), 1, w->file);
+    
+    return 0;
+}
+
+void file_index_writer_append(struct file_index_writer *__restrict w,
+                              const struct file_record *__restrict rec)
+{
+    fwrite(rec, rec->size, 1, w->file);
+    w->size += 1;
+}
+
+int file_index_writer_commit(struct file_index_writer *__restrict w,
+                             const struct file_index *__restrict fi)
+{
+    struct file_index_header header;
+    int err;
+    
+    header.magic   = fi->magic;
+    header.version = fi->version;
+    header.size    = w->size;
+    
+    err = fseek(w->file, 0, SEEK_SET);
+    if (err == 0)
+        fwrite(&header, sizeof(header), 1, w->file);
+    
+    if (err == 0)
+        err = fflush(w->file);
+    
+    if (err == 0)
+        err = fsync(fileno(w->file));
+    
+    if (ferror(w->file) || err < 0) {
+        fclose(w->file);
+        err = -EIO;
+        goto cleanup1;
+    }
+    
+    err = fclose(w->file);
+    if (err < 0) {
+        err = -errno;
+        goto cleanup1;
+    }
+    
+    err = rename(w->tmp, fi->path);
+    if (err < 0) {
+        err = -errno;
+        goto cleanup1;
+    }
+    
+    free(w->tmp);
+    
+    return 0;
+    
+cleanup1:
+    unlink(w->tmp);
+    free(w->tmp);
+    return err;
+}
\ No newline at end of file
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FILE_INDEX_H_
+#define _FILE_INDEX_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include <libvci/map.h>
+
+/*
+ * Memory mapped file of records about local files, looked up by uri. It 
+ * backs the tag cache of climpd as well as the scan index of 
+ * climp-discoverer. Each record starts with a 'struct file_record', followed
+ * by the fixed fields of its user and FILE_INDEX_STRINGS null-terminated 
+ * strings, the uri being the first one. Records are padded to 
+ * FILE_INDEX_ALIGNMENT.
+ */
+#define FILE_INDEX_ALIGNMENT    8
+#define FILE_INDEX_STRINGS      4
+
+struct file_record {
+    uint32_t size;
+};
+
+struct file_index {
+    struct map map;
+    char *path;
+    
+    void *data;
+    size_t data_size;
+    
+    uint32_t magic;
+    uint32_t version;
+    /* offset of the strings within a record */
+    size_t head_size;
+};
+
+struct file_index_writer {
+    FILE *file;
+    char *tmp;
+    uint64_t size;
+};
+
+int file_index_init(struct file_index *__restrict fi, 
+                    const char *__restrict path,
+                    uint32_t magic,
+                    uint32_t version,
+                    size_t head_size);
+
+void file_index_destroy(struct file_index *__restrict fi);
+
+/* 
+ * Maps and indexes the file, a missing file is no error. An invalid file 
+ * is discarded as a whole and reported with -EBADMSG.
+ */
+int file_index_load(struct file_index *__restrict fi);
+
+const struct file_record *
+file_index_lookup(const struct file_index *__restrict fi, 
+                  const char *__restrict uri);
+
+const struct file_record *file_index_take(struct file_index *__restrict fi, 
+                                          const char *__restrict uri);
+
+/* Makes 'rec' the record of its uri, 'rec' has to outlive the index */
+int file_index_put(struct file_index *__restrict fi, 
+                   const struct file_record *__restrict rec);
+
+bool file_index_is_current(const struct file_index *__restrict fi,
+                           const struct file_record *__restrict rec);
+
+/* Iterates the records of the mapped file, starts with 'rec' being NULL */
+const struct file_record *
+file_index_next_mapped(const struct file_index *__restrict fi, 
+                       const struct file_record *__restrict rec);
+
+/* 
+ * Allocates a zeroed record holding 'strings', the fixed fields are filled 
+ * in by the caller. The record is released with free().
+ */
+void *file_record_new(const struct file_index *__restrict fi,
+                      const char *const strings[FILE_INDEX_STRINGS]);
+
+const char *file_record_string(const struct file_index *__restrict fi,
+                               const struct file_record *__restrict rec,
+                               unsigned int i);
+
+uint64_t file_index_mtime(const struct stat *__restrict st);
+
+/* 
+ * Writes a new file next to the old one, which replaces it only once 
+ * everything is on disk.
+ */
+int file_index_writer_open(struct file_index_writer *__restrict w,
+                           const struct file_index *__restrict fi);
+
+void file_index_writer_append(struct file_index_writer *__restrict w,
+                              const struct file_record *__restrict rec);
+
+int file_index_writer_commit(struct file_index_writer *__restrict w,
+                             const struct file_index *__restrict fi);
+
+#endif /* _FILE_INDEX_H_ */
\ No newline at end of file
@@ -19,6 +19,7 @@
  */
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
@@ -34,37 +35,129 @@
 
 #include "ipc.h"
 
-static int ipc_send(int sock, void *__restrict buf, size_t len)
+static void ipc_header_init(struct ipc_header *__restrict hdr, 
+                            enum ipc_message_type type,
+                            size_t size)
+{
+    hdr->magic   = IPC_MAGIC;
+    hdr->version = IPC_PROTOCOL_VERSION;
+    hdr->type    = type;
+    hdr->size    = size;
+}
+
+static int ipc_header_valid(const struct ipc_header *__restrict hdr)
+{
+    if (hdr->magic != IPC_MAGIC || hdr->version != IPC_PROTOCOL_VERSION)
+        return -EPROTONOSUPPORT;
+    
+    if (hdr->size > IPC_MESSAGE_MAX_SIZE)
+        return -EMSGSIZE;
+    
+    return 0;
+}
+
+static int ipc_header_check(const struct ipc_header *__restrict hdr,
+                            enum ipc_message_type type)
 {
     int err;
     
+    err = ipc_header_valid(hdr);
+    if (err < 0)
+        return err;
+    
+    if (hdr->type != type)
+        return -EPROTO;
+    
+    return 0;
+}
+
+static int ipc_sendmsg(int sock, struct msghdr *__restrict msghdr)
+{
+    ssize_t n;
+    
+    /* sendmsg() on a blocking stream socket only returns after sending all */
 again:
-    err = send(sock, buf, len, MSG_NOSIGNAL);
-    if (err < 0) {
+    n = sendmsg(sock, msghdr, MSG_NOSIGNAL);
+    if (n < 0) {
         if (errno == EINTR)
             goto again;
-        
+
         return -errno;
     }
     
     return 0;
 }
 
-static int ipc_recv(int sock, void *__restrict buf, size_t len)
+static int ipc_send(int sock, enum ipc_message_type type, 
+                    const void *__restrict buf, size_t len)
 {
-    ssize_t err;
+    struct ipc_header hdr;
+    struct msghdr msghdr;
+    struct iovec iov[2];
     
-again:
-    err = recv(sock, buf, len, MSG_NOSIGNAL);
-    if (err < 0) {
-        if (errno == EINTR)
-            goto again;
+    ipc_header_init(&hdr, type, len);
+    
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len  = sizeof(hdr);
+    iov[1].iov_base = (void *) buf;
+    iov[1].iov_len  = len;
+    
+    memset(&msghdr, 0, sizeof(msghdr));
+    
+    msghdr.msg_iov    = iov;
+    msghdr.msg_iovlen = 2;
+    
+    return ipc_sendmsg(sock, &msghdr);
+}
+
+static int ipc_recv(int sock, void *__restrict buf, size_t len)
+{
+    char *p = buf;
+    ssize_t n;
+    
+    while (len > 0) {
+        n = recv(sock, p, len, MSG_NOSIGNAL | MSG_WAITALL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            
+            return -errno;
+        }
         
-        return -errno;
+        if (n == 0)
+            return -EIO;
+        
+        p   += n;
+        len -= n;
     }
     
-    if (err == 0)
-        return -EIO;
+    return 0;
+}
+
+static int ipc_recv_header(int sock, 
+                           struct ipc_header *__restrict hdr,
+                           enum ipc_message_type type)
+{
+    int err;
+    
+    err = ipc_recv(sock, hdr, sizeof(*hdr));
+    if (err < 0)
+        return err;
+    
+    return ipc_header_check(hdr, type);
+}
+
+int ipc_socket_path(char **path)
+{
+    const char *env = getenv("CLIMPD_SOCKET");
+    
+    if (env) {
+        *path = strdup(env);
+        return (*path) ? 0 : -errno;
+    }
+    
+    if (asprintf(path, "/tmp/.climpd-%u.sock", getuid()) < 0)
+        return -ENOMEM;
     
     return 0;
 }
@@ -72,27 +165,39 @@ again:
 int ipc_send_setup(int sock, int fd_in,int fd_out, int fd_err, 
                    const char *__restrict wd)
 {
-    static __thread char wd_buf[PATH_MAX];
+    struct ipc_header hdr;
     struct msghdr msghdr;
-    struct iovec iov;
+    struct iovec iov[2];
     struct cmsghdr *cmsg;
-    char data[CMSG_SPACE(sizeof(fd_in) + sizeof(fd_out) + sizeof(fd_err))];
+    char data[CMSG_SPACE(IPC_FD_COUNT * sizeof(int))];
     int *fds;
-    ssize_t err;
-
-    iov.iov_base = strncpy(wd_buf, wd, PATH_MAX);
-    iov.iov_len  = PATH_MAX;
+    size_t len;
+    
+    /* only send the actual working directory, not a PATH_MAX sized buffer */
+    len = strlen(wd) + 1;
+    if (len > PATH_MAX)
+        return -ENAMETOOLONG;
+    
+    ipc_header_init(&hdr, IPC_MESSAGE_SETUP, len);
+    
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len  = sizeof(hdr);
+    iov[1].iov_base = (void *) wd;
+    iov[1].iov_len  = len;
+    
+    memset(data, 0, sizeof(data));
     
     msghdr.msg_control    = data;
     msghdr.msg_controllen = sizeof(data);
-    msghdr.msg_iov        = &iov;
-    msghdr.msg_iovlen     = 1;
+    msghdr.msg_iov        = iov;
+    msghdr.msg_iovlen     = 2;
     msghdr.msg_name       = NULL;
     msghdr.msg_namelen    = 0;
+    msghdr.msg_flags      = 0;
     
     cmsg = CMSG_FIRSTHDR(&msghdr);
     
-    cmsg->cmsg_len   = msghdr.msg_controllen;
+    cmsg->cmsg_len   = CMSG_LEN(IPC_FD_COUNT * sizeof(int));
     cmsg->cmsg_level = SOL_SOCKET;
     cmsg->cmsg_type  = SCM_RIGHTS;
     
@@ -101,34 +206,22 @@ int ipc_send_setup(int sock, int fd_in,int fd_out, int fd_err,
     fds[1] = fd_out;
     fds[2] = fd_err;
     
-again:
-    err = sendmsg(sock, &msghdr, MSG_NOSIGNAL);
-    if (err < 0) {
-        if (errno == EINTR)
-            goto again;
-
-        return -errno;
-    }
-
-    return 0;
+    return ipc_sendmsg(sock, &msghdr);
 }
 
 int ipc_recv_setup(int sock, int *fd_in, int *fd_out, int *fd_err, char **cwd)
 {
+    struct ipc_header hdr;
     struct msghdr msghdr;
     struct iovec iov;
     struct cmsghdr *cmsg;
-    char data[CMSG_SPACE(sizeof(*fd_in) + sizeof(*fd_out) + sizeof(*fd_err))];
+    char data[CMSG_SPACE(IPC_FD_COUNT * sizeof(int))];
     int *fds;
-    ssize_t err;
-    size_t len = PATH_MAX * sizeof(**cwd);
-    
-    *cwd = malloc(len);
-    if (!*cwd)
-        return -errno;
+    ssize_t n;
+    int err;
     
-    iov.iov_base = *cwd;
-    iov.iov_len  = len;
+    iov.iov_base = &hdr;
+    iov.iov_len  = sizeof(hdr);
     
     msghdr.msg_control    = data;
     msghdr.msg_controllen = sizeof(data);
@@ -136,34 +229,68 @@ int ipc_recv_setup(int sock, int *fd_in, int *fd_out, int *fd_err, char **cwd)
     msghdr.msg_iovlen     = 1;
     msghdr.msg_name       = NULL;
     msghdr.msg_namelen    = 0;
+    msghdr.msg_flags      = 0;
     
-    cmsg = CMSG_FIRSTHDR(&msghdr);
-    
-    cmsg->cmsg_len   = msghdr.msg_controllen;
-    cmsg->cmsg_level = 0;
-    cmsg->cmsg_type  = 0;
-    
+    /* the file descriptors are attached to the header of the message */
 again:
-    err = recvmsg(sock, &msghdr, MSG_NOSIGNAL);
-    if (err < 0) {
+    n = recvmsg(sock, &msghdr, MSG_NOSIGNAL | MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    if (n < 0) {
         if (errno == EINTR)
             goto again;
         
-        free(*cwd);
-        return err;
+        return -errno;
     }
     
-    if (err == 0) {
-        free(*cwd);
+    if (n == 0)
         return -EIO;
-    }
+    
+    cmsg = CMSG_FIRSTHDR(&msghdr);
+    
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(IPC_FD_COUNT * sizeof(int)))
+        return -EPROTO;
     
     fds = (int *) CMSG_DATA(cmsg);
+    
+    if ((size_t) n != sizeof(hdr)) {
+        err = -EPROTO;
+        goto cleanup1;
+    }
+    
+    err = ipc_header_check(&hdr, IPC_MESSAGE_SETUP);
+    if (err < 0)
+        goto cleanup1;
+    
+    if (hdr.size == 0 || hdr.size > PATH_MAX) {
+        err = -EPROTO;
+        goto cleanup1;
+    }
+    
+    *cwd = malloc(hdr.size);
+    if (!*cwd) {
+        err = -errno;
+        goto cleanup1;
+    }
+    
+    err = ipc_recv(sock, *cwd, hdr.size);
+    if (err < 0)
+        goto cleanup2;
+    
+    (*cwd)[hdr.size - 1] = '\0';
+    
     *fd_in  = fds[0];
     *fd_out = fds[1];
     *fd_err = fds[2];
 
     return 0;
+
+cleanup2:
+    free(*cwd);
+cleanup1:
+    for (unsigned int i = 0; i < IPC_FD_COUNT; ++i)
+        close(fds[i]);
+    
+    return err;
 }
 
 int ipc_send_argv(int sock, const char **argv, int argc)
@@ -172,7 +299,7 @@ int ipc_send_argv(int sock, const char **argv, int argc)
     int i, err;
     size_t buf_size, argv_lengths[argc];
     
-    buf_size = sizeof(argc) + sizeof(buf_size);
+    buf_size = sizeof(argc);
     
     for (i = 0; i < argc; ++i) {
         argv_lengths[i] = strlen(argv[i]) + 1;
@@ -184,14 +311,14 @@ int ipc_send_argv(int sock, const char **argv, int argc)
         return err;
     
     buffer_write(&buf, &argc, sizeof(argc));
-    buffer_write(&buf, &buf_size, sizeof(buf_size));
     
     for (i = 0; i < argc; ++i)
         buffer_write(&buf, argv[i], argv_lengths[i]);
     
     assert(buffer_size(&buf) == buf_size && "Invalid buffer size");
     
-    err = ipc_send(sock, buffer_data(&buf), buffer_size(&buf));
+    err = ipc_send(sock, IPC_MESSAGE_ARGV, buffer_data(&buf), 
+                   buffer_size(&buf));
     
     buffer_destroy(&buf);
     
@@ -200,54 +327,222 @@ int ipc_send_argv(int sock, const char **argv, int argc)
 
 int ipc_recv_argv(int sock, char ***argv, int *argc)
 {
-    char *buf;
-    size_t buf_len, size;
-    int i, err;
+    struct ipc_header hdr;
+    void *payload;
+    int err;
+    
+    err = ipc_recv_header(sock, &hdr, IPC_MESSAGE_ARGV);
+    if (err < 0)
+        return err;
     
-    err = ipc_recv(sock, argc, sizeof(*argc));
+    payload = malloc(hdr.size);
+    if (!payload)
+        return -errno;
+    
+    err = ipc_recv(sock, payload, hdr.size);
+    if (err < 0)
+        goto out;
+    
+    err = ipc_parse_argv(&hdr, payload, argv, argc);
+
+out:
+    free(payload);
+    return err;
+}
+
+int ipc_send_status(int sock, int status)
+{
+    return ipc_send(sock, IPC_MESSAGE_STATUS, &status, sizeof(status));
+}
+
+int ipc_recv_status(int sock, int *__restrict status)
+{
+    struct ipc_header hdr;
+    int err;
+    
+    err = ipc_recv_header(sock, &hdr, IPC_MESSAGE_STATUS);
     if (err < 0)
         return err;
     
-    err = ipc_recv(sock, &buf_len, sizeof(buf_len));
+    if (hdr.size != sizeof(*status))
+        return -EPROTO;
+    
+    return ipc_recv(sock, status, sizeof(*status));
+}
+
+int ipc_send_subscribe(int sock, uint32_t mask)
+{
+    return ipc_send(sock, IPC_MESSAGE_SUBSCRIBE, &mask, sizeof(mask));
+}
+
+int ipc_recv_event(int sock, struct ipc_event *__restrict ev, char **text)
+{
+    struct ipc_header hdr;
+    size_t len;
+    int err;
+    
+    err = ipc_recv_header(sock, &hdr, IPC_MESSAGE_EVENT);
     if (err < 0)
         return err;
     
-    if (*argc > (int) sysconf(_SC_ARG_MAX))
-        return -EINVAL;
+    if (hdr.size <= sizeof(*ev) || hdr.size > sizeof(*ev) + IPC_EVENT_TEXT_MAX)
+        return -EPROTO;
     
-    /* allocate space for 'argv' array plus all transmitted strings */
-    size = *argc * sizeof(*argv) + buf_len - sizeof(*argc) - sizeof(buf_len);
+    err = ipc_recv(sock, ev, sizeof(*ev));
+    if (err < 0)
+        return err;
     
-    buf = malloc(size);
-    if (!buf)
-        return -errno;
+    len = hdr.size - sizeof(*ev);
     
-    *argv = (char **) buf;
-    /* 
-     * leave space for the 'argv' array 
-     * and jump to the beginning of the string buffer 
-     */
-    buf += *argc * sizeof(*argv);
+    *text = malloc(len);
+    if (!*text)
+        return -errno;
     
-    /* read in all strings at once */
-    err = ipc_recv(sock, buf, buf_len - sizeof(*argc) - sizeof(buf_len));
+    err = ipc_recv(sock, *text, len);
     if (err < 0) {
-        free(*argv);
+        free(*text);
         return err;
     }
     
-    for (i = 0; i < *argc; ++i, buf = strchr(buf, '\0') + 1)
-        (*argv)[i] = buf;
+    (*text)[len - 1] = '\0';
     
     return 0;
 }
 
-int ipc_send_status(int sock, int status)
+ssize_t ipc_build_event(void *__restrict buf, size_t size, 
+                        const struct ipc_event *__restrict ev,
+                        const char *__restrict text)
 {
-    return ipc_send(sock, &status, sizeof(status));
+    struct ipc_header hdr;
+    size_t len, total;
+    char *p = buf;
+    
+    if (!text)
+        text = "";
+    
+    len = strnlen(text, IPC_EVENT_TEXT_MAX - 1);
+    total = sizeof(hdr) + sizeof(*ev) + len + 1;
+    
+    if (total > size)
+        return -ENOBUFS;
+    
+    ipc_header_init(&hdr, IPC_MESSAGE_EVENT, total - sizeof(hdr));
+    
+    memcpy(p, &hdr, sizeof(hdr));
+    p += sizeof(hdr);
+    memcpy(p, ev, sizeof(*ev));
+    p += sizeof(*ev);
+    memcpy(p, text, len);
+    p[len] = '\0';
+    
+    return total;
 }
 
-int ipc_recv_status(int sock, int *__restrict status)
+ssize_t ipc_message_size(const void *__restrict buf, size_t len)
 {
-    return ipc_recv(sock, status, sizeof(*status));
+    struct ipc_header hdr;
+    int err;
+    
+    if (len < sizeof(hdr))
+        return 0;
+    
+    memcpy(&hdr, buf, sizeof(hdr));
+    
+    err = ipc_header_valid(&hdr);
+    if (err < 0)
+        return err;
+    
+    return sizeof(hdr) + hdr.size;
+}
+
+int ipc_parse_setup(const struct ipc_header *__restrict hdr, 
+                    const void *__restrict payload,
+                    char **wd)
+{
+    int err;
+    
+    err = ipc_header_check(hdr, IPC_MESSAGE_SETUP);
+    if (err < 0)
+        return err;
+    
+    if (hdr->size == 0 || hdr->size > PATH_MAX)
+        return -EPROTO;
+    
+    if (memchr(payload, '\0', hdr->size) == NULL)
+        return -EPROTO;
+    
+    *wd = strdup(payload);
+    if (!*wd)
+        return -errno;
+    
+    return 0;
 }
+
+int ipc_parse_argv(const struct ipc_header *__restrict hdr,
+                   const void *__restrict payload,
+                   char ***argv, int *argc)
+{
+    char *buf, *p, *end;
+    size_t len;
+    int i, err;
+    
+    err = ipc_header_check(hdr, IPC_MESSAGE_ARGV);
+    if (err < 0)
+        return err;
+    
+    if (hdr->size < sizeof(*argc))
+        return -EPROTO;
+    
+    memcpy(argc, payload, sizeof(*argc));
+    
+    len = hdr->size - sizeof(*argc);
+    
+    if (*argc < 0 || (size_t) *argc > len)
+        return -EPROTO;
+    
+    /* allocate space for 'argv' array plus all transmitted strings */
+    buf = malloc(*argc * sizeof(**argv) + len);
+    if (!buf)
+        return -errno;
+    
+    *argv = (char **) buf;
+    /* 
+     * leave space for the 'argv' array 
+     * and jump to the beginning of the string buffer 
+     */
+    p   = buf + *argc * sizeof(**argv);
+    end = p + len;
+    
+    memcpy(p, (const char *) payload + sizeof(*argc), len);
+    
+    for (i = 0; i < *argc; ++i) {
+        char *next = memchr(p, '\0', end - p);
+        if (!next) {
+            free(*argv);
+            return -EPROTO;
+        }
+        
+        (*argv)[i] = p;
+        p = next + 1;
+    }
+    
+    return 0;
+}
+
+int ipc_parse_subscribe(const struct ipc_header *__restrict hdr,
+                        const void *__restrict payload,
+                        uint32_t *__restrict mask)
+{
+    int err;
+    
+    err = ipc_header_check(hdr, IPC_MESSAGE_SUBSCRIBE);
+    if (err < 0)
+        return err;
+    
+    if (hdr->size != sizeof(*mask))
+        return -EPROTO;
+    
+    memcpy(mask, payload, sizeof(*mask));
+    
+    return 0;
+}
\ No newline at end of file
@@ -21,6 +21,71 @@
 #ifndef _IPC_H_
 #define _IPC_H_
 
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Every message starts with a 'struct ipc_header' which is followed by
+ * 'size' bytes of payload. A client sends IPC_MESSAGE_SETUP once after
+ * connecting and may then send any number of IPC_MESSAGE_ARGV messages
+ * over the same connection. The server answers each of them with an
+ * IPC_MESSAGE_STATUS message in the same order.
+ *
+ * A client that sends IPC_MESSAGE_SUBSCRIBE instead gets one status
+ * message and from then on an IPC_MESSAGE_EVENT for every event selected
+ * by the subscribed mask. Such a connection does not take further
+ * commands.
+ */
+#define IPC_MAGIC               0x434c4d50u
+#define IPC_PROTOCOL_VERSION    2
+#define IPC_MESSAGE_MAX_SIZE    (2 * 1024 * 1024)
+/* number of file descriptors attached to IPC_MESSAGE_SETUP */
+#define IPC_FD_COUNT            3
+
+enum ipc_message_type {
+    IPC_MESSAGE_SETUP     = 1,
+    IPC_MESSAGE_ARGV      = 2,
+    IPC_MESSAGE_STATUS    = 3,
+    IPC_MESSAGE_SUBSCRIBE = 4,
+    IPC_MESSAGE_EVENT     = 5,
+};
+
+enum ipc_event_type {
+    /* 'value' is the playlist index, the text the uri of the track */
+    IPC_EVENT_TRACK         = 1,
+    IPC_EVENT_END_OF_STREAM = 2,
+    /* the text is the error message */
+    IPC_EVENT_BUS_ERROR     = 3,
+    IPC_EVENT_VOLUME        = 4,
+    IPC_EVENT_MUTE          = 5,
+    /* 'value' events were dropped because the client did not keep up */
+    IPC_EVENT_OVERFLOW      = 6,
+};
+
+#define IPC_EVENT_MASK(type)    (1u << (type))
+#define IPC_EVENT_ALL           0xffffffffu
+/* longer texts attached to events are truncated */
+#define IPC_EVENT_TEXT_MAX      1024
+
+/* Payload of IPC_MESSAGE_EVENT, followed by a nul-terminated text */
+struct ipc_event {
+    uint32_t type;
+    uint32_t value;
+};
+
+struct ipc_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t type;
+    uint32_t size;
+};
+
+/*
+ * Allocates the path of the daemon's socket. It is taken from the
+ * environment variable CLIMPD_SOCKET if set.
+ */
+int ipc_socket_path(char **path);
+
 int ipc_send_setup(int sock, int fd_in, int fd_out, int fd_err,
                    const char *__restrict wd);
 
@@ -34,4 +99,36 @@ int ipc_send_status(int sock, int status);
 
 int ipc_recv_status(int sock, int *__restrict status);
 
+int ipc_send_subscribe(int sock, uint32_t mask);
+
+/* 'text' has to be freed by the caller */
+int ipc_recv_event(int sock, struct ipc_event *__restrict ev, char **text);
+
+/*
+ * Writes a complete event message to 'buf' and returns its size, or
+ * -ENOBUFS if it does not fit into 'size' bytes.
+ */
+ssize_t ipc_build_event(void *__restrict buf, size_t size, 
+                        const struct ipc_event *__restrict ev,
+                        const char *__restrict text);
+
+/*
+ * Returns the full size of the message at the beginning of 'buf', 0 if 
+ * the header has not been received completely yet, or a negative error
+ * code if the header is invalid.
+ */
+ssize_t ipc_message_size(const void *__restrict buf, size_t len);
+
+int ipc_parse_setup(const struct ipc_header *__restrict hdr, 
+                    const void *__restrict payload,
+                    char **wd);
+
+int ipc_parse_argv(const struct ipc_header *__restrict hdr,
+                   const void *__restrict payload,
+                   char ***argv, int *argc);
+
+int ipc_parse_subscribe(const struct ipc_header *__restrict hdr,
+                        const void *__restrict payload,
+                        uint32_t *__restrict mask);
+
 #endif /* _IPC_H_ */
\ No newline at end of file
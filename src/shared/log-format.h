@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LOG_FORMAT_H_
+#define _LOG_FORMAT_H_
+
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+
+/*
+ * With 'Log.Format = json' climpd writes one JSON object per line:
+ *
+ *   {"ts":1700000000123456,"level":"info","tag":"socket-server",
+ *    "tid":4242,"msg":"served request on socket 7 in 0 ms","fd":7,"ms":0}
+ *
+ * 'ts' is the wall clock time in microseconds and always comes first, so
+ * readers can find the time of a record without parsing all of it. Any
+ * keys after "msg" are structured fields with integer values. Lines are
+ * written in the order climpd drained them, the time stamps of records
+ * of different threads may be out of order by up to LOG_FORMAT_MAX_SKEW.
+ */
+#define LOG_FORMAT_TS_PREFIX    "{\"ts\":"
+#define LOG_FORMAT_MAX_SKEW     1000000
+#define LOG_FORMAT_LEVELS       4
+
+static inline const char *log_format_level_name(unsigned int level)
+{
+    static const char *names[LOG_FORMAT_LEVELS] = {
+        "debug", "info", "warning", "error",
+    };
+    
+    return (level < LOG_FORMAT_LEVELS) ? names[level] : "unknown";
+}
+
+/* Returns the level called 'name' or -1 */
+static inline int log_format_level_parse(const char *__restrict name, 
+                                         size_t len)
+{
+    for (unsigned int i = 0; i < LOG_FORMAT_LEVELS; ++i) {
+        const char *level = log_format_level_name(i);
+    
+        if (strlen(level) == len && strncasecmp(name, level, len) == 0)
+            return (int) i;
+    }
+    
+    return -1;
+}
+
+/* 
+ * Writes 'len' bytes of 'src' as JSON string contents to 'dst' and returns
+ * the number of bytes written. Stops early instead of splitting an escape
+ * sequence if 'dst' is too small.
+ */
+static inline size_t log_format_escape(char *__restrict dst, size_t size,
+                                       const char *__restrict src, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t n = 0;
+    
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char c = (unsigned char) src[i];
+        char esc = 0;
+    
+        switch (c) {
+        case '"':  esc = '"';  break;
+        case '\\': esc = '\\'; break;
+        case '\n': esc = 'n';  break;
+        case '\t': esc = 't';  break;
+        case '\r': esc = 'r';  break;
+        case '\b': esc = 'b';  break;
+        default:                break;
+        }
+    
+        if (esc) {
+            if (size - n < 2)
+                break;
+    
+            dst[n++] = '\\';
+            dst[n++] = esc;
+        } else if (c < 0x20) {
+            if (size - n < 6)
+                break;
+    
+            memcpy(dst + n, "\\u00", 4);
+            dst[n + 4] = hex[c >> 4];
+            dst[n + 5] = hex[c & 0xf];
+            n += 6;
+        } else {
+            if (size - n < 1)
+                break;
+    
+            dst[n++] = (char) c;
+        }
+    }
+    
+    return n;
+}
+
+#endif /* _LOG_FORMAT_H_ */
\ No newline at end of file
@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <libvci/macro.h>
+
+#include "prefilter.h"
+
+#define SNIFF_SIZE 16
+
+/* Both lists have to be sorted (case-insensitive) for bsearch() */
+static const char *audio_extensions[] = {
+    "aac", "ac3", "aif", "aifc", "aiff", "alac", "amr", "ape", "au", "dsf",
+    "flac", "m4a", "m4b", "mka", "mp2", "mp3", "mpc", "oga", "ogg", "opus",
+    "ra", "spx", "tta", "wav", "wma", "wv",
+};
+
+static const char *other_extensions[] = {
+    "7z", "accurip", "avi", "bmp", "cue", "db", "doc", "exe", "flv", "gif", 
+    "gz", "htm", "html", "ico", "ini", "jpeg", "jpg", "json", "log", "lrc", 
+    "m3u", "m3u8", "md5", "mkv", "nfo", "par2", "pdf", "pls", "png", "rar", 
+    "sfv", "tar", "tif", "tiff", "torrent", "txt", "url", "webp", "wmv", 
+    "xml", "xz", "zip",
+};
+
+struct magic {
+    unsigned int offset;
+    unsigned int len;
+    const char *bytes;
+};
+
+static const struct magic audio_magics[] = {
+    { 0, 3, "ID3"              },
+    { 0, 4, "fLaC"             },
+    { 0, 4, "OggS"             },
+    { 8, 4, "WAVE"             },
+    { 8, 4, "AIFF"             },
+    { 8, 4, "AIFC"             },
+    { 0, 4, "MAC "             },
+    { 0, 4, "wvpk"             },
+    { 0, 4, "MPCK"             },
+    { 0, 3, "MP+"              },
+    { 0, 4, ".snd"             },
+    { 0, 4, "TTA1"             },
+    { 0, 4, "DSD "             },
+    { 0, 5, "#!AMR"            },
+    { 0, 4, ".RMF"             },
+    { 4, 4, "ftyp"             },
+    { 0, 4, "\x1a\x45\xdf\xa3" },
+    { 0, 4, "\x30\x26\xb2\x75" },
+};
+
+static const struct magic other_magics[] = {
+    { 0, 3, "\xff\xd8\xff"     },
+    { 0, 4, "\x89PNG"          },
+    { 0, 4, "GIF8"             },
+    { 0, 4, "%PDF"             },
+    { 0, 4, "PK\x03\x04"       },
+    { 0, 4, "\x7f" "ELF"       },
+    { 0, 4, "Rar!"             },
+    { 0, 6, "7z\xbc\xaf\x27\x1c" },
+    { 0, 3, "\x1f\x8b\x08"     },
+    { 8, 4, "AVI "             },
+    { 8, 4, "WEBP"             },
+};
+
+static int compare_extension(const void *a, const void *b)
+{
+    return strcasecmp(a, *(const char * const *) b);
+}
+
+static bool has_extension(const char *__restrict ext, 
+                          const char **list, 
+                          size_t size)
+{
+    return bsearch(ext, list, size, sizeof(*list), &compare_extension);
+}
+
+static bool has_magic(const unsigned char *__restrict buf, 
+                      size_t len,
+                      const struct magic *magics,
+                      size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        const struct magic *m = &magics[i];
+        
+        if (m->offset + m->len > len)
+            continue;
+        
+        if (memcmp(buf + m->offset, m->bytes, m->len) == 0)
+            return true;
+    }
+    
+    return false;
+}
+
+static bool is_mpeg_frame(const unsigned char *__restrict buf, size_t len)
+{
+    /* frame sync of mpeg audio and adts streams without an ID3 tag */
+    return len >= 2 && buf[0] == 0xff && (buf[1] & 0xe0) == 0xe0;
+}
+
+static bool is_text(const unsigned char *__restrict buf, size_t len)
+{
+    for (size_t i = 0; i < len; ++i) {
+        if (!isprint(buf[i]) && !isspace(buf[i]))
+            return false;
+    }
+    
+    return true;
+}
+
+enum prefilter_verdict prefilter_check_name(const char *__restrict name)
+{
+    const char *ext;
+    
+    ext = strrchr(name, '.');
+    if (!ext || ext == name)
+        return PREFILTER_UNKNOWN;
+    
+    ++ext;
+    
+    if (has_extension(ext, audio_extensions, ARRAY_SIZE(audio_extensions)))
+        return PREFILTER_PROBE;
+    
+    if (has_extension(ext, other_extensions, ARRAY_SIZE(other_extensions)))
+        return PREFILTER_REJECT;
+    
+    return PREFILTER_UNKNOWN;
+}
+
+enum prefilter_verdict prefilter_check_content(const char *__restrict path)
+{
+    unsigned char buf[SNIFF_SIZE];
+    ssize_t n;
+    int fd;
+    
+    fd = open(path, O_RDONLY | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return PREFILTER_PROBE;
+    
+    n = pread(fd, buf, sizeof(buf), 0);
+    
+    close(fd);
+    
+    /* let the discoverer report the error */
+    if (n < 0)
+        return PREFILTER_PROBE;
+    
+    /* too small to hold any audio */
+    if (n < 4)
+        return PREFILTER_REJECT;
+    
+    if (has_magic(buf, n, audio_magics, ARRAY_SIZE(audio_magics)))
+        return PREFILTER_PROBE;
+    
+    if (is_mpeg_frame(buf, n))
+        return PREFILTER_PROBE;
+    
+    if (has_magic(buf, n, other_magics, ARRAY_SIZE(other_magics)))
+        return PREFILTER_REJECT;
+    
+    if (is_text(buf, n))
+        return PREFILTER_REJECT;
+    
+    return PREFILTER_PROBE;
+}
\ No newline at end of file
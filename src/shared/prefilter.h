@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PREFILTER_H_
+#define _PREFILTER_H_
+
+/*
+ * Cheap checks which sort out files that cannot be audio before they
+ * are handed to a (comparably expensive) GstDiscoverer.
+ */
+enum prefilter_verdict {
+    PREFILTER_REJECT,
+    PREFILTER_PROBE,
+    PREFILTER_UNKNOWN,
+};
+
+/* 
+ * Decides by the extension of 'name' only, returns PREFILTER_UNKNOWN if 
+ * the content has to be looked at. 
+ */
+enum prefilter_verdict prefilter_check_name(const char *__restrict name);
+
+/* Sniffs the first bytes of the file at 'path' */
+enum prefilter_verdict prefilter_check_content(const char *__restrict path);
+
+#endif /* _PREFILTER_H_ */
\ No newline at end of file
@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _STATUS_PAGE_H_
+#define _STATUS_PAGE_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * climpd publishes its playback status in a POSIX shared memory object, so
+ * status bars can poll it without connecting to the daemon. The object is
+ * written by the daemon's main loop only and guarded by a sequence lock:
+ * 'seq' is odd while an update is in progress and readers retry until they
+ * got a copy of 'data' with the same even sequence number before and after.
+ *
+ * Everything needed to read the page lives in this header, it does not
+ * depend on any other part of climp.
+ */
+#define STATUS_PAGE_MAGIC       0x53504c43u
+#define STATUS_PAGE_VERSION     1
+#define STATUS_PAGE_NAME_FMT    "/climpd-%u.status"
+#define STATUS_PAGE_NAME_MAX    64
+#define STATUS_PAGE_TEXT_MAX    256
+#define STATUS_PAGE_NO_TRACK    UINT32_MAX
+/* number of attempts before a reader gives up on a page under update */
+#define STATUS_PAGE_READ_RETRIES (1 << 16)
+
+#define STATUS_PAGE_MUTED       0x1u
+#define STATUS_PAGE_REPEAT      0x2u
+#define STATUS_PAGE_SHUFFLE     0x4u
+
+enum status_page_state {
+    STATUS_PAGE_STOPPED = 0,
+    STATUS_PAGE_PAUSED  = 1,
+    STATUS_PAGE_PLAYING = 2,
+};
+
+struct status_page_data {
+    /* CLOCK_MONOTONIC time in microseconds at which 'position' was taken */
+    int64_t stamp;
+    /* stream position in nanoseconds, -1 if unknown */
+    int64_t position;
+    uint32_t state;
+    uint32_t index;
+    uint32_t tracks;
+    /* duration of the active track in seconds */
+    uint32_t duration;
+    uint32_t volume;
+    uint32_t flags;
+    float speed;
+    uint32_t reserved;
+    char title[STATUS_PAGE_TEXT_MAX];
+    char artist[STATUS_PAGE_TEXT_MAX];
+    char album[STATUS_PAGE_TEXT_MAX];
+};
+
+struct status_page {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    int32_t pid;
+    _Atomic uint32_t seq;
+    struct status_page_data data;
+};
+
+/* The name can be overridden by the environment variable CLIMPD_STATUS_PAGE */
+static inline int status_page_name(char *__restrict buf, size_t size)
+{
+    const char *env = getenv("CLIMPD_STATUS_PAGE");
+    int len;
+    
+    if (env)
+        len = snprintf(buf, size, "%s", env);
+    else
+        len = snprintf(buf, size, STATUS_PAGE_NAME_FMT, (unsigned) getuid());
+    
+    return (len < 0 || (size_t) len >= size) ? -ENAMETOOLONG : 0;
+}
+
+static inline void status_page_write_begin(struct status_page *__restrict page)
+{
+    uint32_t seq = atomic_load_explicit(&page->seq, memory_order_relaxed);
+    
+    atomic_store_explicit(&page->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline void status_page_write_end(struct status_page *__restrict page)
+{
+    uint32_t seq = atomic_load_explicit(&page->seq, memory_order_relaxed);
+    
+    atomic_store_explicit(&page->seq, seq + 1, memory_order_release);
+}
+
+/*
+ * Copies a consistent snapshot of the page to 'data'. Returns -EBUSY if
+ * no stable copy could be taken, e.g. because the daemon died while
+ * updating the page.
+ */
+static inline int status_page_read(const struct status_page *__restrict page,
+                                   struct status_page_data *__restrict data)
+{
+    for (int i = 0; i < STATUS_PAGE_READ_RETRIES; ++i) {
+        uint32_t seq1, seq2;
+    
+        seq1 = atomic_load_explicit(&page->seq, memory_order_acquire);
+        if (seq1 & 1)
+            continue;
+    
+        memcpy(data, (const void *) &page->data, sizeof(*data));
+    
+        atomic_thread_fence(memory_order_acquire);
+        seq2 = atomic_load_explicit(&page->seq, memory_order_relaxed);
+    
+        if (seq1 == seq2) {
+            data->title[STATUS_PAGE_TEXT_MAX - 1]  = '\0';
+            data->artist[STATUS_PAGE_TEXT_MAX - 1] = '\0';
+            data->album[STATUS_PAGE_TEXT_MAX - 1]  = '\0';
+            return 0;
+        }
+    }
+    
+    return -EBUSY;
+}
+
+/*
+ * The daemon does not rewrite the page for every second played, readers
+ * extrapolate the position from the last sample instead.
+ */
+static inline int64_t
+status_page_position(const struct status_page_data *__restrict data)
+{
+    struct timespec ts;
+    int64_t now, pos, end;
+    
+    if (data->position < 0 || data->state != STATUS_PAGE_PLAYING)
+        return data->position;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    
+    pos = data->position + (int64_t) ((now - data->stamp) * 1000 * data->speed);
+    end = (int64_t) data->duration * 1000000000;
+    
+    if (end > 0 && pos > end)
+        pos = end;
+    
+    return pos;
+}
+
+/* Maps the page of the calling user's daemon read-only */
+static inline int status_page_open(const struct status_page **page)
+{
+    char name[STATUS_PAGE_NAME_MAX];
+    const struct status_page *p;
+    struct stat st;
+    int fd, err;
+    
+    err = status_page_name(name, sizeof(name));
+    if (err < 0)
+        return err;
+    
+    fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0)
+        return -errno;
+    
+    err = fstat(fd, &st);
+    if (err < 0) {
+        err = -errno;
+        goto cleanup1;
+    }
+    
+    /* do not trust pages planted by other users */
+    if (st.st_uid != getuid()) {
+        err = -EPERM;
+        goto cleanup1;
+    }
+    
+    if ((size_t) st.st_size < sizeof(*p)) {
+        err = -EPROTO;
+        goto cleanup1;
+    }
+    
+    p = mmap(NULL, sizeof(*p), PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        err = -errno;
+        goto cleanup1;
+    }
+    
+    close(fd);
+    
+    if (p->magic != STATUS_PAGE_MAGIC || p->version != STATUS_PAGE_VERSION) {
+        munmap((void *) p, sizeof(*p));
+        return -EPROTO;
+    }
+    
+    *page = p;
+    
+    return 0;
+    
+cleanup1:
+    close(fd);
+    return err;
+}
+
+static inline void status_page_close(const struct status_page *page)
+{
+    munmap((void *) page, sizeof(*page));
+}
+
+#endif /* _STATUS_PAGE_H_ */
\ No newline at end of file
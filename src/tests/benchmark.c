@@ -0,0 +1,577 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Times the hot paths of the playlist, the shuffler, media creation and
+ * the client protocol. Every case runs several times and the fastest run
+ * is reported as one JSON object per line, so results of different 
+ * releases can be compared by scripts:
+ *
+ *   {"name":"playlist_sort","size":100000,"ops":100000,"ns":...,...}
+ *
+ * Usage: benchmark [-r runs] [size ...]
+ *
+ * Playlist media are created from uris and marked as parsed, so no tag
+ * reading interferes with the measurement.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "../climpd/core/climpd-log.h"
+#include "../climpd/core/playlist/playlist.h"
+#include "../climpd/core/playlist/kfy.h"
+#include "../climpd/media/media.h"
+#include "../climpd/media/uri.h"
+#include "../shared/ipc.h"
+
+#define DEFAULT_RUNS    3
+/* number of operations of the cases that do not depend on a size */
+#define FIXED_OPS       100000
+#define BINARY_PATH     "/tmp/climp-benchmark" PLAYLIST_BINARY_SUFFIX
+#define TEXT_PATH       "/tmp/climp-benchmark.m3u"
+#define MEDIA_PATH      "/tmp/climp-benchmark.flac"
+
+struct timer {
+    struct timespec start;
+    uint64_t ns;
+};
+
+typedef unsigned long (*bench_func)(struct timer *, unsigned int);
+
+/* Unlike assert(), not compiled out by NDEBUG, most checked calls do work */
+#define check(expr)                                                         \
+    do {                                                                    \
+        if (!(expr)) {                                                      \
+            fprintf(stderr, "%s:%d: check '%s' failed\n", __FILE__,         \
+                    __LINE__, #expr);                                       \
+            abort();                                                        \
+        }                                                                   \
+    } while (0)
+
+static const unsigned int default_sizes[] = { 1000, 100000, 1000000 };
+static unsigned int runs = DEFAULT_RUNS;
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+static void timer_start(struct timer *__restrict t)
+{
+    clock_gettime(CLOCK_MONOTONIC, &t->start);
+}
+
+static void timer_stop(struct timer *__restrict t)
+{
+    struct timespec end;
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    t->ns += (uint64_t) (end.tv_sec - t->start.tv_sec) * 1000000000ull
+             + end.tv_nsec - t->start.tv_nsec;
+}
+
+/* The same input for every run and every release */
+static unsigned int rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    
+    return (unsigned int) (rng_state >> 32);
+}
+
+static struct media *bench_media(unsigned int i)
+{
+    char uri[128];
+    struct media *m;
+    int len;
+    
+    len = snprintf(uri, sizeof(uri), 
+                   "file:///home/user/music/artist-%03u/album-%02u/%07u.flac",
+                   i % 997, i % 13, i);
+    
+    m = media_new_uri(uri, len);
+    check(m && "media_new_uri");
+    
+    media_set_parsed(m, true);
+    
+    return m;
+}
+
+/* Fills 'pl' with 'size' tracks in a scrambled but reproducible order */
+static void fill_playlist(struct playlist *__restrict pl, unsigned int size)
+{
+    for (unsigned int i = 0; i < size; ++i) {
+        /* a prime larger than any size makes this a permutation */
+        unsigned int n = (unsigned int) ((uint64_t) i * 2654435761u % size);
+        struct media *m = bench_media(n);
+    
+        check(playlist_add_media(pl, m) == 0 && "playlist_add_media");
+        media_unref(m);
+    }
+}
+
+static void init_playlist(struct playlist *__restrict pl, unsigned int size)
+{
+    check(playlist_init(pl) == 0 && "playlist_init");
+    
+    /* measure the serialization, not the disk */
+    playlist_set_sync(pl, FILE_SYNC_NONE);
+    
+    fill_playlist(pl, size);
+}
+
+static unsigned long bench_playlist_add(struct timer *t, unsigned int size)
+{
+    struct playlist pl;
+    struct media **media;
+    
+    media = malloc(size * sizeof(*media));
+    check(media && "malloc");
+    
+    for (unsigned int i = 0; i < size; ++i)
+        media[i] = bench_media(i);
+    
+    check(playlist_init(&pl) == 0 && "playlist_init");
+    
+    timer_start(t);
+    
+    for (unsigned int i = 0; i < size; ++i)
+        playlist_add_media(&pl, media[i]);
+    
+    timer_stop(t);
+    
+    for (unsigned int i = 0; i < size; ++i)
+        media_unref(media[i]);
+    
+    playlist_destroy(&pl);
+    free(media);
+    
+    return size;
+}
+
+static unsigned long save(struct timer *t, unsigned int size, 
+                          const char *__restrict path)
+{
+    struct playlist pl;
+    int err;
+    
+    init_playlist(&pl, size);
+    
+    timer_start(t);
+    err = playlist_save(&pl, path);
+    timer_stop(t);
+    
+    check(err == 0 && "playlist_save");
+    
+    playlist_destroy(&pl);
+    
+    return size;
+}
+
+static unsigned long load(struct timer *t, unsigned int size, 
+                          const char *__restrict path)
+{
+    struct playlist pl;
+    int err;
+    
+    check(playlist_init(&pl) == 0 && "playlist_init");
+    
+    timer_start(t);
+    err = playlist_load(&pl, path);
+    timer_stop(t);
+    
+    check(err == 0 && "playlist_load");
+    check(playlist_size(&pl) == size && "invalid playlist size");
+    
+    playlist_destroy(&pl);
+    
+    return size;
+}
+
+static unsigned long bench_save_binary(struct timer *t, unsigned int size)
+{
+    return save(t, size, BINARY_PATH);
+}
+
+static unsigned long bench_load_binary(struct timer *t, unsigned int size)
+{
+    return load(t, size, BINARY_PATH);
+}
+
+static unsigned long bench_save_text(struct timer *t, unsigned int size)
+{
+    return save(t, size, TEXT_PATH);
+}
+
+static unsigned long bench_load_text(struct timer *t, unsigned int size)
+{
+    return load(t, size, TEXT_PATH);
+}
+
+static unsigned long bench_index_of(struct timer *t, unsigned int size)
+{
+    unsigned int misses = 0;
+    struct playlist pl;
+    char **paths;
+    
+    init_playlist(&pl, size);
+    
+    paths = malloc(size * sizeof(*paths));
+    check(paths && "malloc");
+    
+    for (unsigned int i = 0; i < size; ++i) {
+        struct media *m = playlist_at_unsafe(&pl, (int) (rng() % size));
+    
+        paths[i] = strdup(media_path(m));
+        check(paths[i] && "strdup");
+    }
+    
+    timer_start(t);
+    
+    for (unsigned int i = 0; i < size; ++i)
+        misses += playlist_index_of(&pl, paths[i]) == (unsigned int) -1;
+    
+    timer_stop(t);
+    
+    check(misses == 0 && "playlist_index_of");
+    
+    for (unsigned int i = 0; i < size; ++i)
+        free(paths[i]);
+    
+    free(paths);
+    playlist_destroy(&pl);
+    
+    return size;
+}
+
+/* Removes every tenth track with a single call */
+static unsigned long bench_remove_array(struct timer *t, unsigned int size)
+{
+    struct playlist pl;
+    unsigned int n = size / 10;
+    int *indices;
+    
+    init_playlist(&pl, size);
+    
+    indices = malloc(n * sizeof(*indices));
+    check(indices && "malloc");
+    
+    for (unsigned int i = 0; i < n; ++i)
+        indices[i] = (int) (i * 10);
+    
+    timer_start(t);
+    playlist_remove_array(&pl, indices, n);
+    timer_stop(t);
+    
+    check(playlist_size(&pl) == size - n && "invalid playlist size");
+    
+    free(indices);
+    playlist_destroy(&pl);
+    
+    return n;
+}
+
+static unsigned long bench_sort(struct timer *t, unsigned int size)
+{
+    struct playlist pl;
+    
+    init_playlist(&pl, size);
+    
+    timer_start(t);
+    playlist_sort(&pl);
+    timer_stop(t);
+    
+    playlist_destroy(&pl);
+    
+    return size;
+}
+
+/* One full shuffled cycle through the playlist */
+static unsigned long bench_next_shuffle(struct timer *t, unsigned int size)
+{
+    struct playlist pl;
+    
+    init_playlist(&pl, size);
+    
+    playlist_set_repeat(&pl, true);
+    playlist_set_shuffle(&pl, true);
+    
+    timer_start(t);
+    
+    for (unsigned int i = 0; i < size; ++i)
+        playlist_next(&pl);
+    
+    timer_stop(t);
+    
+    playlist_destroy(&pl);
+    
+    return size;
+}
+
+static unsigned long bench_kfy_add(struct timer *t, unsigned int size)
+{
+    struct kfy k;
+    int err;
+    
+    check(kfy_init(&k, 0) == 0 && "kfy_init");
+    
+    timer_start(t);
+    err = kfy_add(&k, size);
+    timer_stop(t);
+    
+    check(err == 0 && "kfy_add");
+    
+    kfy_destroy(&k);
+    
+    return size;
+}
+
+static unsigned long bench_kfy_insert(struct timer *t, unsigned int size)
+{
+    struct kfy k;
+    
+    check(kfy_init(&k, 0) == 0 && "kfy_init");
+    
+    timer_start(t);
+    
+    for (unsigned int i = 0; i < size; ++i)
+        kfy_add(&k, 1);
+    
+    timer_stop(t);
+    
+    kfy_destroy(&k);
+    
+    return size;
+}
+
+static unsigned long bench_kfy_shuffle(struct timer *t, unsigned int size)
+{
+    struct kfy k;
+    
+    check(kfy_init(&k, size) == 0 && "kfy_init");
+    check(kfy_add(&k, size) == 0 && "kfy_add");
+    
+    timer_start(t);
+    
+    for (unsigned int i = 0; i < size; ++i)
+        kfy_shuffle(&k);
+    
+    timer_stop(t);
+    
+    kfy_destroy(&k);
+    
+    return size;
+}
+
+static unsigned long bench_kfy_remove(struct timer *t, unsigned int size)
+{
+    unsigned int n = size / 10;
+    struct kfy k;
+    
+    check(kfy_init(&k, size) == 0 && "kfy_init");
+    check(kfy_add(&k, size) == 0 && "kfy_add");
+    
+    timer_start(t);
+    
+    for (unsigned int i = 0; i < n; ++i)
+        kfy_remove(&k, rng() % kfy_size(&k));
+    
+    timer_stop(t);
+    
+    kfy_destroy(&k);
+    
+    return n;
+}
+
+/* uri_new() resolves local paths, so MEDIA_PATH has to exist */
+static unsigned long bench_uri_new(struct timer *t, unsigned int size)
+{
+    (void) size;
+    
+    timer_start(t);
+    
+    for (unsigned int i = 0; i < FIXED_OPS; ++i)
+        uri_delete(uri_new("/tmp/../tmp/./climp-benchmark.flac"));
+    
+    timer_stop(t);
+    
+    return FIXED_OPS;
+}
+
+static unsigned long bench_media_new(struct timer *t, unsigned int size)
+{
+    (void) size;
+    
+    timer_start(t);
+    
+    for (unsigned int i = 0; i < FIXED_OPS; ++i)
+        media_unref(media_new("/tmp/../tmp/./climp-benchmark.flac"));
+    
+    timer_stop(t);
+    
+    return FIXED_OPS;
+}
+
+static void *echo_server(void *arg)
+{
+    int sock = *(int *) arg;
+    char **argv;
+    int argc;
+    
+    while (ipc_recv_argv(sock, &argv, &argc) == 0) {
+        free(argv);
+    
+        if (ipc_send_status(sock, 0) < 0)
+            break;
+    }
+    
+    return NULL;
+}
+
+/* A typical command sent and answered over a unix socket */
+static unsigned long bench_ipc_round_trip(struct timer *t, unsigned int size)
+{
+    const char *argv[] = { 
+        "--play", "/home/user/music/artist/album/01 - track.flac" 
+    };
+    pthread_t thread;
+    int sv[2], status, err = 0;
+    
+    (void) size;
+    
+    check(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == 0);
+    check(pthread_create(&thread, NULL, &echo_server, &sv[1]) == 0);
+    
+    timer_start(t);
+    
+    for (unsigned int i = 0; i < FIXED_OPS && err == 0; ++i) {
+        err = ipc_send_argv(sv[0], argv, 2);
+        if (err == 0)
+            err = ipc_recv_status(sv[0], &status);
+    }
+    
+    timer_stop(t);
+    
+    check(err == 0 && "ipc round trip");
+    
+    shutdown(sv[0], SHUT_RDWR);
+    pthread_join(thread, NULL);
+    close(sv[0]);
+    close(sv[1]);
+    
+    return FIXED_OPS;
+}
+
+static void run(const char *__restrict name, bench_func func, 
+                unsigned int size)
+{
+    uint64_t best = UINT64_MAX;
+    unsigned long ops = 0;
+    
+    for (unsigned int i = 0; i < runs; ++i) {
+        struct timer t = { .ns = 0 };
+    
+        ops = func(&t, size);
+    
+        if (t.ns < best)
+            best = t.ns;
+    }
+    
+    printf("{\"name\":\"%s\",\"size\":%u,\"ops\":%lu,\"ns\":%llu,"
+           "\"ns_per_op\":%.1f}\n", name, size, ops, 
+           (unsigned long long) best, (ops) ? (double) best / ops : 0.0);
+    fflush(stdout);
+}
+
+static const struct {
+    const char *name;
+    bench_func func;
+} sized[] = {
+    { "playlist_add",          &bench_playlist_add    },
+    /* the load cases read the files written by the save cases */
+    { "playlist_save_binary",  &bench_save_binary     },
+    { "playlist_load_binary",  &bench_load_binary     },
+    { "playlist_save_m3u",     &bench_save_text       },
+    { "playlist_load_m3u",     &bench_load_text       },
+    { "playlist_index_of",     &bench_index_of        },
+    { "playlist_remove_array", &bench_remove_array    },
+    { "playlist_sort",         &bench_sort            },
+    { "playlist_next_shuffle", &bench_next_shuffle    },
+    { "kfy_add",               &bench_kfy_add         },
+    { "kfy_add_single",        &bench_kfy_insert      },
+    { "kfy_shuffle",           &bench_kfy_shuffle     },
+    { "kfy_remove",            &bench_kfy_remove      },
+}, fixed[] = {
+    { "uri_new",               &bench_uri_new         },
+    { "media_new",             &bench_media_new       },
+    { "ipc_round_trip",        &bench_ipc_round_trip  },
+};
+
+int main(int argc, char *argv[])
+{
+    unsigned int sizes[argc + 3];
+    unsigned int n = 0;
+    int fd;
+    
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            runs = (unsigned int) strtoul(argv[++i], NULL, 10);
+        else
+            sizes[n++] = (unsigned int) strtoul(argv[i], NULL, 10);
+    }
+    
+    if (n == 0) {
+        memcpy(sizes, default_sizes, sizeof(default_sizes));
+        n = sizeof(default_sizes) / sizeof(*default_sizes);
+    }
+    
+    if (runs == 0)
+        runs = 1;
+    
+    gst_init(NULL, NULL);
+    check(climpd_log_init("/tmp/benchmark.log") == 0 && "climpd_log_init");
+    
+    for (unsigned int i = 0; i < n; ++i) {
+        for (unsigned int j = 0; j < sizeof(sized) / sizeof(*sized); ++j)
+            run(sized[j].name, sized[j].func, sizes[i]);
+    }
+    
+    fd = open(MEDIA_PATH, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    check(fd >= 0 && "open");
+    close(fd);
+    
+    for (unsigned int j = 0; j < sizeof(fixed) / sizeof(*fixed); ++j)
+        run(fixed[j].name, fixed[j].func, 0);
+    
+    unlink(MEDIA_PATH);
+    unlink(BINARY_PATH);
+    unlink(TEXT_PATH);
+    
+    climpd_log_destroy();
+    gst_deinit();
+    
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,232 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "../climpd/core/playlist/kfy.h"
+
+#define SIZE    200
+#define ROUNDS  5000
+
+/* reference model of the played flags, kept in index order */
+static bool model[2 * SIZE];
+static unsigned int model_size;
+
+static void model_insert(unsigned int index)
+{
+    memmove(model + index + 1, model + index, 
+            (model_size - index) * sizeof(*model));
+    
+    model[index] = false;
+    model_size += 1;
+}
+
+static void model_remove(unsigned int index)
+{
+    model_size -= 1;
+    
+    memmove(model + index, model + index + 1, 
+            (model_size - index) * sizeof(*model));
+}
+
+static void check_model(const struct kfy *__restrict k)
+{
+    bool played[2 * SIZE];
+    unsigned int unplayed = 0;
+    
+    assert(kfy_size(k) == model_size && "invalid size");
+    
+    kfy_get_played(k, played);
+    
+    for (unsigned int i = 0; i < model_size; ++i) {
+        assert(played[i] == model[i] && "played flag moved");
+        unplayed += !model[i];
+    }
+    
+    assert(kfy_unplayed(k) == unplayed && "invalid unplayed count");
+}
+
+static void test_insert_remove(void)
+{
+    struct kfy k;
+    
+    assert(kfy_init(&k, SIZE) == 0 && "kfy_init");
+    
+    memset(model, 0, sizeof(model));
+    model_size = SIZE;
+    
+    check_model(&k);
+    
+    for (unsigned int i = 0; i < ROUNDS; ++i) {
+        unsigned int index;
+    
+        switch (rand() % 3) {
+        case 0:
+            if (model_size >= 2 * SIZE)
+                break;
+    
+            index = rand() % (model_size + 1);
+    
+            assert(kfy_insert(&k, index) == 0 && "kfy_insert");
+            model_insert(index);
+            break;
+        case 1:
+            if (model_size <= 1)
+                break;
+    
+            index = rand() % model_size;
+    
+            kfy_remove(&k, index);
+            model_remove(index);
+            break;
+        case 2:
+        default:
+            if (kfy_cycle_done(&k))
+                memset(model, 0, sizeof(model));
+    
+            index = kfy_shuffle(&k);
+    
+            assert(index < model_size && "invalid index");
+            assert(!model[index] && "played index returned");
+    
+            model[index] = true;
+            break;
+        }
+    
+        check_model(&k);
+    }
+    
+    kfy_destroy(&k);
+}
+
+static void test_full_cycle(void)
+{
+    bool seen[SIZE];
+    struct kfy k;
+    
+    assert(kfy_init(&k, SIZE) == 0 && "kfy_init");
+    
+    for (unsigned int cycle = 0; cycle < 3; ++cycle) {
+        memset(seen, 0, sizeof(seen));
+    
+        for (unsigned int i = 0; i < SIZE; ++i) {
+            unsigned int index = kfy_shuffle(&k);
+    
+            assert(index < SIZE && "invalid index");
+            assert(!seen[index] && "index returned twice in one cycle");
+    
+            seen[index] = true;
+        }
+    
+        assert(kfy_cycle_done(&k) && "cycle not done");
+    }
+    
+    kfy_destroy(&k);
+}
+
+static void test_remove_mid_cycle(bool remove_played)
+{
+    bool played[SIZE];
+    unsigned int victim, left;
+    struct kfy k;
+    
+    assert(kfy_init(&k, SIZE) == 0 && "kfy_init");
+    
+    for (unsigned int i = 0; i < SIZE / 2; ++i)
+        kfy_shuffle(&k);
+    
+    kfy_get_played(&k, played);
+    
+    victim = 0;
+    while (played[victim] != remove_played)
+        ++victim;
+    
+    kfy_remove(&k, victim);
+    memmove(played + victim, played + victim + 1, 
+            (SIZE - victim - 1) * sizeof(*played));
+    
+    left = SIZE / 2 - !remove_played;
+    
+    assert(kfy_unplayed(&k) == left && "invalid unplayed count");
+    
+    /* the rest of the cycle returns exactly the remaining unplayed indices */
+    for (unsigned int i = 0; i < left; ++i) {
+        unsigned int index = kfy_shuffle(&k);
+    
+        assert(index < SIZE - 1 && "invalid index");
+        assert(!played[index] && "index returned twice in one cycle");
+    
+        played[index] = true;
+    }
+    
+    assert(kfy_cycle_done(&k) && "cycle not done");
+    
+    kfy_destroy(&k);
+}
+
+static void test_peek(void)
+{
+    unsigned int index;
+    struct kfy k;
+    
+    assert(kfy_init(&k, SIZE) == 0 && "kfy_init");
+    
+    /* peeking never consumes an index, committing does */
+    for (unsigned int i = 0; i < SIZE; ++i) {
+        kfy_peek(&k);
+        assert(kfy_unplayed(&k) == SIZE - i && "kfy_peek marked played");
+    
+        index = kfy_peek(&k);
+        kfy_commit(&k, index);
+    }
+    
+    assert(kfy_cycle_done(&k) && "cycle not done");
+    
+    /* the next cycle only starts with the first commit */
+    index = kfy_peek(&k);
+    assert(kfy_cycle_done(&k) && "kfy_peek started a new cycle");
+    
+    kfy_commit(&k, index);
+    assert(kfy_unplayed(&k) == SIZE - 1 && "new cycle not started");
+    
+    kfy_destroy(&k);
+}
+
+int main(int argc, char *argv[])
+{
+    (void) argc;
+    (void) argv;
+    
+    srand(1);
+    
+    test_insert_remove();
+    test_full_cycle();
+    test_remove_mid_cycle(true);
+    test_remove_mid_cycle(false);
+    test_peek();
+    
+    printf("kfy_test: passed\n");
+    
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,723 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures the command latency a user experiences: a private climpd is
+ * started in '--no-daemon' mode with a fake audio sink and a temporary
+ * home directory, so it cannot interfere with a running daemon. Several
+ * clients then fire a weighted mix of commands at it and the latency of
+ * every request is recorded. The results are printed as one JSON object
+ * per command and one for all requests:
+ *
+ *   {"command":"--current","mode":"connect","clients":4,"count":...,...}
+ *
+ * Usage: latency [-c clients] [-n requests] [-t tracks] [-m mix]
+ *                [-D climpd] [-x climp] [-k]
+ *
+ * The mix is a ';' separated list of commands with an optional weight,
+ * e.g. "8*--current;4*--volume 40;1*--next". By default every request
+ * opens a new connection, sends the setup and the arguments and waits
+ * for the status just like climp does. With '-x' the client binary is
+ * spawned for every request, which adds the process startup. With '-k'
+ * every client keeps a single connection like 'climp --batch'.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <ftw.h>
+#include <spawn.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+
+#include "../shared/ipc.h"
+
+#define DEFAULT_CLIENTS         4
+#define DEFAULT_REQUESTS        1000
+#define DEFAULT_TRACKS          16
+#define DEFAULT_MIX             "8*--current;4*--volume 40;2*--playlist;"  \
+                                "1*--next;1*--mute"
+#define DEFAULT_CLIMPD          "/usr/local/bin/climpd"
+#define MAX_COMMANDS            32
+#define MAX_ARGS                16
+/* length of the silent test tracks in seconds */
+#define TRACK_LENGTH            10
+#define TRACK_RATE              8000
+/* 10 seconds to start the daemon */
+#define CONNECT_ATTEMPTS        1000
+/* marks a request in 'struct client.command' that failed */
+#define REQUEST_FAILED          0x80000000u
+
+extern char **environ;
+
+enum mode {
+    MODE_CONNECT,
+    MODE_KEEP,
+    MODE_EXEC,
+};
+
+struct command {
+    char *text;
+    const char *argv[MAX_ARGS + 1];
+    int argc;
+    unsigned int weight;
+};
+
+struct client {
+    pthread_t thread;
+    uint64_t rng;
+    /* latency in nanoseconds and the command of every request */
+    uint64_t *latency;
+    unsigned int *command;
+};
+
+static const char *mode_names[] = {
+    [MODE_CONNECT]  = "connect",
+    [MODE_KEEP]     = "keep",
+    [MODE_EXEC]     = "exec",
+};
+
+static struct command commands[MAX_COMMANDS];
+static unsigned int command_count;
+static unsigned int weight_sum;
+static unsigned int requests = DEFAULT_REQUESTS;
+static enum mode mode = MODE_CONNECT;
+static const char *climp_path;
+static char sock_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+static char dir[] = "/tmp/climp-latency-XXXXXX";
+static pthread_barrier_t barrier;
+static int dev_null;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static void die(const char *__restrict what, int err)
+{
+    fprintf(stderr, "latency: %s - %s\n", what, strerror(err));
+    exit(EXIT_FAILURE);
+}
+
+static int parse_mix(char *__restrict mix)
+{
+    char *save, *item;
+    
+    for (item = strtok_r(mix, ";", &save); item; 
+         item = strtok_r(NULL, ";", &save)) {
+        struct command *c;
+        char *end, *word, *save2;
+    
+        if (item[strspn(item, " ")] == '\0')
+            continue;
+    
+        if (command_count == MAX_COMMANDS)
+            return -E2BIG;
+    
+        c = &commands[command_count];
+        c->weight = (unsigned int) strtoul(item, &end, 10);
+    
+        if (*end == '*' && c->weight > 0)
+            item = end + 1;
+        else
+            c->weight = 1;
+    
+        c->text = strdup(item + strspn(item, " "));
+        if (!c->text)
+            return -errno;
+    
+        c->argc = 0;
+    
+        for (word = strtok_r(item, " ", &save2); word; 
+             word = strtok_r(NULL, " ", &save2)) {
+            if (c->argc == MAX_ARGS)
+                return -E2BIG;
+    
+            c->argv[c->argc++] = word;
+        }
+    
+        c->argv[c->argc] = NULL;
+    
+        weight_sum += c->weight;
+        ++command_count;
+    }
+    
+    return (command_count > 0) ? 0 : -EINVAL;
+}
+
+static unsigned int pick_command(struct client *__restrict c)
+{
+    unsigned int n;
+    
+    c->rng ^= c->rng << 13;
+    c->rng ^= c->rng >> 7;
+    c->rng ^= c->rng << 17;
+    
+    n = (unsigned int) ((c->rng >> 32) % weight_sum);
+    
+    for (unsigned int i = 0; i < command_count; ++i) {
+        if (n < commands[i].weight)
+            return i;
+    
+        n -= commands[i].weight;
+    }
+    
+    return 0;
+}
+
+static int connect_to_daemon(void)
+{
+    struct sockaddr_un addr;
+    int sock, err;
+    
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return -errno;
+    
+    memset(&addr, 0, sizeof(addr));
+    
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, sock_path, sizeof(addr.sun_path));
+    
+    err = connect(sock, (struct sockaddr *) &addr, sizeof(addr));
+    if (err < 0) {
+        err = -errno;
+        close(sock);
+        return err;
+    }
+    
+    /* the output of the commands is not of interest */
+    err = ipc_send_setup(sock, dev_null, dev_null, dev_null, dir);
+    if (err < 0) {
+        close(sock);
+        return err;
+    }
+    
+    return sock;
+}
+
+static int send_command(int sock, const char **argv, int argc)
+{
+    int status, err;
+    
+    err = ipc_send_argv(sock, argv, argc);
+    if (err < 0)
+        return err;
+    
+    err = ipc_recv_status(sock, &status);
+    if (err < 0)
+        return err;
+    
+    return -status;
+}
+
+static int run_command(const char **argv, int argc)
+{
+    int sock, err;
+    
+    sock = connect_to_daemon();
+    if (sock < 0)
+        return sock;
+    
+    err = send_command(sock, argv, argc);
+    
+    close(sock);
+    
+    return err;
+}
+
+static int exec_command(const struct command *__restrict c)
+{
+    posix_spawn_file_actions_t actions;
+    const char *argv[MAX_ARGS + 2];
+    int status, err;
+    pid_t pid;
+    
+    argv[0] = climp_path;
+    memcpy(argv + 1, c->argv, (size_t) (c->argc + 1) * sizeof(*argv));
+    
+    err = posix_spawn_file_actions_init(&actions);
+    if (err)
+        return -err;
+    
+    posix_spawn_file_actions_adddup2(&actions, dev_null, STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, dev_null, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, dev_null, STDERR_FILENO);
+    
+    err = posix_spawn(&pid, climp_path, &actions, NULL, (char **) argv, 
+                      environ);
+    posix_spawn_file_actions_destroy(&actions);
+    
+    if (err)
+        return -err;
+    
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR)
+            return -errno;
+    }
+    
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+        return -EIO;
+    
+    return 0;
+}
+
+static void *client_main(void *arg)
+{
+    struct client *c = arg;
+    int sock = -1, err;
+    
+    if (mode == MODE_KEEP) {
+        sock = connect_to_daemon();
+        if (sock < 0)
+            die("failed to connect to climpd", -sock);
+    }
+    
+    pthread_barrier_wait(&barrier);
+    
+    for (unsigned int i = 0; i < requests; ++i) {
+        unsigned int n = pick_command(c);
+        struct command *cmd = &commands[n];
+        uint64_t start = now_ns();
+    
+        switch (mode) {
+        case MODE_KEEP:
+            err = send_command(sock, cmd->argv, cmd->argc);
+            break;
+        case MODE_EXEC:
+            err = exec_command(cmd);
+            break;
+        default:
+            err = run_command(cmd->argv, cmd->argc);
+            break;
+        }
+    
+        c->latency[i] = now_ns() - start;
+        c->command[i] = (err < 0) ? n | REQUEST_FAILED : n;
+    }
+    
+    if (sock >= 0)
+        close(sock);
+    
+    return NULL;
+}
+
+static int write_le(int fd, uint32_t val, size_t size)
+{
+    unsigned char buf[4];
+    
+    for (size_t i = 0; i < size; ++i)
+        buf[i] = (unsigned char) (val >> (8 * i));
+    
+    return (write(fd, buf, size) == (ssize_t) size) ? 0 : -EIO;
+}
+
+/* Writes a silent 8 bit mono wave file */
+static int write_track(const char *__restrict path)
+{
+    unsigned char silence[TRACK_RATE];
+    uint32_t size = TRACK_RATE * TRACK_LENGTH;
+    int fd, err = 0;
+    
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -errno;
+    
+    memset(silence, 0x80, sizeof(silence));
+    
+    err |= (write(fd, "RIFF", 4) == 4) ? 0 : -EIO;
+    err |= write_le(fd, 36 + size, 4);
+    err |= (write(fd, "WAVEfmt ", 8) == 8) ? 0 : -EIO;
+    err |= write_le(fd, 16, 4);             /* format chunk size */
+    err |= write_le(fd, 1, 2);              /* PCM */
+    err |= write_le(fd, 1, 2);              /* channels */
+    err |= write_le(fd, TRACK_RATE, 4);     /* sample rate */
+    err |= write_le(fd, TRACK_RATE, 4);     /* byte rate */
+    err |= write_le(fd, 1, 2);              /* block align */
+    err |= write_le(fd, 8, 2);              /* bits per sample */
+    err |= (write(fd, "data", 4) == 4) ? 0 : -EIO;
+    err |= write_le(fd, size, 4);
+    
+    for (unsigned int i = 0; i < TRACK_LENGTH && err == 0; ++i) {
+        if (write(fd, silence, sizeof(silence)) != sizeof(silence))
+            err = -EIO;
+    }
+    
+    close(fd);
+    
+    return (err < 0) ? -EIO : 0;
+}
+
+static void make_dir(const char *__restrict fmt, const char *__restrict base)
+{
+    char path[PATH_MAX];
+    
+    snprintf(path, sizeof(path), fmt, base);
+    
+    if (mkdir(path, 0700) < 0 && errno != EEXIST)
+        die("failed to create directory", errno);
+}
+
+static void setup_home(unsigned int tracks)
+{
+    char path[PATH_MAX];
+    int err;
+    
+    if (!mkdtemp(dir))
+        die("failed to create temporary directory", errno);
+    
+    make_dir("%s/.config", dir);
+    make_dir("%s/.config/climp", dir);
+    make_dir("%s/.config/climp/playlists", dir);
+    make_dir("%s/.cache", dir);
+    make_dir("%s/.cache/climp", dir);
+    make_dir("%s/music", dir);
+    
+    for (unsigned int i = 0; i < tracks; ++i) {
+        snprintf(path, sizeof(path), "%s/music/track-%04u.wav", dir, i);
+    
+        err = write_track(path);
+        if (err < 0)
+            die("failed to write test track", -err);
+    }
+    
+    snprintf(sock_path, sizeof(sock_path), "%s/climpd.sock", dir);
+    snprintf(path, sizeof(path), "/climp-latency-%d.status", (int) getpid());
+    
+    /* climpd and the spawned clients inherit the environment */
+    setenv("HOME", dir, 1);
+    setenv("CLIMPD_SOCKET", sock_path, 1);
+    setenv("CLIMPD_STATUS_PAGE", path, 1);
+    setenv("CLIMPD_AUDIO_SINK", "fakesink", 1);
+    
+    snprintf(path, sizeof(path), "%s/climpd.log", dir);
+    setenv("CLIMPD_LOGFILE", path, 1);
+}
+
+static pid_t start_daemon(const char *__restrict climpd_path)
+{
+    pid_t pid;
+    int sock, status;
+    
+    pid = fork();
+    if (pid < 0)
+        die("failed to fork", errno);
+    
+    if (pid == 0) {
+        dup2(dev_null, STDIN_FILENO);
+        dup2(dev_null, STDOUT_FILENO);
+        dup2(dev_null, STDERR_FILENO);
+    
+        execl(climpd_path, climpd_path, "--no-daemon", (char *) NULL);
+        _exit(127);
+    }
+    
+    for (int i = 0; i < CONNECT_ATTEMPTS; ++i) {
+        nanosleep(&(struct timespec) { 0, 10 * 1000 * 1000 }, NULL);
+    
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            fprintf(stderr, "latency: climpd exited during startup, "
+                    "see %s\n", getenv("CLIMPD_LOGFILE"));
+            exit(EXIT_FAILURE);
+        }
+    
+        sock = connect_to_daemon();
+        if (sock >= 0) {
+            close(sock);
+            return pid;
+        }
+    }
+    
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    
+    die("failed to connect to climpd", ETIMEDOUT);
+    return -1;
+}
+
+static void setup_playlist(unsigned int tracks)
+{
+    const char **argv;
+    char *paths;
+    size_t len = sizeof("music/track-0000.wav");
+    int err;
+    
+    argv = malloc((tracks + 1) * sizeof(*argv));
+    paths = malloc(tracks * len);
+    if (!argv || !paths)
+        die("failed to allocate memory", ENOMEM);
+    
+    argv[0] = "--add";
+    
+    for (unsigned int i = 0; i < tracks; ++i) {
+        snprintf(paths + i * len, len, "music/track-%04u.wav", i);
+        argv[i + 1] = paths + i * len;
+    }
+    
+    err = run_command(argv, (int) tracks + 1);
+    if (err < 0)
+        die("failed to add the test tracks", -err);
+    
+    err = run_command((const char *[]) { "--play" }, 1);
+    if (err < 0)
+        die("failed to start playback", -err);
+    
+    free(paths);
+    free(argv);
+}
+
+static void stop_daemon(pid_t pid)
+{
+    int err;
+    
+    err = run_command((const char *[]) { "--quit" }, 1);
+    if (err < 0) {
+        fprintf(stderr, "latency: failed to quit climpd - %s\n", 
+                strerror(-err));
+        kill(pid, SIGKILL);
+    }
+    
+    waitpid(pid, NULL, 0);
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, 
+                        struct FTW *ftw)
+{
+    (void) st;
+    (void) flag;
+    (void) ftw;
+    
+    remove(path);
+    
+    return 0;
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    
+    return (x > y) - (x < y);
+}
+
+/* Percentile 'p' of the sorted 'data' in microseconds */
+static double percentile(const uint64_t *data, size_t n, double p)
+{
+    size_t i = (size_t) (p * (double) n);
+    
+    return (double) data[(i < n) ? i : n - 1] / 1000.0;
+}
+
+static void print_json_string(const char *__restrict s)
+{
+    putchar('"');
+    
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\')
+            putchar('\\');
+    
+        putchar(*s);
+    }
+    
+    putchar('"');
+}
+
+static void report(const char *name, uint64_t *data, size_t n, 
+                   unsigned int clients, unsigned int failed, uint64_t wall)
+{
+    if (n == 0)
+        return;
+    
+    qsort(data, n, sizeof(*data), &compare_latency);
+    
+    printf("{\"command\":");
+    print_json_string(name);
+    printf(",\"mode\":\"%s\",\"clients\":%u,\"count\":%zu,\"failed\":%u,"
+           "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,"
+           "\"max_us\":%.1f,\"rps\":%.1f}\n",
+           mode_names[mode], clients, n, failed,
+           percentile(data, n, 0.5), percentile(data, n, 0.99),
+           percentile(data, n, 0.999), (double) data[n - 1] / 1000.0,
+           (double) n * 1e9 / (double) wall);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *climpd_path = DEFAULT_CLIMPD;
+    unsigned int clients = DEFAULT_CLIENTS, tracks = DEFAULT_TRACKS;
+    char *mix = strdup(DEFAULT_MIX);
+    struct client *client;
+    uint64_t *data, start, wall;
+    unsigned int failed, total_failed = 0;
+    size_t n;
+    pid_t pid;
+    int opt, err;
+    
+    while ((opt = getopt(argc, argv, "c:n:t:m:D:x:k")) != -1) {
+        switch (opt) {
+        case 'c':
+            clients = (unsigned int) strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            requests = (unsigned int) strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            tracks = (unsigned int) strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            free(mix);
+            mix = strdup(optarg);
+            break;
+        case 'D':
+            climpd_path = optarg;
+            break;
+        case 'x':
+            climp_path = optarg;
+            mode = MODE_EXEC;
+            break;
+        case 'k':
+            mode = MODE_KEEP;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-c clients] [-n requests] "
+                    "[-t tracks] [-m mix] [-D climpd] [-x climp] [-k]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    if (clients == 0 || requests == 0 || tracks == 0 || tracks > 9999) {
+        fprintf(stderr, "latency: invalid number of clients, requests or "
+                "tracks\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    if (!mix)
+        die("failed to allocate memory", ENOMEM);
+    
+    err = parse_mix(mix);
+    if (err < 0)
+        die("invalid command mix", -err);
+    
+    dev_null = open("/dev/null", O_RDWR | O_CLOEXEC);
+    if (dev_null < 0)
+        die("failed to open /dev/null", errno);
+    
+    /* a client that lost its connection must not kill the harness */
+    signal(SIGPIPE, SIG_IGN);
+    
+    setup_home(tracks);
+    pid = start_daemon(climpd_path);
+    setup_playlist(tracks);
+    
+    client = calloc(clients, sizeof(*client));
+    if (!client)
+        die("failed to allocate memory", ENOMEM);
+    
+    pthread_barrier_init(&barrier, NULL, clients + 1);
+    
+    for (unsigned int i = 0; i < clients; ++i) {
+        client[i].rng = 0x9e3779b97f4a7c15ull * (i + 1);
+        client[i].latency = malloc(requests * sizeof(*client[i].latency));
+        client[i].command = malloc(requests * sizeof(*client[i].command));
+    
+        if (!client[i].latency || !client[i].command)
+            die("failed to allocate memory", ENOMEM);
+    
+        err = pthread_create(&client[i].thread, NULL, &client_main, &client[i]);
+        if (err)
+            die("failed to start client", err);
+    }
+    
+    pthread_barrier_wait(&barrier);
+    start = now_ns();
+    
+    for (unsigned int i = 0; i < clients; ++i)
+        pthread_join(client[i].thread, NULL);
+    
+    wall = now_ns() - start;
+    
+    stop_daemon(pid);
+    
+    data = malloc((size_t) clients * requests * sizeof(*data));
+    if (!data)
+        die("failed to allocate memory", ENOMEM);
+    
+    for (unsigned int j = 0; j < command_count; ++j) {
+        n = 0;
+        failed = 0;
+    
+        for (unsigned int i = 0; i < clients; ++i) {
+            for (unsigned int k = 0; k < requests; ++k) {
+                unsigned int cmd = client[i].command[k];
+    
+                if ((cmd & ~REQUEST_FAILED) != j)
+                    continue;
+    
+                data[n++] = client[i].latency[k];
+                failed += (cmd & REQUEST_FAILED) != 0;
+            }
+        }
+    
+        report(commands[j].text, data, n, clients, failed, wall);
+        total_failed += failed;
+    }
+    
+    n = 0;
+    
+    for (unsigned int i = 0; i < clients; ++i) {
+        memcpy(data + n, client[i].latency, requests * sizeof(*data));
+        n += requests;
+    
+        free(client[i].command);
+        free(client[i].latency);
+    }
+    
+    report("total", data, n, clients, total_failed, wall);
+    
+    free(data);
+    free(client);
+    pthread_barrier_destroy(&barrier);
+    
+    nftw(dir, &remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    
+    close(dev_null);
+    
+    for (unsigned int i = 0; i < command_count; ++i)
+        free(commands[i].text);
+    
+    free(mix);
+    
+    return (total_failed > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
\ No newline at end of file
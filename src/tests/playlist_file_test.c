@@ -0,0 +1,303 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+
+#include "../climpd/core/climpd-log.h"
+#include "../climpd/core/playlist/playlist.h"
+
+#define TRACKS  20
+#define PLAYED  7
+
+#define TEST_FILE       "/tmp/playlist_file_test" PLAYLIST_BINARY_SUFFIX
+#define CORRUPT_FILE    "/tmp/playlist_file_test_corrupt" PLAYLIST_BINARY_SUFFIX
+
+/* layout of the file format, the header is followed by the records */
+#define HEADER_SIZE     24
+#define RECORD_SIZE     28
+
+static void set_string(struct playlist *__restrict pl, struct media *m,
+                       enum media_string field, const char *__restrict s)
+{
+    s = string_pool_intern(pl->strings, s);
+    assert(s && "string_pool_intern");
+    
+    media_set_string(m, field, s);
+}
+
+static void add_track(struct playlist *__restrict pl, unsigned int i)
+{
+    struct media_info *info;
+    struct media *m;
+    char buf[64];
+    
+    /* odd tracks are web radios, which are never parsed */
+    if (i % 2) {
+        snprintf(buf, sizeof(buf), "http://file.test/%u", i);
+    
+        m = media_new(buf);
+        assert(m && "media_new");
+        assert(playlist_add_media(pl, m) == 0 && "playlist_add_media");
+    
+        media_unref(m);
+        return;
+    }
+    
+    snprintf(buf, sizeof(buf), "file:///file.test/album %u/%02u.ogg", i / 4, i);
+    
+    m = media_new(buf);
+    assert(m && "media_new");
+    
+    snprintf(buf, sizeof(buf), "title %u", i);
+    set_string(pl, m, MEDIA_TITLE, buf);
+    
+    /* neighbouring tracks share artist and album */
+    snprintf(buf, sizeof(buf), "artist %u", i / 8);
+    set_string(pl, m, MEDIA_ARTIST, buf);
+    
+    snprintf(buf, sizeof(buf), "album %u", i / 4);
+    set_string(pl, m, MEDIA_ALBUM, buf);
+    
+    info = media_info(m);
+    info->track    = i + 1;
+    info->duration = 60 * i + 1;
+    info->seekable = i % 4 == 0;
+    
+    media_set_parsed(m, true);
+    
+    assert(playlist_add_media(pl, m) == 0 && "playlist_add_media");
+    
+    media_unref(m);
+}
+
+static void fill_playlist(struct playlist *__restrict pl)
+{
+    assert(playlist_init(pl) == 0 && "playlist_init");
+    
+    for (unsigned int i = 0; i < TRACKS; ++i)
+        add_track(pl, i);
+    
+    playlist_set_shuffle(pl, true);
+    
+    for (unsigned int i = 0; i < PLAYED; ++i)
+        assert(playlist_next(pl) < TRACKS && "playlist_next");
+}
+
+static bool equal_strings(const char *s1, const char *s2)
+{
+    if (!s1 || !s2)
+        return s1 == s2;
+    
+    return strcmp(s1, s2) == 0;
+}
+
+static void test_round_trip(void)
+{
+    struct playlist pl1, pl2;
+    bool played1[TRACKS], played2[TRACKS];
+    
+    fill_playlist(&pl1);
+    assert(playlist_save(&pl1, TEST_FILE) == 0 && "playlist_save");
+    
+    assert(playlist_init(&pl2) == 0 && "playlist_init");
+    assert(playlist_load(&pl2, TEST_FILE) == 0 && "playlist_load");
+    
+    assert(playlist_size(&pl2) == TRACKS && "invalid playlist size");
+    assert(playlist_index(&pl2) == playlist_index(&pl1) && "invalid index");
+    
+    for (unsigned int i = 0; i < TRACKS; ++i) {
+        struct media *m1 = playlist_at_unsafe(&pl1, (int) i);
+        struct media *m2 = playlist_at_unsafe(&pl2, (int) i);
+        const struct media_info *info1 = media_info(m1);
+        const struct media_info *info2 = media_info(m2);
+    
+        assert(strcmp(media_uri(m1), media_uri(m2)) == 0 && "invalid uri");
+        assert(media_is_parsed(m1) == media_is_parsed(m2) && "invalid parsed");
+    
+        if (!media_is_parsed(m1))
+            continue;
+    
+        assert(equal_strings(info1->title, info2->title) && "invalid title");
+        assert(equal_strings(info1->artist, info2->artist) && "invalid artist");
+        assert(equal_strings(info1->album, info2->album) && "invalid album");
+        assert(info1->track == info2->track && "invalid track number");
+        assert(info1->duration == info2->duration && "invalid duration");
+        assert(info1->seekable == info2->seekable && "invalid seekable");
+    
+        /* tracks sharing a tag share the pooled string */
+        if (i >= 2 && i % 4 != 0) {
+            struct media *prev = playlist_at_unsafe(&pl2, (int) i - 2);
+    
+            assert(media_info(prev)->album == info2->album && "not shared");
+        }
+    }
+    
+    assert(playlist_index_of(&pl2, "file:///file.test/album 2/08.ogg") == 8 
+           && "path index not restored");
+    
+    kfy_get_played(&pl1.kfy, played1);
+    kfy_get_played(&pl2.kfy, played2);
+    
+    assert(memcmp(played1, played2, sizeof(played1)) == 0 
+           && "shuffle state not restored");
+    assert(kfy_unplayed(&pl2.kfy) == TRACKS - PLAYED && "invalid shuffle state");
+    
+    /* the rest of the cycle is played without repeating a track */
+    playlist_set_shuffle(&pl2, true);
+    
+    for (unsigned int i = PLAYED; i < TRACKS; ++i) {
+        unsigned int next = playlist_next(&pl2);
+    
+        assert(next < TRACKS && !played2[next] && "track played twice");
+        played2[next] = true;
+    }
+    
+    playlist_destroy(&pl2);
+    playlist_destroy(&pl1);
+}
+
+static void *read_file(const char *__restrict path, size_t *__restrict size)
+{
+    char *data;
+    FILE *file;
+    long n;
+    
+    file = fopen(path, "r");
+    assert(file && "fopen");
+    
+    assert(fseek(file, 0, SEEK_END) == 0 && "fseek");
+    n = ftell(file);
+    assert(n > 0 && "ftell");
+    rewind(file);
+    
+    data = malloc((size_t) n);
+    assert(data && "malloc");
+    assert(fread(data, 1, (size_t) n, file) == (size_t) n && "fread");
+    
+    fclose(file);
+    
+    *size = (size_t) n;
+    
+    return data;
+}
+
+static void write_file(const char *__restrict path, const void *data, 
+                       size_t size)
+{
+    FILE *file;
+    
+    file = fopen(path, "w");
+    assert(file && "fopen");
+    assert(fwrite(data, 1, size, file) == size && "fwrite");
+    assert(fclose(file) == 0 && "fclose");
+}
+
+/* A rejected file must neither fail halfway nor leave any track behind */
+static void assert_rejected(const void *data, size_t size, const char *what)
+{
+    struct playlist pl;
+    
+    write_file(CORRUPT_FILE, data, size);
+    
+    assert(playlist_init(&pl) == 0 && "playlist_init");
+    
+    if (playlist_load(&pl, CORRUPT_FILE) == 0 || !playlist_empty(&pl)) {
+        fprintf(stderr, "playlist_file_test: accepted %s\n", what);
+        abort();
+    }
+    
+    playlist_destroy(&pl);
+}
+
+static void test_corrupt_file(void)
+{
+    struct playlist pl;
+    uint32_t val;
+    size_t size;
+    char *data, *copy;
+    
+    fill_playlist(&pl);
+    assert(playlist_save(&pl, TEST_FILE) == 0 && "playlist_save");
+    playlist_destroy(&pl);
+    
+    data = read_file(TEST_FILE, &size);
+    
+    copy = malloc(size);
+    assert(copy && "malloc");
+    
+    /* below the size of the magic the format can't be told apart from text */
+    for (size_t n = sizeof(val); n < size; ++n)
+        assert_rejected(data, n, "truncated file");
+    
+    memcpy(copy, data, size);
+    val = 0xffff;
+    memcpy(copy + sizeof(val), &val, sizeof(val));
+    assert_rejected(copy, size, "unknown version");
+    
+    memcpy(copy, data, size);
+    val = 0x7fffffff;
+    memcpy(copy + 2 * sizeof(val), &val, sizeof(val));
+    assert_rejected(copy, size, "too many records");
+    
+    /* the uri of the last record points out of the string table */
+    memcpy(copy, data, size);
+    val = (uint32_t) size;
+    memcpy(copy + HEADER_SIZE + (TRACKS - 1) * RECORD_SIZE, &val, sizeof(val));
+    assert_rejected(copy, size, "invalid string offset");
+    
+    /* the last string of the table is no longer terminated */
+    memcpy(copy, data, size);
+    memset(copy + size - sizeof(val), 'x', sizeof(val));
+    assert_rejected(copy, size, "unterminated string");
+    
+    free(copy);
+    free(data);
+    
+    unlink(CORRUPT_FILE);
+    unlink(TEST_FILE);
+}
+
+int main(int argc, char *argv[])
+{
+    (void) argc;
+    (void) argv;
+    
+    gst_init(NULL, NULL);
+    assert(climpd_log_init("/tmp/playlist_file.log") == 0 && "climpd_log_init");
+    
+    srand(1);
+    
+    test_round_trip();
+    test_corrupt_file();
+    
+    printf("playlist_file_test: passed\n");
+    
+    climpd_log_destroy();
+    gst_deinit();
+    
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2015  Steffen Nüssle
+ * climp - Command Line Interface Music Player
+ *
+ * This file is part of climp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "../climpd/core/climpd-log.h"
+#include "../climpd/core/playlist/playlist.h"
+
+#define TRACKS  50
+#define CYCLES  4
+
+struct play_count {
+    struct media *media;
+    unsigned int count;
+};
+
+static struct play_count counts[4 * TRACKS];
+static unsigned int n_counts;
+static unsigned int n_added;
+
+static void add_track(struct playlist *__restrict pl)
+{
+    char uri[64];
+    
+    /* web radio uris do not need the tag reader */
+    snprintf(uri, sizeof(uri), "http://shuffle.test/%u", n_added++);
+    
+    assert(playlist_add(pl, uri) == 0 && "playlist_add");
+}
+
+static void count_play(struct media *m)
+{
+    for (unsigned int i = 0; i < n_counts; ++i) {
+        if (counts[i].media == m) {
+            counts[i].count += 1;
+            return;
+        }
+    }
+    
+    assert(n_counts < sizeof(counts) / sizeof(*counts) && "too many tracks");
+    
+    /* keep removed tracks alive, so their address is not reused */
+    counts[n_counts].media = media_ref(m);
+    counts[n_counts].count = 1;
+    n_counts += 1;
+}
+
+static void reset_counts(void)
+{
+    for (unsigned int i = 0; i < n_counts; ++i)
+        media_unref(counts[i].media);
+    
+    n_counts = 0;
+}
+
+static unsigned int play_count(struct media *m)
+{
+    for (unsigned int i = 0; i < n_counts; ++i) {
+        if (counts[i].media == m)
+            return counts[i].count;
+    }
+    
+    return 0;
+}
+
+/* Edits the playlist between peeking at and moving to the next track */
+static void edit(struct playlist *__restrict pl, unsigned int step)
+{
+    unsigned int i;
+    
+    switch (step % 5) {
+    case 0:
+        playlist_set_repeat(pl, false);
+        playlist_set_repeat(pl, true);
+        break;
+    case 1:
+        add_track(pl);
+        break;
+    case 2:
+        /* remove any track but the current one */
+        i = (unsigned int) rand() % playlist_size(pl);
+        if (i != playlist_index(pl) && playlist_size(pl) > TRACKS / 2)
+            playlist_remove(pl, (int) i);
+        break;
+    case 3:
+        playlist_set_shuffle(pl, false);
+        playlist_set_shuffle(pl, true);
+        break;
+    default:
+        break;
+    }
+}
+
+static void test_edits_while_shuffling(void)
+{
+    struct playlist pl;
+    unsigned int step = 0;
+    
+    assert(playlist_init(&pl) == 0 && "playlist_init");
+    
+    for (unsigned int i = 0; i < TRACKS; ++i)
+        add_track(&pl);
+    
+    playlist_set_repeat(&pl, true);
+    playlist_set_shuffle(&pl, true);
+    
+    for (unsigned int cycle = 0; cycle < CYCLES; ++cycle) {
+        reset_counts();
+    
+        while (1) {
+            unsigned int next;
+    
+            /* the audio player peeks when it queues the next track */
+            playlist_peek_next(&pl);
+    
+            /* tracks added to a done cycle would still belong to it */
+            if (n_counts > 0)
+                edit(&pl, step++);
+    
+            /* removing the last unplayed track finishes the cycle, too */
+            if (n_counts > 0 && kfy_unplayed(&pl.kfy) == 0)
+                break;
+    
+            next = playlist_next(&pl);
+            assert(next < playlist_size(&pl) && "invalid next track");
+            playlist_set_index(&pl, (int) next);
+    
+            count_play(playlist_at_unsafe(&pl, (int) next));
+    
+            if (kfy_unplayed(&pl.kfy) == 0)
+                break;
+        }
+    
+        /* every track still in the playlist was played exactly once */
+        for (unsigned int i = 0; i < playlist_size(&pl); ++i) {
+            struct media *m = playlist_at_unsafe(&pl, (int) i);
+    
+            assert(play_count(m) == 1 && "track not played once per cycle");
+        }
+    
+        for (unsigned int i = 0; i < n_counts; ++i)
+            assert(counts[i].count == 1 && "track played twice per cycle");
+    }
+    
+    reset_counts();
+    
+    playlist_destroy(&pl);
+}
+
+static void test_end_of_playlist(void)
+{
+    struct playlist pl;
+    
+    assert(playlist_init(&pl) == 0 && "playlist_init");
+    
+    for (unsigned int i = 0; i < TRACKS; ++i)
+        add_track(&pl);
+    
+    playlist_set_repeat(&pl, false);
+    playlist_set_shuffle(&pl, true);
+    
+    /* like the audio player, which plays the track playlist_next() picked */
+    for (unsigned int i = 0; i < TRACKS; ++i) {
+        unsigned int next = playlist_next(&pl);
+        
+        assert(next != (unsigned int) -1 && "playlist_next");
+        playlist_set_index(&pl, (int) next);
+    }
+    
+    /* peeking at the end must not start a new cycle yet */
+    assert(playlist_peek_next(&pl) == (unsigned int) -1 && "no end");
+    assert(kfy_unplayed(&pl.kfy) == 0 && "cycle reset by peeking");
+    
+    /* a track added to a finished playlist is the one played next */
+    add_track(&pl);
+    assert(playlist_next(&pl) == TRACKS && "added track not played");
+    playlist_set_index(&pl, TRACKS);
+    
+    assert(playlist_next(&pl) == (unsigned int) -1 && "no end");
+    assert(kfy_unplayed(&pl.kfy) == playlist_size(&pl) && "cycle not reset");
+    
+    playlist_destroy(&pl);
+}
+
+static unsigned int n_changes;
+static unsigned int changed_next;
+
+static void handle_next_change(struct playlist *pl)
+{
+    n_changes += 1;
+    changed_next = playlist_peek_next(pl);
+}
+
+static void test_next_change_handler(void)
+{
+    struct playlist pl;
+    
+    assert(playlist_init(&pl) == 0 && "playlist_init");
+    
+    for (unsigned int i = 0; i < 4; ++i)
+        add_track(&pl);
+    
+    playlist_set_next_change_handler(&pl, &handle_next_change);
+    playlist_set_index(&pl, 1);
+    n_changes = 0;
+    
+    /* nobody peeked yet, so there is nothing to invalidate */
+    playlist_remove(&pl, 3);
+    assert(n_changes == 0 && "handler called without a peek");
+    
+    /* the handler has to see the index of the playlist after the removal */
+    assert(playlist_peek_next(&pl) == 2 && "playlist_peek_next");
+    playlist_remove(&pl, 0);
+    assert(n_changes == 1 && "handler not called");
+    assert(changed_next == 1 && "handler peeked at an old state");
+    
+    playlist_set_repeat(&pl, true);
+    playlist_set_index(&pl, -1);
+    assert(n_changes == 3 && "handler not called");
+    assert(changed_next == 0 && "handler peeked at an old state");
+    
+    /* moving on is no change for anybody acting on the peek */
+    playlist_next(&pl);
+    assert(n_changes == 3 && "handler called by playlist_next");
+    
+    playlist_destroy(&pl);
+}
+
+int main(int argc, char *argv[])
+{
+    (void) argc;
+    (void) argv;
+    
+    gst_init(NULL, NULL);
+    assert(climpd_log_init("/tmp/shuffle.log") == 0 && "climpd_log_init");
+    
+    srand(1);
+    
+    test_edits_while_shuffling();
+    test_end_of_playlist();
+    test_next_change_handler();
+    
+    printf("shuffle_test: passed\n");
+    
+    climpd_log_destroy();
+    gst_deinit();
+    
+    return 0;
+}
\ No newline at end of file